@@ -24,8 +24,6 @@
 #include <IL/ilu.h>
 #include <IL/ilut.h>
 
-#include<X11/Xlib.h>
-#include<X11/extensions/xf86vmode.h>
 
 ILuint image = 0;
 GLuint texture = 0;
@@ -40,6 +38,7 @@ int config_verbose = 0;
 int config_stereo = 0;
 int config_swap = 1;
 char * config_file = NULL;
+char * config_output = NULL;
 
 
 /* Refresh rate calculation */
@@ -203,6 +202,7 @@ void usage(void) {
   fprintf(stderr, "\t--stereo\t\tEnable Stereo GL\n");
   fprintf(stderr, "\t--stereothread\t\tEnable Stereo GL, swap performed in other thread\n");
   fprintf(stderr, "\t--noswap\t\t Disable USB swap\n");
+  fprintf(stderr, "\t--output NAME\t\tSync to this output (RandR name or card0-DP-1)\n");
   fprintf(stderr, "\t--debug \t\tEnable Debug\n");
 }
 
@@ -220,6 +220,7 @@ int main(int argc, char **argv)
       {"stereo",       no_argument,       &config_stereo,  1},
       {"stereothread", no_argument,       &config_stereo,  2},
       {"noswap",no_argument,       &config_swap,  0},
+      {"output",       required_argument, 0,           'o'},
       {NULL, 0, 0, 0}
     };
 
@@ -248,6 +249,10 @@ int main(int argc, char **argv)
         printf ("\n");
         break;
 
+      case 'o':
+        config_output = optarg;
+        break;
+
       case '?':
       default:
         usage();
@@ -289,17 +294,16 @@ int main(int argc, char **argv)
       exit(EXIT_FAILURE);
     }
 
-    /* Get Vsync rate from X11 */
-    {
-      static Display *dpy;
-      dpy = XOpenDisplay(0);
-      double displayNumber=DefaultScreen(dpy);
-      XF86VidModeModeLine modeline;
-      int pixelclock;
-      XF86VidModeGetModeLine( dpy, displayNumber, &pixelclock, &modeline );
-      double frameRate=(double) pixelclock*1000/modeline.htotal/modeline.vtotal;
-      printf("Vertical Refresh rate:%f Hz\n",frameRate);
-      nvstusb_set_rate(ctx, frameRate);
+    /* Sync to the selected output */
+    if (config_output && nvstusb_select_output(ctx, config_output) < 0) {
+      fprintf(stderr, "output %s not found, aborting\n", config_output);
+      exit(EXIT_FAILURE);
+    }
+
+    /* Detect Vsync rate and follow its drift */
+    if (nvstusb_set_rate_auto(ctx) < 0) {
+      fprintf(stderr, "could not detect refresh rate, aborting\n");
+      exit(EXIT_FAILURE);
     }
   }
 
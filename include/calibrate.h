@@ -0,0 +1,11 @@
+#include <stdbool.h>
+
+/* the vblank method chosen by calibration is cached per GPU, driver and
+ * output in $XDG_CACHE_HOME/libnvstusb/vblank, one line per key */
+struct nvstusb_vblank_result;
+
+/* cached result for key, false if there is none */
+bool nvstusb_calibrate_load(const char *key, struct nvstusb_vblank_result *result);
+
+/* replace the cached result for key */
+bool nvstusb_calibrate_store(const char *key, const struct nvstusb_vblank_result *result);
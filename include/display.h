@@ -0,0 +1,31 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+/* an output (crtc) the emitter is synchronized to */
+struct nvstusb_display_output {
+  int x, y;                   /* position of the crtc */
+  unsigned int width, height; /* size of the crtc */
+  float rate;                 /* refresh rate in Hz, 0 if unknown */
+  int drm_card;               /* /dev/dri/cardN driving it, -1 if unknown */
+  int drm_pipe;               /* crtc index for drm vblank waits, -1 if unknown */
+};
+
+/* find an output by RandR output name ("DP-2") or DRM connector
+ * ("card0-DP-2"), name = 0 selects the primary (or first active) crtc */
+bool nvstusb_display_find_output(const char *name, struct nvstusb_display_output *out);
+
+/* refresh rate of an output in Hz, 0 if unknown */
+float nvstusb_display_detect_rate(const char *name);
+
+/* drm vblank events of a crtc, for waiting without X or GL */
+struct nvstusb_display_vblank;
+
+/* open /dev/dri/cardN for vblank waits on pipe, 0 if that is not
+ * possible (no libdrm, no permission) */
+struct nvstusb_display_vblank *nvstusb_display_open_vblank(int card, int pipe);
+
+/* wait for the next vblank whose sequence number is a multiple of
+ * interval, returns its time (CLOCK_MONOTONIC us) or -1 on errors */
+int64_t nvstusb_display_wait_vblank(struct nvstusb_display_vblank *vblank, unsigned int interval);
+
+void nvstusb_display_close_vblank(struct nvstusb_display_vblank *vblank);
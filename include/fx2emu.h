@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* EZ-USB FX2 emulator: an 8051 core with FX2 instruction timing, the
+ * on-chip RAM shared by code and xdata, timers 0, 1 and 2, ports A to E,
+ * endpoint 1 and the bulk endpoints 2, 4, 6 and 8 in manual mode, SOF and
+ * the autovectored usb interrupt. Enough to run the controller firmware
+ * and watch its port pins. Time is counted in 48 MHz clocks. */
+
+#define FX2EMU_CLOCK        48000000LL
+#define FX2EMU_QUEUE        4         /* packets buffered per endpoint */
+#define FX2EMU_PACKET       512
+
+struct fx2emu_packet {
+  uint16_t length;
+  uint8_t data[FX2EMU_PACKET];
+};
+
+struct fx2emu_endpoint {
+  /* OUT: packets from the host not yet handed to the CPU,
+   * IN: packets the CPU committed, not yet taken by the host */
+  struct fx2emu_packet queue[FX2EMU_QUEUE];
+  int head;
+  int count;
+  bool cpu;               /* OUT: the CPU holds a packet in the buffer */
+};
+
+struct fx2emu {
+  uint8_t xram[65536];    /* code and xdata, registers at 0xe000 and up */
+  uint8_t iram[256];
+  uint8_t sfr[128];
+
+  uint16_t pc;
+  uint64_t clock;         /* 48 MHz clocks since power on */
+  uint64_t instructions;
+  bool idle;              /* PCON.0, waits for an interrupt */
+  bool hold_irq;          /* no interrupt after RETI */
+  uint8_t in_service;     /* bit 0 low, bit 1 high priority interrupt running */
+
+  /* prescaler remainders in CLKOUT clocks */
+  uint32_t t0_rem, t1_rem, t2_rem;
+  uint64_t next_sof;
+
+  /* port pins: latch where OE is set, input elsewhere */
+  uint8_t input[5];
+  uint8_t pins[5];
+
+  struct fx2emu_endpoint ep1out, ep1in;
+  struct fx2emu_endpoint ep[4];   /* 2, 4, 6, 8 */
+
+  uint32_t bad_opcodes;
+
+  /* called when a port's pins change, port 0 = A */
+  void (*port_changed)(void *user, int port, uint8_t pins, uint64_t ns);
+  void *user;
+
+  FILE *vcd;
+  uint64_t vcd_time;
+};
+
+/* power on, the CPU is held in reset until the firmware is loaded */
+void fx2emu_init(struct fx2emu *emu);
+
+/* load nvstusb.fw (chunks for vendor request 0xa0) or, for files
+ * ending in .bin, a program memory image at 0, and start the CPU */
+bool fx2emu_load(struct fx2emu *emu, const char *path);
+
+/* vendor request 0xa0 of the boot loader: write RAM. Writing CPUCS holds
+ * the CPU in reset or releases it, it then starts at 0 */
+void fx2emu_load_ram(struct fx2emu *emu, uint16_t addr, const void *data, int size);
+bool fx2emu_running(const struct fx2emu *emu);
+
+/* run until the emulated time reaches ns */
+void fx2emu_run(struct fx2emu *emu, uint64_t ns);
+uint64_t fx2emu_time_ns(const struct fx2emu *emu);
+
+/* host side of the endpoints, write is false while the endpoint NAKs,
+ * read returns 0 if no packet is ready */
+bool fx2emu_write(struct fx2emu *emu, int endpoint, const void *data, int size);
+int fx2emu_read(struct fx2emu *emu, int endpoint, void *data, int size);
+
+/* log the port pins as a value change dump */
+void fx2emu_trace_vcd(struct fx2emu *emu, FILE *file);
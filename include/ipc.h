@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+/* nvstusbd protocol
+ *
+ * A client connects to the daemon's unix socket, sends one byte with
+ * its protocol version and receives three file
+ * descriptors in one SCM_RIGHTS message: a memfd holding struct
+ * nvstusb_ipc_shm and two eventfds. The client posts commands into
+ * shm->cmd and rings the first eventfd, the daemon posts replies and
+ * posted read completions into shm->reply and rings the second one.
+ * Each ring has exactly one producer and one consumer. The socket stays
+ * open for the life of the client, the daemon drops the client when it
+ * hangs up. A connection closed before the version byte only tells
+ * whether the daemon runs. */
+
+#define NVSTUSB_IPC_MAGIC     0x4e565344  /* "NVSD" */
+#define NVSTUSB_IPC_VERSION   3
+
+#define NVSTUSB_IPC_SLOTS     64          /* power of two */
+#define NVSTUSB_IPC_DATA      64          /* one full speed packet */
+
+/* socket path: $NVSTUSB_DAEMON, $XDG_RUNTIME_DIR/nvstusbd or /tmp */
+#define NVSTUSB_IPC_SOCKET    "nvstusbd.sock"
+
+enum nvstusb_ipc_type {
+  /* client to daemon */
+  nvstusb_ipc_write = 1,    /* bulk write, no reply unless it fails */
+  nvstusb_ipc_read,         /* bulk read of length bytes, replied to */
+  nvstusb_ipc_post_reads,   /* keep reads queued, length = count<<8 | size */
+
+  /* daemon to client */
+  nvstusb_ipc_read_done,    /* reply to nvstusb_ipc_read, same seq */
+  nvstusb_ipc_posted_done,  /* a posted read completed */
+  nvstusb_ipc_write_failed, /* a write failed, result has the error */
+  nvstusb_ipc_post_reads_done /* reply to nvstusb_ipc_post_reads, same seq, result 0 or an error */
+};
+
+struct nvstusb_ipc_msg {
+  uint8_t type;
+  uint8_t endpoint;
+  uint16_t length;
+  int32_t result;
+  uint32_t seq;
+  uint32_t timeout;         /* ms, 0 waits forever */
+  uint64_t deadline;        /* monotonic ns, writes still queued then are dropped, 0 = none */
+  uint64_t submit;          /* monotonic ns, when a posted read was queued and completed */
+  uint64_t complete;
+  uint8_t data[NVSTUSB_IPC_DATA];
+};
+
+/* single producer, single consumer; head and tail count forever and
+ * live on separate cache lines */
+struct nvstusb_ipc_ring {
+  uint32_t head;            /* written by the producer */
+  uint8_t pad0[60];
+  uint32_t tail;            /* written by the consumer */
+  uint8_t pad1[60];
+  struct nvstusb_ipc_msg slots[NVSTUSB_IPC_SLOTS];
+};
+
+struct nvstusb_ipc_shm {
+  uint32_t magic;
+  uint32_t version;
+  int32_t status;           /* set by the daemon, < 0 once the device is gone */
+  uint32_t dropped;         /* replies the daemon could not post */
+  uint8_t pad[48];
+
+  struct nvstusb_ipc_ring cmd;
+  struct nvstusb_ipc_ring reply;
+};
+
+/* rings */
+bool nvstusb_ipc_push(struct nvstusb_ipc_ring *ring, const struct nvstusb_ipc_msg *msg);
+bool nvstusb_ipc_pop(struct nvstusb_ipc_ring *ring, struct nvstusb_ipc_msg *msg);
+
+/* eventfd doorbells */
+void nvstusb_ipc_ring_bell(int fd);
+bool nvstusb_ipc_wait_bell(int fd, int timeout_ms);
+
+/* path of the daemon socket, in a static buffer */
+const char *nvstusb_ipc_socket_path(void);
+
+/* pass and receive the shm and doorbell descriptors */
+bool nvstusb_ipc_send_fds(int sock, const int *fds, int count);
+bool nvstusb_ipc_recv_fds(int sock, int *fds, int count);
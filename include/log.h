@@ -0,0 +1,29 @@
+#include <stdint.h>
+
+#include "nvstusb.h"
+
+/* messages of the library, see nvstusb_set_log_level. NVSTUSB_LOG only
+ * formats the message, a thread of its own writes it out, so a slow
+ * stderr or callback never holds up a swap. Each call site passes a
+ * burst of messages, then one per interval, and reports how many it
+ * suppressed with the next one. */
+#define NVSTUSB_LOG_BURST         5
+#define NVSTUSB_LOG_INTERVAL_US   1000000
+
+/* rate limit state of a call site */
+struct nvstusb_log_site {
+  uint64_t window;          /* start of the current interval */
+  uint32_t count;           /* messages in it */
+  uint32_t suppressed;      /* messages dropped in it */
+};
+
+#define NVSTUSB_LOG(level, ...) do { \
+    static struct nvstusb_log_site nvstusb_log_site_; \
+    nvstusb_log_at(&nvstusb_log_site_, (level), __VA_ARGS__); \
+  } while (0)
+
+void nvstusb_log_at(struct nvstusb_log_site *site, enum nvstusb_log_level level, const char *format, ...)
+  __attribute__((format(printf, 3, 4)));
+
+/* write out what is queued, from the calling thread */
+void nvstusb_log_flush(void);
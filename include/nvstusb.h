@@ -5,6 +5,15 @@
  * under certain conditions. See the file COPYING for details
  * */
 
+#ifndef NVSTUSB_H
+#define NVSTUSB_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct nvstusb_context;
 
 enum nvstusb_eye {
@@ -13,17 +22,266 @@ enum nvstusb_eye {
   nvstusb_quad,
 };
 
+/* results of the timed functions */
+enum nvstusb_status {
+  nvstusb_status_ok = 0,
+  nvstusb_status_error = -1,      /* usb transfer failed */
+  nvstusb_status_timeout = -2,    /* latency budget exceeded */
+  nvstusb_status_dropped = -3,    /* eye command would arrive after its vblank */
+  nvstusb_status_no_device = -4,  /* controller disconnected */
+};
+
+/* how nvstusb_swap finds the vertical blank */
+enum nvstusb_vblank_method {
+  nvstusb_vblank_readpixels = 0,  /* read the front buffer after the swap */
+  nvstusb_vblank_video_sync,      /* GLX_SGI_video_sync */
+  nvstusb_vblank_external,        /* swaps are synced by the driver (__GL_SYNC_TO_VBLANK) */
+  nvstusb_vblank_swap_interval,   /* GLX_SGI_swap_control */
+  nvstusb_vblank_timer,           /* clock at a set rate, no display needed */
+};
+
+/* measured cadence of a vblank method */
+struct nvstusb_vblank_result {
+  enum nvstusb_vblank_method method;
+  int available;        /* 0 if the driver lacks the extension */
+  unsigned int frames;  /* intervals measured */
+  float mean_us;        /* mean frame interval */
+  float jitter_us;      /* standard deviation of the interval */
+  unsigned int missed;  /* vblanks skipped */
+};
+
+/* swap statistics */
+struct nvstusb_stats {
+  uint64_t swaps;
+  uint64_t skipped_vblanks;   /* vblanks passed without a swap */
+  uint64_t duplicated_frames; /* two swaps within one vblank */
+  uint64_t dropped_eyes;      /* eye commands that missed their vblank */
+  uint64_t resyncs;           /* eye phase restored after it was lost */
+};
+
+/* controller state as published by the process owning it, wheel and
+ * button counts are totals since it started publishing */
+struct nvstusb_state {
+  int32_t pid;                /* owner */
+  int32_t active;             /* 0 once the owner closed the controller */
+  int32_t wheel;              /* sum of deltaWheel */
+  int32_t pressed_wheel;      /* sum of pressedDeltaWheel */
+  uint32_t toggles;           /* 3d button presses */
+  int32_t eye;                /* enum nvstusb_eye last sent */
+  int32_t inverted;           /* nvstusb_invert_eyes state */
+  int32_t pad;
+  uint64_t vblank_us;         /* vblank of the last eye (CLOCK_MONOTONIC) */
+  uint64_t updated_us;        /* last change */
+};
+
+struct nvstusb_state_reader;
+
+/* frame pacing, times are CLOCK_MONOTONIC in microseconds */
+struct nvstusb_frame_timing {
+  uint64_t vblank_us;         /* vblank the eye command was sent for */
+  uint64_t present_us;        /* predicted time the submitted frame is shown */
+  uint64_t next_deadline_us;  /* the next swap has to be called before this */
+  float period_us;            /* time between the eyes' vblanks */
+  float render_us;            /* estimated render cost, see nvstusb_wait_render */
+};
+
+/* shutter timing for one refresh rate, times in microseconds */
+struct nvstusb_timing_profile {
+  float rate;           /* refresh rate the profile was made for */
+  float w_us;           /* 0x2007: timer 2 count */
+  float x_us;           /* 0x200b: timer 0 count, start of the eye phase */
+  float active_us;      /* 0x200f: time each eye is open */
+  float eye_delay_us;   /* delay sent with each eye command */
+};
+
+/* usb transport counters of one endpoint. Every transfer is submitted
+ * and then completed or failed, short ones moved fewer bytes than asked
+ * for (and failed if they ended in an error). Errors are counted by
+ * libusb code, index -code for -1..-12, 0 for others. Latency is of the
+ * synchronous transfers, posted reads count when they are taken. */
+#define NVSTUSB_USB_ERROR_CODES 13
+
+struct nvstusb_endpoint_stats {
+  uint32_t endpoint;          /* address, 0x80 set for IN */
+  uint32_t pad;
+  uint64_t submitted;
+  uint64_t completed;
+  uint64_t failed;
+  uint64_t timeouts;          /* failed with a timeout */
+  uint64_t short_transfers;
+  uint64_t bytes;
+  uint64_t errors[NVSTUSB_USB_ERROR_CODES];
+  uint64_t latency_samples;
+  float min_us;
+  float avg_us;
+  float max_us;
+};
+
+/* library messages */
+enum nvstusb_log_level {
+  nvstusb_log_error = 0,
+  nvstusb_log_warning,
+  nvstusb_log_info,
+  nvstusb_log_debug,
+};
+
+typedef void (*nvstusb_log_func)(enum nvstusb_log_level level, const char *message, void *user);
+
 struct nvstusb_keys {
   char deltaWheel;
   char pressedDeltaWheel;
   int  toggled3D;
 };
 
+/* messages up to level (default info, $NVSTUSB_LOG_LEVEL) are written
+ * to stderr by a thread of the library, or passed to func (0 = stderr)
+ * on that thread. Repeated messages are rate limited. libusb's own
+ * output has a level of its own, 0 (none) to 4 (debug), default 0 or
+ * $NVSTUSB_USB_DEBUG. Changes apply at once. */
+void nvstusb_set_log_level(enum nvstusb_log_level level);
+void nvstusb_set_log_callback(nvstusb_log_func func, void *user);
+void nvstusb_set_usb_debug(int level);
+
 struct nvstusb_context *nvstusb_init(char const * fw);
 void nvstusb_deinit(struct nvstusb_context *ctx);
 void nvstusb_set_rate(struct nvstusb_context *ctx, float rate);
 void nvstusb_swap(struct nvstusb_context *ctx, enum nvstusb_eye eye, void (*swapfunc)());
 void nvstusb_get_keys(struct nvstusb_context *ctx, struct nvstusb_keys *keys);
+
+/* refresh rate detection, nvstusb_set_rate_auto also tracks the measured
+ * vblank period and reprograms the controller when it drifts */
+float nvstusb_detect_rate(struct nvstusb_context *ctx);
+int nvstusb_set_rate_auto(struct nvstusb_context *ctx);
+void nvstusb_set_drift_tracking(struct nvstusb_context *ctx, int enable, float threshold_ppm);
+float nvstusb_get_measured_rate(struct nvstusb_context *ctx);
+
+/* timing profiles: nvstusb_set_rate uses the closest built-in profile
+ * or scales the 120 Hz timings, unless a profile or duty cycle is set.
+ * Profiles loaded from a file (nvstusb-tune writes them, NVSTUSB_PROFILE
+ * loads one at init) are preferred to the built-in ones. */
+int nvstusb_get_profiles(const struct nvstusb_timing_profile **profiles);
+int nvstusb_set_profile(struct nvstusb_context *ctx, const struct nvstusb_timing_profile *profile);
+int nvstusb_load_profiles(struct nvstusb_context *ctx, const char *path);
+int nvstusb_set_duty_cycle(struct nvstusb_context *ctx, float duty);
+
+/* raw access to the controller's register window at 0x2007, writes
+ * only transmit the bytes that differ from what was written before */
+int nvstusb_write_regs(struct nvstusb_context *ctx, unsigned int offset, const void *data, unsigned int size);
+int nvstusb_read_regs(struct nvstusb_context *ctx, unsigned int offset, void *data, unsigned int size);
+int nvstusb_replay_regs(struct nvstusb_context *ctx);
+
+/* output to sync to: RandR output name ("DP-2") or DRM connector
+ * ("card0-DP-2"), 0 = primary. Select it before creating GL contexts. */
+int nvstusb_select_output(struct nvstusb_context *ctx, const char *name);
+int nvstusb_get_output_position(struct nvstusb_context *ctx, int *x, int *y);
+
+/* deadline bounded variants, budget_us = 0 uses the context budget,
+ * a context budget of 0 (default) waits forever */
+void nvstusb_set_latency_budget(struct nvstusb_context *ctx, unsigned int budget_us);
+int nvstusb_set_rate_timed(struct nvstusb_context *ctx, float rate, unsigned int budget_us);
+int nvstusb_swap_timed(struct nvstusb_context *ctx, enum nvstusb_eye eye, void (*swapfunc)(), unsigned int budget_us);
+int nvstusb_get_keys_timed(struct nvstusb_context *ctx, struct nvstusb_keys *keys, unsigned int budget_us);
+
+/* pacing: nvstusb_swap_paced also returns when the frame is shown and
+ * when the next swap is due. nvstusb_wait_render sleeps until that
+ * deadline minus the estimated render cost (a moving estimate of the
+ * time from its return to the next swap) and margin_us, so rendering
+ * starts as late as possible. Returns the time it woke up. */
+int nvstusb_swap_paced(struct nvstusb_context *ctx, enum nvstusb_eye eye, void (*swapfunc)(), struct nvstusb_frame_timing *timing);
+uint64_t nvstusb_wait_render(struct nvstusb_context *ctx);
+void nvstusb_set_render_margin(struct nvstusb_context *ctx, unsigned int margin_us);
+
+/* skipped vblanks and duplicated frames are detected from the vblank
+ * counter (or timestamps), the eye phase is restored automatically */
+void nvstusb_get_stats(struct nvstusb_context *ctx, struct nvstusb_stats *stats);
+void nvstusb_reset_stats(struct nvstusb_context *ctx);
+
+/* usb counters of the endpoints used so far, returns how many there are
+ * (at most max are copied). nvstusb_export_usb_stats rewrites a text file
+ * in the Prometheus exposition format every interval_ms (0 = 10 s), path
+ * 0 stops. $NVSTUSB_USB_STATS and $NVSTUSB_USB_STATS_INTERVAL start it
+ * at init. */
+int nvstusb_get_usb_stats(struct nvstusb_context *ctx, struct nvstusb_endpoint_stats *stats, int max);
+void nvstusb_reset_usb_stats(struct nvstusb_context *ctx);
+int nvstusb_export_usb_stats(struct nvstusb_context *ctx, const char *path, unsigned int interval_ms);
+
+/* for callers that wait for vblank themselves (nvstusb.hpp): send the
+ * eye for the vblank at vblank_us (0 = now) with counter msc (-1 if not
+ * known). nvstusb_eye_in_phase tells if eye belongs on vblank msc. */
+int nvstusb_send_eye_vblank(struct nvstusb_context *ctx, enum nvstusb_eye eye, uint64_t vblank_us, int64_t msc, unsigned int budget_us);
+int nvstusb_eye_in_phase(struct nvstusb_context *ctx, enum nvstusb_eye eye, int64_t msc);
+
+/* never waits for a reply: returns the key changes received so far and
+ * keeps a status read in flight, sending it waits at most 2 ms */
+int nvstusb_get_keys_nowait(struct nvstusb_context *ctx, struct nvstusb_keys *keys);
+
+/* event loops (epoll, libuv, ...): nvstusb_get_fd returns a descriptor
+ * that polls readable when transfers completed or the keys are due to
+ * be polled (every interval_us, default 10 ms). nvstusb_handle_events
+ * then services the controller without waiting for replies (sending the
+ * key poll waits at most 2 ms, or the latency budget if shorter) and
+ * returns 1 if key changes wait for nvstusb_get_keys_nowait, 0 if none
+ * or a negative nvstusb_status. -1 from nvstusb_get_fd if the backend has no
+ * descriptor (replay, emu). Not to be mixed with the stereo thread. */
+int nvstusb_get_fd(struct nvstusb_context *ctx);
+int nvstusb_handle_events(struct nvstusb_context *ctx);
+void nvstusb_set_key_interval(struct nvstusb_context *ctx, unsigned int interval_us);
+
+/* usb traffic capture and replay: nvstusb_trace_start records every
+ * transfer ($NVSTUSB_TRACE does the same at init), nvstusb_init_replay
+ * plays a trace back in place of the controller ($NVSTUSB_REPLAY and
+ * $NVSTUSB_REPLAY_SPEED), speed 1 keeps the recorded timing and 0 runs
+ * as fast as possible. Writes that differ from the trace are reported. */
+int nvstusb_trace_start(const char *path);
+void nvstusb_trace_stop(void);
+struct nvstusb_context *nvstusb_init_replay(const char *trace, float speed);
+
+/* vblank source. The timer ticks on an absolute schedule at the given
+ * rate (0 follows nvstusb_set_rate), NVSTUSB_VBLANK=timer and
+ * NVSTUSB_VBLANK_RATE select it at init. Timestamps of an external sync
+ * source (CLOCK_MONOTONIC ns) pull the timer's phase and period towards
+ * it, the phase moves by at most slew_us per frame. */
+int nvstusb_set_vblank_method(struct nvstusb_context *ctx, enum nvstusb_vblank_method method);
+enum nvstusb_vblank_method nvstusb_get_vblank_method(struct nvstusb_context *ctx);
+int nvstusb_set_timer_vblank(struct nvstusb_context *ctx, float rate);
+void nvstusb_sync_vblank(struct nvstusb_context *ctx, uint64_t timestamp_ns);
+void nvstusb_set_vblank_slew(struct nvstusb_context *ctx, float slew_us);
+
+/* run every available GL vblank method for frames frames (0 = default)
+ * and select the one with the fewest missed vblanks and least jitter.
+ * A GL context has to be current, swapfunc swaps its buffers. The
+ * choice is cached per GPU, driver and output unless use_cache is 0.
+ * NVSTUSB_CALIBRATE=1 runs it on the first nvstusb_swap. */
+int nvstusb_calibrate_vblank(struct nvstusb_context *ctx, unsigned int frames, void (*swapfunc)(), int use_cache);
+int nvstusb_get_vblank_results(struct nvstusb_context *ctx, const struct nvstusb_vblank_result **results);
+
+/* shared state page: the owner of the controller publishes the state
+ * accumulated from its key reads and eye commands in a file (path 0 =
+ * $NVSTUSB_STATE, else nvstusb.state in $XDG_RUNTIME_DIR or /tmp), which
+ * any number of processes can map and sample without system calls.
+ * Keys are only seen while the owner polls them (the stereo thread does).
+ * Setting $NVSTUSB_STATE publishes from nvstusb_init. */
+int nvstusb_publish_state(struct nvstusb_context *ctx, const char *path);
+struct nvstusb_state_reader *nvstusb_state_open(const char *path);
+int nvstusb_state_read(struct nvstusb_state_reader *reader, struct nvstusb_state *state);
+void nvstusb_state_close(struct nvstusb_state_reader *reader);
+
+/* what the stereo thread waits on: a hidden GL window using the vblank
+ * method (the default), drm vblank events of the selected output or the
+ * vblank timer. The last two need neither X nor GL. */
+enum nvstusb_thread_mode {
+  nvstusb_thread_gl = 0,
+  nvstusb_thread_drm,
+  nvstusb_thread_timer,
+};
+
 void nvstusb_invert_eyes(struct nvstusb_context *ctx);
 void nvstusb_start_stereo_thread(struct nvstusb_context *ctx);
+int nvstusb_start_stereo_thread_mode(struct nvstusb_context *ctx, enum nvstusb_thread_mode mode);
 void nvstusb_stop_stereo_thread(struct nvstusb_context *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NVSTUSB_H */
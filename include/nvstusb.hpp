@@ -0,0 +1,209 @@
+/* nvstusb.hpp
+ *
+ * C++ wrapper: a move-only Context and swap policies selected at compile
+ * time. Each policy waits for vblank in its own way and sends the eye
+ * through nvstusb_send_eye_vblank, so the chosen path inlines and the
+ * swap function can be any callable.
+ *
+ *   nvstusb::Context ctx;
+ *   nvstusb::VideoSync sync;
+ *   ctx.swap(sync, nvstusb_left, [&] { glXSwapBuffers(dpy, win); });
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#ifndef NVSTUSB_HPP
+#define NVSTUSB_HPP
+
+#include <stdexcept>
+#include <utility>
+
+#include <GL/gl.h>
+#include <GL/glx.h>
+#include <GL/glxext.h>
+#include <GL/glext.h>
+
+#include "nvstusb.h"
+
+namespace nvstusb {
+
+/* owns a controller, closed when the Context goes away */
+class Context {
+public:
+  explicit Context(const char *firmware = 0)
+    : ctx_(nvstusb_init(firmware)) {
+    if (0 == ctx_) throw std::runtime_error("nvstusb: no controller");
+  }
+
+  /* take over a context from nvstusb_init */
+  explicit Context(nvstusb_context *ctx) noexcept : ctx_(ctx) {}
+
+  ~Context() { reset(); }
+
+  Context(Context &&other) noexcept : ctx_(other.ctx_) { other.ctx_ = 0; }
+
+  Context &operator=(Context &&other) noexcept {
+    if (this != &other) {
+      reset();
+      ctx_ = other.ctx_;
+      other.ctx_ = 0;
+    }
+    return *this;
+  }
+
+  Context(const Context &) = delete;
+  Context &operator=(const Context &) = delete;
+
+  nvstusb_context *get() const noexcept { return ctx_; }
+  explicit operator bool() const noexcept { return 0 != ctx_; }
+
+  /* give up ownership */
+  nvstusb_context *release() noexcept {
+    nvstusb_context *ctx = ctx_;
+    ctx_ = 0;
+    return ctx;
+  }
+
+  void reset() noexcept {
+    if (0 != ctx_) nvstusb_deinit(ctx_);
+    ctx_ = 0;
+  }
+
+  int set_rate(float rate, unsigned int budget_us = 0) {
+    return nvstusb_set_rate_timed(ctx_, rate, budget_us);
+  }
+
+  int set_rate_auto() { return nvstusb_set_rate_auto(ctx_); }
+
+  /* swap with a policy, swapfunc is called where the policy swaps */
+  template <class Policy, class Swap>
+  int swap(Policy &policy, nvstusb_eye eye, Swap &&swapfunc) {
+    return policy.swap(ctx_, eye, std::forward<Swap>(swapfunc));
+  }
+
+  nvstusb_keys keys() {
+    nvstusb_keys k;
+    nvstusb_get_keys_nowait(ctx_, &k);
+    return k;
+  }
+
+  /* for event loops, see nvstusb_get_fd */
+  int fd() { return nvstusb_get_fd(ctx_); }
+  int handle_events() { return nvstusb_handle_events(ctx_); }
+
+  nvstusb_stats stats() const {
+    nvstusb_stats s;
+    nvstusb_get_stats(ctx_, &s);
+    return s;
+  }
+
+private:
+  nvstusb_context *ctx_;
+};
+
+/* GLX_SGI_video_sync: wait for vblank, send the eye, swap. Like the
+ * other policies, swap throws if available() is false. */
+class VideoSync {
+public:
+  VideoSync()
+    : get_((PFNGLXGETVIDEOSYNCSGIPROC)glXGetProcAddress((const GLubyte *)"glXGetVideoSyncSGI")),
+      wait_((PFNGLXWAITVIDEOSYNCSGIPROC)glXGetProcAddress((const GLubyte *)"glXWaitVideoSyncSGI")) {}
+
+  bool available() const noexcept { return 0 != get_ && 0 != wait_; }
+
+  template <class Swap>
+  int swap(nvstusb_context *ctx, nvstusb_eye eye, Swap &&swapfunc) {
+    if (!available()) throw std::runtime_error("nvstusb: no GLX_SGI_video_sync");
+    unsigned int count;
+    get_(&count);
+    if (eye == nvstusb_quad) {
+      wait_(2, 0, &count);
+    } else {
+      wait_(2, (count+1)%2, &count);
+      /* keep the eye on its vblank parity after a skipped vblank */
+      if (!nvstusb_eye_in_phase(ctx, eye, count)) wait_(2, (count+1)%2, &count);
+    }
+    int res = nvstusb_send_eye_vblank(ctx, eye, 0, count, 0);
+    swapfunc();
+    return res;
+  }
+
+private:
+  PFNGLXGETVIDEOSYNCSGIPROC get_;
+  PFNGLXWAITVIDEOSYNCSGIPROC wait_;
+};
+
+/* GLX_SGI_swap_control: the swap blocks until vblank, then the eye */
+class SwapInterval {
+public:
+  SwapInterval()
+    : set_((PFNGLXSWAPINTERVALSGIPROC)glXGetProcAddress((const GLubyte *)"glXSwapIntervalSGI")),
+      interval_(-1) {}
+
+  bool available() const noexcept { return 0 != set_; }
+
+  template <class Swap>
+  int swap(nvstusb_context *ctx, nvstusb_eye eye, Swap &&swapfunc) {
+    if (!available()) throw std::runtime_error("nvstusb: no GLX_SGI_swap_control");
+    int interval = eye == nvstusb_quad ? 2 : 1;
+    if (interval != interval_) {
+      set_(interval);
+      interval_ = interval;
+    }
+    swapfunc();
+    return nvstusb_send_eye_vblank(ctx, eye, 0, -1, 0);
+  }
+
+private:
+  PFNGLXSWAPINTERVALSGIPROC set_;
+  int interval_;
+};
+
+/* the driver syncs swaps to vblank (__GL_SYNC_TO_VBLANK) */
+class ExternalSync {
+public:
+  bool available() const noexcept { return true; }
+
+  template <class Swap>
+  int swap(nvstusb_context *ctx, nvstusb_eye eye, Swap &&swapfunc) {
+    swapfunc();
+    return nvstusb_send_eye_vblank(ctx, eye, 0, -1, 0);
+  }
+};
+
+/* swap, then wait on a fence until the GPU has executed it. For
+ * drivers whose swap returns before the flip. */
+class Fence {
+public:
+  explicit Fence(GLuint64 timeout_ns = 100000000)
+    : fence_((PFNGLFENCESYNCPROC)glXGetProcAddress((const GLubyte *)"glFenceSync")),
+      wait_((PFNGLCLIENTWAITSYNCPROC)glXGetProcAddress((const GLubyte *)"glClientWaitSync")),
+      delete_((PFNGLDELETESYNCPROC)glXGetProcAddress((const GLubyte *)"glDeleteSync")),
+      timeout_(timeout_ns) {}
+
+  bool available() const noexcept { return 0 != fence_ && 0 != wait_ && 0 != delete_; }
+
+  template <class Swap>
+  int swap(nvstusb_context *ctx, nvstusb_eye eye, Swap &&swapfunc) {
+    if (!available()) throw std::runtime_error("nvstusb: no sync objects");
+    swapfunc();
+    GLsync sync = fence_(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    if (0 != sync) {
+      wait_(sync, GL_SYNC_FLUSH_COMMANDS_BIT, timeout_);
+      delete_(sync);
+    }
+    return nvstusb_send_eye_vblank(ctx, eye, 0, -1, 0);
+  }
+
+private:
+  PFNGLFENCESYNCPROC fence_;
+  PFNGLCLIENTWAITSYNCPROC wait_;
+  PFNGLDELETESYNCPROC delete_;
+  GLuint64 timeout_;
+};
+
+} /* namespace nvstusb */
+
+#endif /* NVSTUSB_HPP */
@@ -0,0 +1,34 @@
+/* USDT probes of provider nvstusb, compiled in with --enable-usdt and
+ * nothing without. List them with
+ *   bpftrace -l 'usdt:/usr/lib/libnvstusb.so:nvstusb:*'
+ * the scripts in tools/bpftrace use them. Arguments are not evaluated
+ * when the probes are off, they must not have side effects.
+ *
+ *   swap_entry(method, eye)            nvstusb_swap and its variants
+ *   swap_exit(method, eye, status)
+ *   set_eye(eye, r)                    eye command about to be sent
+ *   keys(wheel, pressed_wheel, toggled) key changes handed out
+ *   usb_submit(endpoint, size)         synchronous bulk transfer
+ *   usb_complete(endpoint, size, result)
+ *   usb_reap(endpoint, result)         posted read taken
+ *   firmware(phase)                    NVSTUSB_PROBE_FW_*
+ *   firmware_chunk(address, size, result)
+ */
+/* firmware load phases */
+#define NVSTUSB_PROBE_FW_FAILED     -1
+#define NVSTUSB_PROBE_FW_START      0   /* boot loader found, upload begins */
+#define NVSTUSB_PROBE_FW_UPLOADED   1   /* all chunks written, resetting */
+#define NVSTUSB_PROBE_FW_REOPENED   2   /* the controller came back */
+#define NVSTUSB_PROBE_FW_READY      3   /* interface claimed */
+
+#ifdef NVSTUSB_USDT
+#include <sys/sdt.h>
+
+#define NVSTUSB_PROBE1(name, a)           DTRACE_PROBE1(nvstusb, name, a)
+#define NVSTUSB_PROBE2(name, a, b)        DTRACE_PROBE2(nvstusb, name, a, b)
+#define NVSTUSB_PROBE3(name, a, b, c)     DTRACE_PROBE3(nvstusb, name, a, b, c)
+#else
+#define NVSTUSB_PROBE1(name, a)           do { } while (0)
+#define NVSTUSB_PROBE2(name, a, b)        do { } while (0)
+#define NVSTUSB_PROBE3(name, a, b, c)     do { } while (0)
+#endif
@@ -0,0 +1,32 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+/* host side copy of the controller's register window at 0x2007 */
+#define NVSTUSB_REG_COUNT       256
+
+/* a command carries at most this many register bytes (64 byte packet) */
+#define NVSTUSB_REG_MAX_WRITE   60
+
+struct nvstusb_regs {
+  uint8_t shadow[NVSTUSB_REG_COUNT];  /* value the controller holds */
+  uint8_t staged[NVSTUSB_REG_COUNT];  /* value to be written */
+  uint8_t flags[NVSTUSB_REG_COUNT];   /* NVSTUSB_REG_* */
+};
+
+/* forget everything, e.g. after the controller was reset */
+void nvstusb_regs_init(struct nvstusb_regs *regs);
+
+/* queue a write, bytes equal to the shadow are not sent again */
+void nvstusb_regs_stage(struct nvstusb_regs *regs, unsigned int offset, const void *data, unsigned int size);
+
+/* queue all known registers again (replay after a reconnect) */
+void nvstusb_regs_stage_all(struct nvstusb_regs *regs);
+
+/* next contiguous range to transmit, false if nothing is dirty */
+bool nvstusb_regs_next_range(struct nvstusb_regs *regs, unsigned int *offset, unsigned int *size);
+
+/* a range was written (ok) or its state is unknown now (!ok) */
+void nvstusb_regs_commit(struct nvstusb_regs *regs, unsigned int offset, unsigned int size, bool ok);
+
+/* remember values read from the controller */
+void nvstusb_regs_update(struct nvstusb_regs *regs, unsigned int offset, const void *data, unsigned int size);
@@ -0,0 +1,41 @@
+#include <stdbool.h>
+
+#include "nvstusb.h"
+
+/* Model of what one eye sees through the shutter. The panel scans the
+ * eye's frame out row by row after the vblank it flipped at, each pixel
+ * then settles exponentially with the panel's response time. The eye
+ * command is sent at that vblank, the controller starts the eye phase
+ * eye_delay_us later and opens the shutter after another x_us, for
+ * active_us. Every row sees
+ * its own eye's image settling and the other eye's image taking over,
+ * integrated over the open window that gives brightness and crosstalk.
+ * The two eyes alternate the same way, so both see the same. */
+
+/* rows sampled from top to bottom */
+#define NVSTUSB_SHUTTER_ROWS    64
+
+struct nvstusb_panel {
+  float rate;           /* refresh rate */
+  float vblank_us;      /* vertical blanking, scanout takes the rest */
+  float response_us;    /* 10-90% grey to grey response time */
+};
+
+struct nvstusb_shutter_result {
+  double open_us;       /* window relative to the vblank of the eye's frame */
+  double close_us;
+  double brightness;    /* 1 for an instant panel and the shutter open all frame */
+  double crosstalk;     /* share of the other eye's light, mean over the rows */
+  double worst;         /* crosstalk of the worst row */
+  double worst_row;     /* 0 top, 1 bottom */
+};
+
+/* brightness and crosstalk of a profile on panel */
+void nvstusb_shutter_evaluate(const struct nvstusb_panel *panel,
+  const struct nvstusb_timing_profile *profile, struct nvstusb_shutter_result *result);
+
+/* search x_us and active_us of profile for the brightest timing whose
+ * worst row stays below max_crosstalk, or the one with the least
+ * crosstalk if none does, to step_us. w_us and eye_delay_us are kept. */
+void nvstusb_shutter_optimize(const struct nvstusb_panel *panel, float max_crosstalk,
+  float step_us, struct nvstusb_timing_profile *profile, struct nvstusb_shutter_result *result);
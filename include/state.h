@@ -0,0 +1,38 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "nvstusb.h"
+
+/* shared state page, see nvstusb_publish_state. The writer makes seq
+ * odd, changes state and makes it even again, a reader retries until it
+ * saw the same even seq before and after copying. */
+#define NVSTUSB_STATE_MAGIC     0x4e565354  /* "NVST" */
+#define NVSTUSB_STATE_VERSION   1
+#define NVSTUSB_STATE_SIZE      4096
+
+/* path: $NVSTUSB_STATE, $XDG_RUNTIME_DIR/nvstusb.state or /tmp */
+#define NVSTUSB_STATE_FILE      "nvstusb.state"
+
+struct nvstusb_state_page {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq;
+  uint32_t size;            /* sizeof(struct nvstusb_state) */
+  struct nvstusb_state state;
+};
+
+struct nvstusb_state_writer {
+  pthread_mutex_t lock;     /* threads of the owner take turns */
+  struct nvstusb_state_page *page;
+};
+
+/* path of the page, in a static buffer unless path is given */
+const char *nvstusb_state_path(const char *path);
+
+struct nvstusb_state_writer *nvstusb_state_create(const char *path);
+void nvstusb_state_destroy(struct nvstusb_state_writer *writer);
+
+/* state can be changed between begin and end */
+struct nvstusb_state *nvstusb_state_begin(struct nvstusb_state_writer *writer);
+void nvstusb_state_end(struct nvstusb_state_writer *writer);
@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* cpu clock */
+#define NVSTUSB_CLOCK           48000000LL
+
+/* T0 runs at 4 MHz */
+#define NVSTUSB_T0_CLOCK        (NVSTUSB_CLOCK/12LL)
+#define NVSTUSB_T0_COUNT(us)    (-(us)*(NVSTUSB_T0_CLOCK/1000000)+1)
+#define NVSTUSB_T0_US(count)    (-(count-1)/(NVSTUSB_T0_CLOCK/1000000))
+
+/* T2 runs at 12 MHz */
+#define NVSTUSB_T2_CLOCK        (NVSTUSB_CLOCK/ 4LL)
+#define NVSTUSB_T2_COUNT(us)    (-(us)*(NVSTUSB_T2_CLOCK/1000000)+1)
+#define NVSTUSB_T2_US(count)    (-(count-1)/(NVSTUSB_T2_CLOCK/1000000))
+
+/* supported refresh rates */
+#define NVSTUSB_RATE_MIN        60.0
+#define NVSTUSB_RATE_MAX        240.0
+
+/* timer counts sent to the controller, see nvstusb_set_rate */
+struct nvstusb_timing {
+  int32_t w;  /* 0x2007: timer 2 count */
+  int32_t x;  /* 0x200b: timer 0 count */
+  int32_t y;  /* 0x200f: timer 0 count, time each eye is on */
+  int32_t z;  /* 0x201b: timer 2 reload value, frame time */
+  int32_t r;  /* timer 2 count sent with each SET_EYE */
+};
+
+/* most profiles read from a file */
+#define NVSTUSB_TIMING_MAX_PROFILES 16
+
+/* profile from the built-in table closest to rate, 0 if none is close */
+const struct nvstusb_timing_profile *nvstusb_timing_find_profile(float rate);
+
+/* the same in a table of count profiles */
+const struct nvstusb_timing_profile *nvstusb_timing_find_in(const struct nvstusb_timing_profile *profiles,
+  int count, float rate);
+
+/* profile files hold one profile per line, the columns of the built-in
+ * table: rate w_us x_us active_us eye_delay_us, # starts a comment.
+ * read returns the number of profiles or -1. */
+int nvstusb_timing_read_profiles(const char *path, struct nvstusb_timing_profile *profiles, int max);
+void nvstusb_timing_write_profile(FILE *file, const struct nvstusb_timing_profile *profile);
+
+/* generate a profile for rate by scaling the 120 Hz timings */
+void nvstusb_timing_generate(float rate, struct nvstusb_timing_profile *profile);
+
+/* convert a profile to timer counts for rate, false if they are out of range */
+bool nvstusb_timing_compute(const struct nvstusb_timing_profile *profile, float rate, struct nvstusb_timing *timing);
@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* usb trace file: a 16 byte header ("NVSTRACE", version, reserved)
+ * followed by records of 24 bytes plus payload, all little endian */
+#define NVSTUSB_TRACE_MAGIC     "NVSTRACE"
+#define NVSTUSB_TRACE_VERSION   1
+
+/* record types */
+#define NVSTUSB_TRACE_BULK_OUT  1
+#define NVSTUSB_TRACE_BULK_IN   2
+#define NVSTUSB_TRACE_CONTROL   3   /* payload: 8 byte setup packet + data */
+
+struct nvstusb_trace_record {
+  uint8_t  type;
+  uint8_t  endpoint;        /* with direction bit */
+  uint16_t length;          /* payload bytes following the record */
+  int32_t  result;          /* bytes transferred or negative libusb error */
+  uint64_t submit;          /* ns since the trace started */
+  uint64_t complete;
+};
+
+FILE *nvstusb_trace_create(const char *path);
+bool nvstusb_trace_write(FILE *file, const struct nvstusb_trace_record *rec, const void *data);
+
+/* open a trace for reading, read returns 1 for a record, 0 at the end
+ * and -1 on errors. data must hold 65535 bytes. */
+FILE *nvstusb_trace_open(const char *path);
+int nvstusb_trace_read(FILE *file, struct nvstusb_trace_record *rec, uint8_t *data);
@@ -1,14 +1,72 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "nvstusb.h"
+
 struct nvstusb_usb_device;
 
+/* transfer results below zero are errors, these match the libusb codes */
+#define NVSTUSB_USB_ERROR_IO          (-1)
+#define NVSTUSB_USB_ERROR_ACCESS      (-3)
+#define NVSTUSB_USB_ERROR_NO_DEVICE   (-4)
+#define NVSTUSB_USB_ERROR_BUSY        (-6)
+#define NVSTUSB_USB_ERROR_TIMEOUT     (-7)
+#define NVSTUSB_USB_ERROR_PIPE        (-9)
+
+/* choose the backend ("libusb", "usbfs", "replay", "daemon", "emu") before nvstusb_usb_init,
+ * the default is $NVSTUSB_BACKEND, else daemon if nvstusbd runs, else libusb */
+bool nvstusb_usb_select_backend(const char *name);
+
+/* play back a trace instead of talking to a device,
+ * speed 1 keeps the original timing, 0 runs as fast as possible */
+void nvstusb_usb_set_replay(const char *path, float speed);
+
+/* record all transfers to a trace file ($NVSTUSB_TRACE at init) */
+bool nvstusb_usb_trace_start(const char *path);
+void nvstusb_usb_trace_stop();
+
+/* verbosity of the usb library underneath, 0 (none) to 4 (debug) */
+void nvstusb_usb_set_debug(int level);
+
 bool nvstusb_usb_init();
 void nvstusb_usb_deinit();
 
 struct nvstusb_usb_device *nvstusb_usb_open_device(const char *firmware);
 void nvstusb_usb_close_device(struct nvstusb_usb_device *dev);
 
-int nvstusb_usb_write_bulk(struct nvstusb_usb_device *dev, int endpoint, const void *data, int size);
-int nvstusb_usb_read_bulk(struct nvstusb_usb_device *dev, int endpoint, void *data, int size);
+/* posted reads: keep count IN transfers of size bytes queued on an
+ * endpoint at all times, completed ones are taken with reap_bulk */
+bool nvstusb_usb_post_reads(struct nvstusb_usb_device *dev, int endpoint, int count, int size);
+int nvstusb_usb_reap_bulk(struct nvstusb_usb_device *dev, int endpoint, void *data, int size);
+
+/* reap_bulk that also tells when the read was queued and completed,
+ * monotonic ns like nvstusb_usb_time_ns */
+int nvstusb_usb_reap_bulk_times(struct nvstusb_usb_device *dev, int endpoint, void *data, int size,
+  uint64_t *submit, uint64_t *complete);
+
+/* handle usb events (completions), waits at most timeout_us */
+int nvstusb_usb_handle_events(struct nvstusb_usb_device *dev, int timeout_us);
+
+/* transfer counters per endpoint, see struct nvstusb_endpoint_stats */
+int nvstusb_usb_get_stats(struct nvstusb_usb_device *dev, struct nvstusb_endpoint_stats *stats, int max);
+void nvstusb_usb_reset_stats(struct nvstusb_usb_device *dev);
+
+/* a descriptor that polls readable while handle_events has work, for
+ * event loops. -1 if the backend has none. */
+int nvstusb_usb_get_fd(struct nvstusb_usb_device *dev);
+
+/* buffers owned by the device to build packets in, writes from them are
+ * not copied. nvstusb_usb_buffer hands one to the calling thread until
+ * it releases it after the write, other threads wait for it meanwhile. */
+#define NVSTUSB_USB_BUFFER_EYE      0   /* eye commands, endpoint 1 */
+#define NVSTUSB_USB_BUFFER_COMMAND  1   /* read commands, endpoint 2 */
+#define NVSTUSB_USB_BUFFERS         2
+#define NVSTUSB_USB_BUFFER_SIZE     64
+
+void *nvstusb_usb_buffer(struct nvstusb_usb_device *dev, int buffer);
+void nvstusb_usb_release_buffer(struct nvstusb_usb_device *dev, int buffer);
+
+/* timeouts are in milliseconds, 0 waits forever */
+int nvstusb_usb_write_bulk(struct nvstusb_usb_device *dev, int endpoint, const void *data, int size, unsigned int timeout);
+int nvstusb_usb_read_bulk(struct nvstusb_usb_device *dev, int endpoint, void *data, int size, unsigned int timeout);
 
@@ -0,0 +1,99 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "usb.h"
+
+/* a way to reach the controller, selected when usb is initialized */
+struct nvstusb_usb_backend {
+  const char *name;
+
+  bool (*init)(void);
+  void (*deinit)(void);
+
+  struct nvstusb_usb_device *(*open_device)(const char *firmware);
+  void (*close_device)(struct nvstusb_usb_device *dev);
+
+  /* a transfer that moved some bytes before it failed returns the
+   * bytes and leaves the error in *error, the counters would not see
+   * it otherwise */
+  int (*write_bulk)(struct nvstusb_usb_device *dev, int endpoint, const void *data, int size, unsigned int timeout,
+    int *error);
+  int (*read_bulk)(struct nvstusb_usb_device *dev, int endpoint, void *data, int size, unsigned int timeout,
+    int *error);
+
+  bool (*post_reads)(struct nvstusb_usb_device *dev, int endpoint, int count, int size);
+  /* submit and complete are when the read was queued and when it
+   * completed (monotonic ns), 0 if the backend does not know */
+  int (*reap_bulk)(struct nvstusb_usb_device *dev, int endpoint, void *data, int size,
+    uint64_t *submit, uint64_t *complete);
+  int (*handle_events)(struct nvstusb_usb_device *dev, int timeout_us);
+
+  /* optional, a buffer of the device, 0 if it has none */
+  void *(*buffer)(struct nvstusb_usb_device *dev, int buffer);
+
+  /* optional, readable while handle_events has work to do */
+  int (*get_fd)(struct nvstusb_usb_device *dev);
+};
+
+/* counters of an endpoint, latencies in ns */
+struct nvstusb_usb_counters {
+  struct nvstusb_endpoint_stats stats;
+  uint64_t latencySum;
+  uint64_t latencyMin;
+  uint64_t latencyMax;
+};
+
+/* endpoint numbers 0-15, OUT and IN */
+#define NVSTUSB_USB_ENDPOINTS   32
+
+/* every backend's device starts with this */
+struct nvstusb_usb_device {
+  const struct nvstusb_usb_backend *backend;
+
+  /* packet buffers of backends without their own, and who holds which */
+  uint8_t buffers[NVSTUSB_USB_BUFFERS][NVSTUSB_USB_BUFFER_SIZE];
+  pthread_mutex_t bufferLocks[NVSTUSB_USB_BUFFERS];
+
+  pthread_mutex_t countersLock;
+  struct nvstusb_usb_counters counters[NVSTUSB_USB_ENDPOINTS];
+  bool closing;             /* the counters are gone */
+
+  /* OUT endpoints, bit n for endpoint n, whose writes return before they
+   * complete. The backend counts them with nvstusb_usb_posted_write_done. */
+  uint32_t postedWrites;
+};
+
+extern const struct nvstusb_usb_backend nvstusb_usb_libusb_backend;
+extern const struct nvstusb_usb_backend nvstusb_usb_usbfs_backend;
+extern const struct nvstusb_usb_backend nvstusb_usb_replay_backend;
+extern const struct nvstusb_usb_backend nvstusb_usb_daemon_backend;
+extern const struct nvstusb_usb_backend nvstusb_usb_emu_backend;
+
+/* libusb's verbosity, 0 (none) to 4 (debug) */
+void nvstusb_libusb_set_debug(int level);
+
+/* true if nvstusbd accepts connections */
+bool nvstusb_usb_daemon_running(void);
+
+/* monotonic time in ns */
+uint64_t nvstusb_usb_time_ns(void);
+
+/* backends count each posted read on endpoint as it completes: size
+ * bytes were asked for, res is what it returned and error the error a
+ * short read ended in. Reads cancelled on close are not counted. */
+void nvstusb_usb_posted_done(struct nvstusb_usb_device *dev, int endpoint, int size, int res, int error,
+  uint64_t submit, uint64_t complete);
+
+/* the same for every write on a postedWrites endpoint, as it completes
+ * or as its submit fails */
+void nvstusb_usb_posted_write_done(struct nvstusb_usb_device *dev, int endpoint, int size, int res, int error,
+  uint64_t submit, uint64_t complete);
+
+/* backends report control transfers (firmware upload) to the recorder */
+void nvstusb_usb_trace_control(uint8_t requestType, uint8_t request, uint16_t value, uint16_t index,
+  const void *data, int size, int result, uint64_t submit, uint64_t complete);
+
+/* trace the replay backend plays back */
+const char *nvstusb_usb_replay_path(void);
+float nvstusb_usb_replay_speed(void);
@@ -0,0 +1,17 @@
+#include <stdbool.h>
+
+#include "usb.h"
+
+/* usb counters written to a text file in the Prometheus exposition
+ * format, for the textfile collector of node_exporter and the like.
+ * The file is replaced atomically (written to PATH.tmp and renamed). */
+#define NVSTUSB_USBSTATS_INTERVAL_MS  10000
+
+struct nvstusb_usbstats_exporter;
+
+bool nvstusb_usbstats_write(struct nvstusb_usb_device *dev, const char *path);
+
+/* a thread writing the file every interval_ms (0 = default) until
+ * stopped, and once more when it is stopped */
+struct nvstusb_usbstats_exporter *nvstusb_usbstats_start(struct nvstusb_usb_device *dev, const char *path, unsigned int interval_ms);
+void nvstusb_usbstats_stop(struct nvstusb_usbstats_exporter *exporter);
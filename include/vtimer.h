@@ -0,0 +1,39 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/* virtual vblank: ticks at a fixed rate on an absolute schedule, so
+ * oversleeping one tick does not shift the following ones. External
+ * vblank timestamps pull phase and period towards the real display. */
+struct nvstusb_vtimer {
+  pthread_mutex_t lock;
+
+  double nominal;       /* configured period in ns, 0 = not running */
+  double period;        /* period corrected by external timestamps */
+  int64_t anchor;       /* time of tick 0 (CLOCK_MONOTONIC ns) */
+  int64_t tick;         /* index of the next tick */
+
+  double phase;         /* phase correction still to be applied */
+  double slew;          /* max phase correction per tick in ns */
+
+  int64_t last_sync;    /* last external timestamp, 0 = none */
+  uint32_t missed;      /* ticks slept through */
+};
+
+void nvstusb_vtimer_init(struct nvstusb_vtimer *timer);
+void nvstusb_vtimer_destroy(struct nvstusb_vtimer *timer);
+
+/* (re)start ticking at rate Hz, rate 0 stops */
+void nvstusb_vtimer_set_rate(struct nvstusb_vtimer *timer, float rate);
+
+/* max phase correction per tick in us */
+void nvstusb_vtimer_set_slew(struct nvstusb_vtimer *timer, float slew_us);
+
+/* sleep until the next tick, returns its time in ns (-1 if not running) */
+int64_t nvstusb_vtimer_wait(struct nvstusb_vtimer *timer);
+
+/* an external vblank happened at timestamp (CLOCK_MONOTONIC ns) */
+void nvstusb_vtimer_sync(struct nvstusb_vtimer *timer, int64_t timestamp);
+
+/* current time (CLOCK_MONOTONIC ns) */
+int64_t nvstusb_vtimer_now(void);
@@ -0,0 +1,125 @@
+/* calibrate.c
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "nvstusb.h"
+#include "calibrate.h"
+#include "log.h"
+
+#define NVSTUSB_CALIBRATE_DIR   "libnvstusb"
+#define NVSTUSB_CALIBRATE_FILE  "vblank"
+#define NVSTUSB_CALIBRATE_LINE  1024
+
+/* path of the cache file, creating its directory if create is set */
+static bool
+nvstusb_calibrate_path(
+  char *path,
+  size_t size,
+  bool create
+) {
+  const char *cache = getenv("XDG_CACHE_HOME");
+  char base[512];
+
+  if (cache && cache[0]) {
+    snprintf(base, sizeof(base), "%s", cache);
+  } else {
+    const char *home = getenv("HOME");
+    if (0 == home) return false;
+    snprintf(base, sizeof(base), "%s/.cache", home);
+  }
+
+  if (create) {
+    mkdir(base, 0700);
+    snprintf(path, size, "%s/%s", base, NVSTUSB_CALIBRATE_DIR);
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) return false;
+  }
+  snprintf(path, size, "%s/%s/%s", base, NVSTUSB_CALIBRATE_DIR, NVSTUSB_CALIBRATE_FILE);
+  return true;
+}
+
+/* line: method frames mean jitter missed<TAB>key */
+static bool
+nvstusb_calibrate_parse(
+  char *line,
+  const char *key,
+  struct nvstusb_vblank_result *result
+) {
+  char *tab = strchr(line, '\t');
+  if (0 == tab) return false;
+  tab[strcspn(tab, "\n")] = 0;
+  if (0 != strcmp(tab+1, key)) return false;
+
+  int method;
+  if (sscanf(line, "%d %u %f %f %u", &method, &result->frames,
+        &result->mean_us, &result->jitter_us, &result->missed) != 5) return false;
+  result->method = method;
+  result->available = 1;
+  return true;
+}
+
+bool
+nvstusb_calibrate_load(
+  const char *key,
+  struct nvstusb_vblank_result *result
+) {
+  char path[1024];
+  if (!nvstusb_calibrate_path(path, sizeof(path), false)) return false;
+
+  FILE *file = fopen(path, "r");
+  if (0 == file) return false;
+
+  char line[NVSTUSB_CALIBRATE_LINE];
+  bool found = false;
+  while (!found && fgets(line, sizeof(line), file)) {
+    found = nvstusb_calibrate_parse(line, key, result);
+  }
+  fclose(file);
+  return found;
+}
+
+bool
+nvstusb_calibrate_store(
+  const char *key,
+  const struct nvstusb_vblank_result *result
+) {
+  char path[1024], temp[1040];
+  if (!nvstusb_calibrate_path(path, sizeof(path), true)) return false;
+  snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+
+  FILE *out = fopen(temp, "w");
+  if (0 == out) { NVSTUSB_LOG(nvstusb_log_error, "%s: %s", temp, strerror(errno)); return false; }
+
+  /* keep the other keys */
+  FILE *in = fopen(path, "r");
+  if (0 != in) {
+    char line[NVSTUSB_CALIBRATE_LINE];
+    while (fgets(line, sizeof(line), in)) {
+      struct nvstusb_vblank_result old;
+      char copy[NVSTUSB_CALIBRATE_LINE];
+      strcpy(copy, line);
+      if (!nvstusb_calibrate_parse(copy, key, &old)) fputs(line, out);
+    }
+    fclose(in);
+  }
+
+  fprintf(out, "%d %u %.1f %.1f %u\t%s\n", (int)result->method, result->frames,
+    result->mean_us, result->jitter_us, result->missed, key);
+
+  /* replace the file in one step */
+  if (fclose(out) != 0 || rename(temp, path) != 0) {
+    NVSTUSB_LOG(nvstusb_log_error, "%s: %s", path, strerror(errno));
+    remove(temp);
+    return false;
+  }
+  return true;
+}
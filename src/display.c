@@ -0,0 +1,341 @@
+/* display.c
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+
+#ifdef HAVE_LIBDRM
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#endif
+
+#include "display.h"
+#include "log.h"
+
+/* refresh rate of a mode line */
+static float
+nvstusb_display_rate(
+  double clock,
+  unsigned int htotal,
+  unsigned int vtotal,
+  bool doublescan,
+  bool interlace
+) {
+  if (0 == htotal || 0 == vtotal) return 0;
+
+  double rate = clock / htotal / vtotal;
+  if (doublescan) rate /= 2;
+  if (interlace)  rate *= 2;
+  return rate;
+}
+
+/* find the crtc of a RandR output, or of the primary or first active one
+ * (no primary set, or it is off) */
+static RRCrtc
+nvstusb_display_find_crtc(
+  Display *dpy,
+  XRRScreenResources *res,
+  const char *name
+) {
+  int i;
+  RROutput primary = XRRGetOutputPrimary(dpy, DefaultRootWindow(dpy));
+
+  for (i = 0; i < res->noutput; i++) {
+    if (0 == name && res->outputs[i] != primary) continue;
+
+    XRROutputInfo *out = XRRGetOutputInfo(dpy, res, res->outputs[i]);
+    if (0 == out) continue;
+    RRCrtc crtc = out->crtc;
+    bool match = 0 == name || 0 == strcmp(out->name, name);
+    XRRFreeOutputInfo(out);
+    if (match && (0 != name || None != crtc)) return crtc;
+  }
+  if (0 != name) return None;
+
+  for (i = 0; i < res->ncrtc; i++) {
+    XRRCrtcInfo *info = XRRGetCrtcInfo(dpy, res, res->crtcs[i]);
+    if (0 == info) continue;
+    RRMode mode = info->mode;
+    XRRFreeCrtcInfo(info);
+    if (None != mode) return res->crtcs[i];
+  }
+  return None;
+}
+
+#ifdef HAVE_LIBDRM
+/* the drm card and pipe scanning out the area and mode of out: the
+ * index of the active crtc with the same position, size and rate in
+ * drmModeGetResources */
+static void
+nvstusb_display_find_pipe(
+  struct nvstusb_display_output *out
+) {
+  int card, j;
+  for (card = 0; card < 8 && out->drm_pipe < 0; card++) {
+    char path[32];
+    snprintf(path, sizeof(path), "/dev/dri/card%d", card);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) continue;
+
+    drmModeResPtr res = drmModeGetResources(fd);
+    for (j = 0; 0 != res && j < res->count_crtcs && out->drm_pipe < 0; j++) {
+      drmModeCrtcPtr crtc = drmModeGetCrtc(fd, res->crtcs[j]);
+      if (0 == crtc) continue;
+      if (crtc->mode_valid && crtc->x == out->x && crtc->y == out->y &&
+          crtc->mode.hdisplay == out->width && crtc->mode.vdisplay == out->height) {
+        float rate = nvstusb_display_rate(crtc->mode.clock*1000.0, crtc->mode.htotal, crtc->mode.vtotal,
+          crtc->mode.flags & DRM_MODE_FLAG_DBLSCAN, crtc->mode.flags & DRM_MODE_FLAG_INTERLACE);
+        if (0 == out->rate || fabsf(rate - out->rate) < 0.5) {
+          out->drm_card = card;
+          out->drm_pipe = j;
+        }
+      }
+      drmModeFreeCrtc(crtc);
+    }
+    if (0 != res) drmModeFreeResources(res);
+    close(fd);
+  }
+
+  if (out->drm_pipe < 0) {
+    NVSTUSB_LOG(nvstusb_log_warning, "No drm crtc shows the output, no drm vblank events for it");
+  }
+}
+#endif
+
+/* look up an output through RandR */
+static bool
+nvstusb_display_find_randr(
+  const char *name,
+  struct nvstusb_display_output *out
+) {
+  Display *dpy = XOpenDisplay(0);
+  if (0 == dpy) {
+    NVSTUSB_LOG(nvstusb_log_error, "Could not open display to query outputs");
+    return false;
+  }
+
+  bool found = false;
+  XRRScreenResources *res = XRRGetScreenResourcesCurrent(dpy, DefaultRootWindow(dpy));
+  if (0 != res) {
+    RRCrtc crtc = nvstusb_display_find_crtc(dpy, res, name);
+    XRRCrtcInfo *info = None != crtc ? XRRGetCrtcInfo(dpy, res, crtc) : 0;
+    if (0 != info && None != info->mode) {
+      int i;
+      out->x = info->x;
+      out->y = info->y;
+      out->width = info->width;
+      out->height = info->height;
+      out->rate = 0;
+      for (i = 0; i < res->nmode; i++) {
+        const XRRModeInfo *mode = &res->modes[i];
+        if (mode->id != info->mode) continue;
+        out->rate = nvstusb_display_rate(mode->dotClock, mode->hTotal, mode->vTotal,
+          mode->modeFlags & RR_DoubleScan, mode->modeFlags & RR_Interlace);
+        break;
+      }
+
+      /* RandR crtc ids are not drm's, look the pipe up by what it shows */
+      out->drm_card = -1;
+      out->drm_pipe = -1;
+#ifdef HAVE_LIBDRM
+      nvstusb_display_find_pipe(out);
+#endif
+      found = true;
+    }
+    if (0 != info) XRRFreeCrtcInfo(info);
+    XRRFreeScreenResources(res);
+  }
+  XCloseDisplay(dpy);
+  return found;
+}
+
+#ifdef HAVE_LIBDRM
+/* connector type names as used by the kernel in sysfs */
+static const char *
+nvstusb_display_connector_type(
+  uint32_t type
+) {
+  static const char *names[] = {
+    "Unknown", "VGA", "DVI-I", "DVI-D", "DVI-A", "Composite", "SVIDEO",
+    "LVDS", "Component", "DIN", "DP", "HDMI-A", "HDMI-B", "TV", "eDP",
+    "Virtual", "DSI", "DPI", "Writeback", "SPI", "USB"
+  };
+  if (type >= sizeof(names)/sizeof(names[0])) return "Unknown";
+  return names[type];
+}
+
+/* look up a connector ("card0-DP-2") through DRM */
+static bool
+nvstusb_display_find_drm(
+  const char *name,
+  struct nvstusb_display_output *out
+) {
+  int card;
+  char connector[32];
+  if (sscanf(name, "card%d-%31s", &card, connector) != 2) return false;
+
+  char path[32];
+  snprintf(path, sizeof(path), "/dev/dri/card%d", card);
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) { NVSTUSB_LOG(nvstusb_log_error, "%s: %s", path, strerror(errno)); return false; }
+
+  bool found = false;
+  drmModeResPtr res = drmModeGetResources(fd);
+  int i, j;
+  for (i = 0; 0 != res && i < res->count_connectors && !found; i++) {
+    drmModeConnectorPtr conn = drmModeGetConnector(fd, res->connectors[i]);
+    if (0 == conn) continue;
+
+    char connName[32];
+    snprintf(connName, sizeof(connName), "%s-%u",
+      nvstusb_display_connector_type(conn->connector_type), conn->connector_type_id);
+    drmModeEncoderPtr enc = 0;
+    if (0 == strcmp(connName, connector) && 0 != conn->encoder_id) {
+      enc = drmModeGetEncoder(fd, conn->encoder_id);
+    }
+    drmModeFreeConnector(conn);
+    if (0 == enc) continue;
+
+    for (j = 0; j < res->count_crtcs; j++) {
+      if (res->crtcs[j] != enc->crtc_id) continue;
+
+      drmModeCrtcPtr crtc = drmModeGetCrtc(fd, enc->crtc_id);
+      if (0 != crtc && crtc->mode_valid) {
+        out->x = crtc->x;
+        out->y = crtc->y;
+        out->width = crtc->mode.hdisplay;
+        out->height = crtc->mode.vdisplay;
+        out->rate = nvstusb_display_rate(crtc->mode.clock*1000.0, crtc->mode.htotal, crtc->mode.vtotal,
+          crtc->mode.flags & DRM_MODE_FLAG_DBLSCAN, crtc->mode.flags & DRM_MODE_FLAG_INTERLACE);
+        out->drm_card = card;
+        out->drm_pipe = j;
+        found = true;
+      }
+      if (0 != crtc) drmModeFreeCrtc(crtc);
+    }
+    drmModeFreeEncoder(enc);
+  }
+  if (0 != res) drmModeFreeResources(res);
+  close(fd);
+  return found;
+}
+#endif
+
+/* find an output by RandR or DRM connector name */
+bool
+nvstusb_display_find_output(
+  const char *name,
+  struct nvstusb_display_output *out
+) {
+  out->x = out->y = 0;
+  out->width = out->height = 0;
+  out->rate = 0;
+  out->drm_card = -1;
+  out->drm_pipe = -1;
+
+#ifdef HAVE_LIBDRM
+  if (0 != name && 0 == strncmp(name, "card", 4)) {
+    if (nvstusb_display_find_drm(name, out)) return true;
+  }
+#endif
+  if (nvstusb_display_find_randr(name, out)) return true;
+
+  NVSTUSB_LOG(nvstusb_log_error, "Output %s not found or not active", name ? name : "(primary)");
+  return false;
+}
+
+/* detect the refresh rate of an output */
+float
+nvstusb_display_detect_rate(
+  const char *name
+) {
+  struct nvstusb_display_output out;
+  if (!nvstusb_display_find_output(name, &out)) return 0;
+
+  if (0 == out.rate) {
+    NVSTUSB_LOG(nvstusb_log_error, "Could not detect refresh rate");
+  }
+  return out.rate;
+}
+
+struct nvstusb_display_vblank {
+  int fd;
+  int pipe;
+};
+
+/* open drm vblank waits on a crtc */
+struct nvstusb_display_vblank *
+nvstusb_display_open_vblank(
+  int card,
+  int pipe
+) {
+#ifdef HAVE_LIBDRM
+  char path[32];
+  snprintf(path, sizeof(path), "/dev/dri/card%d", card < 0 ? 0 : card);
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) { NVSTUSB_LOG(nvstusb_log_error, "%s: %s", path, strerror(errno)); return 0; }
+
+  struct nvstusb_display_vblank *vblank = malloc(sizeof(*vblank));
+  vblank->fd = fd;
+  vblank->pipe = pipe < 0 ? 0 : pipe;
+  return vblank;
+#else
+  NVSTUSB_LOG(nvstusb_log_warning, "Built without libdrm, no drm vblank events");
+  return 0;
+#endif
+}
+
+/* wait for a vblank of the crtc */
+int64_t
+nvstusb_display_wait_vblank(
+  struct nvstusb_display_vblank *vblank,
+  unsigned int interval
+) {
+#ifdef HAVE_LIBDRM
+  drmVBlank vbl;
+  unsigned int type = DRM_VBLANK_RELATIVE;
+  if (vblank->pipe == 1) {
+    type |= DRM_VBLANK_SECONDARY;
+  } else if (vblank->pipe > 1) {
+    type |= (vblank->pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
+  }
+
+  /* the next vblank, then the following ones up to a multiple of interval */
+  unsigned int sequence = 1;
+  for (;;) {
+    memset(&vbl, 0, sizeof(vbl));
+    vbl.request.type = type;
+    vbl.request.sequence = sequence;
+    if (drmWaitVBlank(vblank->fd, &vbl) != 0) return -1;
+
+    unsigned int phase = interval > 1 ? vbl.reply.sequence % interval : 0;
+    if (0 == phase) break;
+    sequence = interval - phase;
+  }
+
+  return (int64_t)vbl.reply.tval_sec*1000000 + vbl.reply.tval_usec;
+#else
+  return -1;
+#endif
+}
+
+void
+nvstusb_display_close_vblank(
+  struct nvstusb_display_vblank *vblank
+) {
+  if (0 == vblank) return;
+  close(vblank->fd);
+  free(vblank);
+}
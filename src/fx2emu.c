@@ -0,0 +1,1416 @@
+/* fx2emu.c
+ *
+ * EZ-USB FX2 emulator, see include/fx2emu.h. Instruction timing follows
+ * the FX2 technical reference: one cycle is four CLKOUT clocks, most
+ * instructions take one cycle per byte.
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "fx2emu.h"
+#include "log.h"
+
+/* special function registers */
+#define SFR_IOA         0x80
+#define SFR_SP          0x81
+#define SFR_DPL         0x82
+#define SFR_DPH         0x83
+#define SFR_DPS         0x86
+#define SFR_PCON        0x87
+#define SFR_TCON        0x88
+#define SFR_TMOD        0x89
+#define SFR_TL0         0x8A
+#define SFR_TL1         0x8B
+#define SFR_TH0         0x8C
+#define SFR_TH1         0x8D
+#define SFR_CKCON       0x8E
+#define SFR_IOB         0x90
+#define SFR_EXIF        0x91
+#define SFR_MPAGE       0x92
+#define SFR_IOC         0xA0
+#define SFR_INT2CLR     0xA1
+#define SFR_IE          0xA8
+#define SFR_EP2468STAT  0xAA
+#define SFR_IOD         0xB0
+#define SFR_IOE         0xB1
+#define SFR_OEA         0xB2
+#define SFR_OEE         0xB6
+#define SFR_IP          0xB8
+#define SFR_EP01STAT    0xBA
+#define SFR_T2CON       0xC8
+#define SFR_RCAP2L      0xCA
+#define SFR_RCAP2H      0xCB
+#define SFR_TL2         0xCC
+#define SFR_TH2         0xCD
+#define SFR_PSW         0xD0
+#define SFR_ACC         0xE0
+#define SFR_EIE         0xE8
+#define SFR_B           0xF0
+#define SFR_EIP         0xF8
+
+/* PSW bits */
+#define PSW_CY          0x80
+#define PSW_AC          0x40
+#define PSW_OV          0x04
+#define PSW_P           0x01
+
+/* xdata registers */
+#define XR_CPUCS        0xE600
+#define XR_EP2CFG       0xE612
+#define XR_INPKTEND     0xE648
+#define XR_OUTPKTEND    0xE649
+#define XR_USBIE        0xE65C
+#define XR_USBIRQ       0xE65D
+#define XR_EPIE         0xE65E
+#define XR_EPIRQ        0xE65F
+#define XR_INT2IVEC     0xE666
+#define XR_INTSETUP     0xE668
+#define XR_USBFRAMEH    0xE684
+#define XR_USBFRAMEL    0xE685
+#define XR_MICROFRAME   0xE686
+#define XR_EP1OUTBC     0xE68D
+#define XR_EP1INBC      0xE68F
+#define XR_EP2BCH       0xE690
+#define XR_EP1OUTCS     0xE6A1
+#define XR_EP1INCS      0xE6A2
+#define XR_EP2CS        0xE6A3
+#define XR_EP1OUTBUF    0xE780
+#define XR_EP1INBUF     0xE7C0
+#define XR_EP2FIFOBUF   0xF000
+
+/* EPIRQ bits */
+#define EPIRQ_EP1IN     0x04
+#define EPIRQ_EP1OUT    0x08
+#define EPIRQ_EP2       0x10
+
+/* USBIRQ bits */
+#define USBIRQ_SOF      0x02
+
+/* high speed microframe: 125 us */
+#define FX2EMU_SOF      (FX2EMU_CLOCK/8000)
+
+#define SFR(a)          emu->sfr[(a)-0x80]
+#define ACC             SFR(SFR_ACC)
+#define PSW             SFR(SFR_PSW)
+
+/* 48 MHz clocks per CLKOUT clock, CPUCS bits 4:3 select 12, 24 or 48 MHz */
+static int
+fx2emu_clock_div(
+  const struct fx2emu *emu
+) {
+  switch ((emu->xram[XR_CPUCS] >> 3) & 3) {
+  case 0:  return 4;
+  case 1:  return 2;
+  default: return 1;
+  }
+}
+
+uint64_t
+fx2emu_time_ns(
+  const struct fx2emu *emu
+) {
+  return emu->clock * 1000000000ULL / FX2EMU_CLOCK;
+}
+
+/* ports */
+
+static void
+fx2emu_vcd_change(
+  struct fx2emu *emu,
+  int port,
+  uint8_t pins
+) {
+  uint64_t ns = fx2emu_time_ns(emu);
+  if (ns != emu->vcd_time) {
+    fprintf(emu->vcd, "#%llu\n", (unsigned long long)ns);
+    emu->vcd_time = ns;
+  }
+  int i;
+  fputc('b', emu->vcd);
+  for (i = 7; i >= 0; i--) fputc('0' + ((pins >> i) & 1), emu->vcd);
+  fprintf(emu->vcd, " %c\n", 'A' + port);
+}
+
+/* recompute a port's pins after its latch or OE changed */
+static void
+fx2emu_update_port(
+  struct fx2emu *emu,
+  int port
+) {
+  static const uint8_t latch[5] = { SFR_IOA, SFR_IOB, SFR_IOC, SFR_IOD, SFR_IOE };
+  uint8_t oe = SFR(SFR_OEA + port);
+  uint8_t pins = (SFR(latch[port]) & oe) | (emu->input[port] & ~oe);
+  if (pins == emu->pins[port]) return;
+
+  emu->pins[port] = pins;
+  if (0 != emu->vcd) fx2emu_vcd_change(emu, port, pins);
+  if (0 != emu->port_changed) emu->port_changed(emu->user, port, pins, fx2emu_time_ns(emu));
+}
+
+static int
+fx2emu_port_index(
+  uint8_t addr
+) {
+  switch (addr) {
+  case SFR_IOA: return 0;
+  case SFR_IOB: return 1;
+  case SFR_IOC: return 2;
+  case SFR_IOD: return 3;
+  case SFR_IOE: return 4;
+  }
+  if (addr >= SFR_OEA && addr <= SFR_OEE) return addr - SFR_OEA;
+  return -1;
+}
+
+void
+fx2emu_trace_vcd(
+  struct fx2emu *emu,
+  FILE *file
+) {
+  int i;
+  emu->vcd = file;
+  emu->vcd_time = fx2emu_time_ns(emu);
+  fprintf(file, "$timescale 1ns $end\n$scope module fx2 $end\n");
+  for (i = 0; i < 5; i++) fprintf(file, "$var wire 8 %c IO%c $end\n", 'A' + i, 'A' + i);
+  fprintf(file, "$upscope $end\n$enddefinitions $end\n#%llu\n", (unsigned long long)emu->vcd_time);
+  for (i = 0; i < 5; i++) fx2emu_vcd_change(emu, i, emu->pins[i]);
+}
+
+/* usb interrupt requests */
+
+static void
+fx2emu_usb_irq(
+  struct fx2emu *emu,
+  uint16_t reg,
+  uint8_t bit
+) {
+  emu->xram[reg] |= bit;
+  if (emu->xram[reg - 1] & bit) SFR(SFR_EXIF) |= 0x10;
+}
+
+/* INT2 autovector of the highest priority pending request */
+static uint8_t
+fx2emu_int2_vector(
+  struct fx2emu *emu
+) {
+  int i;
+  uint8_t usb = emu->xram[XR_USBIRQ] & emu->xram[XR_USBIE];
+  uint8_t ep = emu->xram[XR_EPIRQ] & emu->xram[XR_EPIE];
+  for (i = 0; i < 7; i++) if (usb & (1 << i)) return i*4;
+  for (i = 0; i < 8; i++) if (ep & (1 << i)) return 0x20 + i*4;
+  return 0;
+}
+
+/* endpoints */
+
+static int
+fx2emu_ep_index(
+  int endpoint
+) {
+  switch (endpoint & 0x0f) {
+  case 2: return 0;
+  case 4: return 1;
+  case 6: return 2;
+  case 8: return 3;
+  }
+  return -1;
+}
+
+static bool
+fx2emu_ep_is_in(
+  struct fx2emu *emu,
+  int index
+) {
+  return emu->xram[XR_EP2CFG + index] & 0x40;
+}
+
+/* buffers of a bulk endpoint: quad, -, double, triple */
+static int
+fx2emu_ep_depth(
+  struct fx2emu *emu,
+  int index
+) {
+  static const int depth[4] = { 4, 2, 2, 3 };
+  return depth[emu->xram[XR_EP2CFG + index] & 3];
+}
+
+static struct fx2emu_packet *
+fx2emu_queue_tail(
+  struct fx2emu_endpoint *ep
+) {
+  return &ep->queue[(ep->head + ep->count) % FX2EMU_QUEUE];
+}
+
+static void
+fx2emu_queue_pop(
+  struct fx2emu_endpoint *ep
+) {
+  ep->head = (ep->head + 1) % FX2EMU_QUEUE;
+  ep->count--;
+}
+
+/* hand the next OUT packet to the CPU if it holds none */
+static void
+fx2emu_ep1out_load(
+  struct fx2emu *emu
+) {
+  struct fx2emu_endpoint *ep = &emu->ep1out;
+  if (ep->cpu || 0 == ep->count) return;
+
+  struct fx2emu_packet *p = &ep->queue[ep->head];
+  memcpy(emu->xram + XR_EP1OUTBUF, p->data, p->length);
+  emu->xram[XR_EP1OUTBC] = p->length;
+  fx2emu_queue_pop(ep);
+  ep->cpu = true;
+  fx2emu_usb_irq(emu, XR_EPIRQ, EPIRQ_EP1OUT);
+}
+
+static void
+fx2emu_bulk_out_load(
+  struct fx2emu *emu,
+  int index
+) {
+  struct fx2emu_endpoint *ep = &emu->ep[index];
+  if (ep->cpu || 0 == ep->count) return;
+
+  struct fx2emu_packet *p = &ep->queue[ep->head];
+  memcpy(emu->xram + XR_EP2FIFOBUF + index*0x400, p->data, p->length);
+  emu->xram[XR_EP2BCH + index*4] = p->length >> 8;
+  emu->xram[XR_EP2BCH + index*4 + 1] = p->length;
+  fx2emu_queue_pop(ep);
+  ep->cpu = true;
+  fx2emu_usb_irq(emu, XR_EPIRQ, EPIRQ_EP2 << index);
+}
+
+/* the CPU wrote a byte count: give back an OUT buffer or commit IN data */
+static void
+fx2emu_bulk_commit(
+  struct fx2emu *emu,
+  int index,
+  bool skip
+) {
+  struct fx2emu_endpoint *ep = &emu->ep[index];
+
+  if (!fx2emu_ep_is_in(emu, index)) {
+    ep->cpu = false;
+    fx2emu_bulk_out_load(emu, index);
+    return;
+  }
+
+  if (skip || ep->count >= fx2emu_ep_depth(emu, index)) return;
+  struct fx2emu_packet *p = fx2emu_queue_tail(ep);
+  p->length = (emu->xram[XR_EP2BCH + index*4] << 8 | emu->xram[XR_EP2BCH + index*4 + 1]) & 0x7ff;
+  if (p->length > FX2EMU_PACKET) p->length = FX2EMU_PACKET;
+  memcpy(p->data, emu->xram + XR_EP2FIFOBUF + index*0x400, p->length);
+  ep->count++;
+}
+
+/* status registers are computed when read */
+static uint8_t
+fx2emu_xdata_read(
+  struct fx2emu *emu,
+  uint16_t addr
+) {
+  int i;
+  switch (addr) {
+  case XR_INT2IVEC:
+    return fx2emu_int2_vector(emu);
+  case XR_EP1OUTCS:
+    return emu->ep1out.cpu ? 0 : 0x02;
+  case XR_EP1INCS:
+    return emu->ep1in.count ? 0x02 : 0;
+  case XR_EP2CS:
+  case XR_EP2CS+1:
+  case XR_EP2CS+2:
+  case XR_EP2CS+3:
+    i = addr - XR_EP2CS;
+    if (fx2emu_ep_is_in(emu, i)) {
+      return (emu->ep[i].count << 4) |
+        (0 == emu->ep[i].count ? 0x04 : 0) |
+        (emu->ep[i].count >= fx2emu_ep_depth(emu, i) ? 0x08 : 0);
+    }
+    return ((emu->ep[i].count + emu->ep[i].cpu) << 4) |
+      (!emu->ep[i].cpu ? 0x04 : 0) |
+      (emu->ep[i].count + emu->ep[i].cpu >= fx2emu_ep_depth(emu, i) ? 0x08 : 0);
+  }
+  return emu->xram[addr];
+}
+
+static void
+fx2emu_xdata_write(
+  struct fx2emu *emu,
+  uint16_t addr,
+  uint8_t value
+) {
+  int i;
+  switch (addr) {
+  case XR_CPUCS:
+    /* only the clock speed and reset bits */
+    emu->xram[addr] = (emu->xram[addr] & ~0x19) | (value & 0x19);
+    return;
+  case XR_USBIRQ:
+  case XR_EPIRQ:
+    /* write one to clear */
+    emu->xram[addr] &= ~value;
+    return;
+  case XR_EP1OUTBC:
+    emu->xram[addr] = value;
+    emu->ep1out.cpu = false;
+    fx2emu_ep1out_load(emu);
+    return;
+  case XR_EP1INBC:
+    emu->xram[addr] = value;
+    if (emu->ep1in.count < FX2EMU_QUEUE) {
+      struct fx2emu_packet *p = fx2emu_queue_tail(&emu->ep1in);
+      p->length = value > 64 ? 64 : value;
+      memcpy(p->data, emu->xram + XR_EP1INBUF, p->length);
+      emu->ep1in.count++;
+    }
+    return;
+  case XR_OUTPKTEND:
+  case XR_INPKTEND:
+    i = fx2emu_ep_index(value & 0x0f);
+    if (i >= 0) fx2emu_bulk_commit(emu, i, value & 0x80);
+    return;
+  }
+
+  emu->xram[addr] = value;
+
+  /* EPxBCL: 0xe691, 0xe695, 0xe699, 0xe69d */
+  if (addr >= XR_EP2BCH && addr < XR_EP2BCH + 16 && (addr & 3) == 1) {
+    fx2emu_bulk_commit(emu, (addr - XR_EP2BCH) / 4, false);
+  }
+}
+
+/* special function registers */
+
+static uint8_t
+fx2emu_sfr_read(
+  struct fx2emu *emu,
+  uint8_t addr
+) {
+  int i;
+  switch (addr) {
+  case SFR_PSW:
+    {
+      uint8_t a = ACC;
+      a ^= a >> 4; a ^= a >> 2; a ^= a >> 1;
+      return (PSW & ~PSW_P) | (a & 1);
+    }
+  case SFR_IOA:
+  case SFR_IOB:
+  case SFR_IOC:
+  case SFR_IOD:
+  case SFR_IOE:
+    return emu->pins[fx2emu_port_index(addr)];
+  case SFR_EP2468STAT:
+    {
+      uint8_t stat = 0;
+      for (i = 0; i < 4; i++) {
+        uint8_t cs = fx2emu_xdata_read(emu, XR_EP2CS + i);
+        if (cs & 0x04) stat |= 1 << (2*i);
+        if (cs & 0x08) stat |= 2 << (2*i);
+      }
+      return stat;
+    }
+  case SFR_EP01STAT:
+    return (emu->ep1out.cpu ? 0 : 0x02) | (emu->ep1in.count ? 0x04 : 0);
+  }
+  return SFR(addr);
+}
+
+static void
+fx2emu_sfr_write(
+  struct fx2emu *emu,
+  uint8_t addr,
+  uint8_t value
+) {
+  switch (addr) {
+  case SFR_INT2CLR:
+    SFR(SFR_EXIF) &= ~0x10;
+    return;
+  case SFR_EP2468STAT:
+  case SFR_EP01STAT:
+    return;
+  }
+
+  SFR(addr) = value;
+
+  int port = fx2emu_port_index(addr);
+  if (port >= 0) fx2emu_update_port(emu, port);
+  if (addr == SFR_PCON && (value & 1)) emu->idle = true;
+}
+
+/* addressing */
+
+static uint8_t
+fx2emu_fetch(
+  struct fx2emu *emu,
+  int *bytes
+) {
+  (*bytes)++;
+  return emu->xram[emu->pc++];
+}
+
+static uint8_t *
+fx2emu_reg(
+  struct fx2emu *emu,
+  int n
+) {
+  return &emu->iram[(PSW & 0x18) + n];
+}
+
+static uint8_t
+fx2emu_direct_read(
+  struct fx2emu *emu,
+  uint8_t addr
+) {
+  return addr < 0x80 ? emu->iram[addr] : fx2emu_sfr_read(emu, addr);
+}
+
+static void
+fx2emu_direct_write(
+  struct fx2emu *emu,
+  uint8_t addr,
+  uint8_t value
+) {
+  if (addr < 0x80) emu->iram[addr] = value;
+  else fx2emu_sfr_write(emu, addr, value);
+}
+
+static bool
+fx2emu_bit_read(
+  struct fx2emu *emu,
+  uint8_t bit
+) {
+  uint8_t addr = bit < 0x80 ? 0x20 + (bit >> 3) : bit & 0xf8;
+  return (fx2emu_direct_read(emu, addr) >> (bit & 7)) & 1;
+}
+
+/* bit writes read the latch, not the pins */
+static void
+fx2emu_bit_write(
+  struct fx2emu *emu,
+  uint8_t bit,
+  bool value
+) {
+  uint8_t addr = bit < 0x80 ? 0x20 + (bit >> 3) : bit & 0xf8;
+  uint8_t old = addr < 0x80 ? emu->iram[addr] : (addr == SFR_PSW ? PSW : SFR(addr));
+  uint8_t mask = 1 << (bit & 7);
+  fx2emu_direct_write(emu, addr, value ? old | mask : old & ~mask);
+}
+
+static uint16_t
+fx2emu_dptr_addr(
+  struct fx2emu *emu
+) {
+  uint8_t *dp = &SFR(SFR_DPL + ((SFR(SFR_DPS) & 1) ? 2 : 0));
+  return dp[0] | dp[1] << 8;
+}
+
+static void
+fx2emu_dptr_set(
+  struct fx2emu *emu,
+  uint16_t value
+) {
+  uint8_t *dp = &SFR(SFR_DPL + ((SFR(SFR_DPS) & 1) ? 2 : 0));
+  dp[0] = value;
+  dp[1] = value >> 8;
+}
+
+static void
+fx2emu_push(
+  struct fx2emu *emu,
+  uint8_t value
+) {
+  emu->iram[++SFR(SFR_SP)] = value;
+}
+
+static uint8_t
+fx2emu_pop(
+  struct fx2emu *emu
+) {
+  return emu->iram[SFR(SFR_SP)--];
+}
+
+static void
+fx2emu_call(
+  struct fx2emu *emu,
+  uint16_t addr
+) {
+  fx2emu_push(emu, emu->pc);
+  fx2emu_push(emu, emu->pc >> 8);
+  emu->pc = addr;
+}
+
+static void
+fx2emu_carry(
+  struct fx2emu *emu,
+  bool c
+) {
+  PSW = c ? PSW | PSW_CY : PSW & ~PSW_CY;
+}
+
+static void
+fx2emu_add(
+  struct fx2emu *emu,
+  uint8_t v,
+  int c
+) {
+  uint8_t a = ACC;
+  unsigned r = a + v + c;
+  PSW &= ~(PSW_CY | PSW_AC | PSW_OV);
+  if (r > 0xff) PSW |= PSW_CY;
+  if ((a & 0x0f) + (v & 0x0f) + c > 0x0f) PSW |= PSW_AC;
+  if ((a ^ r) & (v ^ r) & 0x80) PSW |= PSW_OV;
+  ACC = r;
+}
+
+static void
+fx2emu_subb(
+  struct fx2emu *emu,
+  uint8_t v
+) {
+  uint8_t a = ACC;
+  int c = (PSW & PSW_CY) ? 1 : 0;
+  uint8_t r = a - v - c;
+  PSW &= ~(PSW_CY | PSW_AC | PSW_OV);
+  if (a < v + c) PSW |= PSW_CY;
+  if ((a & 0x0f) < (v & 0x0f) + c) PSW |= PSW_AC;
+  if ((a ^ v) & (a ^ r) & 0x80) PSW |= PSW_OV;
+  ACC = r;
+}
+
+/* operand of the arithmetic rows: #data, direct, @Ri or Rn */
+static uint8_t
+fx2emu_operand(
+  struct fx2emu *emu,
+  uint8_t op,
+  int *bytes
+) {
+  switch (op & 0x0f) {
+  case 0x4: return fx2emu_fetch(emu, bytes);
+  case 0x5: return fx2emu_direct_read(emu, fx2emu_fetch(emu, bytes));
+  case 0x6:
+  case 0x7: return emu->iram[*fx2emu_reg(emu, op & 1)];
+  default:  return *fx2emu_reg(emu, op & 7);
+  }
+}
+
+static void
+fx2emu_jump_rel(
+  struct fx2emu *emu,
+  uint8_t rel
+) {
+  emu->pc += (int8_t)rel;
+}
+
+/* execute one instruction, returns its cycles */
+static int
+fx2emu_step(
+  struct fx2emu *emu
+) {
+  int bytes = 0;
+  int cycles = 0;
+  uint8_t op = fx2emu_fetch(emu, &bytes);
+  uint8_t a, b, v, *p;
+  uint16_t addr;
+
+  emu->hold_irq = false;
+
+  switch (op) {
+  case 0x00:                                  /* NOP */
+    break;
+
+  case 0x01: case 0x21: case 0x41: case 0x61:
+  case 0x81: case 0xA1: case 0xC1: case 0xE1: /* AJMP */
+    a = fx2emu_fetch(emu, &bytes);
+    emu->pc = (emu->pc & 0xf800) | ((op & 0xe0) << 3) | a;
+    cycles = 3;
+    break;
+
+  case 0x11: case 0x31: case 0x51: case 0x71:
+  case 0x91: case 0xB1: case 0xD1: case 0xF1: /* ACALL */
+    a = fx2emu_fetch(emu, &bytes);
+    fx2emu_call(emu, (emu->pc & 0xf800) | ((op & 0xe0) << 3) | a);
+    cycles = 3;
+    break;
+
+  case 0x02:                                  /* LJMP */
+    a = fx2emu_fetch(emu, &bytes);
+    b = fx2emu_fetch(emu, &bytes);
+    emu->pc = a << 8 | b;
+    cycles = 4;
+    break;
+
+  case 0x12:                                  /* LCALL */
+    a = fx2emu_fetch(emu, &bytes);
+    b = fx2emu_fetch(emu, &bytes);
+    fx2emu_call(emu, a << 8 | b);
+    cycles = 4;
+    break;
+
+  case 0x22:                                  /* RET */
+  case 0x32:                                  /* RETI */
+    a = fx2emu_pop(emu);
+    b = fx2emu_pop(emu);
+    emu->pc = a << 8 | b;
+    if (op == 0x32) {
+      emu->in_service &= (emu->in_service & 2) ? ~2 : ~1;
+      emu->hold_irq = true;
+    }
+    cycles = 4;
+    break;
+
+  case 0x03: ACC = ACC >> 1 | ACC << 7; break; /* RR A */
+  case 0x23: ACC = ACC << 1 | ACC >> 7; break; /* RL A */
+  case 0x13:                                  /* RRC A */
+    a = ACC;
+    ACC = a >> 1 | ((PSW & PSW_CY) ? 0x80 : 0);
+    fx2emu_carry(emu, a & 1);
+    break;
+  case 0x33:                                  /* RLC A */
+    a = ACC;
+    ACC = a << 1 | ((PSW & PSW_CY) ? 1 : 0);
+    fx2emu_carry(emu, a & 0x80);
+    break;
+
+  case 0x04: ACC++; break;                    /* INC A */
+  case 0x05:                                  /* INC direct */
+    a = fx2emu_fetch(emu, &bytes);
+    fx2emu_direct_write(emu, a, (a < 0x80 ? emu->iram[a] : SFR(a)) + 1);
+    break;
+  case 0x06: case 0x07:                       /* INC @Ri */
+    emu->iram[*fx2emu_reg(emu, op & 1)]++;
+    break;
+  case 0x08: case 0x09: case 0x0A: case 0x0B:
+  case 0x0C: case 0x0D: case 0x0E: case 0x0F: /* INC Rn */
+    (*fx2emu_reg(emu, op & 7))++;
+    break;
+
+  case 0x14: ACC--; break;                    /* DEC A */
+  case 0x15:                                  /* DEC direct */
+    a = fx2emu_fetch(emu, &bytes);
+    fx2emu_direct_write(emu, a, (a < 0x80 ? emu->iram[a] : SFR(a)) - 1);
+    break;
+  case 0x16: case 0x17:                       /* DEC @Ri */
+    emu->iram[*fx2emu_reg(emu, op & 1)]--;
+    break;
+  case 0x18: case 0x19: case 0x1A: case 0x1B:
+  case 0x1C: case 0x1D: case 0x1E: case 0x1F: /* DEC Rn */
+    (*fx2emu_reg(emu, op & 7))--;
+    break;
+
+  case 0x10:                                  /* JBC bit,rel */
+  case 0x20:                                  /* JB bit,rel */
+  case 0x30:                                  /* JNB bit,rel */
+    a = fx2emu_fetch(emu, &bytes);
+    b = fx2emu_fetch(emu, &bytes);
+    v = fx2emu_bit_read(emu, a);
+    if (op == 0x30 ? !v : v) {
+      if (op == 0x10) fx2emu_bit_write(emu, a, false);
+      fx2emu_jump_rel(emu, b);
+    }
+    cycles = 4;
+    break;
+
+  case 0x40: case 0x50: case 0x60: case 0x70: /* JC, JNC, JZ, JNZ */
+    a = fx2emu_fetch(emu, &bytes);
+    switch (op) {
+    case 0x40: v = (PSW & PSW_CY) != 0; break;
+    case 0x50: v = (PSW & PSW_CY) == 0; break;
+    case 0x60: v = ACC == 0; break;
+    default:   v = ACC != 0; break;
+    }
+    if (v) fx2emu_jump_rel(emu, a);
+    cycles = 3;
+    break;
+
+  case 0x80:                                  /* SJMP */
+    a = fx2emu_fetch(emu, &bytes);
+    fx2emu_jump_rel(emu, a);
+    cycles = 3;
+    break;
+
+  case 0x73:                                  /* JMP @A+DPTR */
+    emu->pc = fx2emu_dptr_addr(emu) + ACC;
+    cycles = 3;
+    break;
+
+  case 0x24: case 0x25: case 0x26: case 0x27:
+  case 0x28: case 0x29: case 0x2A: case 0x2B:
+  case 0x2C: case 0x2D: case 0x2E: case 0x2F: /* ADD */
+    fx2emu_add(emu, fx2emu_operand(emu, op, &bytes), 0);
+    break;
+
+  case 0x34: case 0x35: case 0x36: case 0x37:
+  case 0x38: case 0x39: case 0x3A: case 0x3B:
+  case 0x3C: case 0x3D: case 0x3E: case 0x3F: /* ADDC */
+    fx2emu_add(emu, fx2emu_operand(emu, op, &bytes), (PSW & PSW_CY) ? 1 : 0);
+    break;
+
+  case 0x94: case 0x95: case 0x96: case 0x97:
+  case 0x98: case 0x99: case 0x9A: case 0x9B:
+  case 0x9C: case 0x9D: case 0x9E: case 0x9F: /* SUBB */
+    fx2emu_subb(emu, fx2emu_operand(emu, op, &bytes));
+    break;
+
+  case 0x44: case 0x45: case 0x46: case 0x47:
+  case 0x48: case 0x49: case 0x4A: case 0x4B:
+  case 0x4C: case 0x4D: case 0x4E: case 0x4F: /* ORL A */
+    ACC |= fx2emu_operand(emu, op, &bytes);
+    break;
+  case 0x54: case 0x55: case 0x56: case 0x57:
+  case 0x58: case 0x59: case 0x5A: case 0x5B:
+  case 0x5C: case 0x5D: case 0x5E: case 0x5F: /* ANL A */
+    ACC &= fx2emu_operand(emu, op, &bytes);
+    break;
+  case 0x64: case 0x65: case 0x66: case 0x67:
+  case 0x68: case 0x69: case 0x6A: case 0x6B:
+  case 0x6C: case 0x6D: case 0x6E: case 0x6F: /* XRL A */
+    ACC ^= fx2emu_operand(emu, op, &bytes);
+    break;
+
+  case 0x42: case 0x43:                       /* ORL direct */
+  case 0x52: case 0x53:                       /* ANL direct */
+  case 0x62: case 0x63:                       /* XRL direct */
+    a = fx2emu_fetch(emu, &bytes);
+    v = (op & 1) ? fx2emu_fetch(emu, &bytes) : ACC;
+    b = a < 0x80 ? emu->iram[a] : (a == SFR_PSW ? PSW : SFR(a));
+    switch (op & 0xf0) {
+    case 0x40: b |= v; break;
+    case 0x50: b &= v; break;
+    default:   b ^= v; break;
+    }
+    fx2emu_direct_write(emu, a, b);
+    break;
+
+  case 0x72:                                  /* ORL C,bit */
+  case 0xA0:                                  /* ORL C,/bit */
+    a = fx2emu_fetch(emu, &bytes);
+    v = fx2emu_bit_read(emu, a) ^ (op == 0xA0);
+    if (v) PSW |= PSW_CY;
+    break;
+  case 0x82:                                  /* ANL C,bit */
+  case 0xB0:                                  /* ANL C,/bit */
+    a = fx2emu_fetch(emu, &bytes);
+    v = fx2emu_bit_read(emu, a) ^ (op == 0xB0);
+    if (!v) PSW &= ~PSW_CY;
+    break;
+
+  case 0x74:                                  /* MOV A,#data */
+    ACC = fx2emu_fetch(emu, &bytes);
+    break;
+  case 0x75:                                  /* MOV direct,#data */
+    a = fx2emu_fetch(emu, &bytes);
+    fx2emu_direct_write(emu, a, fx2emu_fetch(emu, &bytes));
+    break;
+  case 0x76: case 0x77:                       /* MOV @Ri,#data */
+    emu->iram[*fx2emu_reg(emu, op & 1)] = fx2emu_fetch(emu, &bytes);
+    break;
+  case 0x78: case 0x79: case 0x7A: case 0x7B:
+  case 0x7C: case 0x7D: case 0x7E: case 0x7F: /* MOV Rn,#data */
+    *fx2emu_reg(emu, op & 7) = fx2emu_fetch(emu, &bytes);
+    break;
+
+  case 0x83:                                  /* MOVC A,@A+PC */
+    ACC = emu->xram[(uint16_t)(emu->pc + ACC)];
+    cycles = 3;
+    break;
+  case 0x93:                                  /* MOVC A,@A+DPTR */
+    ACC = emu->xram[(uint16_t)(fx2emu_dptr_addr(emu) + ACC)];
+    cycles = 3;
+    break;
+
+  case 0x84:                                  /* DIV AB */
+    a = ACC;
+    b = SFR(SFR_B);
+    PSW &= ~(PSW_CY | PSW_OV);
+    if (0 == b) {
+      PSW |= PSW_OV;
+    } else {
+      ACC = a / b;
+      SFR(SFR_B) = a % b;
+    }
+    cycles = 5;
+    break;
+  case 0xA4:                                  /* MUL AB */
+    {
+      unsigned r = ACC * SFR(SFR_B);
+      ACC = r;
+      SFR(SFR_B) = r >> 8;
+      PSW &= ~(PSW_CY | PSW_OV);
+      if (r > 0xff) PSW |= PSW_OV;
+    }
+    cycles = 5;
+    break;
+
+  case 0x85:                                  /* MOV direct,direct */
+    a = fx2emu_fetch(emu, &bytes);
+    b = fx2emu_fetch(emu, &bytes);
+    fx2emu_direct_write(emu, b, fx2emu_direct_read(emu, a));
+    break;
+  case 0x86: case 0x87:                       /* MOV direct,@Ri */
+    a = fx2emu_fetch(emu, &bytes);
+    fx2emu_direct_write(emu, a, emu->iram[*fx2emu_reg(emu, op & 1)]);
+    break;
+  case 0x88: case 0x89: case 0x8A: case 0x8B:
+  case 0x8C: case 0x8D: case 0x8E: case 0x8F: /* MOV direct,Rn */
+    a = fx2emu_fetch(emu, &bytes);
+    fx2emu_direct_write(emu, a, *fx2emu_reg(emu, op & 7));
+    break;
+
+  case 0x90:                                  /* MOV DPTR,#data16 */
+    a = fx2emu_fetch(emu, &bytes);
+    b = fx2emu_fetch(emu, &bytes);
+    fx2emu_dptr_set(emu, a << 8 | b);
+    break;
+  case 0xA3:                                  /* INC DPTR */
+    fx2emu_dptr_set(emu, fx2emu_dptr_addr(emu) + 1);
+    cycles = 3;
+    break;
+
+  case 0x92:                                  /* MOV bit,C */
+    a = fx2emu_fetch(emu, &bytes);
+    fx2emu_bit_write(emu, a, PSW & PSW_CY);
+    break;
+  case 0xA2:                                  /* MOV C,bit */
+    a = fx2emu_fetch(emu, &bytes);
+    fx2emu_carry(emu, fx2emu_bit_read(emu, a));
+    break;
+  case 0xB2:                                  /* CPL bit */
+    a = fx2emu_fetch(emu, &bytes);
+    {
+      uint8_t byte = a < 0x80 ? 0x20 + (a >> 3) : a & 0xf8;
+      uint8_t latch = byte < 0x80 ? emu->iram[byte] : (byte == SFR_PSW ? PSW : SFR(byte));
+      fx2emu_bit_write(emu, a, !((latch >> (a & 7)) & 1));
+    }
+    break;
+  case 0xB3: PSW ^= PSW_CY; break;            /* CPL C */
+  case 0xC2:                                  /* CLR bit */
+    fx2emu_bit_write(emu, fx2emu_fetch(emu, &bytes), false);
+    break;
+  case 0xC3: PSW &= ~PSW_CY; break;           /* CLR C */
+  case 0xD2:                                  /* SETB bit */
+    fx2emu_bit_write(emu, fx2emu_fetch(emu, &bytes), true);
+    break;
+  case 0xD3: PSW |= PSW_CY; break;            /* SETB C */
+
+  case 0xA5:                                  /* reserved */
+    emu->bad_opcodes++;
+    break;
+
+  case 0xA6: case 0xA7:                       /* MOV @Ri,direct */
+    a = fx2emu_fetch(emu, &bytes);
+    emu->iram[*fx2emu_reg(emu, op & 1)] = fx2emu_direct_read(emu, a);
+    break;
+  case 0xA8: case 0xA9: case 0xAA: case 0xAB:
+  case 0xAC: case 0xAD: case 0xAE: case 0xAF: /* MOV Rn,direct */
+    a = fx2emu_fetch(emu, &bytes);
+    *fx2emu_reg(emu, op & 7) = fx2emu_direct_read(emu, a);
+    break;
+
+  case 0xB4: case 0xB5: case 0xB6: case 0xB7:
+  case 0xB8: case 0xB9: case 0xBA: case 0xBB:
+  case 0xBC: case 0xBD: case 0xBE: case 0xBF: /* CJNE */
+    switch (op) {
+    case 0xB4: a = ACC; v = fx2emu_fetch(emu, &bytes); break;
+    case 0xB5: a = ACC; v = fx2emu_direct_read(emu, fx2emu_fetch(emu, &bytes)); break;
+    case 0xB6:
+    case 0xB7: a = emu->iram[*fx2emu_reg(emu, op & 1)]; v = fx2emu_fetch(emu, &bytes); break;
+    default:   a = *fx2emu_reg(emu, op & 7); v = fx2emu_fetch(emu, &bytes); break;
+    }
+    b = fx2emu_fetch(emu, &bytes);
+    fx2emu_carry(emu, a < v);
+    if (a != v) fx2emu_jump_rel(emu, b);
+    cycles = 4;
+    break;
+
+  case 0xC0:                                  /* PUSH */
+    fx2emu_push(emu, fx2emu_direct_read(emu, fx2emu_fetch(emu, &bytes)));
+    break;
+  case 0xD0:                                  /* POP */
+    a = fx2emu_fetch(emu, &bytes);
+    fx2emu_direct_write(emu, a, fx2emu_pop(emu));
+    break;
+
+  case 0xC4: ACC = ACC << 4 | ACC >> 4; break; /* SWAP A */
+  case 0xC5:                                  /* XCH A,direct */
+    a = fx2emu_fetch(emu, &bytes);
+    v = fx2emu_direct_read(emu, a);
+    fx2emu_direct_write(emu, a, ACC);
+    ACC = v;
+    break;
+  case 0xC6: case 0xC7:                       /* XCH A,@Ri */
+    p = &emu->iram[*fx2emu_reg(emu, op & 1)];
+    v = *p; *p = ACC; ACC = v;
+    break;
+  case 0xC8: case 0xC9: case 0xCA: case 0xCB:
+  case 0xCC: case 0xCD: case 0xCE: case 0xCF: /* XCH A,Rn */
+    p = fx2emu_reg(emu, op & 7);
+    v = *p; *p = ACC; ACC = v;
+    break;
+  case 0xD6: case 0xD7:                       /* XCHD A,@Ri */
+    p = &emu->iram[*fx2emu_reg(emu, op & 1)];
+    v = *p;
+    *p = (v & 0xf0) | (ACC & 0x0f);
+    ACC = (ACC & 0xf0) | (v & 0x0f);
+    break;
+
+  case 0xD4:                                  /* DA A */
+    {
+      unsigned r = ACC;
+      if ((r & 0x0f) > 9 || (PSW & PSW_AC)) r += 0x06;
+      if (r > 0xff) PSW |= PSW_CY;
+      if (((r >> 4) & 0x0f) > 9 || (PSW & PSW_CY)) {
+        r += 0x60;
+        PSW |= PSW_CY;
+      }
+      ACC = r;
+    }
+    break;
+
+  case 0xD5:                                  /* DJNZ direct,rel */
+    a = fx2emu_fetch(emu, &bytes);
+    b = fx2emu_fetch(emu, &bytes);
+    v = (a < 0x80 ? emu->iram[a] : SFR(a)) - 1;
+    fx2emu_direct_write(emu, a, v);
+    if (v) fx2emu_jump_rel(emu, b);
+    cycles = 4;
+    break;
+  case 0xD8: case 0xD9: case 0xDA: case 0xDB:
+  case 0xDC: case 0xDD: case 0xDE: case 0xDF: /* DJNZ Rn,rel */
+    a = fx2emu_fetch(emu, &bytes);
+    p = fx2emu_reg(emu, op & 7);
+    if (--*p) fx2emu_jump_rel(emu, a);
+    cycles = 3;
+    break;
+
+  case 0xE0:                                  /* MOVX A,@DPTR */
+  case 0xE2: case 0xE3:                       /* MOVX A,@Ri */
+    addr = op == 0xE0 ? fx2emu_dptr_addr(emu) :
+      SFR(SFR_MPAGE) << 8 | emu->iram[*fx2emu_reg(emu, op & 1)];
+    ACC = fx2emu_xdata_read(emu, addr);
+    cycles = 2 + (SFR(SFR_CKCON) & 7);
+    break;
+  case 0xF0:                                  /* MOVX @DPTR,A */
+  case 0xF2: case 0xF3:                       /* MOVX @Ri,A */
+    addr = op == 0xF0 ? fx2emu_dptr_addr(emu) :
+      SFR(SFR_MPAGE) << 8 | emu->iram[*fx2emu_reg(emu, op & 1)];
+    fx2emu_xdata_write(emu, addr, ACC);
+    cycles = 2 + (SFR(SFR_CKCON) & 7);
+    break;
+
+  case 0xE4: ACC = 0; break;                  /* CLR A */
+  case 0xF4: ACC = ~ACC; break;               /* CPL A */
+
+  case 0xE5:                                  /* MOV A,direct */
+    ACC = fx2emu_direct_read(emu, fx2emu_fetch(emu, &bytes));
+    break;
+  case 0xE6: case 0xE7:                       /* MOV A,@Ri */
+    ACC = emu->iram[*fx2emu_reg(emu, op & 1)];
+    break;
+  case 0xE8: case 0xE9: case 0xEA: case 0xEB:
+  case 0xEC: case 0xED: case 0xEE: case 0xEF: /* MOV A,Rn */
+    ACC = *fx2emu_reg(emu, op & 7);
+    break;
+
+  case 0xF5:                                  /* MOV direct,A */
+    fx2emu_direct_write(emu, fx2emu_fetch(emu, &bytes), ACC);
+    break;
+  case 0xF6: case 0xF7:                       /* MOV @Ri,A */
+    emu->iram[*fx2emu_reg(emu, op & 1)] = ACC;
+    break;
+  case 0xF8: case 0xF9: case 0xFA: case 0xFB:
+  case 0xFC: case 0xFD: case 0xFE: case 0xFF: /* MOV Rn,A */
+    *fx2emu_reg(emu, op & 7) = ACC;
+    break;
+  }
+
+  return cycles ? cycles : bytes;
+}
+
+/* advance one 8 or 16 bit timer by n ticks, true on overflow. An auto
+ * reloading timer restarts from reload. */
+static bool
+fx2emu_count(
+  uint32_t *value,
+  uint32_t n,
+  uint32_t top,
+  int32_t reload
+) {
+  *value += n;
+  if (*value <= top) return false;
+
+  if (reload < 0) {
+    *value &= top;
+  } else {
+    uint32_t period = top + 1 - reload;
+    *value = reload + (*value - top - 1) % period;
+  }
+  return true;
+}
+
+static void
+fx2emu_timers(
+  struct fx2emu *emu,
+  int clkout
+) {
+  uint8_t tmod = SFR(SFR_TMOD);
+  uint8_t ckcon = SFR(SFR_CKCON);
+  uint8_t tcon = SFR(SFR_TCON);
+  uint32_t n, v;
+
+  /* timer 0 */
+  if (tcon & 0x10) {
+    int div = (ckcon & 0x08) ? 4 : 12;
+    emu->t0_rem += clkout;
+    n = emu->t0_rem / div;
+    emu->t0_rem %= div;
+
+    switch (tmod & 3) {
+    case 0:
+      v = (SFR(SFR_TH0) << 5) | (SFR(SFR_TL0) & 0x1f);
+      if (fx2emu_count(&v, n, 0x1fff, -1)) SFR(SFR_TCON) |= 0x20;
+      SFR(SFR_TH0) = v >> 5;
+      SFR(SFR_TL0) = (SFR(SFR_TL0) & 0xe0) | (v & 0x1f);
+      break;
+    case 1:
+      v = SFR(SFR_TH0) << 8 | SFR(SFR_TL0);
+      if (fx2emu_count(&v, n, 0xffff, -1)) SFR(SFR_TCON) |= 0x20;
+      SFR(SFR_TH0) = v >> 8;
+      SFR(SFR_TL0) = v;
+      break;
+    case 2:
+      v = SFR(SFR_TL0);
+      if (fx2emu_count(&v, n, 0xff, SFR(SFR_TH0))) SFR(SFR_TCON) |= 0x20;
+      SFR(SFR_TL0) = v;
+      break;
+    case 3:
+      v = SFR(SFR_TL0);
+      if (fx2emu_count(&v, n, 0xff, -1)) SFR(SFR_TCON) |= 0x20;
+      SFR(SFR_TL0) = v;
+      /* TH0 runs on TR1 and sets TF1 */
+      if (tcon & 0x40) {
+        v = SFR(SFR_TH0);
+        if (fx2emu_count(&v, n, 0xff, -1)) SFR(SFR_TCON) |= 0x80;
+        SFR(SFR_TH0) = v;
+      }
+      break;
+    }
+  }
+
+  /* timer 1, stopped while timer 0 is split */
+  if ((tcon & 0x40) && (tmod & 3) != 3 && ((tmod >> 4) & 3) != 3) {
+    int div = (ckcon & 0x10) ? 4 : 12;
+    emu->t1_rem += clkout;
+    n = emu->t1_rem / div;
+    emu->t1_rem %= div;
+
+    switch ((tmod >> 4) & 3) {
+    case 0:
+      v = (SFR(SFR_TH1) << 5) | (SFR(SFR_TL1) & 0x1f);
+      if (fx2emu_count(&v, n, 0x1fff, -1)) SFR(SFR_TCON) |= 0x80;
+      SFR(SFR_TH1) = v >> 5;
+      SFR(SFR_TL1) = (SFR(SFR_TL1) & 0xe0) | (v & 0x1f);
+      break;
+    case 1:
+      v = SFR(SFR_TH1) << 8 | SFR(SFR_TL1);
+      if (fx2emu_count(&v, n, 0xffff, -1)) SFR(SFR_TCON) |= 0x80;
+      SFR(SFR_TH1) = v >> 8;
+      SFR(SFR_TL1) = v;
+      break;
+    case 2:
+      v = SFR(SFR_TL1);
+      if (fx2emu_count(&v, n, 0xff, SFR(SFR_TH1))) SFR(SFR_TCON) |= 0x80;
+      SFR(SFR_TL1) = v;
+      break;
+    }
+  }
+
+  /* timer 2: auto reload from RCAP2, or free running with CP/RL2 */
+  uint8_t t2con = SFR(SFR_T2CON);
+  if (t2con & 0x04) {
+    int div = (ckcon & 0x20) ? 4 : 12;
+    emu->t2_rem += clkout;
+    n = emu->t2_rem / div;
+    emu->t2_rem %= div;
+
+    v = SFR(SFR_TH2) << 8 | SFR(SFR_TL2);
+    int32_t reload = (t2con & 0x01) ? -1 : (SFR(SFR_RCAP2H) << 8 | SFR(SFR_RCAP2L));
+    if (fx2emu_count(&v, n, 0xffff, reload)) SFR(SFR_T2CON) |= 0x80;
+    SFR(SFR_TH2) = v >> 8;
+    SFR(SFR_TL2) = v;
+  }
+}
+
+/* start the highest priority pending interrupt, returns its cycles */
+static int
+fx2emu_interrupt(
+  struct fx2emu *emu
+) {
+  uint8_t ie = SFR(SFR_IE);
+  if (!(ie & 0x80) || emu->hold_irq) return 0;
+
+  uint8_t tcon = SFR(SFR_TCON);
+  uint8_t ip = SFR(SFR_IP);
+  int level;
+
+  for (level = 1; level >= 0; level--) {
+    /* a request interrupts only lower priority handlers */
+    if (emu->in_service >> level) return 0;
+
+    uint16_t vector = 0;
+    if ((tcon & 0x20) && (ie & 0x02) && ((ip >> 1) & 1) == level) {
+      SFR(SFR_TCON) &= ~0x20;
+      vector = 0x0b;
+    } else if ((tcon & 0x80) && (ie & 0x08) && ((ip >> 3) & 1) == level) {
+      SFR(SFR_TCON) &= ~0x80;
+      vector = 0x1b;
+    } else if ((SFR(SFR_T2CON) & 0xc0) && (ie & 0x20) && ((ip >> 5) & 1) == level) {
+      vector = 0x2b;
+    } else if ((SFR(SFR_EXIF) & 0x10) && (SFR(SFR_EIE) & 0x01) && (SFR(SFR_EIP) & 1) == level) {
+      vector = 0x43;
+    }
+    if (0 == vector) continue;
+
+    emu->in_service |= 1 << level;
+    emu->idle = false;
+    SFR(SFR_PCON) &= ~0x01;
+    fx2emu_call(emu, vector);
+
+    /* INT2 autovector: the jump table entry replaces the LJMP at 0x43 */
+    if (vector == 0x43 && (emu->xram[XR_INTSETUP] & 0x08)) {
+      emu->pc = emu->xram[0x44] << 8 | fx2emu_int2_vector(emu);
+    }
+    return 4;
+  }
+  return 0;
+}
+
+/* start of frame every microframe */
+static void
+fx2emu_sof(
+  struct fx2emu *emu
+) {
+  uint8_t micro = (emu->xram[XR_MICROFRAME] + 1) & 7;
+  emu->xram[XR_MICROFRAME] = micro;
+  if (0 == micro) {
+    uint16_t frame = ((emu->xram[XR_USBFRAMEH] << 8 | emu->xram[XR_USBFRAMEL]) + 1) & 0x7ff;
+    emu->xram[XR_USBFRAMEH] = frame >> 8;
+    emu->xram[XR_USBFRAMEL] = frame;
+  }
+  fx2emu_usb_irq(emu, XR_USBIRQ, USBIRQ_SOF);
+}
+
+void
+fx2emu_init(
+  struct fx2emu *emu
+) {
+  memset(emu, 0, sizeof(*emu));
+  SFR(SFR_SP) = 0x07;
+  SFR(SFR_CKCON) = 0x01;
+  SFR(SFR_DPS) = 0;
+  emu->xram[XR_CPUCS] = 0x01;     /* held in reset, 12 MHz */
+
+  /* bulk endpoints as after reset: 2 and 4 OUT, 6 and 8 IN, double buffered */
+  emu->xram[XR_EP2CFG + 0] = 0xa2;
+  emu->xram[XR_EP2CFG + 1] = 0xa0;
+  emu->xram[XR_EP2CFG + 2] = 0xe2;
+  emu->xram[XR_EP2CFG + 3] = 0xe0;
+
+  memset(emu->input, 0xff, sizeof(emu->input));
+  memset(emu->pins, 0xff, sizeof(emu->pins));
+  emu->next_sof = FX2EMU_SOF;
+}
+
+bool
+fx2emu_load(
+  struct fx2emu *emu,
+  const char *path
+) {
+  FILE *file = fopen(path, "rb");
+  if (0 == file) {
+    NVSTUSB_LOG(nvstusb_log_error, "%s: %s", path, strerror(errno));
+    return false;
+  }
+
+  size_t len = strlen(path);
+  if (len > 4 && 0 == strcmp(path + len - 4, ".bin")) {
+    /* program memory image */
+    if (fread(emu->xram, 1, 0x4000, file) == 0) {
+      NVSTUSB_LOG(nvstusb_log_error, "%s: empty image", path);
+      fclose(file);
+      return false;
+    }
+  } else {
+    /* 2 byte length, 2 byte address, data; all big endian */
+    uint8_t lenPos[4];
+    while (fread(lenPos, 4, 1, file) == 1) {
+      uint16_t length = lenPos[0] << 8 | lenPos[1];
+      uint16_t pos = lenPos[2] << 8 | lenPos[3];
+      uint8_t buf[1024];
+      if (length > sizeof(buf) || fread(buf, length, 1, file) != 1) {
+        NVSTUSB_LOG(nvstusb_log_error, "%s: truncated firmware", path);
+        fclose(file);
+        return false;
+      }
+      fx2emu_load_ram(emu, pos, buf, length);
+    }
+  }
+  fclose(file);
+
+  /* started here if the firmware does not release CPUCS itself */
+  if (!fx2emu_running(emu)) {
+    emu->xram[XR_CPUCS] &= ~0x01;
+    emu->pc = 0;
+  }
+  return true;
+}
+
+void
+fx2emu_load_ram(
+  struct fx2emu *emu,
+  uint16_t addr,
+  const void *data,
+  int size
+) {
+  const uint8_t *bytes = data;
+  int i;
+
+  for (i = 0; i < size && addr + i < 0x10000; i++) {
+    uint16_t a = addr + i;
+    if (a != XR_CPUCS) {
+      emu->xram[a] = bytes[i];
+      continue;
+    }
+
+    /* leaving reset starts the CPU from the beginning */
+    bool held = emu->xram[XR_CPUCS] & 0x01;
+    emu->xram[XR_CPUCS] = (emu->xram[XR_CPUCS] & ~0x01) | (bytes[i] & 0x01);
+    if (held && !(bytes[i] & 0x01)) {
+      emu->pc = 0;
+      emu->idle = false;
+      emu->hold_irq = false;
+      emu->in_service = 0;
+      SFR(SFR_SP) = 0x07;
+    }
+  }
+}
+
+bool
+fx2emu_running(
+  const struct fx2emu *emu
+) {
+  return !(emu->xram[XR_CPUCS] & 0x01);
+}
+
+void
+fx2emu_run(
+  struct fx2emu *emu,
+  uint64_t ns
+) {
+  uint64_t until = ns * FX2EMU_CLOCK / 1000000000ULL;
+
+  while (emu->clock < until) {
+    if (emu->xram[XR_CPUCS] & 0x01) {
+      /* in reset, nothing runs */
+      emu->clock = until;
+      break;
+    }
+
+    int cycles = fx2emu_interrupt(emu);
+    if (0 == cycles) {
+      if (emu->idle) {
+        cycles = 1;
+      } else {
+        cycles = fx2emu_step(emu);
+        emu->instructions++;
+      }
+    }
+
+    int clkout = cycles * 4;
+    emu->clock += (uint64_t)clkout * fx2emu_clock_div(emu);
+    fx2emu_timers(emu, clkout);
+
+    if (emu->clock >= emu->next_sof) {
+      emu->next_sof += FX2EMU_SOF;
+      fx2emu_sof(emu);
+    }
+  }
+}
+
+bool
+fx2emu_write(
+  struct fx2emu *emu,
+  int endpoint,
+  const void *data,
+  int size
+) {
+  struct fx2emu_endpoint *ep;
+  int depth;
+  int i = fx2emu_ep_index(endpoint);
+
+  if ((endpoint & 0x0f) == 1) {
+    ep = &emu->ep1out;
+    depth = 1;
+    if (size > 64) size = 64;
+  } else if (i >= 0 && !fx2emu_ep_is_in(emu, i)) {
+    ep = &emu->ep[i];
+    depth = fx2emu_ep_depth(emu, i);
+    if (size > FX2EMU_PACKET) size = FX2EMU_PACKET;
+  } else {
+    return false;
+  }
+
+  /* every buffer is full, either queued or held by the CPU */
+  if (ep->count + ep->cpu >= depth) return false;
+
+  struct fx2emu_packet *p = fx2emu_queue_tail(ep);
+  p->length = size;
+  memcpy(p->data, data, size);
+  ep->count++;
+
+  if (ep == &emu->ep1out) fx2emu_ep1out_load(emu);
+  else fx2emu_bulk_out_load(emu, i);
+  return true;
+}
+
+int
+fx2emu_read(
+  struct fx2emu *emu,
+  int endpoint,
+  void *data,
+  int size
+) {
+  struct fx2emu_endpoint *ep;
+  uint8_t irq;
+  int i = fx2emu_ep_index(endpoint);
+
+  if ((endpoint & 0x0f) == 1) {
+    ep = &emu->ep1in;
+    irq = EPIRQ_EP1IN;
+  } else if (i >= 0 && fx2emu_ep_is_in(emu, i)) {
+    ep = &emu->ep[i];
+    irq = EPIRQ_EP2 << i;
+  } else {
+    return 0;
+  }
+  if (0 == ep->count) return 0;
+
+  struct fx2emu_packet *p = &ep->queue[ep->head];
+  int len = p->length < size ? p->length : size;
+  memcpy(data, p->data, len);
+  fx2emu_queue_pop(ep);
+
+  /* the buffer is free for the CPU again */
+  fx2emu_usb_irq(emu, XR_EPIRQ, irq);
+  return len;
+}
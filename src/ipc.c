@@ -0,0 +1,154 @@
+/* ipc.c
+ *
+ * Shared memory rings and descriptor passing between nvstusbd and the
+ * daemon usb backend.
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "ipc.h"
+#include "log.h"
+
+/* post a message, false if the ring is full */
+bool
+nvstusb_ipc_push(
+  struct nvstusb_ipc_ring *ring,
+  const struct nvstusb_ipc_msg *msg
+) {
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail >= NVSTUSB_IPC_SLOTS) return false;
+
+  ring->slots[head & (NVSTUSB_IPC_SLOTS-1)] = *msg;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/* take the oldest message, false if the ring is empty */
+bool
+nvstusb_ipc_pop(
+  struct nvstusb_ipc_ring *ring,
+  struct nvstusb_ipc_msg *msg
+) {
+  uint32_t tail = ring->tail;
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if (head == tail) return false;
+
+  *msg = ring->slots[tail & (NVSTUSB_IPC_SLOTS-1)];
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+void
+nvstusb_ipc_ring_bell(
+  int fd
+) {
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    NVSTUSB_LOG(nvstusb_log_error, "doorbell: %s", strerror(errno));
+  }
+}
+
+/* wait for the bell and clear it, false on timeout */
+bool
+nvstusb_ipc_wait_bell(
+  int fd,
+  int timeout_ms
+) {
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  if (poll(&pfd, 1, timeout_ms) <= 0) return false;
+
+  uint64_t count;
+  return read(fd, &count, sizeof(count)) == sizeof(count);
+}
+
+const char *
+nvstusb_ipc_socket_path(
+) {
+  static char path[256];
+
+  const char *env = getenv("NVSTUSB_DAEMON");
+  if (0 != env) return env;
+
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  if (0 == dir) dir = "/tmp";
+  snprintf(path, sizeof(path), "%s/%s", dir, NVSTUSB_IPC_SOCKET);
+  return path;
+}
+
+bool
+nvstusb_ipc_send_fds(
+  int sock,
+  const int *fds,
+  int count
+) {
+  uint8_t version = NVSTUSB_IPC_VERSION;
+  struct iovec iov = { &version, 1 };
+  char buf[CMSG_SPACE(4*sizeof(int))];
+  if (count > 4) return false;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  memset(buf, 0, sizeof(buf));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = buf;
+  msg.msg_controllen = CMSG_SPACE(count*sizeof(int));
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(count*sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, count*sizeof(int));
+
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+}
+
+bool
+nvstusb_ipc_recv_fds(
+  int sock,
+  int *fds,
+  int count
+) {
+  uint8_t version = 0;
+  struct iovec iov = { &version, 1 };
+  char buf[CMSG_SPACE(4*sizeof(int))];
+  if (count > 4) return false;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = buf;
+  msg.msg_controllen = sizeof(buf);
+
+  if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) return false;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (0 == cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(count*sizeof(int))) {
+    NVSTUSB_LOG(nvstusb_log_error, "Daemon sent no descriptors");
+    return false;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), count*sizeof(int));
+
+  if (version != NVSTUSB_IPC_VERSION) {
+    NVSTUSB_LOG(nvstusb_log_error, "Daemon speaks protocol %d, not %d", version, NVSTUSB_IPC_VERSION);
+    int i;
+    for (i = 0; i < count; i++) close(fds[i]);
+    return false;
+  }
+  return true;
+}
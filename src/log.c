@@ -0,0 +1,302 @@
+/* log.c
+ *
+ * Messages are formatted by the thread logging them and put into a
+ * ring of fixed slots, many producers and one consumer, without locks
+ * (each slot carries a sequence number telling whose turn it is). A
+ * writer thread drains the ring to stderr or the user's callback. It
+ * sleeps on an eventfd while the ring is empty, producers only touch
+ * the eventfd when it sleeps. Messages are copied out of the ring under
+ * a lock and handed out after it is released, so a callback may log or
+ * change the callback itself.
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+
+#define NVSTUSB_LOG_SLOTS   256     /* power of two */
+#define NVSTUSB_LOG_TEXT    248
+#define NVSTUSB_LOG_BATCH   16      /* messages copied out at a time */
+
+struct nvstusb_log_slot {
+  uint32_t seq;             /* index of the message it holds + 1, or free for index */
+  int32_t level;
+  char text[NVSTUSB_LOG_TEXT];
+};
+
+static struct nvstusb_log_slot nvstusb_log_ring[NVSTUSB_LOG_SLOTS];
+static uint32_t nvstusb_log_head;       /* next index to claim, producers */
+static uint32_t nvstusb_log_tail;       /* next index to write out, consumer */
+static uint32_t nvstusb_log_dropped;    /* messages that found the ring full */
+
+static int nvstusb_log_level = nvstusb_log_info;
+
+/* the consumer side: the writer thread or a flush */
+static pthread_mutex_t nvstusb_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static nvstusb_log_func nvstusb_log_callback = 0;
+static void *nvstusb_log_user = 0;
+
+static pthread_once_t nvstusb_log_once = PTHREAD_ONCE_INIT;
+static bool nvstusb_log_threaded = false;
+static pthread_t nvstusb_log_writer;
+static int nvstusb_log_bell = -1;
+static int nvstusb_log_sleeping;
+static int nvstusb_log_stop;
+
+/* set while a thread hands out messages: what its callback logs or
+ * changes is left to that drain instead of draining again inside it */
+static __thread bool nvstusb_log_emitting = false;
+
+static uint64_t
+nvstusb_log_time_us(
+) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* hand one message to the callback or stderr, lock not held */
+static void
+nvstusb_log_emit(
+  nvstusb_log_func func,
+  void *user,
+  enum nvstusb_log_level level,
+  const char *text
+) {
+  if (0 != func) {
+    func(level, text, user);
+  } else {
+    fprintf(stderr, "nvstusb: %s\n", text);
+  }
+}
+
+/* write out everything queued, a batch at a time: copied out with the
+ * lock held, handed out after releasing it */
+static bool
+nvstusb_log_drain(
+) {
+  struct nvstusb_log_slot batch[NVSTUSB_LOG_BATCH];
+  bool any = false;
+  int n;
+  if (nvstusb_log_emitting) return false;
+  nvstusb_log_emitting = true;
+  do {
+    pthread_mutex_lock(&nvstusb_log_lock);
+    nvstusb_log_func func = nvstusb_log_callback;
+    void *user = nvstusb_log_user;
+    for (n = 0; n < NVSTUSB_LOG_BATCH; n++) {
+      struct nvstusb_log_slot *slot = &nvstusb_log_ring[nvstusb_log_tail % NVSTUSB_LOG_SLOTS];
+      if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != nvstusb_log_tail + 1) break;
+
+      batch[n] = *slot;
+      __atomic_store_n(&slot->seq, nvstusb_log_tail + NVSTUSB_LOG_SLOTS, __ATOMIC_RELEASE);
+      nvstusb_log_tail++;
+    }
+    uint32_t dropped = n < NVSTUSB_LOG_BATCH ? __atomic_exchange_n(&nvstusb_log_dropped, 0, __ATOMIC_RELAXED) : 0;
+    pthread_mutex_unlock(&nvstusb_log_lock);
+
+    int i;
+    for (i = 0; i < n; i++) nvstusb_log_emit(func, user, batch[i].level, batch[i].text);
+    if (dropped > 0) {
+      char text[64];
+      snprintf(text, sizeof(text), "%u messages lost, log ring full", dropped);
+      nvstusb_log_emit(func, user, nvstusb_log_warning, text);
+    }
+    any = any || n > 0;
+  } while (n > 0);
+  nvstusb_log_emitting = false;
+  return any;
+}
+
+static bool
+nvstusb_log_empty(
+) {
+  struct nvstusb_log_slot *slot = &nvstusb_log_ring[nvstusb_log_tail % NVSTUSB_LOG_SLOTS];
+  return __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != nvstusb_log_tail + 1 &&
+    0 == __atomic_load_n(&nvstusb_log_dropped, __ATOMIC_RELAXED);
+}
+
+/* the writer, until nvstusb_log_exit stops it */
+static void *
+nvstusb_log_thread(
+  void *arg
+) {
+  while (!__atomic_load_n(&nvstusb_log_stop, __ATOMIC_ACQUIRE)) {
+    nvstusb_log_drain();
+
+    /* announce the sleep before the last look, a producer finishing
+     * after it sees the flag and rings */
+    pthread_mutex_lock(&nvstusb_log_lock);
+    __atomic_store_n(&nvstusb_log_sleeping, 1, __ATOMIC_SEQ_CST);
+    bool empty = nvstusb_log_empty() && !__atomic_load_n(&nvstusb_log_stop, __ATOMIC_ACQUIRE);
+    pthread_mutex_unlock(&nvstusb_log_lock);
+
+    if (empty) {
+      struct pollfd pfd = { nvstusb_log_bell, POLLIN, 0 };
+      uint64_t count;
+      poll(&pfd, 1, -1);
+      if (read(nvstusb_log_bell, &count, sizeof(count)) < 0) {
+        /* rung again by now or not at all */
+      }
+    }
+    __atomic_store_n(&nvstusb_log_sleeping, 0, __ATOMIC_SEQ_CST);
+  }
+  return 0;
+}
+
+/* level names or numbers */
+static void
+nvstusb_log_parse_level(
+  const char *env
+) {
+  static const char *names[] = { "error", "warning", "info", "debug" };
+  int i;
+  for (i = 0; i < 4; i++) {
+    if (0 == strcasecmp(env, names[i])) {
+      nvstusb_log_level = i;
+      return;
+    }
+  }
+  nvstusb_log_level = atoi(env);
+}
+
+static void
+nvstusb_log_start(
+) {
+  uint32_t i;
+  for (i = 0; i < NVSTUSB_LOG_SLOTS; i++) nvstusb_log_ring[i].seq = i;
+
+  const char *env = getenv("NVSTUSB_LOG_LEVEL");
+  if (0 != env) nvstusb_log_parse_level(env);
+
+  /* without a thread every message is written out where it is logged */
+  nvstusb_log_bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (nvstusb_log_bell < 0) return;
+
+  nvstusb_log_threaded = 0 == pthread_create(&nvstusb_log_writer, 0, nvstusb_log_thread, 0);
+}
+
+/* format a message into the ring, site 0 is not rate limited */
+void
+nvstusb_log_at(
+  struct nvstusb_log_site *site,
+  enum nvstusb_log_level level,
+  const char *format,
+  ...
+) {
+  pthread_once(&nvstusb_log_once, nvstusb_log_start);
+  if ((int)level > __atomic_load_n(&nvstusb_log_level, __ATOMIC_RELAXED)) return;
+
+  /* the thread opening a new interval reports what the last one lost */
+  uint32_t suppressed = 0;
+  if (0 != site) {
+    uint64_t now = nvstusb_log_time_us();
+    uint64_t window = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+    if (now - window >= NVSTUSB_LOG_INTERVAL_US &&
+        __atomic_compare_exchange_n(&site->window, &window, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) >= NVSTUSB_LOG_BURST) {
+      __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  /* claim a slot */
+  uint32_t pos = __atomic_load_n(&nvstusb_log_head, __ATOMIC_RELAXED);
+  struct nvstusb_log_slot *slot;
+  for (;;) {
+    slot = &nvstusb_log_ring[pos % NVSTUSB_LOG_SLOTS];
+    int32_t diff = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (0 == diff) {
+      if (__atomic_compare_exchange_n(&nvstusb_log_head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else if (diff < 0) {
+      __atomic_fetch_add(&nvstusb_log_dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&nvstusb_log_head, __ATOMIC_RELAXED);
+    }
+  }
+
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(slot->text, sizeof(slot->text), format, args);
+  va_end(args);
+  if (suppressed > 0 && len >= 0 && len < (int)sizeof(slot->text)) {
+    snprintf(slot->text + len, sizeof(slot->text) - len, " (%u more suppressed)", suppressed);
+  }
+  slot->level = level;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+  if (!nvstusb_log_threaded) {
+    nvstusb_log_flush();
+  } else if (__atomic_exchange_n(&nvstusb_log_sleeping, 0, __ATOMIC_SEQ_CST)) {
+    uint64_t one = 1;
+    if (write(nvstusb_log_bell, &one, sizeof(one)) < 0) {
+      /* the counter is full, it is awake anyway */
+    }
+  }
+}
+
+void
+nvstusb_log_flush(
+) {
+  nvstusb_log_drain();
+}
+
+/* the writer is stopped before the library is unloaded, which would
+ * take its code away, and nothing queued is lost */
+static void nvstusb_log_exit(void) __attribute__((destructor));
+
+static void
+nvstusb_log_exit(
+) {
+  if (nvstusb_log_threaded && !pthread_equal(pthread_self(), nvstusb_log_writer)) {
+    __atomic_store_n(&nvstusb_log_stop, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(nvstusb_log_bell, &one, sizeof(one)) < 0) {
+      /* the counter is full, it wakes anyway */
+    }
+    pthread_join(nvstusb_log_writer, 0);
+    nvstusb_log_threaded = false;
+  }
+  nvstusb_log_flush();
+  if (nvstusb_log_bell >= 0) close(nvstusb_log_bell);
+  nvstusb_log_bell = -1;
+}
+
+void
+nvstusb_set_log_level(
+  enum nvstusb_log_level level
+) {
+  pthread_once(&nvstusb_log_once, nvstusb_log_start);
+  __atomic_store_n(&nvstusb_log_level, level, __ATOMIC_RELAXED);
+}
+
+void
+nvstusb_set_log_callback(
+  nvstusb_log_func func,
+  void *user
+) {
+  /* what was logged before goes to the old callback */
+  nvstusb_log_drain();
+  pthread_mutex_lock(&nvstusb_log_lock);
+  nvstusb_log_callback = func;
+  nvstusb_log_user = user;
+  pthread_mutex_unlock(&nvstusb_log_lock);
+}
@@ -17,6 +17,9 @@
 #include <assert.h>
 #include <math.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include <GL/gl.h>
 #include <GL/glx.h>
@@ -25,6 +28,15 @@
 
 #include "nvstusb.h"
 #include "usb.h"
+#include "display.h"
+#include "timing.h"
+#include "regs.h"
+#include "vtimer.h"
+#include "calibrate.h"
+#include "state.h"
+#include "usbstats.h"
+#include "probes.h"
+#include "log.h"
 
 static PFNGLXGETVIDEOSYNCSGIPROC glXGetVideoSyncSGI = NULL;
 static PFNGLXWAITVIDEOSYNCSGIPROC glXWaitVideoSyncSGI = NULL;
@@ -34,19 +46,8 @@ static PFNGLXSWAPINTERVALEXTPROC glXSwapIntervalEXT = NULL;
 /* Static functions */
 static void nvstusb_print_refresh_rate(void);
 static void * nvstusb_stereo_thread(void * in_pv_arg);
-
-/* cpu clock */
-#define NVSTUSB_CLOCK           48000000LL
-
-/* T0 runs at 4 MHz */
-#define NVSTUSB_T0_CLOCK        (NVSTUSB_CLOCK/12LL)
-#define NVSTUSB_T0_COUNT(us)    (-(us)*(NVSTUSB_T0_CLOCK/1000000)+1)
-#define NVSTUSB_T0_US(count)    (-(count-1)/(NVSTUSB_T0_CLOCK/1000000))
-
-/* T2 runs at 12 MHz */
-#define NVSTUSB_T2_CLOCK        (NVSTUSB_CLOCK/ 4LL)
-#define NVSTUSB_T2_COUNT(us)    (-(us)*(NVSTUSB_T2_CLOCK/1000000)+1)
-#define NVSTUSB_T2_US(count)    (-(count-1)/(NVSTUSB_T2_CLOCK/1000000))
+static void * nvstusb_stereo_thread_nogl(void * in_pv_arg);
+static int nvstusb_poll_status(struct nvstusb_context *ctx);
 
 #define NVSTUSB_CMD_WRITE       (0x01)  /* write data */
 #define NVSTUSB_CMD_READ        (0x02)  /* read data */
@@ -55,6 +56,53 @@ static void * nvstusb_stereo_thread(void * in_pv_arg);
 #define NVSTUSB_CMD_SET_EYE     (0xAA)  /* set current eye */
 #define NVSTUSB_CMD_CALL_X0199  (0xBE)  /* call routine at 0x0199 */
 
+/* an eye command has to be on the bus this long before the next vblank,
+ * one high speed microframe */
+#define NVSTUSB_EYE_MARGIN_US   125
+
+/* status reads used a fixed timeout before budgets existed */
+#define NVSTUSB_READ_TIMEOUT_MS 200
+
+/* IN transfers kept queued on endpoint 4, read commands in flight */
+#define NVSTUSB_POSTED_READS    4
+#define NVSTUSB_MAX_REQUESTS    16
+
+/* how long the reply of a timed out read may still arrive */
+#define NVSTUSB_STALE_US        1000000
+
+/* key status at 0x201f-0x2021 */
+#define NVSTUSB_REG_STATUS      0x18
+
+/* how often nvstusb_handle_events polls the keys by default */
+#define NVSTUSB_KEY_INTERVAL_US 10000
+
+/* longest an event loop waits for the controller to take the status
+ * command, two full speed frames */
+#define NVSTUSB_POLL_TIMEOUT_US 2000
+
+/* a read command waiting for its reply */
+struct nvstusb_request {
+  uint8_t offset;       /* reply header: offset */
+  uint8_t size;         /* reply header: number of bytes */
+  uint8_t *data;        /* where the reply data goes, 0 = timed out */
+  int64_t posted;       /* time the command was sent */
+  bool done;
+};
+
+/* vblank calibration: frames per method, frames before measuring */
+#define NVSTUSB_CALIBRATE_FRAMES  240
+#define NVSTUSB_CALIBRATE_WARMUP  16
+
+/* frame pacing: weight of a new render cost sample (1/8), deviations
+ * added as safety, default margin */
+#define NVSTUSB_RENDER_GAIN       0.125
+#define NVSTUSB_RENDER_DEVIATIONS 2.0
+#define NVSTUSB_RENDER_MARGIN_US  500
+
+/* drift tracking: frames per measurement window and default threshold */
+#define NVSTUSB_DRIFT_FRAMES    1024
+#define NVSTUSB_DRIFT_PPM       200.0
+
 /* state of the controller */
 struct nvstusb_context {
   /* currently selected refresh rate */
@@ -72,6 +120,15 @@ struct nvstusb_context {
   /* Vblank method */
   int vblank_method;
 
+  /* virtual vblank of nvstusb_vblank_timer, its rate (0 = controller rate) */
+  struct nvstusb_vtimer vtimer;
+  float timer_rate;
+
+  /* calibration on the first swap pending, results of the last one */
+  bool calibrate_pending;
+  struct nvstusb_vblank_result vblank_results[nvstusb_vblank_timer];
+  int num_vblank_results;
+
   /* Invert eyes command status */
   int invert_eyes;
 
@@ -80,12 +137,513 @@ struct nvstusb_context {
 
   /* Stereo thread state */
   char b_thread_running;
+
+  /* what the stereo thread waits on, drm vblank events if open */
+  enum nvstusb_thread_mode thread_mode;
+  struct nvstusb_display_vblank *thread_vblank;
+
+  /* latency budget of a call in us, 0 = unbounded */
+  unsigned int budget_us;
+
+  /* drift tracking enabled, threshold in ppm */
+  bool track_drift;
+  float drift_ppm;
+
+  /* measurement window: first and last vblank, frames in between */
+  int64_t drift_anchor;
+  int64_t drift_last;
+  uint32_t drift_frames;
+
+  /* rate measured over the last window, 0 if none yet */
+  float measured_rate;
+
+  /* vblank counter of the last swap, vblank parity of the left eye
+   * (-1 = not known), eye command has to be resent */
+  int64_t msc;
+  bool msc_valid;
+  int eye_phase;
+  bool resync;
+
+  /* swap statistics */
+  struct nvstusb_stats stats;
+
+  /* last vblank an eye was sent for and the eye, 0 = none yet */
+  int64_t last_vblank;
+  enum nvstusb_eye last_eye;
+
+  /* frame pacing: start of the current render, estimated cost and its
+   * mean deviation, safety margin */
+  int64_t render_start;
+  float render_cost;
+  float render_dev;
+  unsigned int render_margin_us;
+
+  /* output to synchronize to, 0 = primary */
+  char *output;
+
+  /* its drm card and crtc index, -1 if not known */
+  int drm_card;
+  int drm_pipe;
+
+  /* timer counts currently programmed */
+  struct nvstusb_timing timing;
+
+  /* profile chosen by the user, used instead of the built-in ones */
+  struct nvstusb_timing_profile profile;
+  bool has_profile;
+
+  /* profiles read from a file, preferred to the built-in ones */
+  struct nvstusb_timing_profile loaded[NVSTUSB_TIMING_MAX_PROFILES];
+  int num_loaded;
+
+  /* fraction of the frame each eye is open, 0 = profile default */
+  float duty;
+
+  /* what has been written to the register window at 0x2007 */
+  struct nvstusb_regs regs;
+
+  /* replies arrive on posted reads and are matched to these requests */
+  bool posted_reads;
+  struct nvstusb_request *requests[NVSTUSB_MAX_REQUESTS];
+  int num_requests;
+
+  /* stand-ins for timed out requests, keeping their place in line
+   * until their reply shows up (done = free) */
+  struct nvstusb_request stale[NVSTUSB_MAX_REQUESTS];
+
+  /* status poll of nvstusb_get_keys_nowait */
+  struct nvstusb_request status_req;
+  uint8_t status_buf[3];
+  bool status_busy;
+
+  /* key status received but not handed out yet */
+  struct nvstusb_keys keys;
+
+  /* shared state page, 0 if not published */
+  struct nvstusb_state_writer *state;
+
+  /* writes the usb counters to a file, 0 if not exported */
+  struct nvstusb_usbstats_exporter *usbstats;
+
+  /* descriptor of nvstusb_get_fd, an epoll set of the backend's
+   * descriptor and the key poll timer, -1 until asked for */
+  int event_fd;
+  int key_timer;
+  unsigned int key_interval_us;
 };
 
+/* monotonic time in microseconds */
+static int64_t
+nvstusb_time_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* absolute deadline of a budget counted from start (us), 0 = none */
+static int64_t
+nvstusb_deadline_from(
+    struct nvstusb_context *ctx,
+    unsigned int budget_us,
+    int64_t start
+    ) {
+  unsigned int budget = budget_us ? budget_us : ctx->budget_us;
+  if (0 == budget) return 0;
+  return start + budget;
+}
+
+/* absolute deadline of a call, 0 = none */
+static int64_t
+nvstusb_deadline(
+    struct nvstusb_context *ctx,
+    unsigned int budget_us
+    ) {
+  return nvstusb_deadline_from(ctx, budget_us, nvstusb_time_us());
+}
+
+/* usb timeout left until deadline (rounded up to libusb's milliseconds),
+ * 0 = wait forever, -1 = deadline already passed */
+static int
+nvstusb_timeout_ms(
+    int64_t deadline
+    ) {
+  if (0 == deadline) return 0;
+  int64_t left = deadline - nvstusb_time_us();
+  if (left <= 0) return -1;
+  return (int)((left + 999) / 1000);
+}
+
+/* bulk write bounded by a deadline */
+static int
+nvstusb_write(
+    struct nvstusb_context *ctx,
+    int endpoint,
+    const void *data,
+    int size,
+    int64_t deadline
+    ) {
+  int timeout = nvstusb_timeout_ms(deadline);
+  if (timeout < 0) return nvstusb_status_timeout;
+
+  int res = nvstusb_usb_write_bulk(ctx->device, endpoint, data, size, timeout);
+  switch (res) {
+  case NVSTUSB_USB_ERROR_TIMEOUT:   return nvstusb_status_timeout;
+  case NVSTUSB_USB_ERROR_NO_DEVICE: return nvstusb_status_no_device;
+  }
+  if (res != size) return nvstusb_status_error;
+  return nvstusb_status_ok;
+}
+
+/* key status from registers 0x201f-0x2021 */
+static void
+nvstusb_add_keys(
+    struct nvstusb_context *ctx,
+    const uint8_t *status
+    ) {
+  /* from address 0x201F:
+   * signed 8 bit integer: amount the wheel was turned without the button pressed
+   */
+  ctx->keys.deltaWheel += (char)status[0];
+
+  /* from address 0x2020:
+   * signed 8 bit integer: amount the wheel was turned with the button pressed
+   */
+  ctx->keys.pressedDeltaWheel += (char)status[1];
+
+  /* from address 0x2021:
+   * bit 0: front button was pressed since last time (presumably fom pin 4 on port C)
+   * bit 1: logic state of pin 7 on port E
+   * bit 2: logic state of pin 2 on port C
+   */
+  ctx->keys.toggled3D |= status[2] & 0x01; 
+
+  if (0 != ctx->state) {
+    struct nvstusb_state *state = nvstusb_state_begin(ctx->state);
+    state->wheel += (char)status[0];
+    state->pressed_wheel += (char)status[1];
+    state->toggles += status[2] & 0x01;
+    nvstusb_state_end(ctx->state);
+  }
+}
+
+/* hand out the key status collected so far */
+static void
+nvstusb_take_keys(
+    struct nvstusb_context *ctx,
+    struct nvstusb_keys *keys
+    ) {
+  *keys = ctx->keys;
+  memset(&ctx->keys, 0, sizeof(ctx->keys));
+  NVSTUSB_PROBE3(keys, keys->deltaWheel, keys->pressedDeltaWheel, keys->toggled3D);
+
+  if(keys->toggled3D) {
+    ctx->toggled3D = !ctx->toggled3D;
+  } 
+}
+
+/* add a read command to the requests waiting for replies */
+static bool
+nvstusb_add_request(
+    struct nvstusb_context *ctx,
+    struct nvstusb_request *req
+    ) {
+  if (ctx->num_requests == NVSTUSB_MAX_REQUESTS) return false;
+
+  req->posted = nvstusb_time_us();
+  req->done = false;
+  ctx->requests[ctx->num_requests++] = req;
+  return true;
+}
+
+/* forget a request, the order of the others is kept */
+static void
+nvstusb_drop_request(
+    struct nvstusb_context *ctx,
+    struct nvstusb_request *req
+    ) {
+  int i;
+  for (i = 0; i < ctx->num_requests; i++) {
+    if (ctx->requests[i] != req) continue;
+    memmove(ctx->requests+i, ctx->requests+i+1, (ctx->num_requests-i-1)*sizeof(req));
+    ctx->num_requests--;
+    return;
+  }
+}
+
+/* give up waiting for a request whose command went out: a stand-in
+ * takes its place, so its reply, if it still comes, is not mistaken
+ * for that of a later read of the same registers */
+static void
+nvstusb_abandon_request(
+    struct nvstusb_context *ctx,
+    struct nvstusb_request *req
+    ) {
+  int i, j;
+  for (i = 0; i < ctx->num_requests; i++) {
+    if (ctx->requests[i] != req) continue;
+
+    for (j = 0; j < NVSTUSB_MAX_REQUESTS; j++) {
+      struct nvstusb_request *stale = &ctx->stale[j];
+      if (!stale->done) continue;
+      *stale = *req;
+      stale->data = 0;
+      stale->done = false;
+      ctx->requests[i] = stale;
+      return;
+    }
+    nvstusb_drop_request(ctx, req);
+    return;
+  }
+}
+
+/* forget stand-ins whose reply is not coming anymore */
+static void
+nvstusb_expire_stale(
+    struct nvstusb_context *ctx
+    ) {
+  int64_t now = nvstusb_time_us();
+  int i;
+  for (i = 0; i < NVSTUSB_MAX_REQUESTS; i++) {
+    struct nvstusb_request *stale = &ctx->stale[i];
+    if (stale->done || now - stale->posted < NVSTUSB_STALE_US) continue;
+    nvstusb_drop_request(ctx, stale);
+    stale->done = true;
+  }
+}
+
+/* match completed replies to the oldest request with the same offset and
+ * length (echoed in readBuf[0..1]). Status reads clear the registers, so
+ * a status reply no one waits for anymore still counts its keys. */
+static int
+nvstusb_dispatch_replies(
+    struct nvstusb_context *ctx
+    ) {
+  uint8_t readBuf[4+NVSTUSB_REG_MAX_WRITE];
+  int len;
+
+  nvstusb_expire_stale(ctx);
+  while ((len = nvstusb_usb_reap_bulk(ctx->device, 4, readBuf, sizeof(readBuf))) > 0) {
+    struct nvstusb_request *match = 0;
+    int i;
+    for (i = 0; i < ctx->num_requests; i++) {
+      struct nvstusb_request *req = ctx->requests[i];
+      if (req->offset != readBuf[0] || req->size != readBuf[1]) continue;
+      if (len >= 4+req->size) match = req;
+      break;
+    }
+
+    if (0 != match) {
+      nvstusb_drop_request(ctx, match);
+      match->done = true;
+      if (0 != match->data) memcpy(match->data, readBuf+4, match->size);
+      if (match == &ctx->status_req) ctx->status_busy = false;
+    }
+
+    if ((0 == match || 0 == match->data || match == &ctx->status_req) &&
+        NVSTUSB_REG_STATUS == readBuf[0] && len >= 4+3) {
+      nvstusb_add_keys(ctx, readBuf+4);
+    }
+  }
+
+  if (len == NVSTUSB_USB_ERROR_NO_DEVICE) return nvstusb_status_no_device;
+  if (len < 0) return nvstusb_status_error;
+  return nvstusb_status_ok;
+}
+
+/* build and send a read command */
+static int
+nvstusb_send_read(
+    struct nvstusb_context *ctx,
+    uint8_t command,
+    unsigned int offset,
+    unsigned int size,
+    int64_t deadline
+    ) {
+  /* built in place, the backend sends it without a copy */
+  uint8_t *cmd = nvstusb_usb_buffer(ctx->device, NVSTUSB_USB_BUFFER_COMMAND);
+  cmd[0] = command;
+  cmd[1] = offset;          /* from address 0x2007+offset */
+  cmd[2] = size;            /* number of bytes */
+  cmd[3] = size>>8;
+  int res = nvstusb_write(ctx, 2, cmd, 4, deadline);
+  nvstusb_usb_release_buffer(ctx->device, NVSTUSB_USB_BUFFER_COMMAND);
+  return res;
+}
+
+/* read through the posted reads: send the command, then handle
+ * completions until the matching reply arrived */
+static int
+nvstusb_read_posted(
+    struct nvstusb_context *ctx,
+    uint8_t command,
+    unsigned int offset,
+    void *data,
+    unsigned int size,
+    int64_t deadline
+    ) {
+  struct nvstusb_request req;
+  req.offset = offset;
+  req.size = size;
+  req.data = data;
+  if (!nvstusb_add_request(ctx, &req)) return nvstusb_status_error;
+
+  int res = nvstusb_send_read(ctx, command, offset, size, deadline);
+  if (res < 0) {
+    nvstusb_drop_request(ctx, &req);
+    return res;
+  }
+  if (0 == deadline) deadline = nvstusb_time_us() + NVSTUSB_READ_TIMEOUT_MS*1000;
+
+  while (res == nvstusb_status_ok) {
+    res = nvstusb_dispatch_replies(ctx);
+    if (req.done) return res;
+    if (res < 0) break;
+
+    int64_t left = deadline - nvstusb_time_us();
+    if (left <= 0) {
+      res = nvstusb_status_timeout;
+      break;
+    }
+    nvstusb_usb_handle_events(ctx->device, left < 10000 ? left : 10000);
+  }
+
+  nvstusb_abandon_request(ctx, &req);
+  return res;
+}
+
+/* send a read command and receive the reply, returns the data
+ * following the 4 byte reply header */
+static int
+nvstusb_read(
+    struct nvstusb_context *ctx,
+    uint8_t command,
+    unsigned int offset,
+    void *data,
+    unsigned int size,
+    int64_t deadline
+    ) {
+  if (ctx->posted_reads) {
+    return nvstusb_read_posted(ctx, command, offset, data, size, deadline);
+  }
+
+  int res = nvstusb_send_read(ctx, command, offset, size, deadline);
+  if (res < 0) return res;
+
+  uint8_t readBuf[4+NVSTUSB_REG_MAX_WRITE];
+  int timeout = deadline ? nvstusb_timeout_ms(deadline) : NVSTUSB_READ_TIMEOUT_MS;
+  if (timeout < 0) return nvstusb_status_timeout;
+
+  res = nvstusb_usb_read_bulk(ctx->device, 4, readBuf, 4+size, timeout);
+  switch (res) {
+  case NVSTUSB_USB_ERROR_TIMEOUT:   return nvstusb_status_timeout;
+  case NVSTUSB_USB_ERROR_NO_DEVICE: return nvstusb_status_no_device;
+  }
+  if (res < (int)(4+size)) return nvstusb_status_error;
+
+  /* readBuf[0] contains the offset,
+   * readBuf[1] contains the number of read bytes,
+   * readBuf[2] (msb) and readBuf[3] (lsb) of the bytes sent (sizeof(cmd)) 
+   * readBuf[4] and following contain the requested data */
+  if (readBuf[0] != offset || readBuf[1] != size) return nvstusb_status_error;
+
+  memcpy(data, readBuf+4, size);
+  return nvstusb_status_ok;
+}
+
+/* transmit the staged register writes, only the bytes that changed,
+ * in as few commands as possible */
+static int
+nvstusb_flush_regs(
+    struct nvstusb_context *ctx,
+    int64_t deadline
+    ) {
+  unsigned int offset, size;
+
+  while (nvstusb_regs_next_range(&ctx->regs, &offset, &size)) {
+    uint8_t cmd[4+NVSTUSB_REG_MAX_WRITE] = {
+      NVSTUSB_CMD_WRITE,    /* write data */
+      offset,               /* to address 0x2007+offset */
+      size, size>>8         /* number of bytes following */
+    };
+    memcpy(cmd+4, ctx->regs.staged+offset, size);
+
+    int res = nvstusb_write(ctx, 2, cmd, 4+size, deadline);
+    nvstusb_regs_commit(&ctx->regs, offset, size, res == nvstusb_status_ok);
+    if (res < 0) return res;
+  }
+  return nvstusb_status_ok;
+}
+
+/* write to the register window at 0x2007, unchanged bytes are skipped */
+int
+nvstusb_write_regs(
+    struct nvstusb_context *ctx,
+    unsigned int offset,
+    const void *data,
+    unsigned int size
+    ) {
+  assert(ctx != 0);
+  assert(ctx->device != 0);
+
+  if (offset + size > NVSTUSB_REG_COUNT) return nvstusb_status_error;
+
+  nvstusb_regs_stage(&ctx->regs, offset, data, size);
+  return nvstusb_flush_regs(ctx, nvstusb_deadline(ctx, 0));
+}
+
+/* read from the register window at 0x2007 */
+int
+nvstusb_read_regs(
+    struct nvstusb_context *ctx,
+    unsigned int offset,
+    void *data,
+    unsigned int size
+    ) {
+  assert(ctx != 0);
+  assert(ctx->device != 0);
+
+  if (offset + size > NVSTUSB_REG_COUNT) return nvstusb_status_error;
+
+  int64_t deadline = nvstusb_deadline(ctx, 0);
+  uint8_t *bytes = data;
+  while (size > 0) {
+    unsigned int chunk = size < NVSTUSB_REG_MAX_WRITE ? size : NVSTUSB_REG_MAX_WRITE;
+    int res = nvstusb_read(ctx, NVSTUSB_CMD_READ, offset, bytes, chunk, deadline);
+    if (res < 0) return res;
+
+    nvstusb_regs_update(&ctx->regs, offset, bytes, chunk);
+    offset += chunk;
+    bytes += chunk;
+    size -= chunk;
+  }
+  return nvstusb_status_ok;
+}
+
+/* write everything known about the registers again, e.g. after
+ * the controller has been reconnected */
+int
+nvstusb_replay_regs(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+  assert(ctx->device != 0);
+
+  nvstusb_regs_stage_all(&ctx->regs);
+  return nvstusb_flush_regs(ctx, nvstusb_deadline(ctx, 0));
+}
+
 /* initialize controller */
 struct nvstusb_context *
 nvstusb_init(char const * fw) 
 {
+  /* replaying a trace instead of talking to the controller */
+  const char *replay = getenv("NVSTUSB_REPLAY");
+  if (replay) {
+    const char *speed = getenv("NVSTUSB_REPLAY_SPEED");
+    nvstusb_usb_set_replay(replay, speed ? atof(speed) : 1.0);
+  }
+
   /* initialize usb */
   if (!nvstusb_usb_init()) return 0;
 
@@ -96,7 +654,7 @@ nvstusb_init(char const * fw)
   /* allocate context */
   struct nvstusb_context *ctx = malloc(sizeof(*ctx));
   if (0 == ctx) {
-    fprintf(stderr, "nvstusb: Could not allocate %d bytes for nvstusb_context...\n", (int)sizeof(*ctx));
+    NVSTUSB_LOG(nvstusb_log_error, "Could not allocate %d bytes for nvstusb_context...", (int)sizeof(*ctx));
     nvstusb_usb_close_device(dev);
     nvstusb_usb_deinit();
     return 0;
@@ -108,15 +666,91 @@ nvstusb_init(char const * fw)
   ctx->toggled3D = 0;
   ctx->invert_eyes = 0;
   ctx->b_thread_running = 0;
+  ctx->budget_us = 0;
+  ctx->track_drift = false;
+  ctx->drift_ppm = NVSTUSB_DRIFT_PPM;
+  ctx->drift_anchor = 0;
+  ctx->drift_last = 0;
+  ctx->drift_frames = 0;
+  ctx->measured_rate = 0.0;
+  ctx->last_vblank = 0;
+  ctx->last_eye = nvstusb_left;
+  ctx->msc = 0;
+  ctx->msc_valid = false;
+  ctx->eye_phase = -1;
+  ctx->resync = false;
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+  ctx->render_start = 0;
+  ctx->render_cost = 0.0;
+  ctx->render_dev = 0.0;
+  ctx->render_margin_us = NVSTUSB_RENDER_MARGIN_US;
+  ctx->output = 0;
+  ctx->drm_card = -1;
+  ctx->drm_pipe = -1;
+  ctx->thread_mode = nvstusb_thread_gl;
+  ctx->thread_vblank = 0;
+  ctx->has_profile = false;
+  ctx->num_loaded = 0;
+  ctx->duty = 0.0;
+  nvstusb_regs_init(&ctx->regs);
+  ctx->num_requests = 0;
+  int i;
+  for (i = 0; i < NVSTUSB_MAX_REQUESTS; i++) ctx->stale[i].done = true;
+  ctx->status_busy = false;
+  memset(&ctx->keys, 0, sizeof(ctx->keys));
+  nvstusb_vtimer_init(&ctx->vtimer);
+  ctx->timer_rate = 0.0;
+  ctx->num_vblank_results = 0;
+  ctx->calibrate_pending = false;
+  ctx->state = 0;
+  ctx->usbstats = 0;
+  ctx->event_fd = -1;
+  ctx->key_timer = -1;
+  ctx->key_interval_us = NVSTUSB_KEY_INTERVAL_US;
+
+  /* keep reads queued on the status endpoint, replies are then
+   * picked up on completion instead of waiting for each one */
+  ctx->posted_reads = nvstusb_usb_post_reads(dev, 4, NVSTUSB_POSTED_READS, 4+NVSTUSB_REG_MAX_WRITE);
+  if (!ctx->posted_reads) {
+    NVSTUSB_LOG(nvstusb_log_warning, "posted reads not available, reading synchronously");
+  }
+
+  if (getenv("NVSTUSB_STATE")) nvstusb_publish_state(ctx, 0);
 
+  const char *usbstats = getenv("NVSTUSB_USB_STATS");
+  if (usbstats) {
+    const char *interval = getenv("NVSTUSB_USB_STATS_INTERVAL");
+    nvstusb_export_usb_stats(ctx, usbstats, interval ? atoi(interval) : 0);
+  }
+
+  /* profiles made by nvstusb-tune */
+  const char *profiles = getenv("NVSTUSB_PROFILE");
+  if (profiles) nvstusb_load_profiles(ctx, profiles);
 
   /* Vblank init */
+  /* a replay has no display to sync to, eyes follow the swap calls */
+  if (replay) {
+    ctx->vblank_method = nvstusb_vblank_external;
+    goto out_err;
+  }
+
+  /* timer instead of a display: headless or externally synced */
+  const char *vblank = getenv("NVSTUSB_VBLANK");
+  if (vblank && 0 == strcmp(vblank, "timer")) {
+    const char *rate = getenv("NVSTUSB_VBLANK_RATE");
+    ctx->vblank_method = nvstusb_vblank_timer;
+    ctx->timer_rate = rate ? atof(rate) : 0.0;
+    if (ctx->timer_rate > 0) nvstusb_vtimer_set_rate(&ctx->vtimer, ctx->timer_rate);
+    NVSTUSB_LOG(nvstusb_log_info, "vblank from timer");
+    goto out_err;
+  }
+
   /* NVIDIA VBlank syncing environment variable defined, signal it and disable
    * any attempt to application side method */
   if (getenv ("__GL_SYNC_TO_VBLANK"))
   {
-    fprintf (stderr, "__GL_SYNC_TO_VBLANK defined in environment\n");
-    ctx->vblank_method = 2;
+    NVSTUSB_LOG(nvstusb_log_info, "__GL_SYNC_TO_VBLANK defined in environment");
+    ctx->vblank_method = nvstusb_vblank_external;
     goto out_err;
   }
 
@@ -124,8 +758,8 @@ nvstusb_init(char const * fw)
   glXSwapIntervalSGI = (PFNGLXSWAPINTERVALSGIPROC)glXGetProcAddress("glXSwapIntervalSGI");
 
   if (NULL != glXSwapIntervalSGI) {
-    fprintf(stderr, "nvstusb: forcing vsync\n");
-    ctx->vblank_method = 3;
+    NVSTUSB_LOG(nvstusb_log_info, "forcing vsync");
+    ctx->vblank_method = nvstusb_vblank_swap_interval;
   }
 
   /* Sync Video */
@@ -134,18 +768,48 @@ nvstusb_init(char const * fw)
   if (NULL == glXWaitVideoSyncSGI) {
     glXGetVideoSyncSGI = 0;
   } else {
-    ctx->vblank_method = 1;
+    ctx->vblank_method = nvstusb_vblank_video_sync;
   }
 
   if (NULL != glXGetVideoSyncSGI ) {
-    fprintf(stderr, "nvstusb: GLX_SGI_video_sync supported!\n");
+    NVSTUSB_LOG(nvstusb_log_info, "GLX_SGI_video_sync supported!");
   }
 
-  fprintf(stderr, "nvstusb:selected vblank method: %d\n", ctx->vblank_method);
+  NVSTUSB_LOG(nvstusb_log_info, "selected vblank method: %d", ctx->vblank_method);
+
+  /* measure the methods once a GL context exists */
+  const char *calibrate = getenv("NVSTUSB_CALIBRATE");
+  ctx->calibrate_pending = calibrate && 0 != strcmp(calibrate, "0");
 out_err:
   return ctx;
 }
 
+/* initialize with a recorded trace in place of the controller */
+struct nvstusb_context *
+nvstusb_init_replay(
+    const char *trace,
+    float speed
+    ) {
+  nvstusb_usb_set_replay(trace, speed);
+  struct nvstusb_context *ctx = nvstusb_init(0);
+  if (0 != ctx) ctx->vblank_method = nvstusb_vblank_external;
+  return ctx;
+}
+
+/* record usb traffic */
+int
+nvstusb_trace_start(
+    const char *path
+    ) {
+  return nvstusb_usb_trace_start(path) ? nvstusb_status_ok : nvstusb_status_error;
+}
+
+void
+nvstusb_trace_stop(
+    ) {
+  nvstusb_usb_trace_stop();
+}
+
 /* deinitialize controller */
 void
 nvstusb_deinit(
@@ -158,6 +822,9 @@ nvstusb_deinit(
     nvstusb_stop_stereo_thread(ctx);
   }
 
+  /* last counters out before the device goes */
+  nvstusb_usbstats_stop(ctx->usbstats);
+
   /* close device */
   if (0 != ctx->device) nvstusb_usb_close_device(ctx->device);
   ctx->device = 0;
@@ -165,9 +832,119 @@ nvstusb_deinit(
   /* close usb */
   nvstusb_usb_deinit();
 
+  free(ctx->output);
+  nvstusb_vtimer_destroy(&ctx->vtimer);
+  nvstusb_state_destroy(ctx->state);
+  if (ctx->event_fd >= 0) close(ctx->event_fd);
+  if (ctx->key_timer >= 0) close(ctx->key_timer);
+
   /* free context */
   memset(ctx, 0, sizeof(*ctx));
   free(ctx);
+
+  /* messages of the shutdown out before the application goes on */
+  nvstusb_log_flush();
+}
+
+/* set libusb's own verbosity, 0 (none) to 4 (debug) */
+void
+nvstusb_set_usb_debug(
+    int level
+    ) {
+  nvstusb_usb_set_debug(level);
+}
+
+/* set latency budget used when a timed call passes 0 */
+void
+nvstusb_set_latency_budget(
+    struct nvstusb_context *ctx,
+    unsigned int budget_us
+    ) {
+  assert(ctx != 0);
+  ctx->budget_us = budget_us;
+}
+
+/* timer counts for rate: from the user's profile, the closest loaded or
+ * built-in profile or generated from the rate, with the duty cycle applied */
+static bool
+nvstusb_get_timing(
+    struct nvstusb_context *ctx,
+    float rate,
+    struct nvstusb_timing *timing
+    ) {
+  struct nvstusb_timing_profile profile;
+  const struct nvstusb_timing_profile *known = nvstusb_timing_find_in(ctx->loaded, ctx->num_loaded, rate);
+  if (0 == known) known = nvstusb_timing_find_profile(rate);
+
+  if (ctx->has_profile) {
+    profile = ctx->profile;
+  } else if (0 != known) {
+    profile = *known;
+  } else {
+    nvstusb_timing_generate(rate, &profile);
+  }
+
+  if (ctx->duty > 0) {
+    profile.active_us = ctx->duty * 1000000.0/rate;
+  }
+  return nvstusb_timing_compute(&profile, rate, timing);
+}
+
+/* reprogram the current rate after the timing parameters changed */
+static int
+nvstusb_reprogram(
+    struct nvstusb_context *ctx
+    ) {
+  if (ctx->rate <= 0) return nvstusb_status_ok;
+  return nvstusb_set_rate_timed(ctx, ctx->rate, 0);
+}
+
+/* use a timing profile instead of the built-in ones, 0 reverts to them */
+int
+nvstusb_set_profile(
+    struct nvstusb_context *ctx,
+    const struct nvstusb_timing_profile *profile
+    ) {
+  assert(ctx != 0);
+
+  ctx->has_profile = 0 != profile;
+  if (0 != profile) ctx->profile = *profile;
+  return nvstusb_reprogram(ctx);
+}
+
+/* prefer the profiles in a file to the built-in ones, 0 drops them */
+int
+nvstusb_load_profiles(
+    struct nvstusb_context *ctx,
+    const char *path
+    ) {
+  assert(ctx != 0);
+
+  if (0 == path) {
+    ctx->num_loaded = 0;
+    return nvstusb_reprogram(ctx);
+  }
+
+  struct nvstusb_timing_profile loaded[NVSTUSB_TIMING_MAX_PROFILES];
+  int count = nvstusb_timing_read_profiles(path, loaded, NVSTUSB_TIMING_MAX_PROFILES);
+  if (count < 0) return nvstusb_status_error;
+
+  memcpy(ctx->loaded, loaded, count * sizeof(loaded[0]));
+  ctx->num_loaded = count;
+  return nvstusb_reprogram(ctx);
+}
+
+/* fraction of each frame the shutter is open, 0 reverts to the profile */
+int
+nvstusb_set_duty_cycle(
+    struct nvstusb_context *ctx,
+    float duty
+    ) {
+  assert(ctx != 0);
+
+  if (duty < 0 || duty >= 1) return nvstusb_status_error;
+  ctx->duty = duty;
+  return nvstusb_reprogram(ctx);
 }
 
 /* set controller refresh rate (should be monitor refresh rate) */
@@ -176,186 +953,934 @@ nvstusb_set_rate(
     struct nvstusb_context *ctx,
     float rate
     ) {
+  nvstusb_set_rate_timed(ctx, rate, 0);
+}
+
+/* set controller refresh rate, all four writes within budget_us */
+int
+nvstusb_set_rate_timed(
+    struct nvstusb_context *ctx,
+    float rate,
+    unsigned int budget_us
+    ) {
   assert(ctx != 0);
   assert(ctx->device != 0);
-  assert(rate > 60);
+
+  int64_t deadline = nvstusb_deadline(ctx, budget_us);
+  int res;
 
   /* send some magic data to device, this function is mainly black magic */
 
-  /* some timing voodoo */
-  int32_t frameTime   = (1000000.0/rate);     /* 8.33333 ms if 120 Hz */
-  int32_t activeTime  = 2080;                 /* 2.08000 ms time each eye is on*/
+  /* some timing voodoo, at 120 Hz: 
+   * w = 4.56850 ms, x = 4.77425 ms, y = 2.08 ms time each eye is on,
+   * z = 8.33333 ms frame time */
+  struct nvstusb_timing timing;
+  if (!nvstusb_get_timing(ctx, rate, &timing)) return nvstusb_status_error;
+
+  int32_t w = timing.w;
+  int32_t x = timing.x;
+  int32_t y = timing.y;
+  int32_t z = timing.z;
+
+  /* the registers are staged and sent together, only bytes that
+   * differ from what the controller already holds go over the bus */
+
+  /* to address 0x2007 (0x2007+0x00) = ??, 24 bytes */
+  uint8_t regTimings[] = { 
+
+    /* original: e1 29 ff ff (-54815; -55835) */
+    w, w>>8, w>>16, w>>24,    /* 2007: ?? some timer 2 counter, 1020 is subtracted from this
+                               *       loaded at startup with:
+                               *       0x44 0xEC 0xFE 0xFF (-70588(-1020)) */ 
+    /* original: 68 b5 ff ff (-19096), 4.774 ms */
+    x, x>>8, x>>16, x>>24,    /* 200b: ?? counter saved at long at address 0x4f
+                               *       increased at timer 0 interrupt if bit 20h.1 
+                               *       is cleared, on overflow
+                               *       to 0 the code at 0x03c8 is executed.
+                               *       timer 0 will be started with this value
+                               *       by timer2 */
+
+    /* original: 81 df ff ff (-8319), 2.08 ms */
+    y, y>>8, y>>16, y>>24,    /* 200f: ?? counter saved at long at address 0x4f, 784 is added to this
+                               *       if PD1 is set, delay until turning eye off? */
+
+    /* wave forms to send via IR: */
+    0x30,                     /* 2013: 110000 PD1=0, PD2=0: left eye off  */
+    0x28,                     /* 2014: 101000 PD1=1, PD2=0: left eye on   */
+    0x24,                     /* 2015: 100100 PD1=0, PD2=1: right eye off */
+    0x22,                     /* 2016: 100010 PD1=1, PD2=1: right eye on  */
+
+    /* ?? used when frameState is != 2, for toggling bits in Port B,
+     * values seem to have no influence on the glasses or infrared signals */
+    0x0a,                     /* 2017: 1010 */
+    0x08,                     /* 2018: 1000 */
+    0x05,                     /* 2019: 0101 */
+    0x04,                     /* 201a: 0100 */
+
+    z, z>>8, z>>16, z>>24     /* 201b: timer 2 reload value */
+  }; 
+  nvstusb_regs_stage(&ctx->regs, 0x00, regTimings, sizeof(regTimings));
+
+  /* to address 0x2023 (0x2007+0x1c) = ??, 2 bytes */
+  uint8_t reg0x1c[] = {
+    0x02, 0x00              /* ?? seems to be the start value of some 
+                               counter. runs up to 6, some things happen
+                               when it is lower, that will stop if when
+                               it reaches 6. could be the index to 6 byte values 
+                               at 0x17ce that are loaded into TH0*/
+  };
+  nvstusb_regs_stage(&ctx->regs, 0x1c, reg0x1c, sizeof(reg0x1c));
+
+  /* wait at most 2 seconds before going into idle */
+  uint16_t timeout = rate * 4;  
+
+  /* to address 0x2025 (0x2007+0x1e) = timeout, 2 bytes */
+  uint8_t regTimeout[] = {
+    timeout, timeout>>8     /* idle timeout (number of frames) */
+  };
+  nvstusb_regs_stage(&ctx->regs, 0x1e, regTimeout, sizeof(regTimeout));
+
+  /* to address 0x2022 (0x2007+0x1b) = ??, 1 byte */
+  uint8_t reg0x1b[] = {
+    0x07                    /* ?? compared with byte at 0x29 in TD_Poll()
+                               bit 0-1: index to a table of 4 bytes at 0x17d4 (0x00,0x08,0x04,0x0C),
+                               PB1 is set in TD_Poll() if this index is 0, cleared otherwise
+                               bit 2:   set bool21_4, start timer 1, enable ext. int. 5
+                               bit 3:   PC1 is set to the inverted value of this bit in TD_Poll()
+                               bit 4-5: index to a table of 4 bytes at 0x2a 
+                               bit 6:   restart t0 on some conditions in TD_Poll()
+                             */
+  };
+  nvstusb_regs_stage(&ctx->regs, 0x1b, reg0x1b, sizeof(reg0x1b));
+
+  res = nvstusb_flush_regs(ctx, deadline);
+  if (res < 0) return res;
+
+  ctx->rate = rate;
+  ctx->timing = timing;
+  ctx->drift_anchor = 0;
+  ctx->measured_rate = 0.0;
+
+  /* a virtual vblank following the controller rate */
+  if (ctx->vblank_method == nvstusb_vblank_timer && 0 == ctx->timer_rate) {
+    nvstusb_vtimer_set_rate(&ctx->vtimer, rate);
+  }
+  return nvstusb_status_ok;
+}
+
+/* reprogram only the timer 2 reload value (0x201b) for a new rate */
+static int
+nvstusb_set_timer_reload(
+    struct nvstusb_context *ctx,
+    float rate,
+    int64_t deadline
+    ) {
+  struct nvstusb_timing timing;
+  if (!nvstusb_get_timing(ctx, rate, &timing)) return nvstusb_status_error;
+
+  int32_t z = timing.z;
+
+  /* to address 0x201b (0x2007+0x14) = timer 2 reload */
+  uint8_t regReload[] = {
+    z, z>>8, z>>16, z>>24
+  };
+  nvstusb_regs_stage(&ctx->regs, 0x14, regReload, sizeof(regReload));
+
+  int res = nvstusb_flush_regs(ctx, deadline);
+  if (res < 0) return res;
+
+  /* only z and the eye delay follow the rate, the rest stays */
+  ctx->rate = rate;
+  ctx->timing.z = timing.z;
+  ctx->timing.r = timing.r;
+  return nvstusb_status_ok;
+}
+
+/* refresh rate of the display, 0 if it could not be detected */
+float
+nvstusb_detect_rate(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+  return nvstusb_display_detect_rate(ctx->output);
+}
+
+/* select the output (RandR name or DRM connector "card0-DP-2") whose
+ * vblank the emitter follows, 0 selects the primary output */
+int
+nvstusb_select_output(
+    struct nvstusb_context *ctx,
+    const char *name
+    ) {
+  assert(ctx != 0);
+
+  struct nvstusb_display_output out;
+  if (!nvstusb_display_find_output(name, &out)) return nvstusb_status_error;
+
+  free(ctx->output);
+  ctx->output = name ? strdup(name) : 0;
+  ctx->drm_card = out.drm_card;
+  ctx->drm_pipe = out.drm_pipe;
+
+  /* the NVIDIA driver syncs GL contexts created from now on to this
+   * device, unless the user already chose one */
+  if (0 != name && 0 != strncmp(name, "card", 4)) {
+    setenv("__GL_SYNC_DISPLAY_DEVICE", name, 0);
+  }
+  NVSTUSB_LOG(nvstusb_log_info, "syncing to output %s at %d,%d", name ? name : "(primary)", out.x, out.y);
+
+  /* follow the new output's rate if it was detected automatically */
+  if (ctx->track_drift && out.rate > NVSTUSB_RATE_MIN) {
+    return nvstusb_set_rate_timed(ctx, out.rate, 0);
+  }
+  return nvstusb_status_ok;
+}
+
+/* position of the selected output, windows used for vblank syncing
+ * should be placed there */
+int
+nvstusb_get_output_position(
+    struct nvstusb_context *ctx,
+    int *x,
+    int *y
+    ) {
+  assert(ctx != 0);
+
+  struct nvstusb_display_output out;
+  if (!nvstusb_display_find_output(ctx->output, &out)) return nvstusb_status_error;
+
+  *x = out.x;
+  *y = out.y;
+  return nvstusb_status_ok;
+}
+
+/* detect refresh rate, program it and follow its drift */
+int
+nvstusb_set_rate_auto(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+
+  float rate = nvstusb_detect_rate(ctx);
+  if (rate <= NVSTUSB_RATE_MIN) return nvstusb_status_error;
+
+  NVSTUSB_LOG(nvstusb_log_info, "detected refresh rate %f Hz", rate);
+  int res = nvstusb_set_rate_timed(ctx, rate, 0);
+  if (res < 0) return res;
+
+  ctx->track_drift = true;
+  return nvstusb_status_ok;
+}
+
+/* enable or disable drift tracking, threshold_ppm = 0 uses the default */
+void
+nvstusb_set_drift_tracking(
+    struct nvstusb_context *ctx,
+    int enable,
+    float threshold_ppm
+    ) {
+  assert(ctx != 0);
+  ctx->track_drift = enable;
+  ctx->drift_ppm = threshold_ppm > 0 ? threshold_ppm : NVSTUSB_DRIFT_PPM;
+  ctx->drift_anchor = 0;
+}
+
+/* refresh rate measured from the vblank timestamps, 0 if not known yet */
+float
+nvstusb_get_measured_rate(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+  return ctx->measured_rate;
+}
+
+/* measure the real vblank period and follow it if it drifted away from
+ * the programmed rate. Single timestamps jitter, so the period is taken
+ * over a whole window of frames. */
+static void
+nvstusb_track_vblank(
+    struct nvstusb_context *ctx,
+    int64_t vblank,
+    int64_t deadline
+    ) {
+  if (!ctx->track_drift || ctx->rate <= 0) return;
+
+  if (0 == ctx->drift_anchor) {
+    ctx->drift_anchor = ctx->drift_last = vblank;
+    ctx->drift_frames = 0;
+    return;
+  }
+
+  /* number of frames since the last swap (2 in quad buffer mode) */
+  double period = 1e6/ctx->rate;
+  int frames = (int)((vblank - ctx->drift_last)/period + 0.5);
+  ctx->drift_last = vblank;
+  if (frames < 1 || frames > 8) {
+    /* not waiting for vblank or stalled, start over */
+    ctx->drift_anchor = vblank;
+    ctx->drift_frames = 0;
+    return;
+  }
+
+  ctx->drift_frames += frames;
+  if (ctx->drift_frames < NVSTUSB_DRIFT_FRAMES) return;
+
+  ctx->measured_rate = ctx->drift_frames*1e6/(vblank - ctx->drift_anchor);
+  ctx->drift_anchor = vblank;
+  ctx->drift_frames = 0;
+
+  float ppm = fabs(ctx->measured_rate - ctx->rate)/ctx->rate*1e6;
+  if (ppm > ctx->drift_ppm) {
+    nvstusb_set_timer_reload(ctx, ctx->measured_rate, deadline);
+  }
+}
+
+void
+nvstusb_invert_eyes(
+    struct nvstusb_context *ctx
+    ) {
+  ctx->invert_eyes = !ctx->invert_eyes;
+
+  if (0 != ctx->state) {
+    nvstusb_state_begin(ctx->state)->inverted = ctx->invert_eyes;
+    nvstusb_state_end(ctx->state);
+  }
+}
+
+/* set currently open eye, the command is dropped if it cannot
+ * be sent before deadline */
+static int
+nvstusb_set_eye(
+    struct nvstusb_context *ctx,
+    enum nvstusb_eye eye,
+    int64_t deadline
+    ) {
+  assert(ctx != 0);
+  assert(ctx->device != 0);
+  assert(eye == nvstusb_left || eye == nvstusb_right || eye == nvstusb_quad);
+  uint32_t r;
+
+  //#define FF_TEST_R
+#ifdef FF_TEST_R
+  static int i = 0;
+  i++;
+  static int j = 0;
+  static uint32_t r_tmp = NVSTUSB_T2_COUNT(0);;
+
+  if(ctx->toggled3D) {
+    r = r_tmp;
+  } else {
+    r = NVSTUSB_T2_COUNT((1e6/ctx->rate)/1.8);
+  }
+
+  if(i%32 == 0) {
+    if(ctx->toggled3D) {
+      r_tmp -= 500;
+    }
+
+    if(((int)r_tmp) < NVSTUSB_T2_COUNT((1e6/ctx->rate))) {
+      r_tmp = NVSTUSB_T2_COUNT(0);
+    }
+    printf("r:%08x %d %lld %lld\n",r, r,NVSTUSB_T0_US(r), NVSTUSB_T2_US(r));
+  }
+#else
+  r = ctx->timing.r;
+#endif
+
+  switch(eye) {
+  case nvstusb_right:
+  case nvstusb_left:
+    {
+      /* built in place, the backend sends it without a copy */
+      uint8_t *buf = nvstusb_usb_buffer(ctx->device, NVSTUSB_USB_BUFFER_EYE);
+      buf[0] = NVSTUSB_CMD_SET_EYE;                                     /* set shutter state */
+      buf[1] = ((eye==nvstusb_right)^(ctx->invert_eyes))?0xFE:0xFF;     /* eye selection */
+      buf[2] = 0x00;                                                    /* unused */
+      buf[3] = 0x00;
+      buf[4] = r;
+      buf[5] = r>>8;
+      buf[6] = r>>16;
+      buf[7] = r>>24;
+      NVSTUSB_PROBE2(set_eye, eye, r);
+      int res = nvstusb_write(ctx, 1, buf, 8, deadline);
+      nvstusb_usb_release_buffer(ctx->device, NVSTUSB_USB_BUFFER_EYE);
+      return res;
+    }
+  case nvstusb_quad:
+    {
+      int res = nvstusb_set_eye(ctx, nvstusb_right, deadline);
+      if (res < 0) return res;
+      return nvstusb_set_eye(ctx, nvstusb_left, deadline);
+    }
+  }
+  return nvstusb_status_error;
+}
+
+/* deadline of an eye command issued for the vblank at time vblank:
+ * it has to arrive before the following vblank and within the budget */
+static int64_t
+nvstusb_eye_deadline(
+    struct nvstusb_context *ctx,
+    int64_t vblank,
+    int64_t deadline
+    ) {
+  if (ctx->rate <= 0) return deadline;
+
+  int64_t next = vblank + (int64_t)(1e6/ctx->rate) - NVSTUSB_EYE_MARGIN_US;
+  if (0 == deadline || next < deadline) return next;
+  return deadline;
+}
+
+/* vblank counter (msc) of a vblank, derived from the time since the
+ * last one if the vblank source has no counter */
+static int64_t
+nvstusb_vblank_msc(
+    struct nvstusb_context *ctx,
+    int64_t vblank
+    ) {
+  if (!ctx->msc_valid) return 0;
+  if (ctx->rate <= 0) return ctx->msc + (ctx->last_eye == nvstusb_quad ? 2 : 1);
+
+  double period = 1e6/(ctx->measured_rate > 0 ? ctx->measured_rate : ctx->rate);
+  return ctx->msc + (int64_t)floor((vblank - ctx->last_vblank)/period + 0.5);
+}
+
+/* true if eye belongs to vblank msc: left and right alternate with the
+ * vblank parity seen on the first swap */
+int
+nvstusb_eye_in_phase(
+    struct nvstusb_context *ctx,
+    enum nvstusb_eye eye,
+    int64_t msc
+    ) {
+  if (eye == nvstusb_quad || ctx->eye_phase < 0) return true;
+  return ((msc + (eye == nvstusb_right)) & 1) == ctx->eye_phase;
+}
+
+/* compare the vblank counter with the previous swap: skipped vblanks
+ * and frames shown twice put the eyes out of phase with the vblanks */
+static void
+nvstusb_track_msc(
+    struct nvstusb_context *ctx,
+    enum nvstusb_eye eye,
+    int64_t msc
+    ) {
+  ctx->stats.swaps++;
+
+  if (ctx->msc_valid) {
+    int64_t expected = ctx->msc + (eye == nvstusb_quad ? 2 : 1);
+    if (msc > expected) {
+      ctx->stats.skipped_vblanks += msc - expected;
+    } else if (msc < expected) {
+      ctx->stats.duplicated_frames++;
+    }
+  }
+
+  if (eye != nvstusb_quad) {
+    if (ctx->eye_phase >= 0 && !nvstusb_eye_in_phase(ctx, eye, msc)) {
+      /* the eye passed is the one on screen, follow it */
+      ctx->stats.resyncs++;
+      ctx->resync = true;
+    }
+    ctx->eye_phase = (msc + (eye == nvstusb_right)) & 1;
+  }
+
+  ctx->msc = msc;
+  ctx->msc_valid = true;
+}
+
+/* send eye command for the vblank at time vblank (us) with counter msc
+ * (-1 if not known), a command that can not arrive in time is dropped
+ * instead of blocking the caller, unless the eye phase has to be resent */
+static int
+nvstusb_send_eye_at(
+    struct nvstusb_context *ctx,
+    enum nvstusb_eye eye,
+    int64_t vblank,
+    int64_t msc,
+    int64_t deadline
+    ) {
+  nvstusb_track_msc(ctx, eye, msc >= 0 ? msc : nvstusb_vblank_msc(ctx, vblank));
+
+  int64_t eye_deadline = ctx->resync ? deadline : nvstusb_eye_deadline(ctx, vblank, deadline);
+
+  int res = nvstusb_set_eye(ctx, eye, eye_deadline);
+  if (res == nvstusb_status_timeout && eye_deadline != deadline) {
+    /* it was the vblank that ran out, not the budget */
+    res = nvstusb_status_dropped;
+  }
+
+  /* the controller runs on with the old phase until an eye arrives */
+  if (res == nvstusb_status_ok) {
+    ctx->resync = false;
+  } else if (res == nvstusb_status_dropped || res == nvstusb_status_timeout) {
+    ctx->stats.dropped_eyes++;
+    ctx->resync = true;
+  }
+
+  ctx->last_vblank = vblank;
+  ctx->last_eye = eye;
+
+  if (0 != ctx->state) {
+    struct nvstusb_state *state = nvstusb_state_begin(ctx->state);
+    state->eye = eye;
+    state->vblank_us = vblank;
+    nvstusb_state_end(ctx->state);
+  }
+  nvstusb_track_vblank(ctx, vblank, deadline);
+  return res;
+}
+
+/* send eye command for the vblank that just happened */
+static int
+nvstusb_send_eye(
+    struct nvstusb_context *ctx,
+    enum nvstusb_eye eye,
+    int64_t deadline
+    ) {
+  return nvstusb_send_eye_at(ctx, eye, nvstusb_time_us(), -1, deadline);
+}
+
+/* send the eye for a vblank the caller waited for itself */
+int
+nvstusb_send_eye_vblank(
+    struct nvstusb_context *ctx,
+    enum nvstusb_eye eye,
+    uint64_t vblank_us,
+    int64_t msc,
+    unsigned int budget_us
+    ) {
+  assert(ctx != 0);
+  assert(ctx->device != 0);
+
+  int64_t deadline = nvstusb_deadline(ctx, budget_us);
+  return nvstusb_send_eye_at(ctx, eye, vblank_us ? (int64_t)vblank_us : nvstusb_time_us(), msc, deadline);
+}
+
+/* swap statistics since init or the last reset */
+void
+nvstusb_get_stats(
+    struct nvstusb_context *ctx,
+    struct nvstusb_stats *stats
+    ) {
+  assert(ctx != 0);
+  *stats = ctx->stats;
+}
+
+void
+nvstusb_reset_stats(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+}
+
+/* usb transfer counters per endpoint */
+int
+nvstusb_get_usb_stats(
+    struct nvstusb_context *ctx,
+    struct nvstusb_endpoint_stats *stats,
+    int max
+    ) {
+  assert(ctx != 0);
+  return nvstusb_usb_get_stats(ctx->device, stats, max);
+}
+
+void
+nvstusb_reset_usb_stats(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+  nvstusb_usb_reset_stats(ctx->device);
+}
+
+/* write the usb counters to a file periodically, path 0 stops */
+int
+nvstusb_export_usb_stats(
+    struct nvstusb_context *ctx,
+    const char *path,
+    unsigned int interval_ms
+    ) {
+  assert(ctx != 0);
+
+  nvstusb_usbstats_stop(ctx->usbstats);
+  ctx->usbstats = 0;
+  if (0 == path) return nvstusb_status_ok;
+
+  ctx->usbstats = nvstusb_usbstats_start(ctx->device, path, interval_ms);
+  if (0 == ctx->usbstats) return nvstusb_status_error;
+  NVSTUSB_LOG(nvstusb_log_info, "Writing usb counters to %s", path);
+  return nvstusb_status_ok;
+}
+
+/* publish keys, eye and vblank in a shared page for other processes */
+int
+nvstusb_publish_state(
+    struct nvstusb_context *ctx,
+    const char *path
+    ) {
+  assert(ctx != 0);
+
+  nvstusb_state_destroy(ctx->state);
+  ctx->state = nvstusb_state_create(path);
+  if (0 == ctx->state) return nvstusb_status_error;
+
+  struct nvstusb_state *state = nvstusb_state_begin(ctx->state);
+  state->eye = ctx->last_eye;
+  state->inverted = ctx->invert_eyes;
+  state->vblank_us = ctx->last_vblank;
+  nvstusb_state_end(ctx->state);
+  return nvstusb_status_ok;
+}
+
+/* choose how nvstusb_swap waits for vblank */
+int
+nvstusb_set_vblank_method(
+    struct nvstusb_context *ctx,
+    enum nvstusb_vblank_method method
+    ) {
+  assert(ctx != 0);
+
+  switch (method) {
+  case nvstusb_vblank_video_sync:
+    if (NULL == glXWaitVideoSyncSGI) return nvstusb_status_error;
+    break;
+  case nvstusb_vblank_swap_interval:
+    if (NULL == glXSwapIntervalSGI) return nvstusb_status_error;
+    break;
+  case nvstusb_vblank_timer:
+    if (0 == ctx->timer_rate) nvstusb_vtimer_set_rate(&ctx->vtimer, ctx->rate);
+    break;
+  case nvstusb_vblank_readpixels:
+  case nvstusb_vblank_external:
+    break;
+  default:
+    return nvstusb_status_error;
+  }
+  ctx->vblank_method = method;
+  return nvstusb_status_ok;
+}
+
+enum nvstusb_vblank_method
+nvstusb_get_vblank_method(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+  return ctx->vblank_method;
+}
+
+/* drive nvstusb_swap from a timer at rate Hz, 0 follows nvstusb_set_rate */
+int
+nvstusb_set_timer_vblank(
+    struct nvstusb_context *ctx,
+    float rate
+    ) {
+  assert(ctx != 0);
+
+  if (rate < 0 || (rate > 0 && (rate < NVSTUSB_RATE_MIN || rate > NVSTUSB_RATE_MAX))) {
+    NVSTUSB_LOG(nvstusb_log_error, "timer rate %f Hz out of range", rate);
+    return nvstusb_status_error;
+  }
+  ctx->timer_rate = rate;
+  nvstusb_vtimer_set_rate(&ctx->vtimer, rate > 0 ? rate : ctx->rate);
+  ctx->vblank_method = nvstusb_vblank_timer;
+  return nvstusb_status_ok;
+}
+
+/* an external vblank happened at timestamp_ns (CLOCK_MONOTONIC), the
+ * timer slews its phase and adjusts its period towards it */
+void
+nvstusb_sync_vblank(
+    struct nvstusb_context *ctx,
+    uint64_t timestamp_ns
+    ) {
+  assert(ctx != 0);
+  nvstusb_vtimer_sync(&ctx->vtimer, timestamp_ns);
+}
+
+/* max phase correction per frame, 0 restores the default */
+void
+nvstusb_set_vblank_slew(
+    struct nvstusb_context *ctx,
+    float slew_us
+    ) {
+  assert(ctx != 0);
+  nvstusb_vtimer_set_slew(&ctx->vtimer, slew_us);
+}
 
-  int32_t w = NVSTUSB_T2_COUNT(4568.50);      /* 4.56800 ms */
-  int32_t x = NVSTUSB_T0_COUNT(4774.25);      /* 4.77425 ms */
-  int32_t y = NVSTUSB_T0_COUNT(activeTime);
-  int32_t z = NVSTUSB_T2_COUNT(frameTime);    
 
-  uint8_t cmdTimings[] = { 
-    NVSTUSB_CMD_WRITE,      /* write data */
-    0x00,                   /* to address 0x2007 (0x2007+0x00) = ?? */
-    0x18, 0x00,             /* 24 bytes follow */
+/* perform swap and toggle eyes hopefully with correct timing */
+void
+nvstusb_swap(
+    struct nvstusb_context *ctx,
+    enum nvstusb_eye eye,
+    void (*swapfunc)()
+    ) {
+  nvstusb_swap_timed(ctx, eye, swapfunc, 0);
+}
 
-    /* original: e1 29 ff ff (-54815; -55835) */
-    w, w>>8, w>>16, w>>24,    /* 2007: ?? some timer 2 counter, 1020 is subtracted from this
-                               *       loaded at startup with:
-                               *       0x44 0xEC 0xFE 0xFF (-70588(-1020)) */ 
-    /* original: 68 b5 ff ff (-19096), 4.774 ms */
-    x, x>>8, x>>16, x>>24,    /* 200b: ?? counter saved at long at address 0x4f
-                               *       increased at timer 0 interrupt if bit 20h.1 
-                               *       is cleared, on overflow
-                               *       to 0 the code at 0x03c8 is executed.
-                               *       timer 0 will be started with this value
-                               *       by timer2 */
+/* time between the vblanks of consecutive swaps */
+static float
+nvstusb_swap_period(
+    struct nvstusb_context *ctx
+    ) {
+  float rate = ctx->measured_rate > 0 ? ctx->measured_rate : ctx->rate;
+  if (rate <= 0) return 0;
+  return (ctx->last_eye == nvstusb_quad ? 2 : 1) * 1e6/rate;
+}
 
-    /* original: 81 df ff ff (-8319), 2.08 ms */
-    y, y>>8, y>>16, y>>24,    /* 200f: ?? counter saved at long at address 0x4f, 784 is added to this
-                               *       if PD1 is set, delay until turning eye off? */
+/* perform swap and predict when the frame is shown and the next is due */
+int
+nvstusb_swap_paced(
+    struct nvstusb_context *ctx,
+    enum nvstusb_eye eye,
+    void (*swapfunc)(),
+    struct nvstusb_frame_timing *timing
+    ) {
+  int res = nvstusb_swap_timed(ctx, eye, swapfunc, 0);
+  if (0 == timing) return res;
 
-    /* wave forms to send via IR: */
-    0x30,                     /* 2013: 110000 PD1=0, PD2=0: left eye off  */
-    0x28,                     /* 2014: 101000 PD1=1, PD2=0: left eye on   */
-    0x24,                     /* 2015: 100100 PD1=0, PD2=1: right eye off */
-    0x22,                     /* 2016: 100010 PD1=1, PD2=1: right eye on  */
+  float period = nvstusb_swap_period(ctx);
+  int64_t vblank = ctx->last_vblank;
+  int64_t present = vblank;
 
-    /* ?? used when frameState is != 2, for toggling bits in Port B,
-     * values seem to have no influence on the glasses or infrared signals */
-    0x0a,                     /* 2017: 1010 */
-    0x08,                     /* 2018: 1000 */
-    0x05,                     /* 2019: 0101 */
-    0x04,                     /* 201a: 0100 */
+  /* these wait for vblank before swapping, the frame flips at the next one */
+  if (ctx->vblank_method == nvstusb_vblank_video_sync || ctx->vblank_method == nvstusb_vblank_timer) {
+    present += period;
+  }
 
-    z, z>>8, z>>16, z>>24     /* 201b: timer 2 reload value */
-  }; 
-  nvstusb_usb_write_bulk(ctx->device, 2, cmdTimings, sizeof(cmdTimings));
+  timing->vblank_us = vblank;
+  timing->present_us = present;
+  timing->next_deadline_us = vblank + (int64_t)period - NVSTUSB_EYE_MARGIN_US;
+  timing->period_us = period;
+  timing->render_us = ctx->render_cost + NVSTUSB_RENDER_DEVIATIONS * ctx->render_dev;
+  return res;
+}
 
-  uint8_t cmd0x1c[] = {
-    NVSTUSB_CMD_WRITE,      /* write data */
-    0x1c,                   /* to address 0x2023 (0x2007+0x1c) = ?? */
-    0x02, 0x00,             /* 2 bytes follow */
+/* sleep until the latest time rendering of the next frame can start */
+uint64_t
+nvstusb_wait_render(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
 
-    0x02, 0x00              /* ?? seems to be the start value of some 
-                               counter. runs up to 6, some things happen
-                               when it is lower, that will stop if when
-                               it reaches 6. could be the index to 6 byte values 
-                               at 0x17ce that are loaded into TH0*/
-  };
-  nvstusb_usb_write_bulk(ctx->device, 2, cmd0x1c, sizeof(cmd0x1c));
+  float period = nvstusb_swap_period(ctx);
+  if (0 != ctx->last_vblank && period > 0) {
+    int64_t deadline = ctx->last_vblank + (int64_t)period - NVSTUSB_EYE_MARGIN_US;
+    int64_t wake = deadline - ctx->render_margin_us
+      - (int64_t)(ctx->render_cost + NVSTUSB_RENDER_DEVIATIONS * ctx->render_dev);
+
+    /* that deadline passed already, aim at the one after */
+    int64_t now = nvstusb_time_us();
+    while (deadline < now) {
+      deadline += period;
+      wake += period;
+    }
 
-  /* wait at most 2 seconds before going into idle */
-  uint16_t timeout = rate * 4;  
+    if (wake > now) {
+      struct timespec ts = { wake / 1000000, (wake % 1000000) * 1000 };
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+    }
+  }
 
-  uint8_t cmdTimeout[] = {
-    NVSTUSB_CMD_WRITE,      /* write data */
-    0x1e,                   /* to address 0x2025 (0x2007+0x1e) = timeout */
-    0x02, 0x00,             /* 2 bytes follow */
+  ctx->render_start = nvstusb_time_us();
+  return ctx->render_start;
+}
 
-    timeout, timeout>>8     /* idle timeout (number of frames) */
-  };
-  nvstusb_usb_write_bulk(ctx->device, 2, cmdTimeout, sizeof(cmdTimeout));
+/* time kept free between the end of rendering and the deadline */
+void
+nvstusb_set_render_margin(
+    struct nvstusb_context *ctx,
+    unsigned int margin_us
+    ) {
+  assert(ctx != 0);
+  ctx->render_margin_us = margin_us;
+}
 
-  uint8_t cmd0x1b[] = {
-    NVSTUSB_CMD_WRITE,      /* write data */
-    0x1b,                   /* to address 0x2022 (0x2007+0x1b) = ?? */
-    0x01, 0x00,             /* 1 byte follows */
+/* swap with one method and record the cadence */
+static void
+nvstusb_measure_vblank(
+    struct nvstusb_context *ctx,
+    enum nvstusb_vblank_method method,
+    unsigned int frames,
+    void (*swapfunc)(),
+    float period,
+    struct nvstusb_vblank_result *result
+    ) {
+  int saved_method = ctx->vblank_method;
+  bool saved_drift = ctx->track_drift;
+  ctx->vblank_method = method;
+  ctx->track_drift = false;
+
+  double sum = 0.0, sumsq = 0.0;
+  int64_t last = 0;
+  unsigned int i;
+
+  result->method = method;
+  result->available = 1;
+  result->frames = 0;
+  result->missed = 0;
+
+  for (i = 0; i < NVSTUSB_CALIBRATE_WARMUP + frames; i++) {
+    nvstusb_swap_timed(ctx, (i & 1) ? nvstusb_right : nvstusb_left, swapfunc, 0);
+    int64_t now = nvstusb_time_us();
+    if (i >= NVSTUSB_CALIBRATE_WARMUP) {
+      double interval = now - last;
+      sum += interval;
+      sumsq += interval*interval;
+      result->frames++;
+
+      /* an interval spanning n periods skipped n-1 vblanks */
+      if (period > 0) {
+        int n = (int)(interval/period + 0.5);
+        if (n > 1) result->missed += n - 1;
+      }
+    }
+    last = now;
+  }
 
-    0x07                    /* ?? compared with byte at 0x29 in TD_Poll()
-                               bit 0-1: index to a table of 4 bytes at 0x17d4 (0x00,0x08,0x04,0x0C),
-                               PB1 is set in TD_Poll() if this index is 0, cleared otherwise
-                               bit 2:   set bool21_4, start timer 1, enable ext. int. 5
-                               bit 3:   PC1 is set to the inverted value of this bit in TD_Poll()
-                               bit 4-5: index to a table of 4 bytes at 0x2a 
-                               bit 6:   restart t0 on some conditions in TD_Poll()
-                             */
-  };
-  nvstusb_usb_write_bulk(ctx->device, 2, cmd0x1b, sizeof(cmd0x1b));
+  result->mean_us = sum / result->frames;
+  result->jitter_us = sqrt(fmax(0.0, sumsq / result->frames - result->mean_us*result->mean_us));
 
-  ctx->rate = rate;
+  ctx->vblank_method = saved_method;
+  ctx->track_drift = saved_drift;
 }
 
-void
-nvstusb_invert_eyes(
-    struct nvstusb_context *ctx
+/* GPU, driver and output the calibration is valid for */
+static void
+nvstusb_calibrate_key(
+    struct nvstusb_context *ctx,
+    char *key,
+    size_t size
     ) {
-  ctx->invert_eyes = !ctx->invert_eyes;
+  const char *vendor   = (const char *)glGetString(GL_VENDOR);
+  const char *renderer = (const char *)glGetString(GL_RENDERER);
+  const char *version  = (const char *)glGetString(GL_VERSION);
+  snprintf(key, size, "%s|%s|%s|%s",
+    vendor ? vendor : "?", renderer ? renderer : "?", version ? version : "?",
+    ctx->output ? ctx->output : "(primary)");
 }
 
-/* set currently open eye */
-static void
-nvstusb_set_eye(
+/* measure the vblank methods and select the best one */
+int
+nvstusb_calibrate_vblank(
     struct nvstusb_context *ctx,
-    enum nvstusb_eye eye
+    unsigned int frames,
+    void (*swapfunc)(),
+    int use_cache
     ) {
   assert(ctx != 0);
-  assert(ctx->device != 0);
-  assert(eye == nvstusb_left || eye == nvstusb_right || eye == nvstusb_quad);
-  uint32_t r;
 
-  //#define FF_TEST_R
-#ifdef FF_TEST_R
-  static int i = 0;
-  i++;
-  static int j = 0;
-  static uint32_t r_tmp = NVSTUSB_T2_COUNT(0);;
+  char key[768];
+  nvstusb_calibrate_key(ctx, key, sizeof(key));
 
-  if(ctx->toggled3D) {
-    r = r_tmp;
-  } else {
-    r = NVSTUSB_T2_COUNT((1e6/ctx->rate)/1.8);
+  struct nvstusb_vblank_result *results = ctx->vblank_results;
+  if (use_cache && nvstusb_calibrate_load(key, &results[0])) {
+    ctx->num_vblank_results = 1;
+    ctx->vblank_method = results[0].method;
+    NVSTUSB_LOG(nvstusb_log_info, "cached vblank method %d", ctx->vblank_method);
+    return nvstusb_status_ok;
   }
 
-  if(i%32 == 0) {
-    if(ctx->toggled3D) {
-      r_tmp -= 500;
-    }
+  if (0 == frames) frames = NVSTUSB_CALIBRATE_FRAMES;
 
-    if(((int)r_tmp) < NVSTUSB_T2_COUNT((1e6/ctx->rate))) {
-      r_tmp = NVSTUSB_T2_COUNT(0);
-    }
-    printf("r:%08x %d %lld %lld\n",r, r,NVSTUSB_T0_US(r), NVSTUSB_T2_US(r));
-  }
-#else
-  r = NVSTUSB_T2_COUNT((1e6/ctx->rate)/1.8);
-#endif
+  /* vblanks are counted against the display rate */
+  float rate = ctx->rate > 0 ? ctx->rate : nvstusb_display_detect_rate(ctx->output);
+  float period = rate > 0 ? 1e6/rate : 0;
 
-  switch(eye) {
-  case nvstusb_right:
-  case nvstusb_left:
-    {
-      uint8_t buf[8] = { 
-        NVSTUSB_CMD_SET_EYE,      /* set shutter state */
-        ((eye==nvstusb_right)^(ctx->invert_eyes))?0xFE:0xFF,        /* eye selection */
-        0x00, 0x00,               /* unused */
-        r, r>>8, r>>16, r>>24
-      };
-      nvstusb_usb_write_bulk(ctx->device, 1, buf, 8);		
-    }
-    break;
-  case nvstusb_quad:
-    {
-      nvstusb_set_eye(ctx, nvstusb_right);
-      nvstusb_set_eye(ctx, nvstusb_left);
+  /* the swap interval set by its method stays in effect, so it is
+   * measured first and the others are measured the way they will run */
+  static const enum nvstusb_vblank_method order[nvstusb_vblank_timer] = {
+    nvstusb_vblank_swap_interval,
+    nvstusb_vblank_readpixels,
+    nvstusb_vblank_video_sync,
+    nvstusb_vblank_external,
+  };
+
+  int best = -1;
+  float best_score = 0;
+  int i;
+  for (i = 0; i < nvstusb_vblank_timer; i++) {
+    enum nvstusb_vblank_method m = order[i];
+    struct nvstusb_vblank_result *result = &results[m];
+    memset(result, 0, sizeof(*result));
+    result->method = m;
+
+    /* only when the driver syncs swaps itself */
+    if (m == nvstusb_vblank_external && !getenv("__GL_SYNC_TO_VBLANK")) continue;
+    if (m == nvstusb_vblank_video_sync && NULL == glXWaitVideoSyncSGI) continue;
+    if (m == nvstusb_vblank_swap_interval && NULL == glXSwapIntervalSGI) continue;
+
+    nvstusb_measure_vblank(ctx, m, frames, swapfunc, period, result);
+    NVSTUSB_LOG(nvstusb_log_info, "vblank method %d: mean %.1f us, jitter %.1f us, %u missed",
+      m, result->mean_us, result->jitter_us, result->missed);
+
+    /* a missed vblank costs a whole frame */
+    float score = result->jitter_us + (period > 0 ? period : result->mean_us) * result->missed / result->frames;
+    if (best < 0 || score < best_score) {
+      best = m;
+      best_score = score;
     }
-    break;
   }
+  ctx->num_vblank_results = nvstusb_vblank_timer;
+
+  if (best < 0) return nvstusb_status_error;
+
+  ctx->vblank_method = best;
+  NVSTUSB_LOG(nvstusb_log_info, "selected vblank method: %d", best);
+  if (use_cache) nvstusb_calibrate_store(key, &results[best]);
+  return nvstusb_status_ok;
 }
 
+/* results of the last calibration */
+int
+nvstusb_get_vblank_results(
+    struct nvstusb_context *ctx,
+    const struct nvstusb_vblank_result **results
+    ) {
+  assert(ctx != 0);
+  *results = ctx->vblank_results;
+  return ctx->num_vblank_results;
+}
 
-/* perform swap and toggle eyes hopefully with correct timing */
-void
-nvstusb_swap(
+/* perform swap, the eye command is bounded by budget_us from the vblank
+ * (or swap) it follows and by the next vblank */
+int
+nvstusb_swap_timed(
     struct nvstusb_context *ctx,
     enum nvstusb_eye eye,
-    void (*swapfunc)()
+    void (*swapfunc)(),
+    unsigned int budget_us
     ) {
   assert(ctx != 0);
   assert(ctx->device != 0);
   assert(eye == nvstusb_left || eye == nvstusb_right || eye == nvstusb_quad);
+  NVSTUSB_PROBE2(swap_entry, ctx->vblank_method, eye);
+
+  /* the render that led to this swap is over */
+  if (0 != ctx->render_start) {
+    float cost = nvstusb_time_us() - ctx->render_start;
+    float error = cost - ctx->render_cost;
+    ctx->render_cost += NVSTUSB_RENDER_GAIN * error;
+    ctx->render_dev += NVSTUSB_RENDER_GAIN * (fabs(error) - ctx->render_dev);
+    ctx->render_start = 0;
+  }
+
+  /* calibration requested at init, now that a context is current */
+  if (ctx->calibrate_pending) {
+    ctx->calibrate_pending = false;
+    nvstusb_calibrate_vblank(ctx, 0, swapfunc, 1);
+  }
+
+  /* the budget runs from the vblank the command follows, not from
+   * entry: the waits below take up to a frame */
+  int64_t deadline;
+  int res = nvstusb_status_ok;
 
   /* if we have the GLX_SGI_video_sync extension, we just wait
    * for vertical blanking, then issue swap. */
   switch(ctx->vblank_method) {
-  case 0:
+  case nvstusb_vblank_readpixels:
     {
       /* Swap buffers */
       if(swapfunc) {
@@ -368,10 +1893,11 @@ nvstusb_swap(
       uint8_t pixels[4] = { 255, 0, 255, 255 };
       glReadBuffer(GL_FRONT);
       glReadPixels(1,1,1,1,GL_RGB, GL_UNSIGNED_BYTE, pixels);
-      nvstusb_set_eye(ctx, eye);
+      deadline = nvstusb_deadline(ctx, budget_us);
+      res = nvstusb_send_eye(ctx, eye, deadline);
     }
     break;
-  case 1:
+  case nvstusb_vblank_video_sync:
     {
       unsigned int count;
 
@@ -387,10 +1913,19 @@ nvstusb_swap(
         /* Waiting OpenGL sync */
         glXGetVideoSyncSGI(&count);
         glXWaitVideoSyncSGI(2, (count+1)%2, &count);
+
+        /* a vblank was skipped, wait one more to keep the eye on its
+         * vblank parity instead of inverting the eyes */
+        if (!nvstusb_eye_in_phase(ctx, eye, count)) {
+          ctx->stats.resyncs++;
+          glXWaitVideoSyncSGI(2, (count+1)%2, &count);
+        }
       }
 
       /* Change eye */
-      nvstusb_set_eye(ctx, eye);
+      int64_t vblank = nvstusb_time_us();
+      deadline = nvstusb_deadline_from(ctx, budget_us, vblank);
+      res = nvstusb_send_eye_at(ctx, eye, vblank, count, deadline);
 
       /* Swap buffers */
       if(swapfunc) {
@@ -398,7 +1933,7 @@ nvstusb_swap(
       }
     }
     break;
-  case 2:
+  case nvstusb_vblank_external:
     {
       /* case __GL_SYNC_TO_VBLANK is defined */
 
@@ -408,10 +1943,11 @@ nvstusb_swap(
       }
 
       /* Change eye */
-      nvstusb_set_eye(ctx, eye);
+      deadline = nvstusb_deadline(ctx, budget_us);
+      res = nvstusb_send_eye(ctx, eye, deadline);
     }
     break;
-  case 3:
+  case nvstusb_vblank_swap_interval:
     {
       static int i_current_interval = -1;
       int i_interval;
@@ -433,16 +1969,47 @@ nvstusb_swap(
       }
 
       /* Change eye */
-      nvstusb_set_eye(ctx, eye);
+      deadline = nvstusb_deadline(ctx, budget_us);
+      res = nvstusb_send_eye(ctx, eye, deadline);
 
     }
     break;
-  default:
-    fprintf(stderr, "nvstusb: unknown vblank method\n");
-  }
+  case nvstusb_vblank_timer:
+    {
+      /* Waiting timer tick, every second one in quad buffer mode */
+      int64_t tick = nvstusb_vtimer_wait(&ctx->vtimer);
+      if (tick >= 0 && eye == nvstusb_quad) {
+        tick = nvstusb_vtimer_wait(&ctx->vtimer);
+      }
+      if (tick < 0) {
+        NVSTUSB_LOG(nvstusb_log_error, "no rate set for the vblank timer");
+        res = nvstusb_status_error;
+        break;
+      }
 
+      /* keep the eye on its tick parity after a skipped tick */
+      if (eye != nvstusb_quad && !nvstusb_eye_in_phase(ctx, eye, nvstusb_vblank_msc(ctx, tick / 1000))) {
+        ctx->stats.resyncs++;
+        tick = nvstusb_vtimer_wait(&ctx->vtimer);
+      }
+
+      /* Change eye */
+      deadline = nvstusb_deadline_from(ctx, budget_us, tick / 1000);
+      res = nvstusb_send_eye_at(ctx, eye, tick / 1000, -1, deadline);
 
+      /* Swap buffers */
+      if(swapfunc) {
+        swapfunc();
+      }
+    }
+    break;
+  default:
+    NVSTUSB_LOG(nvstusb_log_error, "unknown vblank method");
+    res = nvstusb_status_error;
+  }
 
+  NVSTUSB_PROBE3(swap_exit, ctx->vblank_method, eye, res);
+  return res;
 }
 
 /* get key status from controller */
@@ -451,58 +2018,226 @@ nvstusb_get_keys(
     struct nvstusb_context *ctx,
     struct nvstusb_keys *keys
     ) {
+  nvstusb_get_keys_timed(ctx, keys, 0);
+}
+
+/* get key status from controller within budget_us, keys are
+ * zeroed if the status could not be read */
+int
+nvstusb_get_keys_timed(
+    struct nvstusb_context *ctx,
+    struct nvstusb_keys *keys,
+    unsigned int budget_us
+    ) {
   assert(ctx  != 0);
   assert(keys != 0);
 
-  uint8_t cmd1[] = { 
-    NVSTUSB_CMD_READ |      /* read and clear data */
-      NVSTUSB_CMD_CLEAR,
+  int64_t deadline = nvstusb_deadline(ctx, budget_us);
+  memset(keys, 0, sizeof(*keys));
 
-    0x18,                   /* from address 0x201F (0x2007+0x18) = status? */
-    0x03, 0x00              /* read/clear 3 bytes */
-  };
-  nvstusb_usb_write_bulk(ctx->device, 2, cmd1, sizeof(cmd1));
+  /* read and clear 3 bytes from address 0x201F (0x2007+0x18) = status? */
+  uint8_t status[3];
+  int res = nvstusb_read(ctx, NVSTUSB_CMD_READ | NVSTUSB_CMD_CLEAR, NVSTUSB_REG_STATUS, status, sizeof(status), deadline);
+  if (res < 0) return res;
 
-  uint8_t readBuf[4+cmd1[2]];
-  nvstusb_usb_read_bulk(ctx->device, 4, readBuf, sizeof(readBuf));
+  nvstusb_add_keys(ctx, status);
+  nvstusb_take_keys(ctx, keys);
+  return nvstusb_status_ok;
+}
 
-  /* readBuf[0] contains the offset (0x18),
-   * readBuf[1] contains the number of read bytes (0x03),
-   * readBuf[2] (msb) and readBuf[3] (lsb) of the bytes sent (sizeof(cmd1)) 
-   * readBuf[4] and following contain the requested data */
+/* get key status without waiting: hands out what replies brought in
+ * so far and keeps one status read in flight */
+int
+nvstusb_get_keys_nowait(
+    struct nvstusb_context *ctx,
+    struct nvstusb_keys *keys
+    ) {
+  assert(ctx  != 0);
+  assert(keys != 0);
 
-  /* from address 0x201F:
-   * signed 8 bit integer: amount the wheel was turned without the button pressed
-   */
-  keys->deltaWheel = readBuf[4];
+  if (!ctx->posted_reads) return nvstusb_get_keys_timed(ctx, keys, 0);
 
-  /* from address 0x2020:
-   * signed 8 bit integer: amount the wheel was turned with the button pressed
-   */
-  keys->pressedDeltaWheel = readBuf[5];
+  int res = nvstusb_dispatch_replies(ctx);
+  nvstusb_take_keys(ctx, keys);
+  if (res < 0) return res;
 
-  /* from address 0x2021:
-   * bit 0: front button was pressed since last time (presumably fom pin 4 on port C)
-   * bit 1: logic state of pin 7 on port E
-   * bit 2: logic state of pin 2 on port C
-   */
-  keys->toggled3D  = readBuf[6] & 0x01; 
+  return nvstusb_poll_status(ctx);
+}
 
-  if(keys->toggled3D) {
-    ctx->toggled3D = !ctx->toggled3D;
-  } 
+/* arm the key poll timer of the event descriptor */
+static void
+nvstusb_arm_key_timer(
+    struct nvstusb_context *ctx
+    ) {
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = ctx->key_interval_us / 1000000;
+  its.it_value.tv_nsec = (ctx->key_interval_us % 1000000) * 1000;
+  its.it_interval = its.it_value;
+  timerfd_settime(ctx->key_timer, 0, &its, 0);
+}
+
+/* one descriptor for application event loops */
+int
+nvstusb_get_fd(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+  if (ctx->event_fd >= 0) return ctx->event_fd;
+
+  if (!ctx->posted_reads) {
+    NVSTUSB_LOG(nvstusb_log_warning, "Event loops need posted reads, the backend has none");
+    return -1;
+  }
+  int fd = nvstusb_usb_get_fd(ctx->device);
+  if (fd < 0) {
+    NVSTUSB_LOG(nvstusb_log_warning, "The backend cannot be polled");
+    return -1;
+  }
+
+  int epoll = epoll_create1(EPOLL_CLOEXEC);
+  int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct epoll_event ev[2];
+  memset(ev, 0, sizeof(ev));
+  ev[0].events = EPOLLIN;
+  ev[0].data.fd = fd;
+  ev[1].events = EPOLLIN;
+  ev[1].data.fd = timer;
+  if (epoll < 0 || timer < 0 ||
+      epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev[0]) < 0 ||
+      epoll_ctl(epoll, EPOLL_CTL_ADD, timer, &ev[1]) < 0) {
+    NVSTUSB_LOG(nvstusb_log_error, "Could not create the event descriptor: %s", strerror(errno));
+    if (epoll >= 0) close(epoll);
+    if (timer >= 0) close(timer);
+    return -1;
+  }
+
+  ctx->event_fd = epoll;
+  ctx->key_timer = timer;
+  nvstusb_arm_key_timer(ctx);
+  return epoll;
+}
+
+/* set how often nvstusb_handle_events polls the keys, 0 = never */
+void
+nvstusb_set_key_interval(
+    struct nvstusb_context *ctx,
+    unsigned int interval_us
+    ) {
+  assert(ctx != 0);
+  ctx->key_interval_us = interval_us;
+  if (ctx->key_timer >= 0) nvstusb_arm_key_timer(ctx);
+}
+
+/* service the controller once nvstusb_get_fd polled readable, never
+ * waits for replies, only for the status command to be taken (at most
+ * NVSTUSB_POLL_TIMEOUT_US). Returns 1 if key changes wait for
+ * nvstusb_get_keys_nowait. */
+int
+nvstusb_handle_events(
+    struct nvstusb_context *ctx
+    ) {
+  assert(ctx != 0);
+  if (ctx->event_fd < 0) return nvstusb_status_error;
+
+  int res = nvstusb_usb_handle_events(ctx->device, 0);
+  if (res == NVSTUSB_USB_ERROR_NO_DEVICE) return nvstusb_status_no_device;
+
+  res = nvstusb_dispatch_replies(ctx);
+  if (res < 0) return res;
+
+  /* the timer is read empty whether or not a poll goes out */
+  uint64_t expired = 0;
+  if (read(ctx->key_timer, &expired, sizeof(expired)) == sizeof(expired) && expired > 0) {
+    res = nvstusb_poll_status(ctx);
+    if (res < 0) return res;
+  }
+
+  return ctx->keys.deltaWheel || ctx->keys.pressedDeltaWheel || ctx->keys.toggled3D;
+}
+
+/* keep a status read in flight for the key changes, one at a time.
+ * Sending the command waits at most NVSTUSB_POLL_TIMEOUT_US (or the
+ * budget if it is shorter), a controller that does not take it in time
+ * is polled again next time. */
+static int
+nvstusb_poll_status(
+    struct nvstusb_context *ctx
+    ) {
+  /* a reply that never came does not block polling forever */
+  if (ctx->status_busy && nvstusb_time_us() - ctx->status_req.posted > NVSTUSB_READ_TIMEOUT_MS*1000) {
+    nvstusb_abandon_request(ctx, &ctx->status_req);
+    ctx->status_busy = false;
+  }
+  if (ctx->status_busy) return nvstusb_status_ok;
+
+  ctx->status_req.offset = NVSTUSB_REG_STATUS;
+  ctx->status_req.size = sizeof(ctx->status_buf);
+  ctx->status_req.data = ctx->status_buf;
+  if (!nvstusb_add_request(ctx, &ctx->status_req)) return nvstusb_status_error;
+
+  int64_t deadline = nvstusb_deadline(ctx, 0);
+  int64_t limit = nvstusb_time_us() + NVSTUSB_POLL_TIMEOUT_US;
+  if (0 == deadline || deadline > limit) deadline = limit;
+
+  int res = nvstusb_send_read(ctx, NVSTUSB_CMD_READ | NVSTUSB_CMD_CLEAR, NVSTUSB_REG_STATUS, 
+    sizeof(ctx->status_buf), deadline);
+  if (res < 0) {
+    nvstusb_drop_request(ctx, &ctx->status_req);
+    return res == nvstusb_status_timeout ? nvstusb_status_ok : res;
+  }
+  ctx->status_busy = true;
+  return nvstusb_status_ok;
 }
 
 /* Start Stereo Thread - For GL_STEREO */
 void nvstusb_start_stereo_thread(struct nvstusb_context *ctx) 
+{
+  nvstusb_start_stereo_thread_mode(ctx, nvstusb_thread_gl);
+}
+
+/* Start Stereo Thread waiting on a GL window, drm vblank events of the
+ * selected output or the vblank timer */
+int nvstusb_start_stereo_thread_mode(struct nvstusb_context *ctx, enum nvstusb_thread_mode mode)
 {
   assert(ctx != 0);
   assert(ctx->device != 0);
 
+  if (ctx->b_thread_running) return nvstusb_status_error;
+
+  void *(*thread)(void *) = nvstusb_stereo_thread_nogl;
+  switch (mode) {
+  case nvstusb_thread_gl:
+    thread = nvstusb_stereo_thread;
+    break;
+  case nvstusb_thread_drm:
+    ctx->thread_vblank = nvstusb_display_open_vblank(ctx->drm_card, ctx->drm_pipe);
+    if (0 == ctx->thread_vblank) return nvstusb_status_error;
+    break;
+  case nvstusb_thread_timer:
+    if (ctx->vtimer.period <= 0.0) {
+      float rate = ctx->timer_rate > 0 ? ctx->timer_rate : ctx->rate;
+      if (rate <= 0) {
+        NVSTUSB_LOG(nvstusb_log_error, "no rate set for the vblank timer");
+        return nvstusb_status_error;
+      }
+      nvstusb_vtimer_set_rate(&ctx->vtimer, rate);
+    }
+    break;
+  default:
+    return nvstusb_status_error;
+  }
+  ctx->thread_mode = mode;
+
   ctx->b_thread_running = true;
-  if ( pthread_create(&ctx->s_thread, NULL, nvstusb_stereo_thread, (void *)ctx) != 0 ) {
-    fprintf(stderr, "nvstusb: Unable to start stereo stread");
+  if ( pthread_create(&ctx->s_thread, NULL, thread, (void *)ctx) != 0 ) {
+    NVSTUSB_LOG(nvstusb_log_error, "Unable to start stereo stread");
+    ctx->b_thread_running = false;
+    nvstusb_display_close_vblank(ctx->thread_vblank);
+    ctx->thread_vblank = 0;
+    return nvstusb_status_error;
   }
+  return nvstusb_status_ok;
 }
 
 /* End Stereo Thread - For GL_STEREO  */
@@ -515,7 +2250,21 @@ void nvstusb_stop_stereo_thread(struct nvstusb_context *ctx)
 
   ctx->b_thread_running = false;
   if ( pthread_join(ctx->s_thread, NULL) != 0 ) {
-    fprintf(stderr, "nvstusb: Unable to wait end of stereo stread");
+    NVSTUSB_LOG(nvstusb_log_error, "Unable to wait end of stereo stread");
+  }
+
+  nvstusb_display_close_vblank(ctx->thread_vblank);
+  ctx->thread_vblank = 0;
+}
+
+/* Poll the keys after each frame of the stereo thread */
+static void nvstusb_stereo_thread_keys(struct nvstusb_context *ctx)
+{
+  /* Read status from usb controler, without waiting for it */
+  struct nvstusb_keys k;
+  nvstusb_get_keys_nowait(ctx, &k);
+  if (k.toggled3D) {
+    nvstusb_invert_eyes(ctx);
   }
 }
 
@@ -547,11 +2296,14 @@ static void * nvstusb_stereo_thread(void * in_pv_arg)
   swa.colormap = XCreateColormap(dpy, s_window, vi->visual, AllocNone);
   swa.override_redirect = true;
 
-  /* Create X window 1x1 top left of screen */
+  /* Create X window 1x1 top left of the selected output, GL syncs
+   * to the crtc showing the window */
+  int x = 0, y = 0;
+  nvstusb_get_output_position(ctx, &x, &y);
   win = XCreateWindow(dpy,
       s_window ,
-      0,
-      0,
+      x,
+      y,
       1,
       1,
       0,
@@ -572,16 +2324,48 @@ static void * nvstusb_stereo_thread(void * in_pv_arg)
     /* Send swap to usb controler */
     nvstusb_swap(ctx, nvstusb_quad, NULL /*f_swap*/);
 
-    /* Read status from usb controler */
-    struct nvstusb_keys k;
-    nvstusb_get_keys(ctx, &k);
-    if (k.toggled3D) {
-      nvstusb_invert_eyes(ctx);
-    }
+    nvstusb_stereo_thread_keys(ctx);
   }
-  /* Destroy context */
-  glx_ctx = glXGetCurrentContext();
+  /* Destroy context, window and display connection */
+  glXMakeCurrent(dpy, None, NULL);
   glXDestroyContext(dpy, glx_ctx);
+  XDestroyWindow(dpy, win);
+  XFreeColormap(dpy, swa.colormap);
+  XFree(vi);
+  XCloseDisplay(dpy);
+
+  return NULL;
+}
+
+/* Stereo thread - drm vblank events or the vblank timer, no X or GL */
+static void * nvstusb_stereo_thread_nogl(void * in_pv_arg)
+{
+  struct nvstusb_context *ctx = (struct nvstusb_context *) in_pv_arg;
+
+  /* Loop until stop */
+  while (ctx->b_thread_running) {
+    int64_t vblank = -1;
+
+    /* Waiting every second vblank, both eyes are sent for it */
+    if (0 != ctx->thread_vblank) {
+      vblank = nvstusb_display_wait_vblank(ctx->thread_vblank, 2);
+      if (vblank < 0) {
+        /* crtc off or gone, do not spin */
+        usleep(100000);
+        continue;
+      }
+    } else {
+      vblank = nvstusb_vtimer_wait(&ctx->vtimer);
+      if (vblank >= 0) vblank = nvstusb_vtimer_wait(&ctx->vtimer);
+      if (vblank < 0) break;
+      vblank /= 1000;
+    }
+
+    /* Send eyes to usb controler, the budget runs from the vblank */
+    nvstusb_send_eye_at(ctx, nvstusb_quad, vblank, -1, nvstusb_deadline_from(ctx, 0, vblank));
+
+    nvstusb_stereo_thread_keys(ctx);
+  }
 
   return NULL;
 }
@@ -619,7 +2403,7 @@ static void nvstusb_print_refresh_rate(void)
 
     /* Display each 512 frame */
     if(i_it % 512 == 0) {
-      fprintf(stderr,"nvstusb: frame:%d (%0.2f s) mean: %f Hz (%0.2f us) sqrt(var): %0.2f us (%0.1f %%)\n",i_it,f_mean*i_it/1000000.0, 1000000/f_mean, f_mean, f_var, 100.0*f_var/f_mean);
+      NVSTUSB_LOG(nvstusb_log_info, "frame:%d (%0.2f s) mean: %f Hz (%0.2f us) sqrt(var): %0.2f us (%0.1f %%)",i_it,f_mean*i_it/1000000.0, 1000000/f_mean, f_mean, f_var, 100.0*f_var/f_mean);
     }
   }
   /* Increment frame counter */
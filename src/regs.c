@@ -0,0 +1,155 @@
+/* regs.c
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <string.h>
+#include <assert.h>
+
+#include "regs.h"
+
+#define NVSTUSB_REG_VALID       (0x01)  /* shadow holds the controller's value */
+#define NVSTUSB_REG_DIRTY       (0x02)  /* staged value has to be sent */
+#define NVSTUSB_REG_VOLATILE    (0x04)  /* changed by the controller itself */
+
+/* clean bytes between two dirty ranges are resent if that is cheaper than
+ * a second command with its 4 byte header */
+#define NVSTUSB_REG_MAX_GAP     4
+
+/* 0x201f-0x2021 hold the key status, read and cleared by nvstusb_get_keys */
+#define NVSTUSB_REG_STATUS      0x18
+#define NVSTUSB_REG_STATUS_SIZE 3
+
+/* 0x2023 is the start value of a counter the firmware runs up to 6,
+ * it is always written again */
+#define NVSTUSB_REG_COUNTER     0x1c
+#define NVSTUSB_REG_COUNTER_SIZE 2
+
+void
+nvstusb_regs_init(
+  struct nvstusb_regs *regs
+) {
+  memset(regs, 0, sizeof(*regs));
+  memset(regs->flags + NVSTUSB_REG_STATUS, NVSTUSB_REG_VOLATILE, NVSTUSB_REG_STATUS_SIZE);
+  memset(regs->flags + NVSTUSB_REG_COUNTER, NVSTUSB_REG_VOLATILE, NVSTUSB_REG_COUNTER_SIZE);
+}
+
+void
+nvstusb_regs_stage(
+  struct nvstusb_regs *regs,
+  unsigned int offset,
+  const void *data,
+  unsigned int size
+) {
+  assert(offset + size <= NVSTUSB_REG_COUNT);
+
+  const uint8_t *bytes = data;
+  unsigned int i;
+  for (i = 0; i < size; i++) {
+    uint8_t *flags = &regs->flags[offset+i];
+    regs->staged[offset+i] = bytes[i];
+
+    if ((*flags & NVSTUSB_REG_VOLATILE) || !(*flags & NVSTUSB_REG_VALID) ||
+        regs->shadow[offset+i] != bytes[i]) {
+      *flags |= NVSTUSB_REG_DIRTY;
+    } else {
+      *flags &= ~NVSTUSB_REG_DIRTY;
+    }
+  }
+}
+
+void
+nvstusb_regs_stage_all(
+  struct nvstusb_regs *regs
+) {
+  unsigned int i;
+  for (i = 0; i < NVSTUSB_REG_COUNT; i++) {
+    uint8_t *flags = &regs->flags[i];
+    if (*flags & NVSTUSB_REG_VALID) {
+      if (!(*flags & NVSTUSB_REG_DIRTY)) regs->staged[i] = regs->shadow[i];
+      *flags |= NVSTUSB_REG_DIRTY;
+    }
+  }
+}
+
+/* can a clean byte be resent to join two dirty ranges */
+static bool
+nvstusb_regs_fill(
+  struct nvstusb_regs *regs,
+  unsigned int i
+) {
+  uint8_t flags = regs->flags[i];
+  if (flags & NVSTUSB_REG_DIRTY) return true;
+  return (flags & NVSTUSB_REG_VALID) && !(flags & NVSTUSB_REG_VOLATILE);
+}
+
+bool
+nvstusb_regs_next_range(
+  struct nvstusb_regs *regs,
+  unsigned int *offset,
+  unsigned int *size
+) {
+  unsigned int start = 0;
+  while (start < NVSTUSB_REG_COUNT && !(regs->flags[start] & NVSTUSB_REG_DIRTY)) start++;
+  if (start == NVSTUSB_REG_COUNT) return false;
+
+  /* extend over dirty bytes and short gaps of known bytes */
+  unsigned int end = start + 1;
+  unsigned int i;
+  for (i = end; i < NVSTUSB_REG_COUNT && i - start < NVSTUSB_REG_MAX_WRITE; i++) {
+    if (regs->flags[i] & NVSTUSB_REG_DIRTY) {
+      end = i + 1;
+      continue;
+    }
+    if (i - end >= NVSTUSB_REG_MAX_GAP || !nvstusb_regs_fill(regs, i)) break;
+  }
+
+  /* clean bytes inside the range are sent with their shadow value */
+  for (i = start; i < end; i++) {
+    if (!(regs->flags[i] & NVSTUSB_REG_DIRTY)) regs->staged[i] = regs->shadow[i];
+  }
+
+  *offset = start;
+  *size = end - start;
+  return true;
+}
+
+void
+nvstusb_regs_commit(
+  struct nvstusb_regs *regs,
+  unsigned int offset,
+  unsigned int size,
+  bool ok
+) {
+  unsigned int i;
+  for (i = offset; i < offset + size; i++) {
+    regs->flags[i] &= ~NVSTUSB_REG_DIRTY;
+    if (ok) {
+      regs->shadow[i] = regs->staged[i];
+      regs->flags[i] |= NVSTUSB_REG_VALID;
+    } else {
+      regs->flags[i] &= ~NVSTUSB_REG_VALID;
+    }
+  }
+}
+
+void
+nvstusb_regs_update(
+  struct nvstusb_regs *regs,
+  unsigned int offset,
+  const void *data,
+  unsigned int size
+) {
+  assert(offset + size <= NVSTUSB_REG_COUNT);
+
+  const uint8_t *bytes = data;
+  unsigned int i;
+  for (i = 0; i < size; i++) {
+    uint8_t *flags = &regs->flags[offset+i];
+    if (*flags & (NVSTUSB_REG_VOLATILE | NVSTUSB_REG_DIRTY)) continue;
+    regs->shadow[offset+i] = bytes[i];
+    *flags |= NVSTUSB_REG_VALID;
+  }
+}
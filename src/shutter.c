@@ -0,0 +1,168 @@
+/* shutter.c
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "nvstusb.h"
+#include "shutter.h"
+
+/* the firmware shortens the open time by 784 timer 0 counts (196 us)
+ * for one of the waveforms, it has to stay positive */
+#define NVSTUSB_SHUTTER_MIN_ACTIVE_US 200.0
+
+/* the first search steps this many times the final step */
+#define NVSTUSB_SHUTTER_COARSE        10
+
+/* light of the own eye's image on one row between t0 and t1, relative to
+ * the time the row was written. The row alternates between the eyes each
+ * period and approaches the new image with time constant tau, in steady
+ * state it reaches 1/(1+a) of it by the end of the period. */
+static double
+nvstusb_shutter_integral(
+  double t0,
+  double t1,
+  double period,
+  double tau
+) {
+  double a = tau > 0 ? exp(-period/tau) : 0;
+  double c = 1.0 / (1.0 + a);
+  double k = floor(t0 / period);
+  double sum = 0;
+
+  while (t0 < t1) {
+    double start = k * period;
+    double u0 = t0 - start;
+    double u1 = fmin(t1 - start, period);
+    double decay = tau > 0 ? c * tau * (exp(-u0/tau) - exp(-u1/tau)) : 0;
+
+    /* even periods show the own eye, odd ones the other */
+    if (0 == fmod(fabs(k), 2.0)) {
+      sum += (u1 - u0) - decay;
+    } else {
+      sum += decay;
+    }
+    t0 = start + u1;
+    k += 1;
+  }
+  return sum;
+}
+
+/* brightness and crosstalk of a profile */
+void
+nvstusb_shutter_evaluate(
+  const struct nvstusb_panel *panel,
+  const struct nvstusb_timing_profile *profile,
+  struct nvstusb_shutter_result *result
+) {
+  double period = 1000000.0 / panel->rate;
+  double scanout = period - panel->vblank_us;
+  double tau = panel->response_us / log(9.0);
+  int i;
+
+  result->open_us = profile->eye_delay_us + profile->x_us;
+  result->close_us = result->open_us + profile->active_us;
+  result->brightness = 0;
+  result->crosstalk = 0;
+  result->worst = 0;
+  result->worst_row = 0;
+
+  for (i = 0; i < NVSTUSB_SHUTTER_ROWS; i++) {
+    double row = (i + 0.5) / NVSTUSB_SHUTTER_ROWS;
+    double written = panel->vblank_us + row * scanout;
+
+    /* an image of the own eye against black in the other, and the
+     * other way round, see the same response */
+    double own = nvstusb_shutter_integral(result->open_us - written,
+      result->close_us - written, period, tau);
+    double crosstalk = 1.0 - own / profile->active_us;
+
+    result->brightness += own / period;
+    result->crosstalk += crosstalk;
+    if (crosstalk > result->worst || 0 == i) {
+      result->worst = crosstalk;
+      result->worst_row = row;
+    }
+  }
+  result->brightness /= NVSTUSB_SHUTTER_ROWS;
+  result->crosstalk /= NVSTUSB_SHUTTER_ROWS;
+}
+
+/* true if a is a better timing than b */
+static bool
+nvstusb_shutter_better(
+  const struct nvstusb_shutter_result *a,
+  const struct nvstusb_shutter_result *b,
+  float max_crosstalk
+) {
+  bool fitA = a->worst <= max_crosstalk;
+  bool fitB = b->worst <= max_crosstalk;
+
+  if (fitA != fitB) return fitA;
+  if (fitA && a->brightness != b->brightness) return a->brightness > b->brightness;
+  return a->worst < b->worst;
+}
+
+/* grid search of x_us and active_us within the given ranges, keeping
+ * the best timing in profile and result */
+static void
+nvstusb_shutter_search(
+  const struct nvstusb_panel *panel,
+  float max_crosstalk,
+  double x0,
+  double x1,
+  double active0,
+  double active1,
+  double step,
+  struct nvstusb_timing_profile *profile,
+  struct nvstusb_shutter_result *result,
+  bool found
+) {
+  struct nvstusb_timing_profile test = *profile;
+  struct nvstusb_shutter_result r;
+  double x, active;
+
+  for (x = x0; x < x1; x += step) {
+    for (active = active0; active < active1; active += step) {
+      test.x_us = x;
+      test.active_us = active;
+      nvstusb_shutter_evaluate(panel, &test, &r);
+      if (!found || nvstusb_shutter_better(&r, result, max_crosstalk)) {
+        *profile = test;
+        *result = r;
+        found = true;
+      }
+    }
+  }
+}
+
+/* coarse search over the whole frame, then around the best timing */
+void
+nvstusb_shutter_optimize(
+  const struct nvstusb_panel *panel,
+  float max_crosstalk,
+  float step_us,
+  struct nvstusb_timing_profile *profile,
+  struct nvstusb_shutter_result *result
+) {
+  double period = 1000000.0 / panel->rate;
+
+  if (!(step_us > 0)) step_us = 10.0;
+  double coarse = NVSTUSB_SHUTTER_COARSE * step_us;
+  profile->rate = panel->rate;
+
+  nvstusb_shutter_search(panel, max_crosstalk, coarse, period, NVSTUSB_SHUTTER_MIN_ACTIVE_US, period,
+    coarse, profile, result, false);
+
+  double x = profile->x_us;
+  double active = profile->active_us;
+  nvstusb_shutter_search(panel, max_crosstalk,
+    fmax(x - coarse, step_us), fmin(x + coarse, period),
+    fmax(active - coarse, NVSTUSB_SHUTTER_MIN_ACTIVE_US), fmin(active + coarse, period),
+    step_us, profile, result, true);
+}
@@ -0,0 +1,206 @@
+/* state.c
+ *
+ * Controller state published in a shared page guarded by a seqlock, so
+ * other processes can follow keys and eyes without touching the device.
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "state.h"
+#include "log.h"
+
+/* a reader seeing the same odd seq spins this often, then yields until
+ * the page was busy this long */
+#define NVSTUSB_STATE_SPINS     1000
+#define NVSTUSB_STATE_STUCK_US  100000
+
+struct nvstusb_state_reader {
+  const struct nvstusb_state_page *page;
+};
+
+const char *
+nvstusb_state_path(
+  const char *path
+) {
+  static char buf[256];
+  if (0 != path) return path;
+
+  const char *env = getenv("NVSTUSB_STATE");
+  if (0 != env) return env;
+
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  if (0 == dir) dir = "/tmp";
+  snprintf(buf, sizeof(buf), "%s/%s", dir, NVSTUSB_STATE_FILE);
+  return buf;
+}
+
+static uint64_t
+nvstusb_state_time_us(
+) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+struct nvstusb_state_writer *
+nvstusb_state_create(
+  const char *path
+) {
+  path = nvstusb_state_path(path);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0 || ftruncate(fd, NVSTUSB_STATE_SIZE) < 0) {
+    NVSTUSB_LOG(nvstusb_log_error, "%s: %s", path, strerror(errno));
+    if (fd >= 0) close(fd);
+    return 0;
+  }
+  struct nvstusb_state_page *page = mmap(0, NVSTUSB_STATE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == page) {
+    NVSTUSB_LOG(nvstusb_log_error, "%s: %s", path, strerror(errno));
+    return 0;
+  }
+
+  /* readers of an older page see it change under the seqlock */
+  uint32_t seq = page->magic == NVSTUSB_STATE_MAGIC ? page->seq | 1 : 1;
+  __atomic_store_n(&page->seq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  page->magic = NVSTUSB_STATE_MAGIC;
+  page->version = NVSTUSB_STATE_VERSION;
+  page->size = sizeof(page->state);
+  memset(&page->state, 0, sizeof(page->state));
+  page->state.pid = getpid();
+  page->state.active = 1;
+  page->state.updated_us = nvstusb_state_time_us();
+  __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELEASE);
+
+  struct nvstusb_state_writer *writer = (struct nvstusb_state_writer *) calloc(1, sizeof(*writer));
+  pthread_mutex_init(&writer->lock, 0);
+  writer->page = page;
+  NVSTUSB_LOG(nvstusb_log_info, "Publishing state in %s", path);
+  return writer;
+}
+
+/* the page stays, marked inactive */
+void
+nvstusb_state_destroy(
+  struct nvstusb_state_writer *writer
+) {
+  if (0 == writer) return;
+
+  nvstusb_state_begin(writer)->active = 0;
+  nvstusb_state_end(writer);
+
+  munmap(writer->page, NVSTUSB_STATE_SIZE);
+  pthread_mutex_destroy(&writer->lock);
+  free(writer);
+}
+
+struct nvstusb_state *
+nvstusb_state_begin(
+  struct nvstusb_state_writer *writer
+) {
+  pthread_mutex_lock(&writer->lock);
+  uint32_t seq = writer->page->seq;
+  __atomic_store_n(&writer->page->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  return &writer->page->state;
+}
+
+void
+nvstusb_state_end(
+  struct nvstusb_state_writer *writer
+) {
+  writer->page->state.updated_us = nvstusb_state_time_us();
+  __atomic_store_n(&writer->page->seq, writer->page->seq + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&writer->lock);
+}
+
+/* map the page of another process read only */
+struct nvstusb_state_reader *
+nvstusb_state_open(
+  const char *path
+) {
+  path = nvstusb_state_path(path);
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    NVSTUSB_LOG(nvstusb_log_error, "%s: %s", path, strerror(errno));
+    return 0;
+  }
+  const struct nvstusb_state_page *page = mmap(0, NVSTUSB_STATE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == page) {
+    NVSTUSB_LOG(nvstusb_log_error, "%s: %s", path, strerror(errno));
+    return 0;
+  }
+  if (page->magic != NVSTUSB_STATE_MAGIC || page->version != NVSTUSB_STATE_VERSION) {
+    NVSTUSB_LOG(nvstusb_log_error, "%s is no state page of this version", path);
+    munmap((void *)page, NVSTUSB_STATE_SIZE);
+    return 0;
+  }
+
+  struct nvstusb_state_reader *reader = (struct nvstusb_state_reader *) calloc(1, sizeof(*reader));
+  reader->page = page;
+  return reader;
+}
+
+void
+nvstusb_state_close(
+  struct nvstusb_state_reader *reader
+) {
+  if (0 == reader) return;
+  munmap((void *)reader->page, NVSTUSB_STATE_SIZE);
+  free(reader);
+}
+
+/* copy a consistent snapshot, no system calls unless the page is busy */
+int
+nvstusb_state_read(
+  struct nvstusb_state_reader *reader,
+  struct nvstusb_state *state
+) {
+  const struct nvstusb_state_page *page = reader->page;
+  uint32_t size = page->size < sizeof(*state) ? page->size : sizeof(*state);
+  uint32_t seq, busy = 0;
+  uint64_t since = 0;
+  int spins = 0;
+
+  for (;;) {
+    seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      /* the writer may have been preempted, or died for good */
+      if (seq != busy) {
+        busy = seq;
+        spins = 0;
+        since = 0;
+      }
+      if (++spins < NVSTUSB_STATE_SPINS) continue;
+
+      uint64_t now = nvstusb_state_time_us();
+      if (0 == since) since = now;
+      if (now - since > NVSTUSB_STATE_STUCK_US) return nvstusb_status_timeout;
+      sched_yield();
+      continue;
+    }
+
+    memcpy(state, (const void *)&page->state, size);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq) break;
+  }
+  if (size < sizeof(*state)) memset((uint8_t *)state + size, 0, sizeof(*state) - size);
+  return nvstusb_status_ok;
+}
@@ -0,0 +1,182 @@
+/* timing.c
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "nvstusb.h"
+#include "timing.h"
+#include "log.h"
+
+/* a profile is used for rates this close to its own */
+#define NVSTUSB_PROFILE_TOLERANCE 1.0
+
+/* the firmware adds 784 to the 0x200f count if PD1 is set, it has
+ * to stay negative */
+#define NVSTUSB_Y_ADJUST        784
+
+/* known profiles. Only the 120 Hz entry comes from the Windows driver,
+ * the others keep its phase (w, x) relative to the frame and shorten
+ * the open time, since panel response takes a growing share of short
+ * frames. */
+static const struct nvstusb_timing_profile nvstusb_profiles[] = {
+  /* rate    w_us       x_us       active_us  eye_delay_us */
+  { 100.0,   5482.20,   5729.10,   2496.0,    5555.56 },
+  { 110.0,   4983.82,   5208.27,   2269.1,    5050.51 },
+  { 120.0,   4568.50,   4774.25,   2080.0,    4629.63 },
+  { 144.0,   3807.08,   3978.54,   1666.7,    3858.02 },
+  { 165.0,   3322.55,   3472.18,   1393.9,    3367.00 },
+  { 200.0,   2741.10,   2864.55,   1100.0,    2777.78 },
+  { 240.0,   2284.25,   2387.12,    875.0,    2314.81 },
+};
+
+/* closest profile in a table */
+const struct nvstusb_timing_profile *
+nvstusb_timing_find_in(
+  const struct nvstusb_timing_profile *profiles,
+  int count,
+  float rate
+) {
+  const struct nvstusb_timing_profile *best = 0;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    float diff = fabs(profiles[i].rate - rate);
+    if (diff > NVSTUSB_PROFILE_TOLERANCE) continue;
+    if (0 == best || diff < fabs(best->rate - rate)) best = &profiles[i];
+  }
+  return best;
+}
+
+/* closest built-in profile */
+const struct nvstusb_timing_profile *
+nvstusb_timing_find_profile(
+  float rate
+) {
+  return nvstusb_timing_find_in(nvstusb_profiles,
+    sizeof(nvstusb_profiles)/sizeof(nvstusb_profiles[0]), rate);
+}
+
+/* read a profile file */
+int
+nvstusb_timing_read_profiles(
+  const char *path,
+  struct nvstusb_timing_profile *profiles,
+  int max
+) {
+  FILE *file = fopen(path, "r");
+  if (0 == file) {
+    NVSTUSB_LOG(nvstusb_log_error, "could not open profile file %s", path);
+    return -1;
+  }
+
+  char line[256];
+  int count = 0;
+  int lineNo = 0;
+  while (fgets(line, sizeof(line), file)) {
+    struct nvstusb_timing_profile p;
+    char *comment = strchr(line, '#');
+    lineNo++;
+    if (comment) *comment = 0;
+    if (strspn(line, " \t\r\n") == strlen(line)) continue;
+
+    if (5 != sscanf(line, "%f %f %f %f %f", &p.rate, &p.w_us, &p.x_us, &p.active_us, &p.eye_delay_us)) {
+      NVSTUSB_LOG(nvstusb_log_error, "%s:%d: expected rate w_us x_us active_us eye_delay_us", path, lineNo);
+      count = -1;
+      break;
+    }
+    if (count == max) {
+      NVSTUSB_LOG(nvstusb_log_warning, "%s: only the first %d profiles are used", path, max);
+      break;
+    }
+    profiles[count++] = p;
+  }
+  fclose(file);
+  return count;
+}
+
+/* one line of a profile file */
+void
+nvstusb_timing_write_profile(
+  FILE *file,
+  const struct nvstusb_timing_profile *profile
+) {
+  fprintf(file, "%7.2f  %9.2f  %9.2f  %9.2f  %9.2f\n", profile->rate, profile->w_us,
+    profile->x_us, profile->active_us, profile->eye_delay_us);
+}
+
+/* list of built-in profiles */
+int
+nvstusb_get_profiles(
+  const struct nvstusb_timing_profile **profiles
+) {
+  *profiles = nvstusb_profiles;
+  return sizeof(nvstusb_profiles)/sizeof(nvstusb_profiles[0]);
+}
+
+/* scale the 120 Hz timings of the Windows driver to rate */
+void
+nvstusb_timing_generate(
+  float rate,
+  struct nvstusb_timing_profile *profile
+) {
+  double frameTime = 1000000.0/rate;
+
+  profile->rate = rate;
+  profile->w_us = frameTime * (4568.50 / (1000000.0/120.0));
+  profile->x_us = frameTime * (4774.25 / (1000000.0/120.0));
+  profile->active_us = frameTime * (2080.0 / (1000000.0/120.0));
+  profile->eye_delay_us = frameTime / 1.8;
+}
+
+/* convert a time to a timer count, false if it does not fit */
+static bool
+nvstusb_timing_count(
+  double us,
+  long long clock,
+  int32_t adjust,
+  int32_t *count
+) {
+  int64_t c = (int64_t)(-us*(clock/1000000)+1);
+  if (c >= 0 || c + adjust >= 0 || c <= INT32_MIN) return false;
+  *count = c;
+  return true;
+}
+
+/* timer counts of a profile at rate */
+bool
+nvstusb_timing_compute(
+  const struct nvstusb_timing_profile *profile,
+  float rate,
+  struct nvstusb_timing *timing
+) {
+  if (!(rate > NVSTUSB_RATE_MIN && rate <= NVSTUSB_RATE_MAX)) {
+    NVSTUSB_LOG(nvstusb_log_error, "refresh rate %f Hz out of range (%.0f-%.0f Hz)", 
+      rate, NVSTUSB_RATE_MIN, NVSTUSB_RATE_MAX);
+    return false;
+  }
+
+  double frameTime = 1000000.0/rate;
+  if (profile->active_us <= 0 || profile->active_us >= frameTime ||
+      profile->w_us >= frameTime || profile->x_us >= frameTime ||
+      profile->eye_delay_us >= frameTime) {
+    NVSTUSB_LOG(nvstusb_log_error, "timing profile does not fit into a %f us frame", frameTime);
+    return false;
+  }
+
+  if (!nvstusb_timing_count(profile->w_us,       NVSTUSB_T2_CLOCK, 0, &timing->w) ||
+      !nvstusb_timing_count(profile->x_us,       NVSTUSB_T0_CLOCK, 0, &timing->x) ||
+      !nvstusb_timing_count(profile->active_us,  NVSTUSB_T0_CLOCK, NVSTUSB_Y_ADJUST, &timing->y) ||
+      !nvstusb_timing_count(frameTime,           NVSTUSB_T2_CLOCK, 0, &timing->z) ||
+      !nvstusb_timing_count(profile->eye_delay_us, NVSTUSB_T2_CLOCK, 0, &timing->r)) {
+    NVSTUSB_LOG(nvstusb_log_error, "timing profile overflows the timer counters");
+    return false;
+  }
+  return true;
+}
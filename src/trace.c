@@ -0,0 +1,116 @@
+/* trace.c
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "trace.h"
+#include "log.h"
+
+#define NVSTUSB_TRACE_HEADER_SIZE 16
+#define NVSTUSB_TRACE_RECORD_SIZE 24
+
+static void
+nvstusb_trace_put(
+  uint8_t *buf,
+  uint64_t value,
+  int size
+) {
+  int i;
+  for (i = 0; i < size; i++) buf[i] = value >> (8*i);
+}
+
+static uint64_t
+nvstusb_trace_get(
+  const uint8_t *buf,
+  int size
+) {
+  uint64_t value = 0;
+  int i;
+  for (i = 0; i < size; i++) value |= (uint64_t)buf[i] << (8*i);
+  return value;
+}
+
+/* create a trace file and write its header */
+FILE *
+nvstusb_trace_create(
+  const char *path
+) {
+  FILE *file = fopen(path, "wb");
+  if (0 == file) { NVSTUSB_LOG(nvstusb_log_error, "%s: %s", path, strerror(errno)); return 0; }
+
+  uint8_t header[NVSTUSB_TRACE_HEADER_SIZE] = { 0 };
+  memcpy(header, NVSTUSB_TRACE_MAGIC, 8);
+  nvstusb_trace_put(header+8, NVSTUSB_TRACE_VERSION, 4);
+  if (fwrite(header, sizeof(header), 1, file) != 1) {
+    NVSTUSB_LOG(nvstusb_log_error, "%s: %s", path, strerror(errno));
+    fclose(file);
+    return 0;
+  }
+  return file;
+}
+
+/* append a record with its payload */
+bool
+nvstusb_trace_write(
+  FILE *file,
+  const struct nvstusb_trace_record *rec,
+  const void *data
+) {
+  uint8_t buf[NVSTUSB_TRACE_RECORD_SIZE];
+  buf[0] = rec->type;
+  buf[1] = rec->endpoint;
+  nvstusb_trace_put(buf+2,  rec->length,   2);
+  nvstusb_trace_put(buf+4,  (uint32_t)rec->result, 4);
+  nvstusb_trace_put(buf+8,  rec->submit,   8);
+  nvstusb_trace_put(buf+16, rec->complete, 8);
+
+  if (fwrite(buf, sizeof(buf), 1, file) != 1) return false;
+  if (rec->length > 0 && fwrite(data, rec->length, 1, file) != 1) return false;
+  return true;
+}
+
+/* open a trace file and check its header */
+FILE *
+nvstusb_trace_open(
+  const char *path
+) {
+  FILE *file = fopen(path, "rb");
+  if (0 == file) { NVSTUSB_LOG(nvstusb_log_error, "%s: %s", path, strerror(errno)); return 0; }
+
+  uint8_t header[NVSTUSB_TRACE_HEADER_SIZE];
+  if (fread(header, sizeof(header), 1, file) != 1 ||
+      memcmp(header, NVSTUSB_TRACE_MAGIC, 8) != 0 ||
+      nvstusb_trace_get(header+8, 4) != NVSTUSB_TRACE_VERSION) {
+    NVSTUSB_LOG(nvstusb_log_error, "%s: not an nvstusb trace", path);
+    fclose(file);
+    return 0;
+  }
+  return file;
+}
+
+/* read the next record */
+int
+nvstusb_trace_read(
+  FILE *file,
+  struct nvstusb_trace_record *rec,
+  uint8_t *data
+) {
+  uint8_t buf[NVSTUSB_TRACE_RECORD_SIZE];
+  if (fread(buf, sizeof(buf), 1, file) != 1) return feof(file) ? 0 : -1;
+
+  rec->type     = buf[0];
+  rec->endpoint = buf[1];
+  rec->length   = nvstusb_trace_get(buf+2, 2);
+  rec->result   = (int32_t)nvstusb_trace_get(buf+4, 4);
+  rec->submit   = nvstusb_trace_get(buf+8, 8);
+  rec->complete = nvstusb_trace_get(buf+16, 8);
+
+  if (rec->length > 0 && fread(data, rec->length, 1, file) != 1) return -1;
+  return 1;
+}
@@ -0,0 +1,498 @@
+/* usb.c
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "usb_backend.h"
+#include "trace.h"
+#include "probes.h"
+#include "log.h"
+
+static const struct nvstusb_usb_backend *nvstusb_usb_backends[] = {
+  &nvstusb_usb_libusb_backend,
+  &nvstusb_usb_usbfs_backend,
+  &nvstusb_usb_replay_backend,
+  &nvstusb_usb_daemon_backend,
+  &nvstusb_usb_emu_backend,
+  0
+};
+
+/* backend in use, selected at init if not chosen before */
+static const struct nvstusb_usb_backend *nvstusb_usb_backend = 0;
+static bool nvstusb_usb_initialized = false;
+
+/* replay source */
+static char *nvstusb_usb_replay_file = 0;
+static float nvstusb_usb_replay_factor = 1.0;
+
+/* trace recorder */
+static pthread_mutex_t nvstusb_usb_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *nvstusb_usb_trace = 0;
+static uint64_t nvstusb_usb_trace_begin = 0;
+
+uint64_t
+nvstusb_usb_time_ns(
+) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/* choose a backend by name */
+bool
+nvstusb_usb_select_backend(
+  const char *name
+) {
+  int i;
+  for (i = 0; 0 != nvstusb_usb_backends[i]; i++) {
+    if (0 == strcmp(nvstusb_usb_backends[i]->name, name)) {
+      nvstusb_usb_backend = nvstusb_usb_backends[i];
+      return true;
+    }
+  }
+  NVSTUSB_LOG(nvstusb_log_error, "Unknown usb backend %s", name);
+  return false;
+}
+
+/* play back a trace file */
+void
+nvstusb_usb_set_replay(
+  const char *path,
+  float speed
+) {
+  free(nvstusb_usb_replay_file);
+  nvstusb_usb_replay_file = strdup(path);
+  nvstusb_usb_replay_factor = speed;
+  nvstusb_usb_backend = &nvstusb_usb_replay_backend;
+}
+
+const char *
+nvstusb_usb_replay_path(
+) {
+  return nvstusb_usb_replay_file;
+}
+
+float
+nvstusb_usb_replay_speed(
+) {
+  return nvstusb_usb_replay_factor;
+}
+
+/* start recording */
+bool
+nvstusb_usb_trace_start(
+  const char *path
+) {
+  FILE *file = nvstusb_trace_create(path);
+  if (0 == file) return false;
+
+  pthread_mutex_lock(&nvstusb_usb_trace_lock);
+  if (0 != nvstusb_usb_trace) fclose(nvstusb_usb_trace);
+  nvstusb_usb_trace = file;
+  nvstusb_usb_trace_begin = nvstusb_usb_time_ns();
+  pthread_mutex_unlock(&nvstusb_usb_trace_lock);
+
+  NVSTUSB_LOG(nvstusb_log_info, "Recording usb traffic to %s", path);
+  return true;
+}
+
+/* stop recording */
+void
+nvstusb_usb_trace_stop(
+) {
+  pthread_mutex_lock(&nvstusb_usb_trace_lock);
+  if (0 != nvstusb_usb_trace) fclose(nvstusb_usb_trace);
+  nvstusb_usb_trace = 0;
+  pthread_mutex_unlock(&nvstusb_usb_trace_lock);
+}
+
+/* append a transfer to the trace */
+static void
+nvstusb_usb_record(
+  uint8_t type,
+  uint8_t endpoint,
+  const void *data,
+  int size,
+  int result,
+  uint64_t submit,
+  uint64_t complete
+) {
+  if (0 == nvstusb_usb_trace) return;
+
+  pthread_mutex_lock(&nvstusb_usb_trace_lock);
+  if (0 != nvstusb_usb_trace) {
+    struct nvstusb_trace_record rec;
+    rec.type = type;
+    rec.endpoint = endpoint;
+    rec.length = size > 0 ? size : 0;
+    rec.result = result;
+    /* a posted read may have been queued before the trace started */
+    if (submit < nvstusb_usb_trace_begin) submit = nvstusb_usb_trace_begin;
+    if (complete < submit) complete = submit;
+    rec.submit = submit - nvstusb_usb_trace_begin;
+    rec.complete = complete - nvstusb_usb_trace_begin;
+    if (!nvstusb_trace_write(nvstusb_usb_trace, &rec, data)) {
+      NVSTUSB_LOG(nvstusb_log_error, "trace: %s", strerror(errno));
+      fclose(nvstusb_usb_trace);
+      nvstusb_usb_trace = 0;
+    }
+  }
+  pthread_mutex_unlock(&nvstusb_usb_trace_lock);
+}
+
+void
+nvstusb_usb_trace_control(
+  uint8_t requestType,
+  uint8_t request,
+  uint16_t value,
+  uint16_t index,
+  const void *data,
+  int size,
+  int result,
+  uint64_t submit,
+  uint64_t complete
+) {
+  /* control transfers are the firmware upload */
+  NVSTUSB_PROBE3(firmware_chunk, value, size, result);
+  if (0 == nvstusb_usb_trace) return;
+
+  uint8_t buf[8+1024];
+  if (size > 1024) size = 1024;
+  buf[0] = requestType;
+  buf[1] = request;
+  buf[2] = value;   buf[3] = value>>8;
+  buf[4] = index;   buf[5] = index>>8;
+  buf[6] = size;    buf[7] = size>>8;
+  memcpy(buf+8, data, size);
+  nvstusb_usb_record(NVSTUSB_TRACE_CONTROL, 0, buf, 8+size, result, submit, complete);
+}
+
+/* count a transfer on endpoint (0x80 set for IN) that asked for size
+ * bytes and returned res, error if a short transfer ended in one,
+ * latency 0 if it was not measured */
+static void
+nvstusb_usb_count(
+  struct nvstusb_usb_device *dev,
+  uint8_t endpoint,
+  int size,
+  int res,
+  int error,
+  uint64_t latency
+) {
+  struct nvstusb_usb_counters *c = &dev->counters[(endpoint & 0x0f) | ((endpoint & 0x80) >> 3)];
+  struct nvstusb_endpoint_stats *s = &c->stats;
+  if (res < 0) error = res;
+
+  pthread_mutex_lock(&dev->countersLock);
+  s->endpoint = endpoint;
+  s->submitted++;
+  if (res > 0) s->bytes += res;
+  if (res >= 0 && res < size) s->short_transfers++;
+
+  if (error < 0) {
+    s->failed++;
+    if (error == NVSTUSB_USB_ERROR_TIMEOUT) s->timeouts++;
+    s->errors[-error < NVSTUSB_USB_ERROR_CODES ? -error : 0]++;
+  } else {
+    s->completed++;
+  }
+
+  if (latency > 0) {
+    if (0 == s->latency_samples || latency < c->latencyMin) c->latencyMin = latency;
+    if (latency > c->latencyMax) c->latencyMax = latency;
+    c->latencySum += latency;
+    s->latency_samples++;
+  }
+  pthread_mutex_unlock(&dev->countersLock);
+}
+
+/* copy the counters of the endpoints that saw transfers */
+int
+nvstusb_usb_get_stats(
+  struct nvstusb_usb_device *dev,
+  struct nvstusb_endpoint_stats *stats,
+  int max
+) {
+  assert(dev != 0);
+
+  int i, n = 0;
+  pthread_mutex_lock(&dev->countersLock);
+  for (i = 0; i < NVSTUSB_USB_ENDPOINTS; i++) {
+    struct nvstusb_usb_counters *c = &dev->counters[i];
+    if (0 == c->stats.submitted) continue;
+    if (n < max) {
+      stats[n] = c->stats;
+      if (c->stats.latency_samples > 0) {
+        stats[n].min_us = c->latencyMin / 1000.0;
+        stats[n].avg_us = c->latencySum / 1000.0 / c->stats.latency_samples;
+        stats[n].max_us = c->latencyMax / 1000.0;
+      }
+    }
+    n++;
+  }
+  pthread_mutex_unlock(&dev->countersLock);
+  return n;
+}
+
+void
+nvstusb_usb_reset_stats(
+  struct nvstusb_usb_device *dev
+) {
+  assert(dev != 0);
+
+  pthread_mutex_lock(&dev->countersLock);
+  memset(dev->counters, 0, sizeof(dev->counters));
+  pthread_mutex_unlock(&dev->countersLock);
+}
+
+void
+nvstusb_usb_set_debug(
+  int level
+) {
+  nvstusb_libusb_set_debug(level);
+}
+
+/* initialize usb */
+bool 
+nvstusb_usb_init(
+) {
+  if (nvstusb_usb_initialized) return true;
+
+  if (0 == nvstusb_usb_backend) {
+    const char *name = getenv("NVSTUSB_BACKEND");
+    if (0 == name || !nvstusb_usb_select_backend(name)) {
+      /* nvstusbd holds the controller if it runs */
+      nvstusb_usb_backend = nvstusb_usb_daemon_running() ?
+        &nvstusb_usb_daemon_backend : &nvstusb_usb_libusb_backend;
+    }
+  }
+
+  const char *trace = getenv("NVSTUSB_TRACE");
+  if (0 != trace && 0 == nvstusb_usb_trace) nvstusb_usb_trace_start(trace);
+
+  if (!nvstusb_usb_backend->init()) return false;
+  nvstusb_usb_initialized = true;
+  return true;
+}
+
+/* shutdown usb */
+void
+nvstusb_usb_deinit(
+) {
+  if (!nvstusb_usb_initialized) return;
+
+  nvstusb_usb_backend->deinit();
+  nvstusb_usb_initialized = false;
+  nvstusb_usb_trace_stop();
+}
+
+/* open 3d controller */
+struct nvstusb_usb_device *
+nvstusb_usb_open_device(
+  const char *firmware
+) {
+  assert(nvstusb_usb_initialized);
+
+  struct nvstusb_usb_device *dev = nvstusb_usb_backend->open_device(firmware);
+  if (0 == dev) return 0;
+
+  dev->backend = nvstusb_usb_backend;
+  int i;
+  for (i = 0; i < NVSTUSB_USB_BUFFERS; i++) pthread_mutex_init(&dev->bufferLocks[i], 0);
+  pthread_mutex_init(&dev->countersLock, 0);
+  memset(dev->counters, 0, sizeof(dev->counters));
+  dev->closing = false;
+  return dev;
+}
+
+/* close the device */
+void
+nvstusb_usb_close_device(
+  struct nvstusb_usb_device *dev
+) {
+  if (0 == dev) return;
+  int i;
+  /* what the backend reaps while it closes is not counted */
+  dev->closing = true;
+  for (i = 0; i < NVSTUSB_USB_BUFFERS; i++) pthread_mutex_destroy(&dev->bufferLocks[i]);
+  pthread_mutex_destroy(&dev->countersLock);
+  dev->backend->close_device(dev);
+}
+
+/* send data to an endpoint, bulk transfer 
+ * returns the number of bytes sent or a negative libusb error */
+int
+nvstusb_usb_write_bulk(
+  struct nvstusb_usb_device *dev,
+  int endpoint,
+  const void *data,
+  int size,
+  unsigned int timeout
+) {
+  assert(dev != 0);
+
+  int error = 0;
+  NVSTUSB_PROBE2(usb_submit, endpoint, size);
+  uint64_t submit = nvstusb_usb_time_ns();
+  int res = dev->backend->write_bulk(dev, endpoint, data, size, timeout, &error);
+  uint64_t complete = nvstusb_usb_time_ns();
+  NVSTUSB_PROBE3(usb_complete, endpoint, size, res);
+  if (!(dev->postedWrites & (1u << endpoint))) nvstusb_usb_count(dev, endpoint, size, res, error, complete - submit);
+  nvstusb_usb_record(NVSTUSB_TRACE_BULK_OUT, endpoint, data, size, res, submit, complete);
+  return res;
+}
+
+/* receive data from an endpoint 
+ * returns the number of bytes received or a negative libusb error */
+int
+nvstusb_usb_read_bulk(
+  struct nvstusb_usb_device *dev,
+  int endpoint,
+  void *data,
+  int size,
+  unsigned int timeout
+) {
+  assert(dev != 0);
+
+  int error = 0;
+  NVSTUSB_PROBE2(usb_submit, endpoint | 0x80, size);
+  uint64_t submit = nvstusb_usb_time_ns();
+  int res = dev->backend->read_bulk(dev, endpoint, data, size, timeout, &error);
+  uint64_t complete = nvstusb_usb_time_ns();
+  NVSTUSB_PROBE3(usb_complete, endpoint | 0x80, size, res);
+  nvstusb_usb_count(dev, endpoint | 0x80, size, res, error, complete - submit);
+  nvstusb_usb_record(NVSTUSB_TRACE_BULK_IN, endpoint | 0x80, data, res, res, submit, complete);
+  return res;
+}
+
+/* keep count IN transfers queued on an endpoint */
+bool
+nvstusb_usb_post_reads(
+  struct nvstusb_usb_device *dev,
+  int endpoint,
+  int count,
+  int size
+) {
+  assert(dev != 0);
+  return dev->backend->post_reads(dev, endpoint, count, size);
+}
+
+/* a posted read completed, called by the backends */
+void
+nvstusb_usb_posted_done(
+  struct nvstusb_usb_device *dev,
+  int endpoint,
+  int size,
+  int res,
+  int error,
+  uint64_t submit,
+  uint64_t complete
+) {
+  if (dev->closing) return;
+  nvstusb_usb_count(dev, endpoint | 0x80, size, res, error, complete > submit ? complete - submit : 0);
+}
+
+/* a posted write completed, called by the backends */
+void
+nvstusb_usb_posted_write_done(
+  struct nvstusb_usb_device *dev,
+  int endpoint,
+  int size,
+  int res,
+  int error,
+  uint64_t submit,
+  uint64_t complete
+) {
+  if (dev->closing) return;
+  nvstusb_usb_count(dev, endpoint, size, res, error, complete > submit ? complete - submit : 0);
+}
+
+/* take the oldest completed posted read, recorded with the times the
+ * backend stamped it with, or the time it is taken. It was counted
+ * when it completed. */
+int
+nvstusb_usb_reap_bulk_times(
+  struct nvstusb_usb_device *dev,
+  int endpoint,
+  void *data,
+  int size,
+  uint64_t *submit,
+  uint64_t *complete
+) {
+  assert(dev != 0);
+
+  *submit = *complete = 0;
+  int res = dev->backend->reap_bulk(dev, endpoint, data, size, submit, complete);
+  if (0 != res) NVSTUSB_PROBE2(usb_reap, endpoint | 0x80, res);
+  if (0 == *complete) *complete = nvstusb_usb_time_ns();
+  if (0 == *submit) *submit = *complete;
+  if (res > 0) nvstusb_usb_record(NVSTUSB_TRACE_BULK_IN, endpoint | 0x80, data, res, res, *submit, *complete);
+  return res;
+}
+
+int
+nvstusb_usb_reap_bulk(
+  struct nvstusb_usb_device *dev,
+  int endpoint,
+  void *data,
+  int size
+) {
+  uint64_t submit, complete;
+  return nvstusb_usb_reap_bulk_times(dev, endpoint, data, size, &submit, &complete);
+}
+
+/* a buffer to build packets in, from the backend if it has them. It is
+ * held until released, the backend may reuse its transfer then. */
+void *
+nvstusb_usb_buffer(
+  struct nvstusb_usb_device *dev,
+  int buffer
+) {
+  assert(dev != 0);
+  assert(buffer >= 0 && buffer < NVSTUSB_USB_BUFFERS);
+
+  pthread_mutex_lock(&dev->bufferLocks[buffer]);
+  void *data = 0;
+  if (0 != dev->backend->buffer) data = dev->backend->buffer(dev, buffer);
+  return 0 != data ? data : dev->buffers[buffer];
+}
+
+void
+nvstusb_usb_release_buffer(
+  struct nvstusb_usb_device *dev,
+  int buffer
+) {
+  assert(dev != 0);
+  assert(buffer >= 0 && buffer < NVSTUSB_USB_BUFFERS);
+  pthread_mutex_unlock(&dev->bufferLocks[buffer]);
+}
+
+/* run completions, waiting at most timeout_us for one */
+int
+nvstusb_usb_handle_events(
+  struct nvstusb_usb_device *dev,
+  int timeout_us
+) {
+  assert(dev != 0);
+  return dev->backend->handle_events(dev, timeout_us);
+}
+
+/* descriptor of the backend for event loops */
+int
+nvstusb_usb_get_fd(
+  struct nvstusb_usb_device *dev
+) {
+  assert(dev != 0);
+  if (0 == dev->backend->get_fd) return -1;
+  return dev->backend->get_fd(dev);
+}
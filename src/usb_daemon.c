@@ -0,0 +1,478 @@
+/* usb_daemon.c
+ *
+ * Reach the controller through nvstusbd, which holds the device and has
+ * loaded the firmware already. Writes are posted to the daemon's ring
+ * and return at once, reads wait for the daemon's reply.
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "usb_backend.h"
+#include "ipc.h"
+#include "log.h"
+
+/* posted read completions kept until they are reaped */
+#define NVSTUSB_DAEMON_QUEUE  16
+
+/* longest single wait for the doorbell, another thread may have taken it */
+#define NVSTUSB_DAEMON_SLICE  1
+
+struct nvstusb_daemon_device {
+  struct nvstusb_usb_device base;
+
+  int sock;
+  int cmdBell;
+  int replyBell;
+  struct nvstusb_ipc_shm *shm;
+
+  /* the rings have one producer and one consumer, the lock makes the
+   * threads of this process one of each */
+  pthread_mutex_t lock;
+
+  uint32_t seq;
+  struct nvstusb_ipc_msg reply;   /* newest reply to a read or post_reads */
+
+  int readSize;                   /* of the posted reads */
+
+  struct nvstusb_ipc_msg queue[NVSTUSB_DAEMON_QUEUE];
+  int queueHead;
+  int queueCount;
+
+  int writeError;                 /* reported by the daemon, returned once */
+  bool hungUp;
+
+  int epoll;                      /* of nvstusb_daemon_get_fd, -1 if not asked for */
+};
+
+/* connect to the daemon socket, -1 if nobody listens */
+static int
+nvstusb_daemon_connect(
+) {
+  const char *path = nvstusb_ipc_socket_path();
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) return -1;
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/* connecting and hanging up before the hello costs the daemon nothing */
+bool
+nvstusb_usb_daemon_running(
+) {
+  int sock = nvstusb_daemon_connect();
+  if (sock < 0) return false;
+  close(sock);
+  return true;
+}
+
+static bool
+nvstusb_daemon_init(
+) {
+  return true;
+}
+
+static void
+nvstusb_daemon_deinit(
+) {
+}
+
+static struct nvstusb_usb_device *
+nvstusb_daemon_open_device(
+  const char *firmware
+) {
+  int sock = nvstusb_daemon_connect();
+  if (sock < 0) {
+    NVSTUSB_LOG(nvstusb_log_error, "No nvstusbd listening on %s", nvstusb_ipc_socket_path());
+    return 0;
+  }
+
+  /* hello, then shm, command doorbell, reply doorbell */
+  uint8_t hello = NVSTUSB_IPC_VERSION;
+  int fds[3];
+  if (send(sock, &hello, 1, MSG_NOSIGNAL) != 1 || !nvstusb_ipc_recv_fds(sock, fds, 3)) {
+    close(sock);
+    return 0;
+  }
+
+  struct nvstusb_ipc_shm *shm = mmap(0, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  close(fds[0]);
+  if (MAP_FAILED == shm || shm->magic != NVSTUSB_IPC_MAGIC) {
+    NVSTUSB_LOG(nvstusb_log_error, "Bad shared memory from nvstusbd");
+    if (MAP_FAILED != shm) munmap(shm, sizeof(*shm));
+    close(fds[1]);
+    close(fds[2]);
+    close(sock);
+    return 0;
+  }
+
+  NVSTUSB_LOG(nvstusb_log_info, "Using the controller held by nvstusbd...");
+
+  struct nvstusb_daemon_device *dev = (struct nvstusb_daemon_device *) calloc(1, sizeof(*dev));
+  dev->sock = sock;
+  dev->epoll = -1;
+  dev->shm = shm;
+  dev->cmdBell = fds[1];
+  dev->replyBell = fds[2];
+  pthread_mutex_init(&dev->lock, 0);
+  return &dev->base;
+}
+
+static void
+nvstusb_daemon_close_device(
+  struct nvstusb_usb_device *base
+) {
+  struct nvstusb_daemon_device *dev = (struct nvstusb_daemon_device *) base;
+  if (0 == dev) return;
+
+  munmap(dev->shm, sizeof(*dev->shm));
+  if (dev->epoll >= 0) close(dev->epoll);
+  close(dev->cmdBell);
+  close(dev->replyBell);
+  close(dev->sock);
+  pthread_mutex_destroy(&dev->lock);
+  free(dev);
+}
+
+/* move everything the daemon posted into the device, lock held */
+static void
+nvstusb_daemon_drain(
+  struct nvstusb_daemon_device *dev
+) {
+  struct nvstusb_ipc_msg msg;
+  while (nvstusb_ipc_pop(&dev->shm->reply, &msg)) {
+    switch (msg.type) {
+    case nvstusb_ipc_read_done:
+    case nvstusb_ipc_post_reads_done:
+      dev->reply = msg;
+      break;
+
+    case nvstusb_ipc_posted_done:
+      /* completed in the daemon, it is counted as it arrives */
+      nvstusb_usb_posted_done(&dev->base, msg.endpoint, dev->readSize, msg.result, 0, msg.submit, msg.complete);
+      if (dev->queueCount == NVSTUSB_DAEMON_QUEUE) {
+        /* nobody reaps, drop the oldest */
+        dev->queueHead = (dev->queueHead + 1) % NVSTUSB_DAEMON_QUEUE;
+        dev->queueCount--;
+      }
+      dev->queue[(dev->queueHead + dev->queueCount) % NVSTUSB_DAEMON_QUEUE] = msg;
+      dev->queueCount++;
+      break;
+
+    case nvstusb_ipc_write_failed:
+      dev->writeError = msg.result;
+      break;
+    }
+  }
+}
+
+/* wait for the reply doorbell or the daemon hanging up, lock not held */
+static void
+nvstusb_daemon_wait(
+  struct nvstusb_daemon_device *dev,
+  int timeout_us
+) {
+  struct pollfd pfd[2] = {
+    { dev->replyBell, POLLIN, 0 },
+    { dev->sock, POLLIN, 0 }
+  };
+  struct timespec ts = { timeout_us / 1000000, (timeout_us % 1000000) * 1000 };
+  if (ppoll(pfd, 2, &ts, 0) <= 0) return;
+
+  if (pfd[0].revents & POLLIN) {
+    uint64_t count;
+    if (read(dev->replyBell, &count, sizeof(count)) < 0) {
+      /* the other thread took it */
+    }
+  }
+  if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+    if (!dev->hungUp) NVSTUSB_LOG(nvstusb_log_warning, "nvstusbd went away");
+    dev->hungUp = true;
+  }
+}
+
+/* error the device is in, 0 if it works */
+static int
+nvstusb_daemon_error(
+  struct nvstusb_daemon_device *dev
+) {
+  if (dev->hungUp) return NVSTUSB_USB_ERROR_NO_DEVICE;
+  return __atomic_load_n(&dev->shm->status, __ATOMIC_ACQUIRE);
+}
+
+/* post a command, waiting for room at most timeout ms */
+static int
+nvstusb_daemon_post(
+  struct nvstusb_daemon_device *dev,
+  struct nvstusb_ipc_msg *msg,
+  unsigned int timeout
+) {
+  uint64_t start = nvstusb_usb_time_ns();
+  msg->timeout = timeout;
+  msg->deadline = timeout ? start + timeout*1000000ULL : 0;
+
+  for (;;) {
+    int res = nvstusb_daemon_error(dev);
+    if (res < 0) return res;
+
+    pthread_mutex_lock(&dev->lock);
+    bool posted = nvstusb_ipc_push(&dev->shm->cmd, msg);
+    pthread_mutex_unlock(&dev->lock);
+    if (posted) break;
+
+    if (timeout && nvstusb_usb_time_ns() - start >= timeout*1000000ULL) {
+      return NVSTUSB_USB_ERROR_TIMEOUT;
+    }
+    usleep(100);
+  }
+  nvstusb_ipc_ring_bell(dev->cmdBell);
+  return 0;
+}
+
+/* the write is queued and counted as sent, a failure is returned by the
+ * next write once that one is queued */
+static int
+nvstusb_daemon_write_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  const void *data,
+  int size,
+  unsigned int timeout,
+  int *error
+) {
+  struct nvstusb_daemon_device *dev = (struct nvstusb_daemon_device *) base;
+  assert(dev != 0);
+  assert(size <= NVSTUSB_IPC_DATA);
+
+  struct nvstusb_ipc_msg msg;
+  memset(&msg, 0, sizeof(msg) - sizeof(msg.data));
+  msg.type = nvstusb_ipc_write;
+  msg.endpoint = endpoint;
+  msg.length = size;
+  memcpy(msg.data, data, size);
+
+  int res = nvstusb_daemon_post(dev, &msg, timeout);
+  if (res < 0) return res;
+
+  /* an earlier write failed in the daemon */
+  pthread_mutex_lock(&dev->lock);
+  nvstusb_daemon_drain(dev);
+  int failed = dev->writeError;
+  dev->writeError = 0;
+  pthread_mutex_unlock(&dev->lock);
+  if (failed < 0) return failed;
+  return size;
+}
+
+/* wait for the daemon's reply of type to the message seq, returns its
+ * result and copies its data. The daemon times the message out itself
+ * after timeout ms, it gets a second more to answer. */
+static int
+nvstusb_daemon_wait_reply(
+  struct nvstusb_daemon_device *dev,
+  int type,
+  uint32_t seq,
+  unsigned int timeout,
+  void *data
+) {
+  uint64_t limit = timeout ? nvstusb_usb_time_ns() + (timeout + 1000)*1000000ULL : 0;
+  for (;;) {
+    int res;
+    pthread_mutex_lock(&dev->lock);
+    nvstusb_daemon_drain(dev);
+    bool done = dev->reply.type == type && dev->reply.seq == seq;
+    if (done) {
+      res = dev->reply.result;
+      if (res > 0 && 0 != data) memcpy(data, dev->reply.data, res);
+    }
+    pthread_mutex_unlock(&dev->lock);
+    if (done) return res;
+
+    res = nvstusb_daemon_error(dev);
+    if (res < 0) return res;
+    if (limit && nvstusb_usb_time_ns() >= limit) return NVSTUSB_USB_ERROR_TIMEOUT;
+
+    nvstusb_daemon_wait(dev, NVSTUSB_DAEMON_SLICE*1000);
+  }
+}
+
+static int
+nvstusb_daemon_read_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  void *data,
+  int size,
+  unsigned int timeout,
+  int *error
+) {
+  struct nvstusb_daemon_device *dev = (struct nvstusb_daemon_device *) base;
+  assert(dev != 0);
+  if (size > NVSTUSB_IPC_DATA) size = NVSTUSB_IPC_DATA;
+
+  struct nvstusb_ipc_msg msg;
+  memset(&msg, 0, sizeof(msg) - sizeof(msg.data));
+  msg.type = nvstusb_ipc_read;
+  msg.endpoint = endpoint;
+  msg.length = size;
+
+  pthread_mutex_lock(&dev->lock);
+  msg.seq = ++dev->seq;
+  pthread_mutex_unlock(&dev->lock);
+
+  int res = nvstusb_daemon_post(dev, &msg, timeout);
+  if (res < 0) return res;
+  return nvstusb_daemon_wait_reply(dev, nvstusb_ipc_read_done, msg.seq, timeout, data);
+}
+
+/* the daemon keeps the reads queued and forwards the completions of
+ * this client's read commands, true once it confirmed that */
+static bool
+nvstusb_daemon_post_reads(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  int count,
+  int size
+) {
+  struct nvstusb_daemon_device *dev = (struct nvstusb_daemon_device *) base;
+  assert(dev != 0);
+  if (size > NVSTUSB_IPC_DATA || count > 255) return false;
+
+  struct nvstusb_ipc_msg msg;
+  memset(&msg, 0, sizeof(msg) - sizeof(msg.data));
+  msg.type = nvstusb_ipc_post_reads;
+  msg.endpoint = endpoint;
+  msg.length = count << 8 | size;
+
+  pthread_mutex_lock(&dev->lock);
+  msg.seq = ++dev->seq;
+  dev->readSize = size;
+  pthread_mutex_unlock(&dev->lock);
+
+  if (nvstusb_daemon_post(dev, &msg, 1000) < 0) return false;
+  int res = nvstusb_daemon_wait_reply(dev, nvstusb_ipc_post_reads_done, msg.seq, 1000, 0);
+  if (res < 0) NVSTUSB_LOG(nvstusb_log_warning, "nvstusbd did not post reads, error %d", res);
+  return 0 == res;
+}
+
+static int
+nvstusb_daemon_reap_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  void *data,
+  int size,
+  uint64_t *submit,
+  uint64_t *complete
+) {
+  struct nvstusb_daemon_device *dev = (struct nvstusb_daemon_device *) base;
+  assert(dev != 0);
+
+  /* the daemon's clock is the same monotonic clock */
+  int len = 0;
+  pthread_mutex_lock(&dev->lock);
+  nvstusb_daemon_drain(dev);
+  while (dev->queueCount > 0 && 0 == len) {
+    struct nvstusb_ipc_msg *msg = &dev->queue[dev->queueHead];
+    dev->queueHead = (dev->queueHead + 1) % NVSTUSB_DAEMON_QUEUE;
+    dev->queueCount--;
+    if (msg->endpoint != endpoint) continue;
+
+    len = msg->result < size ? msg->result : size;
+    if (len > 0) memcpy(data, msg->data, len);
+    *submit = msg->submit;
+    *complete = msg->complete;
+  }
+  pthread_mutex_unlock(&dev->lock);
+  return len;
+}
+
+/* wait until the daemon posts something, at most timeout_us */
+static int
+nvstusb_daemon_handle_events(
+  struct nvstusb_usb_device *base,
+  int timeout_us
+) {
+  struct nvstusb_daemon_device *dev = (struct nvstusb_daemon_device *) base;
+  assert(dev != 0);
+
+  /* an event loop calls without a timeout once the doorbell rang, it
+   * has to be cleared before draining or it keeps the loop spinning */
+  if (0 == timeout_us) nvstusb_daemon_wait(dev, 0);
+
+  pthread_mutex_lock(&dev->lock);
+  nvstusb_daemon_drain(dev);
+  bool pending = dev->queueCount > 0;
+  pthread_mutex_unlock(&dev->lock);
+
+  if (!pending && timeout_us > 0) nvstusb_daemon_wait(dev, timeout_us);
+  return dev->hungUp ? NVSTUSB_USB_ERROR_NO_DEVICE : 0;
+}
+
+/* the reply doorbell and the socket, which only becomes readable when
+ * the daemon goes away */
+static int
+nvstusb_daemon_get_fd(
+  struct nvstusb_usb_device *base
+) {
+  struct nvstusb_daemon_device *dev = (struct nvstusb_daemon_device *) base;
+  assert(dev != 0);
+  if (dev->epoll >= 0) return dev->epoll;
+
+  int epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll < 0) return -1;
+
+  int fds[2] = { dev->replyBell, dev->sock };
+  int i;
+  for (i = 0; i < 2; i++) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fds[i];
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, fds[i], &ev) < 0) {
+      close(epoll);
+      return -1;
+    }
+  }
+  dev->epoll = epoll;
+  return epoll;
+}
+
+const struct nvstusb_usb_backend nvstusb_usb_daemon_backend = {
+  "daemon",
+  nvstusb_daemon_init,
+  nvstusb_daemon_deinit,
+  nvstusb_daemon_open_device,
+  nvstusb_daemon_close_device,
+  nvstusb_daemon_write_bulk,
+  nvstusb_daemon_read_bulk,
+  nvstusb_daemon_post_reads,
+  nvstusb_daemon_reap_bulk,
+  nvstusb_daemon_handle_events,
+  0,
+  nvstusb_daemon_get_fd
+};
@@ -0,0 +1,238 @@
+/* usb_emu.c
+ *
+ * An emulated controller: the firmware runs in fx2emu, kept in step
+ * with the wall clock by a thread. $NVSTUSB_EMU_VCD names a file that
+ * receives the port pins as a value change dump.
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "usb_backend.h"
+#include "fx2emu.h"
+#include "log.h"
+
+/* how often the emulation catches up with the wall clock */
+#define NVSTUSB_EMU_STEP_US   250
+
+struct nvstusb_emu_device {
+  struct nvstusb_usb_device base;
+
+  pthread_mutex_t lock;
+  struct fx2emu emu;
+  uint64_t start;         /* wall clock at emulated time 0 */
+
+  pthread_t thread;
+  volatile bool running;
+
+  int readEndpoint;       /* posted reads, -1 if none */
+  int readSize;
+  uint64_t readSubmitted; /* since when the next one waits */
+  FILE *vcd;
+};
+
+static bool
+nvstusb_emu_init(
+) {
+  return true;
+}
+
+static void
+nvstusb_emu_deinit(
+) {
+}
+
+/* run the firmware up to now, lock held */
+static void
+nvstusb_emu_catch_up(
+  struct nvstusb_emu_device *dev
+) {
+  fx2emu_run(&dev->emu, nvstusb_usb_time_ns() - dev->start);
+}
+
+static void *
+nvstusb_emu_thread(
+  void *arg
+) {
+  struct nvstusb_emu_device *dev = arg;
+  while (dev->running) {
+    pthread_mutex_lock(&dev->lock);
+    nvstusb_emu_catch_up(dev);
+    pthread_mutex_unlock(&dev->lock);
+    usleep(NVSTUSB_EMU_STEP_US);
+  }
+  return 0;
+}
+
+static struct nvstusb_usb_device *
+nvstusb_emu_open_device(
+  const char *firmware
+) {
+  const char *image = getenv("NVSTUSB_EMU_FIRMWARE");
+  if (0 == image) image = firmware;
+
+  struct nvstusb_emu_device *dev = (struct nvstusb_emu_device *) calloc(1, sizeof(*dev));
+  fx2emu_init(&dev->emu);
+  if (!fx2emu_load(&dev->emu, image)) {
+    free(dev);
+    return 0;
+  }
+  NVSTUSB_LOG(nvstusb_log_info, "Emulating the controller with %s...", image);
+
+  const char *vcd = getenv("NVSTUSB_EMU_VCD");
+  if (0 != vcd) {
+    dev->vcd = fopen(vcd, "w");
+    if (0 == dev->vcd) NVSTUSB_LOG(nvstusb_log_error, "%s: %s", vcd, strerror(errno));
+    else fx2emu_trace_vcd(&dev->emu, dev->vcd);
+  }
+
+  pthread_mutex_init(&dev->lock, 0);
+  dev->readEndpoint = -1;
+  dev->start = nvstusb_usb_time_ns();
+  dev->running = true;
+  pthread_create(&dev->thread, 0, nvstusb_emu_thread, dev);
+  return &dev->base;
+}
+
+static void
+nvstusb_emu_close_device(
+  struct nvstusb_usb_device *base
+) {
+  struct nvstusb_emu_device *dev = (struct nvstusb_emu_device *) base;
+  if (0 == dev) return;
+
+  dev->running = false;
+  pthread_join(dev->thread, 0);
+  if (0 != dev->vcd) fclose(dev->vcd);
+  if (dev->emu.bad_opcodes) {
+    NVSTUSB_LOG(nvstusb_log_warning, "the firmware ran %u undefined opcodes", dev->emu.bad_opcodes);
+  }
+  pthread_mutex_destroy(&dev->lock);
+  free(dev);
+}
+
+/* wait for the firmware to accept the packet like a NAKed transfer */
+static int
+nvstusb_emu_write_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  const void *data,
+  int size,
+  unsigned int timeout,
+  int *error
+) {
+  struct nvstusb_emu_device *dev = (struct nvstusb_emu_device *) base;
+  assert(dev != 0);
+
+  uint64_t limit = timeout ? nvstusb_usb_time_ns() + timeout*1000000ULL : 0;
+  for (;;) {
+    pthread_mutex_lock(&dev->lock);
+    nvstusb_emu_catch_up(dev);
+    bool sent = fx2emu_write(&dev->emu, endpoint, data, size);
+    pthread_mutex_unlock(&dev->lock);
+    if (sent) return size;
+
+    if (limit && nvstusb_usb_time_ns() >= limit) return NVSTUSB_USB_ERROR_TIMEOUT;
+    usleep(NVSTUSB_EMU_STEP_US);
+  }
+}
+
+static int
+nvstusb_emu_read_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  void *data,
+  int size,
+  unsigned int timeout,
+  int *error
+) {
+  struct nvstusb_emu_device *dev = (struct nvstusb_emu_device *) base;
+  assert(dev != 0);
+
+  uint64_t limit = timeout ? nvstusb_usb_time_ns() + timeout*1000000ULL : 0;
+  for (;;) {
+    pthread_mutex_lock(&dev->lock);
+    nvstusb_emu_catch_up(dev);
+    int len = fx2emu_read(&dev->emu, endpoint, data, size);
+    pthread_mutex_unlock(&dev->lock);
+    if (len > 0) return len;
+
+    if (limit && nvstusb_usb_time_ns() >= limit) return NVSTUSB_USB_ERROR_TIMEOUT;
+    usleep(NVSTUSB_EMU_STEP_US);
+  }
+}
+
+/* the endpoint's buffers are polled when reaped */
+static bool
+nvstusb_emu_post_reads(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  int count,
+  int size
+) {
+  struct nvstusb_emu_device *dev = (struct nvstusb_emu_device *) base;
+  assert(dev != 0);
+  dev->readEndpoint = endpoint;
+  dev->readSize = size;
+  dev->readSubmitted = nvstusb_usb_time_ns();
+  return true;
+}
+
+static int
+nvstusb_emu_reap_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  void *data,
+  int size,
+  uint64_t *submit,
+  uint64_t *complete
+) {
+  struct nvstusb_emu_device *dev = (struct nvstusb_emu_device *) base;
+  assert(dev != 0);
+  if (endpoint != dev->readEndpoint) return 0;
+
+  pthread_mutex_lock(&dev->lock);
+  nvstusb_emu_catch_up(dev);
+  int len = fx2emu_read(&dev->emu, endpoint, data, size);
+  if (len > 0) {
+    /* the next read is queued as this one completes */
+    *submit = dev->readSubmitted;
+    *complete = dev->readSubmitted = nvstusb_usb_time_ns();
+  }
+  pthread_mutex_unlock(&dev->lock);
+
+  /* completes when it is taken */
+  if (len > 0) nvstusb_usb_posted_done(base, endpoint, dev->readSize, len, 0, *submit, *complete);
+  return len;
+}
+
+static int
+nvstusb_emu_handle_events(
+  struct nvstusb_usb_device *base,
+  int timeout_us
+) {
+  usleep(timeout_us < NVSTUSB_EMU_STEP_US ? timeout_us : NVSTUSB_EMU_STEP_US);
+  return 0;
+}
+
+const struct nvstusb_usb_backend nvstusb_usb_emu_backend = {
+  "emu",
+  nvstusb_emu_init,
+  nvstusb_emu_deinit,
+  nvstusb_emu_open_device,
+  nvstusb_emu_close_device,
+  nvstusb_emu_write_bulk,
+  nvstusb_emu_read_bulk,
+  nvstusb_emu_post_reads,
+  nvstusb_emu_reap_bulk,
+  nvstusb_emu_handle_events
+};
@@ -1,15 +1,90 @@
-#include "usb.h"
+#include "usb_backend.h"
+#include "probes.h"
+#include "log.h"
 #include <libusb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
 #include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <poll.h>
 
 static struct libusb_context *nvstusb_usb_context = 0;
-static const int nvstusb_usb_debug_level = 3;
 
-struct nvstusb_usb_device {
+/* libusb's verbosity, -1 = $NVSTUSB_USB_DEBUG or 0 */
+static int nvstusb_usb_debug_level = -1;
+
+/* posted reads in flight and completed replies kept for reaping */
+#define NVSTUSB_USB_MAX_READS   8
+#define NVSTUSB_USB_REPLIES     32
+#define NVSTUSB_USB_REPLY_SIZE  64
+
+/* transfers with buffers of their own, for writes not from a device
+ * buffer and for reads */
+#define NVSTUSB_USB_IO_SIZE     64
+
+/* libusb_dev_mem_alloc came with libusb 1.0.21 */
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+#define NVSTUSB_USB_DEV_MEM     1
+#endif
+
+/* a transfer kept for the life of the device, its buffer mapped from
+ * the kernel (no copy on submit) or page aligned and locked */
+struct nvstusb_usb_buffer {
+  struct libusb_transfer *transfer;
+  unsigned char *data;
+  int size;
+  bool devMem;
+  int completed;
+};
+
+/* a posted read, with the device its completion belongs to */
+struct nvstusb_usb_read {
+  struct nvstusb_usb_buffer buf;
+  struct nvstusb_libusb_device *dev;
+  uint64_t submitted;
+};
+
+/* a completed IN transfer */
+struct nvstusb_usb_reply {
+  int length;
+  uint64_t submit;
+  uint64_t complete;
+  uint8_t data[NVSTUSB_USB_REPLY_SIZE];
+};
+
+struct nvstusb_libusb_device {
+  struct nvstusb_usb_device base;
   struct libusb_device_handle *handle;
+
+  /* the device buffers, written from in place */
+  struct nvstusb_usb_buffer buffers[NVSTUSB_USB_BUFFERS];
+
+  /* other writes are copied into out, reads land in in */
+  pthread_mutex_t ioLock;
+  struct nvstusb_usb_buffer out;
+  struct nvstusb_usb_buffer in;
+
+  /* posted reads */
+  int readEndpoint;
+  int numReads;
+  int activeReads;
+  struct nvstusb_usb_read reads[NVSTUSB_USB_MAX_READS];
+
+  /* ring of completed replies, filled from the libusb callback */
+  pthread_mutex_t replyLock;
+  unsigned int replyHead;
+  unsigned int replyTail;
+  struct nvstusb_usb_reply replies[NVSTUSB_USB_REPLIES];
+
+  /* epoll set of libusb's descriptors for nvstusb_libusb_get_fd, -1
+   * until asked for, and the next device that has one */
+  int epoll;
+  struct nvstusb_libusb_device *nextPolled;
 };
 
  /* convert a libusb error to a readable string */
@@ -36,9 +111,44 @@ libusb_error_to_string(
   return "Unknown error";
 }  
 
+/* libusb's verbosity, 0 (none) to 4 (debug) */
+void
+nvstusb_libusb_set_debug(
+  int level
+) {
+  nvstusb_usb_debug_level = level;
+  if (0 == nvstusb_usb_context) return;
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000106
+  libusb_set_option(nvstusb_usb_context, LIBUSB_OPTION_LOG_LEVEL, level);
+#else
+  libusb_set_debug(nvstusb_usb_context, level);
+#endif
+}
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000107
+static void
+nvstusb_libusb_log(
+  struct libusb_context *ctx,
+  enum libusb_log_level level,
+  const char *message
+) {
+  static const enum nvstusb_log_level levels[] = {
+    nvstusb_log_error, nvstusb_log_error, nvstusb_log_warning, nvstusb_log_info, nvstusb_log_debug
+  };
+  /* rate limited per level, a flood of debug messages does not
+   * suppress the errors */
+  static struct nvstusb_log_site sites[LIBUSB_LOG_LEVEL_DEBUG + 1];
+  int i = level <= LIBUSB_LOG_LEVEL_DEBUG ? level : LIBUSB_LOG_LEVEL_DEBUG;
+  int len = strlen(message);
+  while (len > 0 && message[len-1] == '\n') len--;
+  nvstusb_log_at(&sites[i], levels[i], "libusb: %.*s", len, message);
+}
+#endif
+
 /* initialize usb */
-bool 
-nvstusb_usb_init(
+static bool
+nvstusb_libusb_init(
 ) {
   if (0 != nvstusb_usb_context) {
     return true;
@@ -47,32 +157,105 @@ nvstusb_usb_init(
   struct libusb_context *ctx = 0;
   libusb_init(&ctx);
   if (0 == ctx) {
-    fprintf(stderr, "nvstusb: Could not initialize libusb\n");
+    NVSTUSB_LOG(nvstusb_log_error, "Could not initialize libusb");
     return false;
   }
 
-  libusb_set_debug(ctx, nvstusb_usb_debug_level);
-  fprintf(stderr, "nvstusb: libusb initialized, debug level %d\n", nvstusb_usb_debug_level);
-
   nvstusb_usb_context = ctx;
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000107
+  /* its messages queue up with ours instead of going to stderr */
+  libusb_set_log_cb(ctx, nvstusb_libusb_log, LIBUSB_LOG_CB_CONTEXT);
+#endif
+  if (nvstusb_usb_debug_level < 0) {
+    const char *env = getenv("NVSTUSB_USB_DEBUG");
+    nvstusb_usb_debug_level = env ? atoi(env) : 0;
+  }
+  nvstusb_libusb_set_debug(nvstusb_usb_debug_level);
+  NVSTUSB_LOG(nvstusb_log_info, "libusb initialized, debug level %d", nvstusb_usb_debug_level);
   return true;
 }
 
+/* devices with an epoll set. libusb has one set of pollfd notifiers
+ * for the context, they keep the set of every device up to date. */
+static pthread_mutex_t nvstusb_libusb_poll_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct nvstusb_libusb_device *nvstusb_libusb_polled = 0;
+
+static void
+nvstusb_libusb_epoll_add(
+  int epoll,
+  int fd,
+  short events
+) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+  ev.data.fd = fd;
+  if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev) < 0 && errno == EEXIST) {
+    epoll_ctl(epoll, EPOLL_CTL_MOD, fd, &ev);
+  }
+}
+
+static void
+nvstusb_libusb_pollfd_added(
+  int fd,
+  short events,
+  void *user_data
+) {
+  pthread_mutex_lock(&nvstusb_libusb_poll_lock);
+  struct nvstusb_libusb_device *dev;
+  for (dev = nvstusb_libusb_polled; 0 != dev; dev = dev->nextPolled) {
+    nvstusb_libusb_epoll_add(dev->epoll, fd, events);
+  }
+  pthread_mutex_unlock(&nvstusb_libusb_poll_lock);
+}
+
+static void
+nvstusb_libusb_pollfd_removed(
+  int fd,
+  void *user_data
+) {
+  pthread_mutex_lock(&nvstusb_libusb_poll_lock);
+  struct nvstusb_libusb_device *dev;
+  for (dev = nvstusb_libusb_polled; 0 != dev; dev = dev->nextPolled) {
+    epoll_ctl(dev->epoll, EPOLL_CTL_DEL, fd, 0);
+  }
+  pthread_mutex_unlock(&nvstusb_libusb_poll_lock);
+}
+
+/* drop the epoll set of a device */
+static void
+nvstusb_libusb_unpoll(
+  struct nvstusb_libusb_device *dev
+) {
+  if (dev->epoll < 0) return;
+
+  pthread_mutex_lock(&nvstusb_libusb_poll_lock);
+  struct nvstusb_libusb_device **p = &nvstusb_libusb_polled;
+  while (*p != dev) p = &(*p)->nextPolled;
+  *p = dev->nextPolled;
+  if (0 == nvstusb_libusb_polled) libusb_set_pollfd_notifiers(nvstusb_usb_context, 0, 0, 0);
+  pthread_mutex_unlock(&nvstusb_libusb_poll_lock);
+
+  close(dev->epoll);
+  dev->epoll = -1;
+}
+
 /* shutdown usb */
-void
-nvstusb_usb_deinit(
+static void
+nvstusb_libusb_deinit(
 ) {
   if (0 == nvstusb_usb_context) return;
 
   libusb_exit(nvstusb_usb_context);
-  fprintf(stderr, "nvstusb: libusb deinitialized\n");
+  NVSTUSB_LOG(nvstusb_log_debug, "libusb deinitialized");
 
   nvstusb_usb_context = 0;
 }
     
 /* get the number of endpoints on a device */
 static int
-nvstusb_usb_get_numendpoints(
+nvstusb_libusb_get_numendpoints(
   struct libusb_device_handle *handle
 ) {
   assert(handle != 0);
@@ -81,40 +264,40 @@ nvstusb_usb_get_numendpoints(
   struct libusb_config_descriptor *cfgDesc = 0;
   int res = libusb_get_active_config_descriptor(dev, &cfgDesc);
   if (res < 0) {
-    fprintf(stderr, "nvstusb: Could not determine the number of endpoints... Error %d: %s\n", res, libusb_error_to_string(res));
+    NVSTUSB_LOG(nvstusb_log_error, "Could not determine the number of endpoints... Error %d: %s", res, libusb_error_to_string(res));
     return res;
   }
 
   int num = cfgDesc->interface->altsetting->bNumEndpoints;
   libusb_free_config_descriptor(cfgDesc);
-  fprintf(stderr, "nvstusb: Found %d endpoints...\n", num);
+  NVSTUSB_LOG(nvstusb_log_debug, "Found %d endpoints...", num);
   return num;
 }
 
 static bool
-nvstusb_usb_needs_firmware(
-  struct nvstusb_usb_device *dev
+nvstusb_libusb_needs_firmware(
+  struct nvstusb_libusb_device *dev
 ) {
   assert(dev != 0);
   assert(dev->handle != 0);
 
-  return nvstusb_usb_get_numendpoints(dev->handle) == 0;
+  return nvstusb_libusb_get_numendpoints(dev->handle) == 0;
 }
 
 
 /* upload firmware file */
 static int
-nvstusb_usb_load_firmware(
-  struct nvstusb_usb_device *dev,
+nvstusb_libusb_load_firmware(
+  struct nvstusb_libusb_device *dev,
   const char *filename
 ) {
   assert(dev != 0);
   assert(dev->handle != 0);
 
   FILE *fw = fopen(filename, "rb");
-  if (!fw) { perror(filename); return -1; }
+  if (!fw) { NVSTUSB_LOG(nvstusb_log_error, "%s: %s", filename, strerror(errno)); return -1; }
   
-  fprintf(stderr, "nvstusb: Loading firmware...\n");
+  NVSTUSB_LOG(nvstusb_log_info, "Loading firmware...");
 
   uint8_t lenPos[4];
   uint8_t buf[1024];
@@ -124,10 +307,11 @@ nvstusb_usb_load_firmware(
     uint16_t pos    = (lenPos[2]<<8) | lenPos[3];
   
     if (fread(buf, length, 1, fw) != 1) { 
-      perror(filename); 
+      NVSTUSB_LOG(nvstusb_log_error, "%s: %s", filename, strerror(errno)); 
       return LIBUSB_ERROR_OTHER; 
     }
 
+    uint64_t submit = nvstusb_usb_time_ns();
     int res = libusb_control_transfer(
       dev->handle,
       LIBUSB_REQUEST_TYPE_VENDOR, 
@@ -136,8 +320,10 @@ nvstusb_usb_load_firmware(
       buf, length,
       0
     );
+    nvstusb_usb_trace_control(LIBUSB_REQUEST_TYPE_VENDOR, 0xA0, pos, 0x0000,
+      buf, length, res, submit, nvstusb_usb_time_ns());
     if (res < 0) {
-      fprintf(stderr, "nvstusb: Error uploading firmware... Error %d: %s\n", res, libusb_error_to_string(res));
+      NVSTUSB_LOG(nvstusb_log_error, "Error uploading firmware... Error %d: %s", res, libusb_error_to_string(res));
       return res;
     }
   }
@@ -146,9 +332,53 @@ nvstusb_usb_load_firmware(
   return 0;
 }       
 
+/* allocate a transfer and its buffer */
+static bool
+nvstusb_libusb_alloc_buffer(
+  struct nvstusb_libusb_device *dev,
+  struct nvstusb_usb_buffer *buf,
+  int size
+) {
+  buf->size = size;
+  buf->transfer = libusb_alloc_transfer(0);
+  if (0 == buf->transfer) return false;
+
+#ifdef NVSTUSB_USB_DEV_MEM
+  buf->data = libusb_dev_mem_alloc(dev->handle, size);
+  buf->devMem = 0 != buf->data;
+#endif
+  if (0 == buf->data) {
+    void *data = 0;
+    if (0 != posix_memalign(&data, sysconf(_SC_PAGESIZE), size)) return false;
+    /* RLIMIT_MEMLOCK may not allow it, the buffer works unpinned */
+    if (0 != mlock(data, size)) {
+      NVSTUSB_LOG(nvstusb_log_warning, "Could not pin a %d byte transfer buffer: %s", size, strerror(errno));
+    }
+    buf->data = data;
+  }
+  return true;
+}
+
+static void
+nvstusb_libusb_free_buffer(
+  struct nvstusb_libusb_device *dev,
+  struct nvstusb_usb_buffer *buf
+) {
+  if (0 != buf->transfer) libusb_free_transfer(buf->transfer);
+  if (0 == buf->data) return;
+#ifdef NVSTUSB_USB_DEV_MEM
+  if (buf->devMem) {
+    libusb_dev_mem_free(dev->handle, buf->data, buf->size);
+    return;
+  }
+#endif
+  munlock(buf->data, buf->size);
+  free(buf->data);
+}
+
 /* open 3d controller */
-struct nvstusb_usb_device *
-nvstusb_usb_open_device(
+static struct nvstusb_usb_device *
+nvstusb_libusb_open_device(
   const char *firmware
 ) {
   assert(nvstusb_usb_context != 0);
@@ -158,78 +388,446 @@ nvstusb_usb_open_device(
     libusb_open_device_with_vid_pid(nvstusb_usb_context, 0x0955, 0x0007);
 
   if (0 == handle) {
-    fprintf(stderr, "nvstusb: No NVIDIA 3d stereo controller found...\n");
+    NVSTUSB_LOG(nvstusb_log_error, "No NVIDIA 3d stereo controller found...");
     return 0;
   }
 
-  fprintf(stderr, "nvstusb: Found NVIDIA 3d stereo controller...\n");
+  NVSTUSB_LOG(nvstusb_log_info, "Found NVIDIA 3d stereo controller...");
 
-  struct nvstusb_usb_device *dev = (struct nvstusb_usb_device *) malloc(sizeof(*dev));
+  struct nvstusb_libusb_device *dev = (struct nvstusb_libusb_device *) calloc(1, sizeof(*dev));
   dev->handle = handle;
-
-  if (nvstusb_usb_needs_firmware(dev)) {
-    if (nvstusb_usb_load_firmware(dev, firmware) < 0) {
+  dev->epoll = -1;
+  pthread_mutex_init(&dev->replyLock, 0);
+
+  bool needsFirmware = nvstusb_libusb_needs_firmware(dev);
+  if (needsFirmware) {
+    NVSTUSB_PROBE1(firmware, NVSTUSB_PROBE_FW_START);
+    if (nvstusb_libusb_load_firmware(dev, firmware) < 0) {
+      NVSTUSB_PROBE1(firmware, NVSTUSB_PROBE_FW_FAILED);
       free(dev);
       return 0;
     }
+    NVSTUSB_PROBE1(firmware, NVSTUSB_PROBE_FW_UPLOADED);
     libusb_reset_device(dev->handle);
     libusb_close(dev->handle);
     usleep(250000);
     handle = dev->handle = libusb_open_device_with_vid_pid(nvstusb_usb_context, 0x0955, 0x0007);
     libusb_reset_device(dev->handle);
     usleep(250000);
+    NVSTUSB_PROBE1(firmware, NVSTUSB_PROBE_FW_REOPENED);
   }
   libusb_set_configuration(dev->handle, 1); // TODO: error checking
   libusb_claim_interface(dev->handle, 0);   // TODO: error checking
+  if (needsFirmware) NVSTUSB_PROBE1(firmware, NVSTUSB_PROBE_FW_READY);
+
+  /* without them every transfer takes the allocating path of libusb */
+  int i;
+  bool buffers = true;
+  pthread_mutex_init(&dev->ioLock, 0);
+  for (i = 0; i < NVSTUSB_USB_BUFFERS; i++) {
+    buffers = buffers && nvstusb_libusb_alloc_buffer(dev, &dev->buffers[i], NVSTUSB_USB_BUFFER_SIZE);
+  }
+  buffers = buffers && nvstusb_libusb_alloc_buffer(dev, &dev->out, NVSTUSB_USB_IO_SIZE);
+  buffers = buffers && nvstusb_libusb_alloc_buffer(dev, &dev->in, NVSTUSB_USB_IO_SIZE);
+  if (!buffers) {
+    NVSTUSB_LOG(nvstusb_log_error, "Could not allocate transfer buffers");
+  } else if (!dev->in.devMem) {
+    NVSTUSB_LOG(nvstusb_log_warning, "Kernel transfer buffers not available, using locked memory");
+  }
+
+  return &dev->base;
+}
 
-  return dev;
+/* cancel posted reads and wait until libusb gave them back */
+static void
+nvstusb_libusb_cancel_reads(
+  struct nvstusb_libusb_device *dev
+) {
+  int i;
+  for (i = 0; i < dev->numReads; i++) {
+    libusb_cancel_transfer(dev->reads[i].buf.transfer);
+  }
+  while (dev->activeReads > 0) {
+    struct timeval tv = { 0, 100000 };
+    if (libusb_handle_events_timeout(nvstusb_usb_context, &tv) < 0) break;
+  }
+  for (i = 0; i < dev->numReads; i++) {
+    nvstusb_libusb_free_buffer(dev, &dev->reads[i].buf);
+  }
+  dev->numReads = 0;
 }
 
 /* close the device */
-void
-nvstusb_usb_close_device(
-  struct nvstusb_usb_device *dev
+static void
+nvstusb_libusb_close_device(
+  struct nvstusb_usb_device *base
 ) {
+  struct nvstusb_libusb_device *dev = (struct nvstusb_libusb_device *) base;
   if (0 == dev) return;
 
+  nvstusb_libusb_cancel_reads(dev);
+
+  nvstusb_libusb_unpoll(dev);
+
+  int i;
+  for (i = 0; i < NVSTUSB_USB_BUFFERS; i++) nvstusb_libusb_free_buffer(dev, &dev->buffers[i]);
+  nvstusb_libusb_free_buffer(dev, &dev->out);
+  nvstusb_libusb_free_buffer(dev, &dev->in);
+
   if (0 != dev->handle) {
     libusb_close(dev->handle);
   }
+  pthread_mutex_destroy(&dev->ioLock);
+  pthread_mutex_destroy(&dev->replyLock);
   free(dev);
 }
 
-/* send data to an endpoint, bulk transfer */
-int
-nvstusb_usb_write_bulk(
-  struct nvstusb_usb_device *dev,
+/* a transfer status as a libusb error, 0 if it completed */
+static int
+nvstusb_libusb_status_error(
+  enum libusb_transfer_status status
+) {
+  switch (status) {
+  case LIBUSB_TRANSFER_COMPLETED: return 0;
+  case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+  case LIBUSB_TRANSFER_STALL:     return LIBUSB_ERROR_PIPE;
+  case LIBUSB_TRANSFER_NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+  case LIBUSB_TRANSFER_OVERFLOW:  return LIBUSB_ERROR_OVERFLOW;
+  default:                        return LIBUSB_ERROR_IO;
+  }
+}
+
+/* a posted read completed: count it, keep the reply and queue the
+ * transfer again */
+static void
+nvstusb_libusb_read_done(
+  struct libusb_transfer *transfer
+) {
+  struct nvstusb_usb_read *read = transfer->user_data;
+  struct nvstusb_libusb_device *dev = read->dev;
+  uint64_t now = nvstusb_usb_time_ns();
+
+  if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+    int error = nvstusb_libusb_status_error(transfer->status);
+    int res = transfer->actual_length > 0 || 0 == error ? transfer->actual_length : error;
+    nvstusb_usb_posted_done(&dev->base, dev->readEndpoint, transfer->length, res,
+      res > 0 ? error : 0, read->submitted, now);
+  }
+
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED && transfer->actual_length > 0) {
+    pthread_mutex_lock(&dev->replyLock);
+    if (dev->replyHead - dev->replyTail < NVSTUSB_USB_REPLIES) {
+      struct nvstusb_usb_reply *reply = &dev->replies[dev->replyHead % NVSTUSB_USB_REPLIES];
+      reply->length = transfer->actual_length;
+      reply->submit = read->submitted;
+      reply->complete = now;
+      memcpy(reply->data, transfer->buffer, transfer->actual_length);
+      dev->replyHead++;
+    } else {
+      NVSTUSB_LOG(nvstusb_log_warning, "Reply queue full, dropping reply");
+    }
+    pthread_mutex_unlock(&dev->replyLock);
+  }
+
+  switch (transfer->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    read->submitted = now;
+    if (libusb_submit_transfer(transfer) == 0) return;
+    break;
+  case LIBUSB_TRANSFER_CANCELLED:
+    break;
+  default:
+    NVSTUSB_LOG(nvstusb_log_error, "Posted read failed with status %d", transfer->status);
+    break;
+  }
+  dev->activeReads--;
+}
+
+/* keep count IN transfers queued on an endpoint */
+static bool
+nvstusb_libusb_post_reads(
+  struct nvstusb_usb_device *base,
   int endpoint,
-  const void *data,
+  int count,
   int size
 ) {
+  struct nvstusb_libusb_device *dev = (struct nvstusb_libusb_device *) base;
+  assert(dev         != 0);
+  assert(dev->handle != 0);
+  assert(dev->numReads == 0);
+
+  if (count > NVSTUSB_USB_MAX_READS) count = NVSTUSB_USB_MAX_READS;
+  if (size > NVSTUSB_USB_REPLY_SIZE) size = NVSTUSB_USB_REPLY_SIZE;
+
+  dev->readEndpoint = endpoint;
+  while (dev->numReads < count) {
+    /* each keeps its buffer, freed the way it was allocated */
+    struct nvstusb_usb_read *read = &dev->reads[dev->numReads];
+    memset(read, 0, sizeof(*read));
+    read->dev = dev;
+    if (!nvstusb_libusb_alloc_buffer(dev, &read->buf, size)) {
+      nvstusb_libusb_free_buffer(dev, &read->buf);
+      break;
+    }
+    struct libusb_transfer *transfer = read->buf.transfer;
+    libusb_fill_bulk_transfer(transfer, dev->handle, endpoint | LIBUSB_ENDPOINT_IN,
+      read->buf.data, size, nvstusb_libusb_read_done, read, 0);
+    dev->numReads++;
+
+    read->submitted = nvstusb_usb_time_ns();
+    int res = libusb_submit_transfer(transfer);
+    if (res < 0) {
+      NVSTUSB_LOG(nvstusb_log_error, "Could not post read... Error %d: %s", res, libusb_error_to_string(res));
+      break;
+    }
+    dev->activeReads++;
+  }
+
+  if (dev->activeReads < count) {
+    nvstusb_libusb_cancel_reads(dev);
+    return false;
+  }
+  return true;
+}
+
+/* take the oldest completed reply, returns its length or 0 if there is none */
+static int
+nvstusb_libusb_reap_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  void *data,
+  int size,
+  uint64_t *submit,
+  uint64_t *complete
+) {
+  struct nvstusb_libusb_device *dev = (struct nvstusb_libusb_device *) base;
+  assert(dev != 0);
+
+  if (endpoint != dev->readEndpoint || 0 == dev->numReads) return 0;
+
+  int len = 0;
+  pthread_mutex_lock(&dev->replyLock);
+  if (dev->replyHead != dev->replyTail) {
+    struct nvstusb_usb_reply *reply = &dev->replies[dev->replyTail % NVSTUSB_USB_REPLIES];
+    len = reply->length < size ? reply->length : size;
+    memcpy(data, reply->data, len);
+    *submit = reply->submit;
+    *complete = reply->complete;
+    dev->replyTail++;
+  } else if (0 == dev->activeReads) {
+    len = NVSTUSB_USB_ERROR_NO_DEVICE;
+  }
+  pthread_mutex_unlock(&dev->replyLock);
+  return len;
+}
+
+/* run completions, waiting at most timeout_us for one */
+static int
+nvstusb_libusb_handle_events(
+  struct nvstusb_usb_device *base,
+  int timeout_us
+) {
+  struct nvstusb_libusb_device *dev = (struct nvstusb_libusb_device *) base;
+  assert(dev != 0);
+
+  struct timeval tv = { timeout_us / 1000000, timeout_us % 1000000 };
+  return libusb_handle_events_timeout(nvstusb_usb_context, &tv);
+}
+
+static void
+nvstusb_libusb_transfer_done(
+  struct libusb_transfer *transfer
+) {
+  struct nvstusb_usb_buffer *buf = transfer->user_data;
+  buf->completed = 1;
+}
+
+/* run the transfer of buf like libusb_bulk_transfer does, but without
+ * allocating one. returns the status as a libusb error, 0 if completed */
+static int
+nvstusb_libusb_transfer(
+  struct nvstusb_libusb_device *dev,
+  struct nvstusb_usb_buffer *buf,
+  unsigned char endpoint,
+  int size,
+  unsigned int timeout
+) {
+  buf->completed = 0;
+  libusb_fill_bulk_transfer(buf->transfer, dev->handle, endpoint, buf->data, size,
+    nvstusb_libusb_transfer_done, buf, timeout);
+  /* not set if the submit fails */
+  buf->transfer->actual_length = 0;
+
+  int res = libusb_submit_transfer(buf->transfer);
+  if (res < 0) return res;
+
+  while (!buf->completed) {
+    res = libusb_handle_events_completed(nvstusb_usb_context, &buf->completed);
+    if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED) {
+      libusb_cancel_transfer(buf->transfer);
+      while (!buf->completed) {
+        if (libusb_handle_events_completed(nvstusb_usb_context, &buf->completed) < 0) break;
+      }
+      return res;
+    }
+  }
+
+  return nvstusb_libusb_status_error(buf->transfer->status);
+}
+
+/* the device buffer data is, -1 if it is none */
+static int
+nvstusb_libusb_find_buffer(
+  struct nvstusb_libusb_device *dev,
+  const void *data
+) {
+  int i;
+  for (i = 0; i < NVSTUSB_USB_BUFFERS; i++) {
+    if (data == dev->buffers[i].data && 0 != dev->buffers[i].transfer) return i;
+  }
+  return -1;
+}
+
+/* one descriptor for all of libusb's, owned by the device. On Linux
+ * libusb keeps its timeouts in a timerfd among them, elsewhere only the
+ * posted reads (which have none) are safe to leave to an event loop.
+ * The descriptors are those of the whole context, every device's set
+ * also wakes for the others' transfers. */
+static int
+nvstusb_libusb_get_fd(
+  struct nvstusb_usb_device *base
+) {
+  struct nvstusb_libusb_device *dev = (struct nvstusb_libusb_device *) base;
+  assert(dev != 0);
+  if (dev->epoll >= 0) return dev->epoll;
+
+  int epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll < 0) return -1;
+
+  /* listed before asking libusb for its descriptors, so none added
+   * meanwhile is missed. libusb is not called with the lock held. */
+  pthread_mutex_lock(&nvstusb_libusb_poll_lock);
+  if (0 == nvstusb_libusb_polled) {
+    libusb_set_pollfd_notifiers(nvstusb_usb_context, nvstusb_libusb_pollfd_added, nvstusb_libusb_pollfd_removed, 0);
+  }
+  dev->epoll = epoll;
+  dev->nextPolled = nvstusb_libusb_polled;
+  nvstusb_libusb_polled = dev;
+  pthread_mutex_unlock(&nvstusb_libusb_poll_lock);
+
+  const struct libusb_pollfd **fds = libusb_get_pollfds(nvstusb_usb_context);
+  if (0 == fds) {
+    nvstusb_libusb_unpoll(dev);
+    return -1;
+  }
+  int i;
+  for (i = 0; 0 != fds[i]; i++) {
+    nvstusb_libusb_epoll_add(epoll, fds[i]->fd, fds[i]->events);
+  }
+  libusb_free_pollfds(fds);
+
+  if (!libusb_pollfds_handle_timeouts(nvstusb_usb_context)) {
+    NVSTUSB_LOG(nvstusb_log_warning, "libusb timeouts are not pollable, transfers with a timeout need handle_events calls");
+  }
+  return epoll;
+}
+
+/* device buffers for nvstusb_usb_buffer */
+static void *
+nvstusb_libusb_buffer(
+  struct nvstusb_usb_device *base,
+  int buffer
+) {
+  struct nvstusb_libusb_device *dev = (struct nvstusb_libusb_device *) base;
+  assert(dev != 0);
+  return 0 != dev->buffers[buffer].transfer ? dev->buffers[buffer].data : 0;
+}
+
+/* send data to an endpoint, bulk transfer 
+ * returns the number of bytes sent or a negative libusb error */
+static int
+nvstusb_libusb_write_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  const void *data,
+  int size,
+  unsigned int timeout,
+  int *error
+) {
+  struct nvstusb_libusb_device *dev = (struct nvstusb_libusb_device *) base;
   int sent = 0;
+  int res;
   
   assert(dev         != 0);
   assert(dev->handle != 0);
 
-  return libusb_bulk_transfer(dev->handle, endpoint | LIBUSB_ENDPOINT_OUT, (unsigned char*)data, size, &sent, 0);
+  /* built in a device buffer: sent from where it is. The caller holds
+   * the buffer, which keeps its transfer to one thread. */
+  int buffer = nvstusb_libusb_find_buffer(dev, data);
+  if (buffer >= 0 && size <= dev->buffers[buffer].size) {
+    struct nvstusb_usb_buffer *buf = &dev->buffers[buffer];
+    res = nvstusb_libusb_transfer(dev, buf, endpoint | LIBUSB_ENDPOINT_OUT, size, timeout);
+    sent = buf->transfer->actual_length;
+  } else if (0 != dev->out.transfer && size <= dev->out.size) {
+    pthread_mutex_lock(&dev->ioLock);
+    memcpy(dev->out.data, data, size);
+    res = nvstusb_libusb_transfer(dev, &dev->out, endpoint | LIBUSB_ENDPOINT_OUT, size, timeout);
+    sent = dev->out.transfer->actual_length;
+    pthread_mutex_unlock(&dev->ioLock);
+  } else {
+    res = libusb_bulk_transfer(dev->handle, endpoint | LIBUSB_ENDPOINT_OUT, (unsigned char*)data, size, &sent, timeout);
+  }
+  if (res < 0 && sent == 0) return res;
+  if (res < 0) *error = res;
+  return sent;
 }
 
-/* receive data from an endpoint */
-int
-nvstusb_usb_read_bulk(
-  struct nvstusb_usb_device *dev,
+/* receive data from an endpoint 
+ * returns the number of bytes received or a negative libusb error */
+static int
+nvstusb_libusb_read_bulk(
+  struct nvstusb_usb_device *base,
   int endpoint,
   void *data,
-  int size
+  int size,
+  unsigned int timeout,
+  int *error
 ) {
+  struct nvstusb_libusb_device *dev = (struct nvstusb_libusb_device *) base;
   int recvd = 0;
   int res;
   
   assert(dev         != 0);
   assert(dev->handle != 0);
   
-  res = libusb_bulk_transfer(dev->handle, endpoint | LIBUSB_ENDPOINT_IN, (unsigned char*) data, size, &recvd, 200);
+  if (0 != dev->in.transfer && size <= dev->in.size) {
+    pthread_mutex_lock(&dev->ioLock);
+    res = nvstusb_libusb_transfer(dev, &dev->in, endpoint | LIBUSB_ENDPOINT_IN, size, timeout);
+    recvd = dev->in.transfer->actual_length;
+    memcpy(data, dev->in.data, recvd);
+    pthread_mutex_unlock(&dev->ioLock);
+  } else {
+    res = libusb_bulk_transfer(dev->handle, endpoint | LIBUSB_ENDPOINT_IN, (unsigned char*) data, size, &recvd, timeout);
+  }
+  if (res < 0 && recvd == 0) return res;
+  if (res < 0) *error = res;
   return recvd;
 }
 
  
+
+const struct nvstusb_usb_backend nvstusb_usb_libusb_backend = {
+  "libusb",
+  nvstusb_libusb_init,
+  nvstusb_libusb_deinit,
+  nvstusb_libusb_open_device,
+  nvstusb_libusb_close_device,
+  nvstusb_libusb_write_bulk,
+  nvstusb_libusb_read_bulk,
+  nvstusb_libusb_post_reads,
+  nvstusb_libusb_reap_bulk,
+  nvstusb_libusb_handle_events,
+  nvstusb_libusb_buffer,
+  nvstusb_libusb_get_fd
+};
@@ -0,0 +1,349 @@
+/* usb_replay.c
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "usb_backend.h"
+#include "trace.h"
+#include "log.h"
+
+/* mismatching writes reported before going quiet */
+#define NVSTUSB_REPLAY_REPORT 8
+
+/* a recorded bulk transfer */
+struct nvstusb_replay_transfer {
+  struct nvstusb_trace_record rec;
+  uint8_t *data;
+};
+
+/* plays back a trace: writes are checked against the recorded ones in
+ * order, a recorded read becomes available once every write before it
+ * was replayed and its completion time has come */
+struct nvstusb_replay_device {
+  struct nvstusb_usb_device base;
+
+  pthread_mutex_t lock;
+
+  struct nvstusb_replay_transfer *transfers;
+  int numTransfers;
+
+  int nextOut;          /* next recorded write */
+  int nextIn;           /* next recorded read */
+
+  float speed;          /* 0 = as fast as possible */
+  uint64_t start;       /* replay time of the first transfer */
+  uint64_t first;       /* trace time of the first transfer */
+
+  int readEndpoint;     /* posted reads, -1 if none */
+  int readSize;
+
+  int numWrites;
+  int mismatches;
+};
+
+static bool
+nvstusb_replay_init(
+) {
+  if (0 == nvstusb_usb_replay_path()) {
+    NVSTUSB_LOG(nvstusb_log_error, "No trace to replay");
+    return false;
+  }
+  return true;
+}
+
+static void
+nvstusb_replay_deinit(
+) {
+}
+
+/* replay time of a trace timestamp */
+static uint64_t
+nvstusb_replay_time(
+  struct nvstusb_replay_device *dev,
+  uint64_t t
+) {
+  if (dev->speed <= 0.0) return 0;
+  return dev->start + (uint64_t)((t - dev->first) / dev->speed);
+}
+
+/* wait until a trace timestamp is due */
+static void
+nvstusb_replay_wait(
+  struct nvstusb_replay_device *dev,
+  uint64_t t
+) {
+  uint64_t due = nvstusb_replay_time(dev, t);
+  uint64_t now = nvstusb_usb_time_ns();
+  if (due > now) usleep((due - now) / 1000);
+}
+
+/* find the next record of a type on an endpoint starting at index */
+static int
+nvstusb_replay_find(
+  struct nvstusb_replay_device *dev,
+  int index,
+  uint8_t type
+) {
+  while (index < dev->numTransfers && dev->transfers[index].rec.type != type) index++;
+  return index;
+}
+
+static struct nvstusb_usb_device *
+nvstusb_replay_open_device(
+  const char *firmware
+) {
+  const char *path = nvstusb_usb_replay_path();
+  FILE *file = nvstusb_trace_open(path);
+  if (0 == file) return 0;
+
+  struct nvstusb_replay_device *dev = (struct nvstusb_replay_device *) calloc(1, sizeof(*dev));
+  pthread_mutex_init(&dev->lock, 0);
+  dev->speed = nvstusb_usb_replay_speed();
+  dev->readEndpoint = -1;
+
+  uint8_t *buf = malloc(65535);
+  int size = 0;
+  struct nvstusb_trace_record rec;
+  int res;
+  while ((res = nvstusb_trace_read(file, &rec, buf)) > 0) {
+    /* the firmware upload is not replayed, the device is ready */
+    if (rec.type == NVSTUSB_TRACE_CONTROL) continue;
+
+    if (dev->numTransfers == size) {
+      size = size ? size*2 : 1024;
+      dev->transfers = realloc(dev->transfers, size * sizeof(*dev->transfers));
+    }
+    struct nvstusb_replay_transfer *t = &dev->transfers[dev->numTransfers++];
+    t->rec = rec;
+    t->data = malloc(rec.length + 1);
+    memcpy(t->data, buf, rec.length);
+  }
+  free(buf);
+  fclose(file);
+
+  if (res < 0 || 0 == dev->numTransfers) {
+    NVSTUSB_LOG(nvstusb_log_error, "Could not replay %s", path);
+    int i;
+    for (i = 0; i < dev->numTransfers; i++) free(dev->transfers[i].data);
+    free(dev->transfers);
+    free(dev);
+    return 0;
+  }
+
+  dev->first = dev->transfers[0].rec.submit;
+  dev->start = nvstusb_usb_time_ns();
+  dev->nextOut = nvstusb_replay_find(dev, 0, NVSTUSB_TRACE_BULK_OUT);
+  dev->nextIn = nvstusb_replay_find(dev, 0, NVSTUSB_TRACE_BULK_IN);
+
+  NVSTUSB_LOG(nvstusb_log_info, "Replaying %d transfers from %s at speed %g",
+    dev->numTransfers, path, dev->speed);
+  return &dev->base;
+}
+
+static void
+nvstusb_replay_close_device(
+  struct nvstusb_usb_device *base
+) {
+  struct nvstusb_replay_device *dev = (struct nvstusb_replay_device *) base;
+
+  int i, left = 0;
+  for (i = dev->nextOut; i < dev->numTransfers; i++) {
+    if (dev->transfers[i].rec.type == NVSTUSB_TRACE_BULK_OUT) left++;
+  }
+  NVSTUSB_LOG(nvstusb_log_info, "Replay done, %d writes, %d mismatched, %d not replayed",
+    dev->numWrites, dev->mismatches, left);
+
+  for (i = 0; i < dev->numTransfers; i++) free(dev->transfers[i].data);
+  free(dev->transfers);
+  pthread_mutex_destroy(&dev->lock);
+  free(dev);
+}
+
+/* check a write against the next recorded one and return its result */
+static int
+nvstusb_replay_write_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  const void *data,
+  int size,
+  unsigned int timeout,
+  int *error
+) {
+  struct nvstusb_replay_device *dev = (struct nvstusb_replay_device *) base;
+
+  pthread_mutex_lock(&dev->lock);
+  if (dev->nextOut >= dev->numTransfers) {
+    pthread_mutex_unlock(&dev->lock);
+    return NVSTUSB_USB_ERROR_NO_DEVICE;
+  }
+  struct nvstusb_replay_transfer *t = &dev->transfers[dev->nextOut];
+  dev->nextOut = nvstusb_replay_find(dev, dev->nextOut+1, NVSTUSB_TRACE_BULK_OUT);
+  dev->numWrites++;
+
+  if ((t->rec.endpoint & 0x7f) != endpoint ||
+      t->rec.length != size ||
+      0 != memcmp(t->data, data, size)) {
+    if (dev->mismatches++ < NVSTUSB_REPLAY_REPORT) {
+      NVSTUSB_LOG(nvstusb_log_warning, "Replay mismatch at write %d: endpoint %d, %d bytes (recorded endpoint %d, %d bytes)",
+        dev->numWrites, endpoint, size, t->rec.endpoint & 0x7f, t->rec.length);
+    }
+  }
+  pthread_mutex_unlock(&dev->lock);
+
+  nvstusb_replay_wait(dev, t->rec.complete);
+  return t->rec.result;
+}
+
+/* take the next recorded read if it is due, returns its result,
+ * 0 if it is not due yet, or no device at the end of the trace.
+ * submit is when it was recorded to be queued, in replay time. */
+static int
+nvstusb_replay_take(
+  struct nvstusb_replay_device *dev,
+  int endpoint,
+  void *data,
+  int size,
+  uint64_t *due,
+  uint64_t *submit
+) {
+  int res = 0;
+
+  pthread_mutex_lock(&dev->lock);
+  if (dev->nextIn >= dev->numTransfers) {
+    res = NVSTUSB_USB_ERROR_NO_DEVICE;
+  } else if (dev->nextOut > dev->nextIn) {
+    struct nvstusb_replay_transfer *t = &dev->transfers[dev->nextIn];
+    *due = nvstusb_replay_time(dev, t->rec.complete);
+    if (*due <= nvstusb_usb_time_ns()) {
+      if ((t->rec.endpoint & 0x7f) != endpoint && dev->mismatches++ < NVSTUSB_REPLAY_REPORT) {
+        NVSTUSB_LOG(nvstusb_log_warning, "Replay mismatch: read on endpoint %d, recorded endpoint %d",
+          endpoint, t->rec.endpoint & 0x7f);
+      }
+      *submit = nvstusb_replay_time(dev, t->rec.submit);
+      res = t->rec.result;
+      if (res > 0) {
+        if (res > size) res = size;
+        if (res > t->rec.length) res = t->rec.length;
+        memcpy(data, t->data, res);
+      }
+      dev->nextIn = nvstusb_replay_find(dev, dev->nextIn+1, NVSTUSB_TRACE_BULK_IN);
+      /* a recorded read that timed out comes back as 0 from reap */
+      if (0 == res) res = NVSTUSB_USB_ERROR_TIMEOUT;
+    }
+  } else {
+    /* waits for a write */
+    *due = 0;
+  }
+  pthread_mutex_unlock(&dev->lock);
+  return res;
+}
+
+static int
+nvstusb_replay_read_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  void *data,
+  int size,
+  unsigned int timeout,
+  int *error
+) {
+  struct nvstusb_replay_device *dev = (struct nvstusb_replay_device *) base;
+
+  uint64_t deadline = nvstusb_usb_time_ns() + (uint64_t)timeout*1000000;
+  for (;;) {
+    uint64_t due = 0, submit;
+    int res = nvstusb_replay_take(dev, endpoint, data, size, &due, &submit);
+    if (0 != res) return res;
+
+    /* nothing will write while a synchronous read waits */
+    if (0 == due) return NVSTUSB_USB_ERROR_TIMEOUT;
+
+    uint64_t now = nvstusb_usb_time_ns();
+    if (timeout > 0 && due > deadline) {
+      if (deadline > now) usleep((deadline - now) / 1000);
+      return NVSTUSB_USB_ERROR_TIMEOUT;
+    }
+    if (due > now) usleep((due - now) / 1000);
+  }
+}
+
+static bool
+nvstusb_replay_post_reads(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  int count,
+  int size
+) {
+  struct nvstusb_replay_device *dev = (struct nvstusb_replay_device *) base;
+  dev->readEndpoint = endpoint;
+  dev->readSize = size;
+  return true;
+}
+
+static int
+nvstusb_replay_reap_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  void *data,
+  int size,
+  uint64_t *submit,
+  uint64_t *complete
+) {
+  struct nvstusb_replay_device *dev = (struct nvstusb_replay_device *) base;
+  if (endpoint != dev->readEndpoint) return 0;
+
+  /* played back as fast as possible there are no times, they stay 0 */
+  uint64_t due = 0;
+  int res = nvstusb_replay_take(dev, endpoint, data, size, &due, submit);
+  if (0 == res || NVSTUSB_USB_ERROR_NO_DEVICE == res) return res;
+
+  /* a recorded read completes when it is taken, one that timed out is
+   * counted and queued again */
+  *complete = due;
+  nvstusb_usb_posted_done(base, endpoint, dev->readSize, res, 0, *submit, *complete);
+  return NVSTUSB_USB_ERROR_TIMEOUT == res ? 0 : res;
+}
+
+/* sleep until the next recorded read is due */
+static int
+nvstusb_replay_handle_events(
+  struct nvstusb_usb_device *base,
+  int timeout_us
+) {
+  struct nvstusb_replay_device *dev = (struct nvstusb_replay_device *) base;
+
+  uint64_t wait = (uint64_t)timeout_us * 1000;
+  pthread_mutex_lock(&dev->lock);
+  if (dev->nextIn < dev->numTransfers && dev->nextOut > dev->nextIn) {
+    uint64_t due = nvstusb_replay_time(dev, dev->transfers[dev->nextIn].rec.complete);
+    uint64_t now = nvstusb_usb_time_ns();
+    wait = due > now ? due - now : 0;
+    if (wait > (uint64_t)timeout_us * 1000) wait = (uint64_t)timeout_us * 1000;
+  }
+  pthread_mutex_unlock(&dev->lock);
+
+  if (wait > 0) usleep(wait / 1000);
+  return 0;
+}
+
+const struct nvstusb_usb_backend nvstusb_usb_replay_backend = {
+  "replay",
+  nvstusb_replay_init,
+  nvstusb_replay_deinit,
+  nvstusb_replay_open_device,
+  nvstusb_replay_close_device,
+  nvstusb_replay_write_bulk,
+  nvstusb_replay_read_bulk,
+  nvstusb_replay_post_reads,
+  nvstusb_replay_reap_bulk,
+  nvstusb_replay_handle_events
+};
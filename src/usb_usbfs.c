@@ -0,0 +1,743 @@
+/* usb_usbfs.c
+ *
+ * The controller through usbfs (/dev/bus/usb/BBB/DDD) without libusb:
+ * URBs are submitted and reaped with ioctls on the device file. Every
+ * transfer uses a URB and buffer allocated with the device, eye packets
+ * on endpoint 1 are posted without waiting for their completion, an
+ * error shows up on the next write. $NVSTUSB_USBFS_DEVICE names the
+ * device file instead of looking for 0955:0007 in sysfs.
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <linux/usbdevice_fs.h>
+
+#include "usb_backend.h"
+#include "probes.h"
+#include "log.h"
+
+#define NVSTUSB_USBFS_VENDOR    0x0955
+#define NVSTUSB_USBFS_PRODUCT   0x0007
+
+/* URBs of each kind, allocated with the device and reused */
+#define NVSTUSB_USBFS_WRITES    8
+#define NVSTUSB_USBFS_MAX_READS 8
+#define NVSTUSB_USBFS_REPLIES   32
+#define NVSTUSB_USBFS_BUFFER    512
+
+/* eye packets go here and are not waited for */
+#define NVSTUSB_USBFS_EYE_ENDPOINT 1
+
+struct nvstusb_usbfs_urb {
+  struct usbdevfs_urb urb;
+  bool busy;              /* submitted and not reaped yet */
+  bool posted;            /* a posted read, submitted again when reaped */
+  bool async;             /* a write nobody waits for */
+  uint64_t submitted;     /* when it was last submitted */
+  uint8_t buffer[NVSTUSB_USBFS_BUFFER];
+};
+
+/* a completed posted read */
+struct nvstusb_usbfs_reply {
+  int length;
+  uint64_t submit;
+  uint64_t complete;
+  uint8_t data[NVSTUSB_USBFS_BUFFER];
+};
+
+struct nvstusb_usbfs_device {
+  struct nvstusb_usb_device base;
+  int fd;
+
+  /* one thread polls the file and reaps, the others wait for it */
+  pthread_mutex_t lock;
+  pthread_cond_t reaped;
+  bool reaping;
+  bool gone;              /* disconnected, nothing completes any more */
+  int epoll;              /* of nvstusb_usbfs_get_fd, -1 if not asked for */
+
+  struct nvstusb_usbfs_urb writes[NVSTUSB_USBFS_WRITES];
+  int writeError;         /* of an eye packet, for the next eye packet */
+
+  struct nvstusb_usbfs_urb read;
+
+  /* posted reads */
+  int readEndpoint;
+  int numReads;
+  int activeReads;
+  struct nvstusb_usbfs_urb reads[NVSTUSB_USBFS_MAX_READS];
+
+  unsigned int replyHead;
+  unsigned int replyTail;
+  struct nvstusb_usbfs_reply replies[NVSTUSB_USBFS_REPLIES];
+};
+
+static bool
+nvstusb_usbfs_init(
+) {
+  return true;
+}
+
+static void
+nvstusb_usbfs_deinit(
+) {
+}
+
+/* errno to the libusb style codes of usb.h */
+static int
+nvstusb_usbfs_error(
+  int error
+) {
+  switch (error) {
+  case ENODEV:
+  case ESHUTDOWN:   return NVSTUSB_USB_ERROR_NO_DEVICE;
+  case ETIMEDOUT:   return NVSTUSB_USB_ERROR_TIMEOUT;
+  case EACCES:
+  case EPERM:       return NVSTUSB_USB_ERROR_ACCESS;
+  case EBUSY:       return NVSTUSB_USB_ERROR_BUSY;
+  case EPIPE:       return NVSTUSB_USB_ERROR_PIPE;
+  }
+  return NVSTUSB_USB_ERROR_IO;
+}
+
+/* read a number from a sysfs attribute */
+static bool
+nvstusb_usbfs_attr(
+  const char *device,
+  const char *name,
+  int base,
+  unsigned int *value
+) {
+  char path[512];
+  snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/%s", device, name);
+  FILE *file = fopen(path, "r");
+  if (0 == file) return false;
+
+  char buf[32];
+  bool ok = 0 != fgets(buf, sizeof(buf), file);
+  fclose(file);
+  if (ok) *value = strtoul(buf, 0, base);
+  return ok;
+}
+
+/* device file of the controller */
+static bool
+nvstusb_usbfs_find(
+  char *path,
+  size_t size
+) {
+  const char *env = getenv("NVSTUSB_USBFS_DEVICE");
+  if (0 != env) {
+    snprintf(path, size, "%s", env);
+    return true;
+  }
+
+  DIR *dir = opendir("/sys/bus/usb/devices");
+  if (0 == dir) return false;
+
+  struct dirent *entry;
+  bool found = false;
+  while (!found && 0 != (entry = readdir(dir))) {
+    unsigned int vendor, product, bus, address;
+    if (!nvstusb_usbfs_attr(entry->d_name, "idVendor", 16, &vendor) ||
+        !nvstusb_usbfs_attr(entry->d_name, "idProduct", 16, &product)) continue;
+    if (vendor != NVSTUSB_USBFS_VENDOR || product != NVSTUSB_USBFS_PRODUCT) continue;
+    if (!nvstusb_usbfs_attr(entry->d_name, "busnum", 10, &bus) ||
+        !nvstusb_usbfs_attr(entry->d_name, "devnum", 10, &address)) continue;
+
+    snprintf(path, size, "/dev/bus/usb/%03u/%03u", bus, address);
+    found = true;
+  }
+  closedir(dir);
+  return found;
+}
+
+/* open the controller's device file, -1 if there is none */
+static int
+nvstusb_usbfs_open(
+) {
+  char path[64];
+  if (!nvstusb_usbfs_find(path, sizeof(path))) return -1;
+
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) NVSTUSB_LOG(nvstusb_log_error, "%s: %s", path, strerror(errno));
+  return fd;
+}
+
+/* the device without firmware has no endpoints, the descriptors are
+ * read from the device file: the device descriptor, then the
+ * configuration with its interfaces */
+static bool
+nvstusb_usbfs_needs_firmware(
+  int fd
+) {
+  uint8_t desc[1024];
+  int len = pread(fd, desc, sizeof(desc), 0);
+  int pos = 18;
+
+  while (pos + 5 <= len && desc[pos] >= 2) {
+    if (desc[pos+1] == 4) { /* interface */
+      NVSTUSB_LOG(nvstusb_log_debug, "Found %d endpoints...", desc[pos+4]);
+      return 0 == desc[pos+4];
+    }
+    pos += desc[pos];
+  }
+  return true;
+}
+
+/* upload firmware file with vendor request 0xa0 */
+static int
+nvstusb_usbfs_load_firmware(
+  int fd,
+  const char *filename
+) {
+  FILE *fw = fopen(filename, "rb");
+  if (!fw) { NVSTUSB_LOG(nvstusb_log_error, "%s: %s", filename, strerror(errno)); return -1; }
+
+  NVSTUSB_LOG(nvstusb_log_info, "Loading firmware...");
+
+  uint8_t lenPos[4];
+  uint8_t buf[1024];
+
+  while (fread(lenPos, 4, 1, fw) == 1) {
+    uint16_t length = (lenPos[0]<<8) | lenPos[1];
+    uint16_t pos    = (lenPos[2]<<8) | lenPos[3];
+
+    if (length > sizeof(buf) || fread(buf, length, 1, fw) != 1) {
+      NVSTUSB_LOG(nvstusb_log_error, "%s: %s", filename, strerror(errno));
+      fclose(fw);
+      return -1;
+    }
+
+    struct usbdevfs_ctrltransfer ctrl = {
+      0x40, 0xA0, pos, 0x0000, length, 0, buf   /* vendor, 'Firmware load' */
+    };
+    uint64_t submit = nvstusb_usb_time_ns();
+    int res = ioctl(fd, USBDEVFS_CONTROL, &ctrl);
+    if (res < 0) res = nvstusb_usbfs_error(errno);
+    nvstusb_usb_trace_control(0x40, 0xA0, pos, 0x0000, buf, length, res, submit, nvstusb_usb_time_ns());
+    if (res < 0) {
+      NVSTUSB_LOG(nvstusb_log_error, "Error uploading firmware... Error %d", res);
+      fclose(fw);
+      return res;
+    }
+  }
+
+  fclose(fw);
+  return 0;
+}
+
+/* hand a completed URB back to its owner, lock held */
+static void
+nvstusb_usbfs_complete(
+  struct nvstusb_usbfs_device *dev,
+  struct nvstusb_usbfs_urb *u
+) {
+  u->busy = false;
+  uint64_t now = nvstusb_usb_time_ns();
+
+  if (u->async) {
+    /* discarded writes (-ENOENT) are being closed */
+    if (-ENOENT == u->urb.status) return;
+    int error = u->urb.status < 0 ? nvstusb_usbfs_error(-u->urb.status) : 0;
+    int res = u->urb.actual_length > 0 || 0 == error ? u->urb.actual_length : error;
+    nvstusb_usb_posted_write_done(&dev->base, u->urb.endpoint, u->urb.buffer_length, res,
+      res > 0 ? error : 0, u->submitted, now);
+    if (error < 0 && 0 == dev->writeError) dev->writeError = error;
+    return;
+  }
+  if (!u->posted) return;
+
+  /* discarded reads (-ENOENT) are being closed */
+  if (-ENOENT != u->urb.status) {
+    int error = u->urb.status < 0 ? nvstusb_usbfs_error(-u->urb.status) : 0;
+    int res = u->urb.actual_length > 0 || 0 == error ? u->urb.actual_length : error;
+    nvstusb_usb_posted_done(&dev->base, dev->readEndpoint, u->urb.buffer_length, res,
+      res > 0 ? error : 0, u->submitted, now);
+  }
+
+  if (0 == u->urb.status && u->urb.actual_length > 0) {
+    if (dev->replyHead - dev->replyTail < NVSTUSB_USBFS_REPLIES) {
+      struct nvstusb_usbfs_reply *reply = &dev->replies[dev->replyHead % NVSTUSB_USBFS_REPLIES];
+      reply->length = u->urb.actual_length;
+      reply->submit = u->submitted;
+      reply->complete = now;
+      memcpy(reply->data, u->buffer, u->urb.actual_length);
+      dev->replyHead++;
+    } else {
+      NVSTUSB_LOG(nvstusb_log_warning, "Reply queue full, dropping reply");
+    }
+  }
+
+  if (0 == u->urb.status || -ETIMEDOUT == u->urb.status) {
+    u->urb.actual_length = 0;
+    u->submitted = now;
+    if (0 == ioctl(dev->fd, USBDEVFS_SUBMITURB, &u->urb)) {
+      u->busy = true;
+      return;
+    }
+  } else if (-ENOENT != u->urb.status) {
+    NVSTUSB_LOG(nvstusb_log_error, "Posted read failed with status %d", u->urb.status);
+  }
+  dev->activeReads--;
+}
+
+/* reap every completed URB, lock held */
+static bool
+nvstusb_usbfs_reap_all(
+  struct nvstusb_usbfs_device *dev
+) {
+  struct usbdevfs_urb *urb;
+  bool any = false;
+
+  while (0 == ioctl(dev->fd, USBDEVFS_REAPURBNDELAY, &urb)) {
+    nvstusb_usbfs_complete(dev, (struct nvstusb_usbfs_urb *) urb->usercontext);
+    any = true;
+  }
+  if (any) pthread_cond_broadcast(&dev->reaped);
+  return any;
+}
+
+/* wait until u is reaped, or any URB if u is 0, lock held. limit is a
+ * monotonic time in ns, 0 waits forever. false if the limit passed. */
+static bool
+nvstusb_usbfs_wait(
+  struct nvstusb_usbfs_device *dev,
+  struct nvstusb_usbfs_urb *u,
+  uint64_t limit
+) {
+  for (;;) {
+    bool any = nvstusb_usbfs_reap_all(dev);
+    if (0 == u ? any : !u->busy) return true;
+    if (dev->gone) return false;
+
+    uint64_t now = nvstusb_usb_time_ns();
+    if (limit && now >= limit) return false;
+
+    if (!dev->reaping) {
+      /* the file is writable while completed URBs wait to be reaped */
+      struct pollfd pfd = { dev->fd, POLLOUT, 0 };
+      int ms = limit ? (int)((limit - now + 999999) / 1000000) : -1;
+
+      dev->reaping = true;
+      pthread_mutex_unlock(&dev->lock);
+      int res = poll(&pfd, 1, ms);
+      pthread_mutex_lock(&dev->lock);
+      dev->reaping = false;
+      pthread_cond_broadcast(&dev->reaped);
+
+      if (res > 0 && (pfd.revents & (POLLERR | POLLHUP))) {
+        nvstusb_usbfs_reap_all(dev);
+        dev->gone = true;
+        pthread_cond_broadcast(&dev->reaped);
+        return 0 == u || !u->busy;
+      }
+    } else if (limit) {
+      struct timespec ts = { limit / 1000000000ULL, limit % 1000000000ULL };
+      pthread_cond_timedwait(&dev->reaped, &dev->lock, &ts);
+    } else {
+      pthread_cond_wait(&dev->reaped, &dev->lock);
+    }
+
+    if (0 == u) {
+      nvstusb_usbfs_reap_all(dev);
+      return true;
+    }
+  }
+}
+
+/* submit a URB, lock held */
+static int
+nvstusb_usbfs_submit(
+  struct nvstusb_usbfs_device *dev,
+  struct nvstusb_usbfs_urb *u,
+  int endpoint,
+  int size
+) {
+  u->urb.type = USBDEVFS_URB_TYPE_BULK;
+  u->urb.endpoint = endpoint;
+  u->urb.status = 0;
+  u->urb.flags = 0;
+  u->urb.buffer = u->buffer;
+  u->urb.buffer_length = size;
+  u->urb.actual_length = 0;
+  u->urb.usercontext = u;
+
+  u->submitted = nvstusb_usb_time_ns();
+  if (ioctl(dev->fd, USBDEVFS_SUBMITURB, &u->urb) < 0) return nvstusb_usbfs_error(errno);
+  u->busy = true;
+  return 0;
+}
+
+/* run a URB to completion within timeout ms, lock held. A short
+ * transfer that failed leaves its error in *error. */
+static int
+nvstusb_usbfs_transfer(
+  struct nvstusb_usbfs_device *dev,
+  struct nvstusb_usbfs_urb *u,
+  int endpoint,
+  int size,
+  unsigned int timeout,
+  int *error
+) {
+  uint64_t limit = timeout ? nvstusb_usb_time_ns() + timeout*1000000ULL : 0;
+
+  int res = nvstusb_usbfs_submit(dev, u, endpoint, size);
+  if (res < 0) return res;
+
+  if (!nvstusb_usbfs_wait(dev, u, limit)) {
+    ioctl(dev->fd, USBDEVFS_DISCARDURB, &u->urb);
+    if (!nvstusb_usbfs_wait(dev, u, 0)) {
+      u->busy = false;
+      return NVSTUSB_USB_ERROR_NO_DEVICE;
+    }
+    if (u->urb.actual_length == 0) return NVSTUSB_USB_ERROR_TIMEOUT;
+    *error = NVSTUSB_USB_ERROR_TIMEOUT;
+  }
+  if (u->urb.status < 0 && 0 == u->urb.actual_length) return nvstusb_usbfs_error(-u->urb.status);
+  if (u->urb.status < 0 && 0 == *error) *error = nvstusb_usbfs_error(-u->urb.status);
+  return u->urb.actual_length;
+}
+
+/* open 3d controller */
+static struct nvstusb_usb_device *
+nvstusb_usbfs_open_device(
+  const char *firmware
+) {
+  int fd = nvstusb_usbfs_open();
+  if (fd < 0) {
+    NVSTUSB_LOG(nvstusb_log_error, "No NVIDIA 3d stereo controller found...");
+    return 0;
+  }
+  NVSTUSB_LOG(nvstusb_log_info, "Found NVIDIA 3d stereo controller...");
+
+  bool needsFirmware = nvstusb_usbfs_needs_firmware(fd);
+  if (needsFirmware) {
+    NVSTUSB_PROBE1(firmware, NVSTUSB_PROBE_FW_START);
+    if (nvstusb_usbfs_load_firmware(fd, firmware) < 0) {
+      NVSTUSB_PROBE1(firmware, NVSTUSB_PROBE_FW_FAILED);
+      close(fd);
+      return 0;
+    }
+    NVSTUSB_PROBE1(firmware, NVSTUSB_PROBE_FW_UPLOADED);
+    /* it comes back with a new address */
+    ioctl(fd, USBDEVFS_RESET, 0);
+    close(fd);
+    usleep(250000);
+    fd = nvstusb_usbfs_open();
+    if (fd < 0) {
+      NVSTUSB_LOG(nvstusb_log_error, "The controller did not come back after loading the firmware");
+      NVSTUSB_PROBE1(firmware, NVSTUSB_PROBE_FW_FAILED);
+      return 0;
+    }
+    ioctl(fd, USBDEVFS_RESET, 0);
+    usleep(250000);
+    NVSTUSB_PROBE1(firmware, NVSTUSB_PROBE_FW_REOPENED);
+  }
+
+  unsigned int config = 1;
+  unsigned int interface = 0;
+  ioctl(fd, USBDEVFS_SETCONFIGURATION, &config);
+  if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &interface) < 0) {
+    NVSTUSB_LOG(nvstusb_log_error, "Could not claim the interface: %s", strerror(errno));
+    if (needsFirmware) NVSTUSB_PROBE1(firmware, NVSTUSB_PROBE_FW_FAILED);
+    close(fd);
+    return 0;
+  }
+  if (needsFirmware) NVSTUSB_PROBE1(firmware, NVSTUSB_PROBE_FW_READY);
+
+  struct nvstusb_usbfs_device *dev = (struct nvstusb_usbfs_device *) calloc(1, sizeof(*dev));
+  dev->fd = fd;
+  dev->epoll = -1;
+  dev->readEndpoint = -1;
+  dev->base.postedWrites = 1u << NVSTUSB_USBFS_EYE_ENDPOINT;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&dev->reaped, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&dev->lock, 0);
+  return &dev->base;
+}
+
+/* close the device, discarding what is still in flight */
+static void
+nvstusb_usbfs_close_device(
+  struct nvstusb_usb_device *base
+) {
+  struct nvstusb_usbfs_device *dev = (struct nvstusb_usbfs_device *) base;
+  if (0 == dev) return;
+
+  int i;
+  pthread_mutex_lock(&dev->lock);
+  for (i = 0; i < dev->numReads; i++) {
+    if (dev->reads[i].busy) ioctl(dev->fd, USBDEVFS_DISCARDURB, &dev->reads[i].urb);
+  }
+  for (i = 0; i < NVSTUSB_USBFS_WRITES; i++) {
+    if (dev->writes[i].busy) ioctl(dev->fd, USBDEVFS_DISCARDURB, &dev->writes[i].urb);
+  }
+  uint64_t limit = nvstusb_usb_time_ns() + 1000000000ULL;
+  for (i = 0; i < NVSTUSB_USBFS_WRITES; i++) {
+    if (dev->writes[i].busy) nvstusb_usbfs_wait(dev, &dev->writes[i], limit);
+  }
+  while (dev->activeReads > 0 && nvstusb_usbfs_wait(dev, 0, limit));
+  pthread_mutex_unlock(&dev->lock);
+
+  unsigned int interface = 0;
+  ioctl(dev->fd, USBDEVFS_RELEASEINTERFACE, &interface);
+  if (dev->epoll >= 0) close(dev->epoll);
+  close(dev->fd);
+  pthread_cond_destroy(&dev->reaped);
+  pthread_mutex_destroy(&dev->lock);
+  free(dev);
+}
+
+/* count an eye packet that was not submitted, usb.c leaves them to us */
+static int
+nvstusb_usbfs_write_failed(
+  struct nvstusb_usbfs_device *dev,
+  int endpoint,
+  int size,
+  int res
+) {
+  if (endpoint != NVSTUSB_USBFS_EYE_ENDPOINT) return res;
+  uint64_t now = nvstusb_usb_time_ns();
+  nvstusb_usb_posted_write_done(&dev->base, endpoint, size, res, 0, now, now);
+  return res;
+}
+
+/* send data to an endpoint, bulk transfer. Eye packets are not waited
+ * for, the error of one that failed is returned by the next.
+ * returns the number of bytes sent or a negative error */
+static int
+nvstusb_usbfs_write_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  const void *data,
+  int size,
+  unsigned int timeout,
+  int *error
+) {
+  struct nvstusb_usbfs_device *dev = (struct nvstusb_usbfs_device *) base;
+  assert(dev != 0);
+
+  if (size > NVSTUSB_USBFS_BUFFER) return nvstusb_usbfs_write_failed(dev, endpoint, size, NVSTUSB_USB_ERROR_IO);
+
+  uint64_t limit = timeout ? nvstusb_usb_time_ns() + timeout*1000000ULL : 0;
+  struct nvstusb_usbfs_urb *u = 0;
+  int res;
+  int i;
+
+  pthread_mutex_lock(&dev->lock);
+  nvstusb_usbfs_reap_all(dev);
+  while (0 == u) {
+    for (i = 0; i < NVSTUSB_USBFS_WRITES && 0 == u; i++) {
+      if (!dev->writes[i].busy) u = &dev->writes[i];
+    }
+    if (0 == u && !nvstusb_usbfs_wait(dev, 0, limit)) {
+      res = dev->gone ? NVSTUSB_USB_ERROR_NO_DEVICE : NVSTUSB_USB_ERROR_TIMEOUT;
+      nvstusb_usbfs_write_failed(dev, endpoint, size, res);
+      pthread_mutex_unlock(&dev->lock);
+      return res;
+    }
+  }
+
+  memcpy(u->buffer, data, size);
+  u->async = endpoint == NVSTUSB_USBFS_EYE_ENDPOINT;
+  if (u->async) {
+    res = nvstusb_usbfs_submit(dev, u, endpoint, size);
+    if (res < 0) {
+      nvstusb_usbfs_write_failed(dev, endpoint, size, res);
+    } else if (dev->writeError < 0) {
+      /* this one is on its way, an eye packet before it failed. That
+       * was counted when it was reaped. */
+      res = dev->writeError;
+      dev->writeError = 0;
+    } else {
+      res = size;
+    }
+  } else {
+    res = nvstusb_usbfs_transfer(dev, u, endpoint, size, timeout, error);
+  }
+  pthread_mutex_unlock(&dev->lock);
+  return res;
+}
+
+/* receive data from an endpoint
+ * returns the number of bytes received or a negative error */
+static int
+nvstusb_usbfs_read_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  void *data,
+  int size,
+  unsigned int timeout,
+  int *error
+) {
+  struct nvstusb_usbfs_device *dev = (struct nvstusb_usbfs_device *) base;
+  assert(dev != 0);
+
+  if (size > NVSTUSB_USBFS_BUFFER) size = NVSTUSB_USBFS_BUFFER;
+
+  pthread_mutex_lock(&dev->lock);
+  uint64_t limit = timeout ? nvstusb_usb_time_ns() + timeout*1000000ULL : 0;
+  while (dev->read.busy) {
+    if (!nvstusb_usbfs_wait(dev, &dev->read, limit)) {
+      pthread_mutex_unlock(&dev->lock);
+      return dev->gone ? NVSTUSB_USB_ERROR_NO_DEVICE : NVSTUSB_USB_ERROR_TIMEOUT;
+    }
+  }
+
+  int res = nvstusb_usbfs_transfer(dev, &dev->read, endpoint | 0x80, size, timeout, error);
+  if (res > 0) memcpy(data, dev->read.buffer, res);
+  pthread_mutex_unlock(&dev->lock);
+  return res;
+}
+
+/* keep count IN transfers queued on an endpoint */
+static bool
+nvstusb_usbfs_post_reads(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  int count,
+  int size
+) {
+  struct nvstusb_usbfs_device *dev = (struct nvstusb_usbfs_device *) base;
+  assert(dev != 0);
+  assert(dev->numReads == 0);
+
+  if (count > NVSTUSB_USBFS_MAX_READS) count = NVSTUSB_USBFS_MAX_READS;
+  if (size > NVSTUSB_USBFS_BUFFER) size = NVSTUSB_USBFS_BUFFER;
+
+  pthread_mutex_lock(&dev->lock);
+  dev->readEndpoint = endpoint;
+  while (dev->numReads < count) {
+    struct nvstusb_usbfs_urb *u = &dev->reads[dev->numReads++];
+    u->posted = true;
+    int res = nvstusb_usbfs_submit(dev, u, endpoint | 0x80, size);
+    if (res < 0) {
+      NVSTUSB_LOG(nvstusb_log_error, "Could not post read... Error %d", res);
+      break;
+    }
+    dev->activeReads++;
+  }
+
+  bool ok = dev->activeReads == count;
+  if (!ok) {
+    int i;
+    for (i = 0; i < dev->numReads; i++) {
+      if (dev->reads[i].busy) ioctl(dev->fd, USBDEVFS_DISCARDURB, &dev->reads[i].urb);
+    }
+    while (dev->activeReads > 0 && nvstusb_usbfs_wait(dev, 0, 0));
+    dev->numReads = 0;
+  }
+  pthread_mutex_unlock(&dev->lock);
+  return ok;
+}
+
+/* take the oldest completed reply, returns its length or 0 if there is none */
+static int
+nvstusb_usbfs_reap_bulk(
+  struct nvstusb_usb_device *base,
+  int endpoint,
+  void *data,
+  int size,
+  uint64_t *submit,
+  uint64_t *complete
+) {
+  struct nvstusb_usbfs_device *dev = (struct nvstusb_usbfs_device *) base;
+  assert(dev != 0);
+
+  if (endpoint != dev->readEndpoint || 0 == dev->numReads) return 0;
+
+  int len = 0;
+  pthread_mutex_lock(&dev->lock);
+  nvstusb_usbfs_reap_all(dev);
+  if (dev->replyHead != dev->replyTail) {
+    struct nvstusb_usbfs_reply *reply = &dev->replies[dev->replyTail % NVSTUSB_USBFS_REPLIES];
+    len = reply->length < size ? reply->length : size;
+    memcpy(data, reply->data, len);
+    *submit = reply->submit;
+    *complete = reply->complete;
+    dev->replyTail++;
+  } else if (0 == dev->activeReads) {
+    len = NVSTUSB_USB_ERROR_NO_DEVICE;
+  }
+  pthread_mutex_unlock(&dev->lock);
+  return len;
+}
+
+/* reap completions, waiting at most timeout_us for one */
+static int
+nvstusb_usbfs_handle_events(
+  struct nvstusb_usb_device *base,
+  int timeout_us
+) {
+  struct nvstusb_usbfs_device *dev = (struct nvstusb_usbfs_device *) base;
+  assert(dev != 0);
+
+  pthread_mutex_lock(&dev->lock);
+  if (timeout_us > 0) {
+    nvstusb_usbfs_wait(dev, 0, nvstusb_usb_time_ns() + timeout_us*1000ULL);
+  } else {
+    nvstusb_usbfs_reap_all(dev);
+  }
+  bool gone = dev->gone;
+  pthread_mutex_unlock(&dev->lock);
+  return gone ? NVSTUSB_USB_ERROR_NO_DEVICE : 0;
+}
+
+/* the device file signals reapable URBs as writable, an epoll set
+ * turns that into readable */
+static int
+nvstusb_usbfs_get_fd(
+  struct nvstusb_usb_device *base
+) {
+  struct nvstusb_usbfs_device *dev = (struct nvstusb_usbfs_device *) base;
+  assert(dev != 0);
+  if (dev->epoll >= 0) return dev->epoll;
+
+  int epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll < 0) return -1;
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLOUT;
+  ev.data.fd = dev->fd;
+  if (epoll_ctl(epoll, EPOLL_CTL_ADD, dev->fd, &ev) < 0) {
+    close(epoll);
+    return -1;
+  }
+  dev->epoll = epoll;
+  return epoll;
+}
+
+const struct nvstusb_usb_backend nvstusb_usb_usbfs_backend = {
+  "usbfs",
+  nvstusb_usbfs_init,
+  nvstusb_usbfs_deinit,
+  nvstusb_usbfs_open_device,
+  nvstusb_usbfs_close_device,
+  nvstusb_usbfs_write_bulk,
+  nvstusb_usbfs_read_bulk,
+  nvstusb_usbfs_post_reads,
+  nvstusb_usbfs_reap_bulk,
+  nvstusb_usbfs_handle_events,
+  0,
+  nvstusb_usbfs_get_fd
+};
@@ -0,0 +1,197 @@
+/* usbstats.c
+ *
+ * Exposition of the usb transfer counters as a text file.
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "usb_backend.h"
+#include "usbstats.h"
+#include "log.h"
+
+struct nvstusb_usbstats_exporter {
+  struct nvstusb_usb_device *dev;
+  char *path;
+  unsigned int interval_ms;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  bool stop;
+};
+
+/* one counter of every endpoint */
+static void
+nvstusb_usbstats_counter(
+  FILE *file,
+  const char *backend,
+  const struct nvstusb_endpoint_stats *stats,
+  int n,
+  const char *name,
+  const char *help,
+  size_t offset
+) {
+  int i;
+  fprintf(file, "# HELP nvstusb_usb_%s %s\n# TYPE nvstusb_usb_%s counter\n", name, help, name);
+  for (i = 0; i < n; i++) {
+    uint64_t value = *(const uint64_t *)((const char *)&stats[i] + offset);
+    fprintf(file, "nvstusb_usb_%s{backend=\"%s\",endpoint=\"0x%02x\"} %llu\n",
+      name, backend, stats[i].endpoint, (unsigned long long)value);
+  }
+}
+
+/* write the counters of dev to path */
+bool
+nvstusb_usbstats_write(
+  struct nvstusb_usb_device *dev,
+  const char *path
+) {
+  struct nvstusb_endpoint_stats stats[NVSTUSB_USB_ENDPOINTS];
+  int n = nvstusb_usb_get_stats(dev, stats, NVSTUSB_USB_ENDPOINTS);
+  const char *backend = dev->backend->name;
+
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *file = fopen(tmp, "w");
+  if (0 == file) {
+    NVSTUSB_LOG(nvstusb_log_error, "%s: %s", tmp, strerror(errno));
+    return false;
+  }
+
+  nvstusb_usbstats_counter(file, backend, stats, n, "submitted_total", "Transfers submitted.",
+    offsetof(struct nvstusb_endpoint_stats, submitted));
+  nvstusb_usbstats_counter(file, backend, stats, n, "completed_total", "Transfers completed without an error.",
+    offsetof(struct nvstusb_endpoint_stats, completed));
+  nvstusb_usbstats_counter(file, backend, stats, n, "failed_total", "Transfers ended in an error.",
+    offsetof(struct nvstusb_endpoint_stats, failed));
+  nvstusb_usbstats_counter(file, backend, stats, n, "timeouts_total", "Transfers timed out.",
+    offsetof(struct nvstusb_endpoint_stats, timeouts));
+  nvstusb_usbstats_counter(file, backend, stats, n, "short_total", "Transfers moving fewer bytes than asked for.",
+    offsetof(struct nvstusb_endpoint_stats, short_transfers));
+  nvstusb_usbstats_counter(file, backend, stats, n, "bytes_total", "Bytes transferred.",
+    offsetof(struct nvstusb_endpoint_stats, bytes));
+
+  int i, code;
+  fprintf(file, "# HELP nvstusb_usb_errors_total Failed transfers by libusb error code.\n"
+                "# TYPE nvstusb_usb_errors_total counter\n");
+  for (i = 0; i < n; i++) {
+    for (code = 0; code < NVSTUSB_USB_ERROR_CODES; code++) {
+      if (0 == stats[i].errors[code]) continue;
+      char label[16];
+      if (0 == code) strcpy(label, "other");
+      else snprintf(label, sizeof(label), "%d", -code);
+      fprintf(file, "nvstusb_usb_errors_total{backend=\"%s\",endpoint=\"0x%02x\",code=\"%s\"} %llu\n",
+        backend, stats[i].endpoint, label, (unsigned long long)stats[i].errors[code]);
+    }
+  }
+
+  fprintf(file, "# HELP nvstusb_usb_latency_us Latency of synchronous transfers in microseconds.\n"
+                "# TYPE nvstusb_usb_latency_us gauge\n");
+  for (i = 0; i < n; i++) {
+    if (0 == stats[i].latency_samples) continue;
+    fprintf(file, "nvstusb_usb_latency_us{backend=\"%s\",endpoint=\"0x%02x\",stat=\"min\"} %.1f\n"
+                  "nvstusb_usb_latency_us{backend=\"%s\",endpoint=\"0x%02x\",stat=\"avg\"} %.1f\n"
+                  "nvstusb_usb_latency_us{backend=\"%s\",endpoint=\"0x%02x\",stat=\"max\"} %.1f\n",
+      backend, stats[i].endpoint, stats[i].min_us,
+      backend, stats[i].endpoint, stats[i].avg_us,
+      backend, stats[i].endpoint, stats[i].max_us);
+  }
+
+  bool ok = !ferror(file);
+  if (0 != fclose(file)) ok = false;
+  if (ok && 0 != rename(tmp, path)) ok = false;
+  if (!ok) {
+    NVSTUSB_LOG(nvstusb_log_error, "%s: %s", path, strerror(errno));
+    remove(tmp);
+  }
+  return ok;
+}
+
+static void *
+nvstusb_usbstats_thread(
+  void *arg
+) {
+  struct nvstusb_usbstats_exporter *exporter = arg;
+
+  pthread_mutex_lock(&exporter->lock);
+  while (!exporter->stop) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += exporter->interval_ms / 1000;
+    ts.tv_nsec += (exporter->interval_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_unlock(&exporter->lock);
+    nvstusb_usbstats_write(exporter->dev, exporter->path);
+    pthread_mutex_lock(&exporter->lock);
+
+    while (!exporter->stop && 0 == pthread_cond_timedwait(&exporter->wake, &exporter->lock, &ts));
+  }
+  pthread_mutex_unlock(&exporter->lock);
+
+  /* the last counts before the device goes */
+  nvstusb_usbstats_write(exporter->dev, exporter->path);
+  return 0;
+}
+
+struct nvstusb_usbstats_exporter *
+nvstusb_usbstats_start(
+  struct nvstusb_usb_device *dev,
+  const char *path,
+  unsigned int interval_ms
+) {
+  struct nvstusb_usbstats_exporter *exporter = calloc(1, sizeof(*exporter));
+  if (0 == exporter) return 0;
+
+  exporter->dev = dev;
+  exporter->path = strdup(path);
+  exporter->interval_ms = interval_ms ? interval_ms : NVSTUSB_USBSTATS_INTERVAL_MS;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&exporter->wake, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&exporter->lock, 0);
+
+  if (0 == exporter->path || 0 != pthread_create(&exporter->thread, 0, nvstusb_usbstats_thread, exporter)) {
+    NVSTUSB_LOG(nvstusb_log_error, "Could not start writing usb counters to %s", path);
+    pthread_cond_destroy(&exporter->wake);
+    pthread_mutex_destroy(&exporter->lock);
+    free(exporter->path);
+    free(exporter);
+    return 0;
+  }
+  return exporter;
+}
+
+void
+nvstusb_usbstats_stop(
+  struct nvstusb_usbstats_exporter *exporter
+) {
+  if (0 == exporter) return;
+
+  pthread_mutex_lock(&exporter->lock);
+  exporter->stop = true;
+  pthread_cond_signal(&exporter->wake);
+  pthread_mutex_unlock(&exporter->lock);
+  pthread_join(exporter->thread, 0);
+
+  pthread_cond_destroy(&exporter->wake);
+  pthread_mutex_destroy(&exporter->lock);
+  free(exporter->path);
+  free(exporter);
+}
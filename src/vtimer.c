@@ -0,0 +1,175 @@
+/* vtimer.c
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include "vtimer.h"
+
+/* default phase slew per tick */
+#define NVSTUSB_VTIMER_SLEW_US      20.0
+
+/* the period follows external timestamps by this fraction of the error */
+#define NVSTUSB_VTIMER_FREQ_GAIN    0.1
+
+/* and stays within this distance of the configured period */
+#define NVSTUSB_VTIMER_MAX_PPM      10000.0
+
+/* timestamps further apart than this many ticks only resync the phase */
+#define NVSTUSB_VTIMER_MAX_GAP      64
+
+int64_t
+nvstusb_vtimer_now(
+) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+void
+nvstusb_vtimer_init(
+  struct nvstusb_vtimer *timer
+) {
+  pthread_mutex_init(&timer->lock, 0);
+  timer->nominal = 0.0;
+  timer->period = 0.0;
+  timer->anchor = 0;
+  timer->tick = 0;
+  timer->phase = 0.0;
+  timer->slew = NVSTUSB_VTIMER_SLEW_US * 1000.0;
+  timer->last_sync = 0;
+  timer->missed = 0;
+}
+
+void
+nvstusb_vtimer_destroy(
+  struct nvstusb_vtimer *timer
+) {
+  pthread_mutex_destroy(&timer->lock);
+}
+
+/* move tick 0 to the next tick, so the period can change without
+ * moving ticks already scheduled */
+static void
+nvstusb_vtimer_rebase(
+  struct nvstusb_vtimer *timer
+) {
+  timer->anchor += (int64_t)(timer->tick * timer->period);
+  timer->tick = 0;
+}
+
+void
+nvstusb_vtimer_set_rate(
+  struct nvstusb_vtimer *timer,
+  float rate
+) {
+  pthread_mutex_lock(&timer->lock);
+  if (rate <= 0) {
+    timer->nominal = timer->period = 0.0;
+  } else if (timer->nominal > 0.0) {
+    /* keep the phase, change the period */
+    nvstusb_vtimer_rebase(timer);
+    timer->nominal = timer->period = 1e9/rate;
+  } else {
+    timer->nominal = timer->period = 1e9/rate;
+    timer->anchor = nvstusb_vtimer_now() + (int64_t)timer->period;
+    timer->tick = 0;
+    timer->phase = 0.0;
+    timer->last_sync = 0;
+  }
+  pthread_mutex_unlock(&timer->lock);
+}
+
+void
+nvstusb_vtimer_set_slew(
+  struct nvstusb_vtimer *timer,
+  float slew_us
+) {
+  pthread_mutex_lock(&timer->lock);
+  timer->slew = (slew_us > 0 ? slew_us : NVSTUSB_VTIMER_SLEW_US) * 1000.0;
+  pthread_mutex_unlock(&timer->lock);
+}
+
+int64_t
+nvstusb_vtimer_wait(
+  struct nvstusb_vtimer *timer
+) {
+  pthread_mutex_lock(&timer->lock);
+  if (timer->period <= 0.0) {
+    pthread_mutex_unlock(&timer->lock);
+    return -1;
+  }
+
+  /* apply a slice of the pending phase correction */
+  if (timer->phase != 0.0) {
+    double step = timer->phase;
+    if (step >  timer->slew) step =  timer->slew;
+    if (step < -timer->slew) step = -timer->slew;
+    timer->anchor += (int64_t)step;
+    timer->phase -= step;
+  }
+
+  int64_t due = timer->anchor + (int64_t)(timer->tick * timer->period);
+  pthread_mutex_unlock(&timer->lock);
+
+  struct timespec ts = { due / 1000000000LL, due % 1000000000LL };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+
+  pthread_mutex_lock(&timer->lock);
+  timer->tick++;
+
+  /* slept through ticks: skip them instead of firing in a burst */
+  int64_t late = nvstusb_vtimer_now() - due;
+  if (late > timer->period) {
+    int64_t skip = (int64_t)(late / timer->period);
+    timer->tick += skip;
+    timer->missed += skip;
+    due += (int64_t)(skip * timer->period);
+  }
+  pthread_mutex_unlock(&timer->lock);
+  return due;
+}
+
+void
+nvstusb_vtimer_sync(
+  struct nvstusb_vtimer *timer,
+  int64_t timestamp
+) {
+  pthread_mutex_lock(&timer->lock);
+  if (timer->period <= 0.0) {
+    pthread_mutex_unlock(&timer->lock);
+    return;
+  }
+
+  /* error against the closest scheduled tick */
+  double ticks = floor((timestamp - timer->anchor) / timer->period + 0.5);
+  double error = timestamp - (timer->anchor + ticks * timer->period);
+
+  if (0 == timer->last_sync) {
+    /* first timestamp: jump to its phase */
+    timer->anchor += (int64_t)error;
+    timer->phase = 0.0;
+  } else {
+    /* the error is against the corrected schedule, so it replaces
+     * what is still pending instead of adding to it */
+    timer->phase = error;
+
+    /* a steady error over n ticks means the period is off by error/n */
+    double n = floor((timestamp - timer->last_sync) / timer->period + 0.5);
+    if (n >= 1 && n <= NVSTUSB_VTIMER_MAX_GAP) {
+      double period = timer->period + NVSTUSB_VTIMER_FREQ_GAIN * error / n;
+      double limit = timer->nominal * NVSTUSB_VTIMER_MAX_PPM / 1e6;
+      if (period > timer->nominal + limit) period = timer->nominal + limit;
+      if (period < timer->nominal - limit) period = timer->nominal - limit;
+      nvstusb_vtimer_rebase(timer);
+      timer->period = period;
+    }
+  }
+  timer->last_sync = timestamp;
+  pthread_mutex_unlock(&timer->lock);
+}
@@ -0,0 +1,102 @@
+/* Runs a short hand assembled 8051 program on the FX2 emulator and
+ * checks the accumulator, the PSW flags of ADD, register and indirect
+ * moves, a DJNZ loop and the pins of port A with half of them driven.
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fx2emu.h"
+
+#define XR_CPUCS  0xE600
+
+static const uint8_t program[] = {
+  0x74, 0x7F,             /* 0000 MOV A,#7Fh */
+  0x24, 0x01,             /* 0002 ADD A,#01h      A=80h, AC OV */
+  0xF5, 0x30,             /* 0004 MOV 30h,A */
+  0x85, 0xD0, 0x31,       /* 0006 MOV 31h,PSW */
+  0x74, 0xF0,             /* 0009 MOV A,#F0h */
+  0x24, 0x20,             /* 000B ADD A,#20h      A=10h, CY */
+  0x85, 0xD0, 0x32,       /* 000D MOV 32h,PSW */
+  0x75, 0xB2, 0x0F,       /* 0010 MOV OEA,#0Fh */
+  0x75, 0x80, 0xA5,       /* 0013 MOV IOA,#A5h */
+  0x78, 0x40,             /* 0016 MOV R0,#40h */
+  0x76, 0x5A,             /* 0018 MOV @R0,#5Ah */
+  0x7A, 0x03,             /* 001A MOV R2,#3 */
+  0x05, 0x33,             /* 001C INC 33h */
+  0xDA, 0xFC,             /* 001E DJNZ R2,001Ch */
+  0x80, 0xFE,             /* 0020 SJMP $ */
+};
+
+static int failures = 0;
+
+#define CHECK(expr) \
+  do { if (!(expr)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #expr); failures++; } } while (0)
+
+static int changes = 0;
+static int changedPort = -1;
+static uint8_t changedPins = 0;
+
+static void
+port_changed(
+  void *user,
+  int port,
+  uint8_t pins,
+  uint64_t ns
+) {
+  changes++;
+  changedPort = port;
+  changedPins = pins;
+}
+
+/* Main function */
+int
+main(
+  int argc,
+  char **argv
+) {
+  static struct fx2emu emu;
+  uint8_t run = 0x00;
+
+  fx2emu_init(&emu);
+  emu.port_changed = port_changed;
+
+  fx2emu_load_ram(&emu, 0, program, sizeof(program));
+  CHECK(!fx2emu_running(&emu));
+  fx2emu_load_ram(&emu, XR_CPUCS, &run, 1);
+  CHECK(fx2emu_running(&emu));
+
+  fx2emu_run(&emu, 100000);
+
+  CHECK(0 == emu.bad_opcodes);
+  CHECK(0x20 == emu.pc);
+
+  /* 7Fh + 01h: half carry and signed overflow, no carry, odd parity */
+  CHECK(0x80 == emu.iram[0x30]);
+  CHECK(0x45 == emu.iram[0x31]);
+
+  /* F0h + 20h: carry only, A holds 10h */
+  CHECK(0x81 == emu.iram[0x32]);
+  CHECK(0x10 == emu.sfr[0xE0 - 0x80]);
+
+  CHECK(0x40 == emu.iram[0]);
+  CHECK(0x5A == emu.iram[0x40]);
+  CHECK(0 == emu.iram[2]);
+  CHECK(3 == emu.iram[0x33]);
+
+  /* OEA drives the cleared latch first, then IOA sets the low nibble,
+   * the high nibble floats high */
+  CHECK(0xF5 == emu.pins[0]);
+  CHECK(2 == changes);
+  CHECK(0 == changedPort);
+  CHECK(0xF5 == changedPins);
+
+  if (failures) fprintf(stderr, "%d checks failed\n", failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
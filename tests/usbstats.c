@@ -0,0 +1,195 @@
+/* Checks the transfer counters against the replay backend: a trace
+ * with completed, short and timed out transfers is played back through
+ * synchronous and posted reads, and the counters must show each of them
+ * once, posted reads with the size they asked for.
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "usb.h"
+#include "usb_backend.h"
+#include "trace.h"
+
+#define COMMAND_ENDPOINT  2
+#define READ_ENDPOINT     4
+#define EYE_ENDPOINT      1
+
+static const uint8_t command[4] = { 0x02, 0x18, 0x04, 0x00 };
+static const uint8_t reply[4] = { 0x18, 0x04, 0x00, 0x00 };
+
+static int failures = 0;
+
+#define CHECK(expr) \
+  do { if (!(expr)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #expr); failures++; } } while (0)
+
+/* append a transfer, times are not replayed at speed 0 */
+static void
+add(
+  FILE *file,
+  uint8_t type,
+  uint8_t endpoint,
+  const void *data,
+  int length,
+  int result
+) {
+  static uint64_t t = 0;
+  struct nvstusb_trace_record rec;
+  rec.type = type;
+  rec.endpoint = endpoint;
+  rec.length = length;
+  rec.result = result;
+  rec.submit = t;
+  rec.complete = t + 1000;
+  t += 2000;
+  nvstusb_trace_write(file, &rec, data);
+}
+
+/* a read command and the device's answer to it */
+static void
+add_read(
+  FILE *file,
+  int result
+) {
+  add(file, NVSTUSB_TRACE_BULK_OUT, COMMAND_ENDPOINT, command, sizeof(command), sizeof(command));
+  add(file, NVSTUSB_TRACE_BULK_IN, READ_ENDPOINT | 0x80, reply, result > 0 ? result : 0, result);
+}
+
+/* the replay backend with a write that sends half and then fails, as
+ * libusb reports a bulk write that timed out part way */
+static struct nvstusb_usb_backend shorting;
+static const struct nvstusb_usb_backend *replay;
+
+static int
+short_write(
+  struct nvstusb_usb_device *dev,
+  int endpoint,
+  const void *data,
+  int size,
+  unsigned int timeout,
+  int *error
+) {
+  int res = replay->write_bulk(dev, endpoint, data, size, timeout, error);
+  if (res < size) return res;
+  *error = NVSTUSB_USB_ERROR_TIMEOUT;
+  return size / 2;
+}
+
+static const struct nvstusb_endpoint_stats *
+find(
+  const struct nvstusb_endpoint_stats *stats,
+  int n,
+  uint32_t endpoint
+) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (stats[i].endpoint == endpoint) return &stats[i];
+  }
+  return 0;
+}
+
+/* Main function */
+int main(int argc, char **argv) {
+  char path[] = "/tmp/nvstusb-usbstats-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) { perror("mkstemp"); return 1; }
+  close(fd);
+
+  FILE *file = nvstusb_trace_create(path);
+  if (0 == file) { perror(path); return 1; }
+
+  /* synchronous reads: complete, timeout, short */
+  add_read(file, 4);
+  add_read(file, NVSTUSB_USB_ERROR_TIMEOUT);
+  add_read(file, 3);
+  add(file, NVSTUSB_TRACE_BULK_OUT, EYE_ENDPOINT, command, sizeof(command), NVSTUSB_USB_ERROR_TIMEOUT);
+  /* posted reads: complete, timeout, short */
+  add_read(file, 4);
+  add_read(file, NVSTUSB_USB_ERROR_TIMEOUT);
+  add_read(file, 2);
+  /* a write that fails after sending some of it */
+  add(file, NVSTUSB_TRACE_BULK_OUT, COMMAND_ENDPOINT, command, sizeof(command), sizeof(command));
+  fclose(file);
+
+  nvstusb_usb_set_replay(path, 0);
+  CHECK(nvstusb_usb_init());
+  struct nvstusb_usb_device *dev = nvstusb_usb_open_device("");
+  CHECK(0 != dev);
+  if (0 == dev) {
+    unlink(path);
+    return 1;
+  }
+
+  uint8_t buf[4];
+  CHECK(nvstusb_usb_write_bulk(dev, COMMAND_ENDPOINT, command, sizeof(command), 0) == 4);
+  CHECK(nvstusb_usb_read_bulk(dev, READ_ENDPOINT, buf, sizeof(buf), 0) == 4);
+  CHECK(nvstusb_usb_write_bulk(dev, COMMAND_ENDPOINT, command, sizeof(command), 0) == 4);
+  CHECK(nvstusb_usb_read_bulk(dev, READ_ENDPOINT, buf, sizeof(buf), 0) == NVSTUSB_USB_ERROR_TIMEOUT);
+  CHECK(nvstusb_usb_write_bulk(dev, COMMAND_ENDPOINT, command, sizeof(command), 0) == 4);
+  CHECK(nvstusb_usb_read_bulk(dev, READ_ENDPOINT, buf, sizeof(buf), 0) == 3);
+  CHECK(nvstusb_usb_write_bulk(dev, EYE_ENDPOINT, command, sizeof(command), 0) == NVSTUSB_USB_ERROR_TIMEOUT);
+
+  CHECK(nvstusb_usb_post_reads(dev, READ_ENDPOINT, 2, sizeof(buf)));
+  CHECK(nvstusb_usb_write_bulk(dev, COMMAND_ENDPOINT, command, sizeof(command), 0) == 4);
+  CHECK(nvstusb_usb_reap_bulk(dev, READ_ENDPOINT, buf, sizeof(buf)) == 4);
+  CHECK(nvstusb_usb_write_bulk(dev, COMMAND_ENDPOINT, command, sizeof(command), 0) == 4);
+  CHECK(nvstusb_usb_reap_bulk(dev, READ_ENDPOINT, buf, sizeof(buf)) == 0);
+  CHECK(nvstusb_usb_write_bulk(dev, COMMAND_ENDPOINT, command, sizeof(command), 0) == 4);
+  CHECK(nvstusb_usb_reap_bulk(dev, READ_ENDPOINT, buf, sizeof(buf)) == 2);
+
+  replay = dev->backend;
+  shorting = *replay;
+  shorting.write_bulk = short_write;
+  dev->backend = &shorting;
+  CHECK(nvstusb_usb_write_bulk(dev, COMMAND_ENDPOINT, command, sizeof(command), 0) == 2);
+  dev->backend = replay;
+
+  struct nvstusb_endpoint_stats stats[8];
+  int n = nvstusb_usb_get_stats(dev, stats, 8);
+  CHECK(n == 3);
+
+  const struct nvstusb_endpoint_stats *s = find(stats, n, COMMAND_ENDPOINT);
+  CHECK(0 != s);
+  if (0 != s) {
+    CHECK(s->submitted == 7);
+    CHECK(s->completed == 6);
+    CHECK(s->failed == 1);
+    CHECK(s->timeouts == 1);
+    CHECK(s->short_transfers == 1);
+    CHECK(s->bytes == 24+2);
+  }
+
+  s = find(stats, n, EYE_ENDPOINT);
+  CHECK(0 != s);
+  if (0 != s) {
+    CHECK(s->submitted == 1);
+    CHECK(s->failed == 1);
+    CHECK(s->timeouts == 1);
+    CHECK(s->errors[-NVSTUSB_USB_ERROR_TIMEOUT] == 1);
+  }
+
+  s = find(stats, n, READ_ENDPOINT | 0x80);
+  CHECK(0 != s);
+  if (0 != s) {
+    CHECK(s->submitted == 6);
+    CHECK(s->completed == 4);
+    CHECK(s->failed == 2);
+    CHECK(s->timeouts == 2);
+    CHECK(s->short_transfers == 2);
+    CHECK(s->bytes == 4+3+4+2);
+  }
+
+  nvstusb_usb_close_device(dev);
+  nvstusb_usb_deinit();
+  unlink(path);
+
+  if (failures > 0) fprintf(stderr, "usbstats: %d checks failed\n", failures);
+  return failures > 0;
+}
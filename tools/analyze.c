@@ -0,0 +1,729 @@
+/* Timing analyzer for captures of the 3d stereo controller. Reads usbmon
+ * text (cat /sys/kernel/debug/usb/usbmon/1u), pcap or pcapng captures
+ * (Linux usbmon or USBPcap on Windows) and traces recorded by the library
+ * (NVSTUSB_TRACE), decodes the controller commands and reports command
+ * intervals, eye cadence and jitter.
+ *
+ * The controller (0955:0007) is found by its device descriptor, so the
+ * capture should include the enumeration. Otherwise pass --device BUS:DEV.
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+
+#include "timing.h"
+#include "trace.h"
+
+/* controller commands, see src/nvstusb.c */
+#define NVSTUSB_CMD_WRITE       (0x01)  /* write data */
+#define NVSTUSB_CMD_READ        (0x02)  /* read data */
+#define NVSTUSB_CMD_CLEAR       (0x40)  /* set data to 0 */
+#define NVSTUSB_CMD_SET_EYE     (0xAA)  /* set current eye */
+#define NVSTUSB_CMD_CALL_X0199  (0xBE)  /* call routine at 0x0199 */
+
+/* pcap link types */
+#define LINKTYPE_USB_LINUX        189
+#define LINKTYPE_USB_LINUX_MMAPPED 220
+#define LINKTYPE_USBPCAP          249
+
+/* transfer types */
+#define XFER_ISO      0
+#define XFER_INTR     1
+#define XFER_CONTROL  2
+#define XFER_BULK     3
+
+/* eye commands closer than this belong to one quad buffer swap */
+#define QUAD_PAIR_US  500.0
+
+#define MAX_DEVICES   16
+#define DATA_SIZE     64
+
+/* a bulk transfer carrying data */
+struct event {
+  double t;         /* us */
+  int device;       /* bus<<16 | address */
+  int endpoint;     /* with direction bit */
+  int length;
+  uint8_t data[DATA_SIZE];
+};
+
+static struct event *events = 0;
+static int numEvents = 0;
+static int sizeEvents = 0;
+
+/* devices identified as the controller */
+static int devices[MAX_DEVICES];
+static int numDevices = 0;
+
+/* every device seen, to pick one when there is only one */
+static int seen[MAX_DEVICES];
+static int numSeen = 0;
+
+static int verbose = 0;
+
+/* Usage */
+void usage(void) {
+  fprintf(stderr, "nvstusb-analyze [--device BUS:DEV] [--verbose] capture\n");
+}
+
+static void
+addDevice(
+  int *list,
+  int *count,
+  int device
+) {
+  int i;
+  for (i = 0; i < *count; i++) if (list[i] == device) return;
+  if (*count < MAX_DEVICES) list[(*count)++] = device;
+}
+
+/* a packet from any of the capture formats. Data of OUT transfers is
+ * taken on submission, data of IN transfers on completion. */
+static void
+addPacket(
+  double t,
+  int device,
+  int type,
+  int endpoint,
+  int completion,
+  const uint8_t *data,
+  int length
+) {
+  if (length <= 0) return;
+
+  /* GET_DESCRIPTOR(device) reply: 18 bytes, type 1, vendor at 8, product at 10 */
+  if (type == XFER_CONTROL && completion && (endpoint & 0x80) &&
+      length >= 12 && data[0] == 18 && data[1] == 1) {
+    int vendor  = data[8]  | (data[9]<<8);
+    int product = data[10] | (data[11]<<8);
+    if (vendor == 0x0955 && product == 0x0007) addDevice(devices, &numDevices, device);
+    return;
+  }
+
+  if (type != XFER_BULK && type != XFER_INTR) return;
+  if (((endpoint & 0x80) != 0) != (completion != 0)) return;
+
+  addDevice(seen, &numSeen, device);
+
+  if (numEvents == sizeEvents) {
+    sizeEvents = sizeEvents ? sizeEvents*2 : 4096;
+    events = realloc(events, sizeEvents * sizeof(*events));
+    if (0 == events) { perror("nvstusb-analyze"); exit(EXIT_FAILURE); }
+  }
+  struct event *e = &events[numEvents++];
+  e->t = t;
+  e->device = device;
+  e->endpoint = endpoint;
+  e->length = length < DATA_SIZE ? length : DATA_SIZE;
+  memcpy(e->data, data, e->length);
+}
+
+static uint32_t
+get16(
+  const uint8_t *p,
+  int swap
+) {
+  return swap ? (p[0]<<8) | p[1] : p[0] | (p[1]<<8);
+}
+
+static uint32_t
+get32(
+  const uint8_t *p,
+  int swap
+) {
+  return swap ? ((uint32_t)p[0]<<24) | (p[1]<<16) | (p[2]<<8) | p[3]
+              : p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+/* a captured usb packet with its link layer header */
+static void
+parseLinkPacket(
+  int linktype,
+  double t,
+  const uint8_t *p,
+  uint32_t size
+) {
+  switch (linktype) {
+  case LINKTYPE_USB_LINUX:
+  case LINKTYPE_USB_LINUX_MMAPPED:
+    {
+      /* struct usbmon_packet, host byte order (assumed little endian) */
+      uint32_t header = linktype == LINKTYPE_USB_LINUX ? 48 : 64;
+      if (size < header) return;
+      int event = p[8];
+      if (event != 'S' && event != 'C') return;
+      uint32_t length = get32(p+36, 0);
+      if (length > size - header) length = size - header;
+      addPacket(t, (get16(p+12, 0)<<16) | p[11], p[9], p[10], event == 'C', p+header, length);
+    }
+    break;
+  case LINKTYPE_USBPCAP:
+    {
+      /* USBPCAP_BUFFER_PACKET_HEADER, little endian */
+      if (size < 27) return;
+      uint32_t header = get16(p, 0);
+      if (header > size) return;
+      uint32_t length = get32(p+23, 0);
+      if (length > size - header) length = size - header;
+      int completion = p[16] & 1;
+      addPacket(t, (get16(p+17, 0)<<16) | get16(p+19, 0), p[22], p[21], completion, p+header, length);
+    }
+    break;
+  }
+}
+
+/* classic pcap file */
+static int
+parsePcap(
+  FILE *file,
+  const uint8_t *magic
+) {
+  uint8_t header[24];
+  memcpy(header, magic, 4);
+  if (fread(header+4, 20, 1, file) != 1) return -1;
+
+  uint32_t m = get32(header, 0);
+  int swap = (m == 0xd4c3b2a1 || m == 0x4d3cb2a1);
+  int nano = (m == 0xa1b23c4d || m == 0x4d3cb2a1);
+  int linktype = get32(header+20, swap) & 0xffff;
+
+  uint8_t rec[16];
+  uint8_t *buf = malloc(65536);
+  while (fread(rec, 16, 1, file) == 1) {
+    uint32_t size = get32(rec+8, swap);
+    if (size > 65536) { free(buf); return -1; }
+    if (fread(buf, size, 1, file) != 1) break;
+    double t = get32(rec, swap)*1e6 + get32(rec+4, swap) / (nano ? 1000.0 : 1.0);
+    parseLinkPacket(linktype, t, buf, size);
+  }
+  free(buf);
+  return 0;
+}
+
+/* pcapng file */
+static int
+parsePcapng(
+  FILE *file
+) {
+  int linktypes[MAX_DEVICES];
+  double units[MAX_DEVICES];    /* us per timestamp tick */
+  int numInterfaces = 0;
+  int swap = 0;
+
+  uint8_t head[8];
+  uint8_t *body = 0;
+  uint32_t bodySize = 0;
+
+  /* the magic was consumed to detect the format */
+  memcpy(head, "\x0a\x0d\x0d\x0a", 4);
+  if (fread(head+4, 4, 1, file) != 1) return -1;
+
+  for (;;) {
+    uint32_t type = get32(head, 0);
+    uint32_t total = get32(head+4, swap);
+
+    /* the section header decides the byte order of its block length */
+    if (type == 0x0a0d0d0a) {
+      uint8_t bom[4];
+      if (fread(bom, 4, 1, file) != 1) break;
+      swap = get32(bom, 0) != 0x1a2b3c4d;
+      total = get32(head+4, swap);
+      numInterfaces = 0;
+      if (total < 16) break;
+      if (fseek(file, total - 12, SEEK_CUR) != 0) break;
+    } else {
+      if (total < 12) break;
+      uint32_t size = total - 8;
+      if (size > bodySize) {
+        bodySize = size;
+        body = realloc(body, bodySize);
+      }
+      if (fread(body, size, 1, file) != 1) break;
+      type = get32(head, swap);
+
+      if (type == 1 && size >= 8 && numInterfaces < MAX_DEVICES) {
+        /* interface description, look for if_tsresol */
+        double unit = 1.0;
+        uint32_t pos = 8;
+        while (pos + 4 <= size - 4) {
+          uint32_t code = get16(body+pos, swap);
+          uint32_t len  = get16(body+pos+2, swap);
+          if (code == 0) break;
+          if (code == 9 && len >= 1) {
+            uint8_t res = body[pos+4];
+            unit = (res & 0x80) ? 1e6 / pow(2, res & 0x7f) : 1e6 / pow(10, res);
+          }
+          pos += 4 + ((len + 3) & ~3);
+        }
+        linktypes[numInterfaces] = get16(body, swap);
+        units[numInterfaces] = unit;
+        numInterfaces++;
+      } else if (type == 6 && size >= 20) {
+        /* enhanced packet */
+        uint32_t iface = get32(body, swap);
+        if (iface < (uint32_t)numInterfaces) {
+          uint64_t ts = ((uint64_t)get32(body+4, swap) << 32) | get32(body+8, swap);
+          uint32_t caplen = get32(body+12, swap);
+          if (caplen > size - 20) caplen = size - 20;
+          parseLinkPacket(linktypes[iface], ts * units[iface], body+20, caplen);
+        }
+      }
+    }
+
+    if (fread(head, 8, 1, file) != 1) break;
+  }
+
+  free(body);
+  return 0;
+}
+
+/* usbmon text: tag timestamp event address status length [= data] */
+static int
+parseUsbmon(
+  FILE *file
+) {
+  char line[1024];
+  int lines = 0;
+
+  while (fgets(line, sizeof(line), file)) {
+    char *tok[64];
+    int n = 0;
+    char *save = 0;
+    char *s = strtok_r(line, " \t\n", &save);
+    while (s && n < 64) { tok[n++] = s; s = strtok_r(0, " \t\n", &save); }
+    if (n < 5) continue;
+
+    char event = tok[2][0];
+    if (event != 'S' && event != 'C') continue;
+
+    /* address: Bo:1:005:2, or Bo:005:2 from older kernels */
+    char kind, dir;
+    int bus = 0, address, endpoint;
+    if (sscanf(tok[3], "%c%c:%d:%d:%d", &kind, &dir, &bus, &address, &endpoint) != 5) {
+      bus = 0;
+      if (sscanf(tok[3], "%c%c:%d:%d", &kind, &dir, &address, &endpoint) != 4) continue;
+    }
+    int type;
+    switch (kind) {
+    case 'C': type = XFER_CONTROL; break;
+    case 'B': type = XFER_BULK; break;
+    case 'I': type = XFER_INTR; break;
+    case 'Z': type = XFER_ISO; break;
+    default: continue;
+    }
+    if (dir == 'i') endpoint |= 0x80;
+
+    /* setup packet takes the place of the status */
+    int i = 4;
+    if (tok[i][0] == 's') i += 6;
+    else i += 1;
+    if (i + 1 >= n || tok[i+1][0] != '=') continue;
+    i += 2;
+
+    uint8_t data[DATA_SIZE];
+    int length = 0;
+    for (; i < n && length < DATA_SIZE; i++) {
+      const char *h = tok[i];
+      while (h[0] && h[1] && length < DATA_SIZE) {
+        unsigned int byte;
+        if (sscanf(h, "%2x", &byte) != 1) break;
+        data[length++] = byte;
+        h += 2;
+      }
+    }
+
+    addPacket(strtod(tok[1], 0), (bus<<16) | address, type, endpoint, event == 'C', data, length);
+    lines++;
+  }
+  return lines > 0 ? 0 : -1;
+}
+
+/* trace recorded by the library, only has the controller's traffic */
+static int
+parseTrace(
+  const char *path
+) {
+  FILE *file = nvstusb_trace_open(path);
+  if (0 == file) return -1;
+
+  struct nvstusb_trace_record rec;
+  uint8_t *data = malloc(65535);
+  int res;
+  addDevice(devices, &numDevices, 0);
+  while ((res = nvstusb_trace_read(file, &rec, data)) > 0) {
+    if (rec.type == NVSTUSB_TRACE_BULK_OUT) {
+      addPacket(rec.submit / 1000.0, 0, XFER_BULK, rec.endpoint & 0x7f, 0, data, rec.length);
+    } else if (rec.type == NVSTUSB_TRACE_BULK_IN && rec.result > 0) {
+      addPacket(rec.complete / 1000.0, 0, XFER_BULK, rec.endpoint | 0x80, 1, data, rec.length);
+    }
+  }
+  free(data);
+  fclose(file);
+  return res;
+}
+
+/* interval statistics */
+struct stats {
+  double *values;
+  int count;
+  int size;
+};
+
+static void
+statsAdd(
+  struct stats *s,
+  double value
+) {
+  if (s->count == s->size) {
+    s->size = s->size ? s->size*2 : 1024;
+    s->values = realloc(s->values, s->size * sizeof(double));
+  }
+  s->values[s->count++] = value;
+}
+
+static int
+compareDouble(
+  const void *a,
+  const void *b
+) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* print count, min/mean/max, stddev and the deviation from expected
+ * (from the mean if expected is 0) */
+static void
+statsPrint(
+  const char *name,
+  struct stats *s,
+  double expected
+) {
+  if (s->count == 0) {
+    printf("%-18s none\n", name);
+    return;
+  }
+
+  double sum = 0.0, sumsq = 0.0;
+  int i;
+  for (i = 0; i < s->count; i++) sum += s->values[i];
+  double mean = sum / s->count;
+  for (i = 0; i < s->count; i++) sumsq += (s->values[i]-mean)*(s->values[i]-mean);
+  double stddev = sqrt(sumsq / s->count);
+
+  if (expected <= 0.0) expected = mean;
+  double *dev = malloc(s->count * sizeof(double));
+  for (i = 0; i < s->count; i++) dev[i] = fabs(s->values[i] - expected);
+  qsort(dev, s->count, sizeof(double), compareDouble);
+  qsort(s->values, s->count, sizeof(double), compareDouble);
+
+  printf("%-18s n=%d min=%.1f mean=%.1f max=%.1f stddev=%.1f us\n",
+    name, s->count, s->values[0], mean, s->values[s->count-1], stddev);
+  printf("%-18s jitter vs %.1f us: p50=%.1f p99=%.1f max=%.1f us\n",
+    "", expected, dev[s->count/2], dev[(s->count*99)/100], dev[s->count-1]);
+  free(dev);
+}
+
+static int
+isController(
+  int device
+) {
+  int i;
+  for (i = 0; i < numDevices; i++) if (devices[i] == device) return 1;
+  return 0;
+}
+
+static int32_t
+getCount(
+  const uint8_t *p
+) {
+  return (int32_t)(p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24));
+}
+
+/* how printWrite shows a field */
+enum field_kind {
+  field_raw,            /* bytes */
+  field_t0,             /* timer 0 count */
+  field_t2,             /* timer 2 count */
+  field_frames,         /* 16 bit number of frames */
+  field_poll_flags      /* the TD_Poll() bits of 0x1b */
+};
+
+/* print a register write with the meaning of the known fields, see
+ * nvstusb_set_rate_timed in src/nvstusb.c */
+static void
+printWrite(
+  unsigned int offset,
+  const uint8_t *data,
+  unsigned int size
+) {
+  static const struct {
+    unsigned int offset;
+    unsigned int size;
+    const char *name;
+    enum field_kind kind;
+  } fields[] = {
+    { 0x00, 4, "w (timer 2)",        field_t2 },
+    { 0x04, 4, "x (timer 0)",        field_t0 },
+    { 0x08, 4, "y (eye open)",       field_t0 },
+    { 0x0c, 4, "ir waveforms",       field_raw },
+    { 0x10, 4, "port b",             field_raw },
+    { 0x14, 4, "z (t2 reload)",      field_t2 },
+    { 0x1b, 1, "poll flags",         field_poll_flags },
+    { 0x1c, 2, "th0 index start",    field_raw },
+    { 0x1e, 2, "idle timeout",       field_frames },
+  };
+  unsigned int i, j;
+
+  for (i = 0; i < sizeof(fields)/sizeof(fields[0]); i++) {
+    if (fields[i].offset < offset || fields[i].offset + fields[i].size > offset + size) continue;
+    const uint8_t *p = data + fields[i].offset - offset;
+    printf("             %02x %-16s", fields[i].offset, fields[i].name);
+    switch (fields[i].kind) {
+    case field_t0:
+    case field_t2:
+      {
+        int32_t count = getCount(p);
+        long long us = fields[i].kind == field_t2 ? NVSTUSB_T2_US((long long)count) : NVSTUSB_T0_US((long long)count);
+        printf(" %d (%lld us)", count, us);
+      }
+      break;
+    case field_frames:
+      printf(" %d frames", p[0] | (p[1]<<8));
+      break;
+    case field_poll_flags:
+      /* bits 0-1 index the table at 0x17d4, 2 starts timer 1, 3 is PC1
+       * inverted, 4-5 index the table at 0x2a, 6 restarts timer 0 */
+      printf(" %02x (table %d, t1 %d, pc1 %d, table2 %d, t0 restart %d)", p[0],
+        p[0] & 3, (p[0]>>2) & 1, !((p[0]>>3) & 1), (p[0]>>4) & 3, (p[0]>>6) & 1);
+      break;
+    default:
+      for (j = 0; j < fields[i].size; j++) printf(" %02x", p[j]);
+      break;
+    }
+    printf("\n");
+  }
+}
+
+/* decode the controller traffic and print the report */
+static void
+analyze(
+) {
+  struct stats commands = { 0 }, eyes = { 0 }, leftEyes = { 0 }, rightEyes = { 0 }, replies = { 0 };
+  int numWrites = 0, numReads = 0, numSetEye = 0, numOther = 0, numReplies = 0;
+  int repeated = 0, quadPairs = 0;
+  double lastCommand = -1.0, lastEye = -1.0, lastLeft = -1.0, lastRight = -1.0;
+  double readSent = -1.0;
+  int lastEyeValue = -1;
+  double rate = 0.0;
+  double first = -1.0;
+  int i;
+
+  for (i = 0; i < numEvents; i++) {
+    struct event *e = &events[i];
+    if (!isController(e->device)) continue;
+    if (first < 0.0) first = e->t;
+
+    if (e->endpoint & 0x80) {
+      /* reply: offset, length, bytes sent, data */
+      numReplies++;
+      if (readSent >= 0.0) statsAdd(&replies, e->t - readSent);
+      readSent = -1.0;
+      if (verbose && e->length >= 4) {
+        int j;
+        printf("%12.1f  IN  ep%d  REPLY 0x%02x+%d:", e->t - first, e->endpoint & 0x7f, e->data[0], e->data[1]);
+        for (j = 4; j < e->length && j < 4 + e->data[1]; j++) printf(" %02x", e->data[j]);
+        printf("\n");
+      }
+      continue;
+    }
+
+    if (lastCommand >= 0.0) statsAdd(&commands, e->t - lastCommand);
+    lastCommand = e->t;
+
+    int cmd = e->data[0];
+    if (e->endpoint == 1 && cmd == NVSTUSB_CMD_SET_EYE && e->length >= 8) {
+      int eye = e->data[1];
+      int32_t r = getCount(e->data+4);
+      numSetEye++;
+      if (verbose) {
+        printf("%12.1f  OUT ep1  SET_EYE %s r=%d (%lld us)\n", e->t - first,
+          eye == 0xFE ? "right" : eye == 0xFF ? "left" : "?", r, NVSTUSB_T2_US((long long)r));
+      }
+
+      /* the second eye of a quad buffer swap follows immediately */
+      if (lastEye >= 0.0 && e->t - lastEye < QUAD_PAIR_US) {
+        quadPairs++;
+      } else {
+        if (lastEye >= 0.0) statsAdd(&eyes, e->t - lastEye);
+        if (eye == lastEyeValue) repeated++;
+        lastEye = e->t;
+      }
+      lastEyeValue = eye;
+
+      if (eye == 0xFF) {
+        if (lastLeft >= 0.0) statsAdd(&leftEyes, e->t - lastLeft);
+        lastLeft = e->t;
+      } else {
+        if (lastRight >= 0.0) statsAdd(&rightEyes, e->t - lastRight);
+        lastRight = e->t;
+      }
+    } else if (e->endpoint == 2 && (cmd & ~NVSTUSB_CMD_CLEAR) == NVSTUSB_CMD_WRITE && e->length >= 4) {
+      unsigned int offset = e->data[1];
+      unsigned int size = e->data[2] | (e->data[3]<<8);
+      unsigned int have = e->length - 4 < (int)size ? e->length - 4 : size;
+      numWrites++;
+      if (verbose) {
+        printf("%12.1f  OUT ep2  WRITE 0x%02x+%u (0x%04x)\n", e->t - first, offset, size, 0x2007+offset);
+        printWrite(offset, e->data+4, have);
+      }
+      if (offset <= 0x14 && offset + have >= 0x18) {
+        int32_t z = getCount(e->data+4 + 0x14 - offset);
+        long long us = NVSTUSB_T2_US((long long)z);
+        if (us > 0) {
+          rate = 1000000.0 / us;
+          printf("%12.1f  programmed rate %.2f Hz (z=%d)\n", e->t - first, rate, z);
+        }
+      }
+    } else if (e->endpoint == 2 && (cmd & ~NVSTUSB_CMD_CLEAR) == NVSTUSB_CMD_READ && e->length >= 4) {
+      numReads++;
+      readSent = e->t;
+      if (verbose) {
+        printf("%12.1f  OUT ep2  READ%s 0x%02x+%d\n", e->t - first,
+          (cmd & NVSTUSB_CMD_CLEAR) ? "+CLEAR" : "", e->data[1], e->data[2] | (e->data[3]<<8));
+      }
+    } else {
+      numOther++;
+      if (verbose) {
+        printf("%12.1f  OUT ep%d  cmd 0x%02x, %d bytes\n", e->t - first, e->endpoint, cmd, e->length);
+      }
+    }
+  }
+
+  double frame = rate > 0.0 ? 1000000.0 / rate : 0.0;
+
+  printf("\ncommands: %d write, %d read, %d set eye (%d quad pairs), %d other, %d replies\n",
+    numWrites, numReads, numSetEye, quadPairs, numOther, numReplies);
+  statsPrint("command interval", &commands, 0.0);
+  statsPrint("eye interval", &eyes, frame);
+  statsPrint("left eye", &leftEyes, 2*frame);
+  statsPrint("right eye", &rightEyes, 2*frame);
+  statsPrint("read round trip", &replies, 0.0);
+  if (eyes.count > 0) {
+    double sum = 0.0;
+    for (i = 0; i < eyes.count; i++) sum += eyes.values[i];
+    printf("eye cadence: %.3f Hz, %d repeated eyes\n", eyes.count * 1000000.0 / sum, repeated);
+  }
+
+  free(commands.values);
+  free(eyes.values);
+  free(leftEyes.values);
+  free(rightEyes.values);
+  free(replies.values);
+}
+
+/* Main function */
+int main(int argc, char **argv)
+{
+  int configDevice = -1;
+
+  /* Getopt section */
+  struct option long_options[] =
+  {
+    {"device",       required_argument, 0, 'd'},
+    {"verbose",      no_argument,       0, 'v'},
+    {"help",         no_argument,       0, 'h'},
+    {NULL, 0, 0, 0}
+  };
+
+  while (1)
+  {
+    int c;
+    int option_index = 0;
+
+    c = getopt_long (argc, argv, "d:vh",
+        long_options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch (c)
+    {
+    case 'd':
+      {
+        int bus, address;
+        if (sscanf(optarg, "%d:%d", &bus, &address) != 2) {
+          usage();
+          exit(EXIT_FAILURE);
+        }
+        configDevice = (bus<<16) | address;
+      }
+      break;
+
+    case 'v':
+      verbose = 1;
+      break;
+
+    case 'h':
+    case '?':
+    default:
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind + 1 != argc) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+  const char *path = argv[optind];
+
+  FILE *file = fopen(path, "rb");
+  if (0 == file) { perror(path); exit(EXIT_FAILURE); }
+
+  uint8_t magic[8] = { 0 };
+  size_t got = fread(magic, 1, 4, file);
+  uint32_t m = get32(magic, 0);
+  int res;
+  if (got == 4 && m == 0x0a0d0d0a) {
+    res = parsePcapng(file);
+    fclose(file);
+  } else if (got == 4 && (m == 0xa1b2c3d4 || m == 0xd4c3b2a1 || m == 0xa1b23c4d || m == 0x4d3cb2a1)) {
+    res = parsePcap(file, magic);
+    fclose(file);
+  } else if (got == 4 && 0 == memcmp(magic, NVSTUSB_TRACE_MAGIC, 4)) {
+    fclose(file);
+    res = parseTrace(path);
+  } else {
+    rewind(file);
+    res = parseUsbmon(file);
+    fclose(file);
+  }
+  if (res < 0) {
+    fprintf(stderr, "%s: not a usbmon, pcap, pcapng or nvstusb trace file\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  if (configDevice >= 0) {
+    numDevices = 0;
+    addDevice(devices, &numDevices, configDevice);
+  } else if (numDevices == 0 && numSeen == 1) {
+    fprintf(stderr, "%s: no device descriptor found, using the only device %d:%d\n",
+      path, seen[0]>>16, seen[0]&0xffff);
+    addDevice(devices, &numDevices, seen[0]);
+  } else if (numDevices == 0) {
+    fprintf(stderr, "%s: no 0955:0007 device found, use --device BUS:DEV\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  analyze();
+  free(events);
+  return EXIT_SUCCESS;
+}
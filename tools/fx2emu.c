@@ -0,0 +1,259 @@
+/* Runs the controller firmware in the FX2 emulator, faster than real
+ * time, and measures the waveforms on its port pins. The firmware is
+ * driven by the bulk writes of a trace recorded by the library
+ * (NVSTUSB_TRACE), at their recorded times. Replies are drained and
+ * counted. The pins can also be written as a value change dump.
+ *
+ * To drive the emulated controller from an application in real time use
+ * NVSTUSB_BACKEND=emu (and NVSTUSB_EMU_VCD) instead.
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+
+#include "fx2emu.h"
+#include "trace.h"
+
+/* a write the firmware does not take within this time is dropped */
+#define NAK_LIMIT_NS  100000000ULL
+
+/* one port pin */
+struct pin {
+  uint64_t edges;
+  uint64_t lastRise;
+  uint64_t lastFall;
+  uint64_t periods;
+  double periodSum;
+  double periodSq;
+  double highSum;
+  uint64_t highs;
+};
+
+static struct pin pins[5][8];
+static uint8_t lastPins[5] = { 0xff, 0xff, 0xff, 0xff, 0xff };
+
+static uint64_t replies = 0;
+static uint64_t dropped = 0;
+
+/* Usage */
+void usage(void) {
+  fprintf(stderr, "nvstusb-emu [--trace FILE] [--time SECONDS] [--vcd FILE] firmware\n");
+}
+
+static void
+portChanged(
+  void *user,
+  int port,
+  uint8_t value,
+  uint64_t ns
+) {
+  uint8_t changed = value ^ lastPins[port];
+  int i;
+  for (i = 0; i < 8; i++) {
+    if (!(changed & (1 << i))) continue;
+    struct pin *p = &pins[port][i];
+    p->edges++;
+
+    if (value & (1 << i)) {
+      if (p->lastRise) {
+        double period = ns - p->lastRise;
+        p->periodSum += period;
+        p->periodSq += period*period;
+        p->periods++;
+      }
+      p->lastRise = ns;
+    } else {
+      if (p->lastRise) {
+        p->highSum += ns - p->lastRise;
+        p->highs++;
+      }
+      p->lastFall = ns;
+    }
+  }
+  lastPins[port] = value;
+}
+
+/* run until ns, taking every reply the firmware sends */
+static void
+runUntil(
+  struct fx2emu *emu,
+  uint64_t ns
+) {
+  uint8_t buf[FX2EMU_PACKET];
+  while (fx2emu_time_ns(emu) < ns) {
+    uint64_t step = fx2emu_time_ns(emu) + 125000;
+    fx2emu_run(emu, step < ns ? step : ns);
+    int ep;
+    for (ep = 1; ep <= 8; ep++) {
+      while (fx2emu_read(emu, ep, buf, sizeof(buf)) > 0) replies++;
+    }
+  }
+}
+
+/* send a packet, waiting while the endpoint NAKs */
+static void
+send(
+  struct fx2emu *emu,
+  int endpoint,
+  const uint8_t *data,
+  int size
+) {
+  uint64_t limit = fx2emu_time_ns(emu) + NAK_LIMIT_NS;
+  while (!fx2emu_write(emu, endpoint, data, size)) {
+    if (fx2emu_time_ns(emu) >= limit) {
+      dropped++;
+      return;
+    }
+    runUntil(emu, fx2emu_time_ns(emu) + 1000);
+  }
+}
+
+static int
+feedTrace(
+  struct fx2emu *emu,
+  const char *path
+) {
+  FILE *file = nvstusb_trace_open(path);
+  if (0 == file) return -1;
+
+  static uint8_t data[65535];
+  struct nvstusb_trace_record rec;
+  uint64_t first = 0;
+  int res;
+  bool started = false;
+
+  while ((res = nvstusb_trace_read(file, &rec, data)) > 0) {
+    /* the firmware is loaded already */
+    if (rec.type != NVSTUSB_TRACE_BULK_OUT || rec.result < 0) continue;
+
+    if (!started) {
+      first = rec.submit;
+      started = true;
+    }
+    runUntil(emu, rec.submit - first);
+    send(emu, rec.endpoint & 0x0f, data, rec.length);
+  }
+  fclose(file);
+  return res;
+}
+
+static void
+report(
+  struct fx2emu *emu
+) {
+  int port, bit;
+  double seconds = fx2emu_time_ns(emu) / 1e9;
+
+  printf("emulated %.3f s, %llu instructions (%.2f MIPS)\n", seconds,
+    (unsigned long long)emu->instructions, emu->instructions / seconds / 1e6);
+  printf("replies: %llu, writes NAKed for good: %llu\n",
+    (unsigned long long)replies, (unsigned long long)dropped);
+  if (emu->bad_opcodes) printf("undefined opcodes: %u\n", emu->bad_opcodes);
+
+  printf("\npin   edges      period us   jitter us   high us   duty\n");
+  for (port = 0; port < 5; port++) {
+    for (bit = 0; bit < 8; bit++) {
+      struct pin *p = &pins[port][bit];
+      if (0 == p->edges) continue;
+
+      printf("P%c.%d %7llu", 'A' + port, bit, (unsigned long long)p->edges);
+      if (p->periods > 0) {
+        double mean = p->periodSum / p->periods;
+        double var = p->periodSq / p->periods - mean*mean;
+        double high = p->highs ? p->highSum / p->highs : 0;
+        printf("  %12.3f  %10.3f  %8.3f  %5.1f%%", mean/1000, sqrt(var > 0 ? var : 0)/1000,
+          high/1000, high / mean * 100);
+      }
+      printf("\n");
+    }
+  }
+}
+
+/* Main function */
+int main(int argc, char **argv)
+{
+  const char *trace = 0;
+  const char *vcd = 0;
+  double seconds = 0;
+
+  /* Getopt section */
+  struct option long_options[] =
+  {
+    {"trace",        required_argument, 0, 't'},
+    {"time",         required_argument, 0, 's'},
+    {"vcd",          required_argument, 0, 'o'},
+    {"help",         no_argument,       0, 'h'},
+    {NULL, 0, 0, 0}
+  };
+
+  while (1)
+  {
+    int c;
+    int option_index = 0;
+
+    c = getopt_long (argc, argv, "t:s:o:h",
+        long_options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch (c)
+    {
+    case 't':
+      trace = optarg;
+      break;
+
+    case 's':
+      seconds = atof(optarg);
+      break;
+
+    case 'o':
+      vcd = optarg;
+      break;
+
+    case 'h':
+    case '?':
+    default:
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind + 1 != argc) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  static struct fx2emu emu;
+  fx2emu_init(&emu);
+  emu.port_changed = portChanged;
+  if (!fx2emu_load(&emu, argv[optind])) exit(EXIT_FAILURE);
+
+  FILE *vcdFile = 0;
+  if (0 != vcd) {
+    vcdFile = fopen(vcd, "w");
+    if (0 == vcdFile) { perror(vcd); exit(EXIT_FAILURE); }
+    fx2emu_trace_vcd(&emu, vcdFile);
+  }
+
+  if (0 != trace && feedTrace(&emu, trace) < 0) {
+    fprintf(stderr, "%s: trace is damaged, stopped there\n", trace);
+  }
+
+  /* run on after the trace, or for the given time */
+  uint64_t end = (uint64_t)(seconds * 1e9);
+  if (0 == trace && 0 == end) end = 1000000000ULL;
+  if (end > fx2emu_time_ns(&emu)) runUntil(&emu, end);
+
+  if (0 != vcdFile) fclose(vcdFile);
+  report(&emu);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,580 @@
+/* Plays the 3d stereo controller on a USB device controller through raw
+ * gadget, so the whole library including firmware upload and the
+ * reset and reopen that follows runs against it without an emitter:
+ *
+ *   modprobe dummy_hcd; modprobe raw_gadget
+ *   nvstusb-gadget &
+ *   NVSTUSB_BACKEND=libusb nvstusb-usbbench nvstusb.fw
+ *
+ * It first enumerates as the FX2 boot loader (0955:0007 without
+ * endpoints) and takes vendor request 0xa0. Once the uploaded firmware
+ * leaves reset it reconnects with bulk endpoints 1 and 2 OUT and 4 IN
+ * and runs that firmware in fx2emu, which answers the commands. The
+ * times of each startup step and the traffic are printed on exit.
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#include "fx2emu.h"
+#include "usb_backend.h"
+
+#define VENDOR        0x0955
+#define PRODUCT       0x0007
+#define PACKET        512
+
+/* newer kernels report bus resets */
+#define RAW_EVENT_RESET   5
+
+/* how often the emulation catches up with the wall clock */
+#define STEP_US       250
+
+/* a write the firmware does not take within this time is dropped */
+#define NAK_LIMIT_NS  100000000ULL
+
+enum stage {
+  stage_boot,       /* boot loader, no endpoints */
+  stage_firmware    /* the uploaded firmware runs */
+};
+
+/* one bulk endpoint of the firmware stage */
+struct endpoint {
+  uint8_t address;
+  int handle;
+  pthread_t thread;
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t dropped;
+};
+
+static const char *driver = "dummy_udc";
+static const char *device = "dummy_udc.0";
+static bool verbose = false;
+
+static int fd = -1;
+static enum stage stage = stage_boot;
+static bool configured = false;
+static volatile sig_atomic_t stopping = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fx2emu emu;
+static uint64_t emuStart;
+
+static struct endpoint endpoints[] = {
+  { 0x01 }, { 0x02 }, { 0x84 }
+};
+#define NUM_ENDPOINTS (sizeof(endpoints)/sizeof(endpoints[0]))
+
+/* startup steps, ns since start */
+static uint64_t begin;
+static uint64_t tConnect, tFirstLoad, tStarted, tFirmwareConnect, tConfigured, tFirstEye;
+static uint64_t loadRequests, loadBytes;
+
+/* Usage */
+void usage(void) {
+  fprintf(stderr, "nvstusb-gadget [--driver NAME] [--device NAME] [--verbose]\n");
+}
+
+static uint64_t
+since(
+) {
+  return nvstusb_usb_time_ns() - begin;
+}
+
+static void
+mark(
+  uint64_t *step,
+  const char *what
+) {
+  if (0 != *step) return;
+  *step = since();
+  if (verbose) fprintf(stderr, "%10.3f ms  %s\n", *step / 1e6, what);
+}
+
+static const struct usb_device_descriptor deviceDesc = {
+  USB_DT_DEVICE_SIZE, USB_DT_DEVICE, 0x0200,
+  0xff, 0xff, 0xff, 64,
+  VENDOR, PRODUCT, 0x0001,
+  0, 0, 0, 1
+};
+
+static const struct usb_qualifier_descriptor qualifierDesc = {
+  sizeof(struct usb_qualifier_descriptor), USB_DT_DEVICE_QUALIFIER, 0x0200,
+  0xff, 0xff, 0xff, 64, 1, 0
+};
+
+/* configuration of the current stage */
+static int
+configDescriptor(
+  uint8_t *buf
+) {
+  int numEndpoints = stage == stage_firmware ? NUM_ENDPOINTS : 0;
+  int total = USB_DT_CONFIG_SIZE + USB_DT_INTERFACE_SIZE + numEndpoints * USB_DT_ENDPOINT_SIZE;
+  struct usb_config_descriptor config = {
+    USB_DT_CONFIG_SIZE, USB_DT_CONFIG, total, 1, 1, 0, USB_CONFIG_ATT_ONE, 50
+  };
+  struct usb_interface_descriptor interface = {
+    USB_DT_INTERFACE_SIZE, USB_DT_INTERFACE, 0, 0, numEndpoints, 0xff, 0xff, 0xff, 0
+  };
+
+  memcpy(buf, &config, USB_DT_CONFIG_SIZE);
+  memcpy(buf + USB_DT_CONFIG_SIZE, &interface, USB_DT_INTERFACE_SIZE);
+
+  int pos = USB_DT_CONFIG_SIZE + USB_DT_INTERFACE_SIZE;
+  int i;
+  for (i = 0; i < numEndpoints; i++) {
+    struct usb_endpoint_descriptor ep = {
+      USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, endpoints[i].address,
+      USB_ENDPOINT_XFER_BULK, PACKET, 0
+    };
+    memcpy(buf + pos, &ep, USB_DT_ENDPOINT_SIZE);
+    pos += USB_DT_ENDPOINT_SIZE;
+  }
+  return total;
+}
+
+/* run the firmware up to now, lock held */
+static void
+catchUp(
+) {
+  fx2emu_run(&emu, nvstusb_usb_time_ns() - emuStart);
+}
+
+static void *
+clockThread(
+  void *arg
+) {
+  while (!stopping) {
+    pthread_mutex_lock(&lock);
+    catchUp();
+    pthread_mutex_unlock(&lock);
+    usleep(STEP_US);
+  }
+  return 0;
+}
+
+/* host to firmware */
+static void *
+outThread(
+  void *arg
+) {
+  struct endpoint *ep = arg;
+  struct {
+    struct usb_raw_ep_io io;
+    uint8_t data[PACKET];
+  } packet;
+
+  while (!stopping) {
+    packet.io.ep = ep->handle;
+    packet.io.flags = 0;
+    packet.io.length = PACKET;
+    int len = ioctl(fd, USB_RAW_IOCTL_EP_READ, &packet);
+    if (len < 0) {
+      /* reset or reconfiguration in progress */
+      usleep(1000);
+      continue;
+    }
+    if (ep->address == 0x01) mark(&tFirstEye, "first packet on endpoint 1");
+
+    /* the packet is taken already, the firmware NAKs it here */
+    uint64_t limit = 0;
+    for (;;) {
+      pthread_mutex_lock(&lock);
+      catchUp();
+      bool sent = fx2emu_write(&emu, ep->address, packet.data, len);
+      uint64_t now = fx2emu_time_ns(&emu);
+      pthread_mutex_unlock(&lock);
+
+      if (sent) {
+        ep->packets++;
+        ep->bytes += len;
+        break;
+      }
+      if (0 == limit) limit = now + NAK_LIMIT_NS;
+      if (now >= limit) {
+        ep->dropped++;
+        break;
+      }
+      usleep(STEP_US);
+    }
+  }
+  return 0;
+}
+
+/* firmware to host */
+static void *
+inThread(
+  void *arg
+) {
+  struct endpoint *ep = arg;
+  struct {
+    struct usb_raw_ep_io io;
+    uint8_t data[PACKET];
+  } packet;
+
+  while (!stopping) {
+    pthread_mutex_lock(&lock);
+    catchUp();
+    int len = fx2emu_read(&emu, ep->address & 0x0f, packet.data, PACKET);
+    pthread_mutex_unlock(&lock);
+
+    if (len <= 0) {
+      usleep(STEP_US);
+      continue;
+    }
+
+    packet.io.ep = ep->handle;
+    packet.io.flags = 0;
+    packet.io.length = len;
+    while (!stopping && ioctl(fd, USB_RAW_IOCTL_EP_WRITE, &packet) < 0) {
+      usleep(1000);
+    }
+    ep->packets++;
+    ep->bytes += len;
+  }
+  return 0;
+}
+
+/* enable the firmware's endpoints and start serving them, once */
+static bool
+enableEndpoints(
+) {
+  unsigned int i;
+  if (configured) return true;
+
+  for (i = 0; i < NUM_ENDPOINTS; i++) {
+    struct usb_endpoint_descriptor desc = {
+      USB_DT_ENDPOINT_SIZE, USB_DT_ENDPOINT, endpoints[i].address,
+      USB_ENDPOINT_XFER_BULK, PACKET, 0
+    };
+    endpoints[i].handle = ioctl(fd, USB_RAW_IOCTL_EP_ENABLE, &desc);
+    if (endpoints[i].handle < 0) {
+      fprintf(stderr, "could not enable endpoint %02x: %s\n", endpoints[i].address, strerror(errno));
+      return false;
+    }
+  }
+
+  pthread_t clock;
+  pthread_create(&clock, 0, clockThread, 0);
+  for (i = 0; i < NUM_ENDPOINTS; i++) {
+    pthread_create(&endpoints[i].thread, 0,
+      (endpoints[i].address & USB_DIR_IN) ? inThread : outThread, &endpoints[i]);
+  }
+  configured = true;
+  return true;
+}
+
+static void
+ep0Write(
+  const void *data,
+  int length
+) {
+  struct {
+    struct usb_raw_ep_io io;
+    uint8_t data[1024];
+  } packet;
+
+  packet.io.ep = 0;
+  packet.io.flags = 0;
+  packet.io.length = length;
+  memcpy(packet.data, data, length);
+  if (ioctl(fd, USB_RAW_IOCTL_EP0_WRITE, &packet) < 0 && verbose) perror("ep0 write");
+}
+
+/* data stage of an OUT request, or the status stage if there is none */
+static int
+ep0Read(
+  void *data,
+  int length
+) {
+  struct {
+    struct usb_raw_ep_io io;
+    uint8_t data[1024];
+  } packet;
+
+  packet.io.ep = 0;
+  packet.io.flags = 0;
+  packet.io.length = length;
+  int len = ioctl(fd, USB_RAW_IOCTL_EP0_READ, &packet);
+  if (len > 0) memcpy(data, packet.data, len);
+  return len;
+}
+
+static void
+stall(
+) {
+  ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0);
+}
+
+/* handle a request on endpoint 0, true if the firmware just started */
+static bool
+control(
+  const struct usb_ctrlrequest *req
+) {
+  uint8_t buf[1024];
+  int length = req->wLength < sizeof(buf) ? req->wLength : sizeof(buf);
+  bool in = req->bRequestType & USB_DIR_IN;
+
+  if ((req->bRequestType & USB_TYPE_MASK) == USB_TYPE_VENDOR && req->bRequest == 0xA0) {
+    /* boot loader RAM access, also understood by the firmware */
+    if (in) {
+      pthread_mutex_lock(&lock);
+      int n = length < 0x10000 - req->wValue ? length : 0x10000 - req->wValue;
+      memcpy(buf, emu.xram + req->wValue, n);
+      pthread_mutex_unlock(&lock);
+      ep0Write(buf, n);
+      return false;
+    }
+
+    int len = ep0Read(buf, length);
+    if (len < 0) return false;
+    mark(&tFirstLoad, "first firmware write");
+    loadRequests++;
+    loadBytes += len;
+
+    pthread_mutex_lock(&lock);
+    bool wasRunning = fx2emu_running(&emu);
+    fx2emu_load_ram(&emu, req->wValue, buf, len);
+    bool started = !wasRunning && fx2emu_running(&emu);
+    pthread_mutex_unlock(&lock);
+    return started && stage == stage_boot;
+  }
+
+  if ((req->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD) {
+    stall();
+    return false;
+  }
+
+  switch (req->bRequest) {
+  case USB_REQ_GET_DESCRIPTOR:
+    switch (req->wValue >> 8) {
+    case USB_DT_DEVICE:
+      ep0Write(&deviceDesc, length < USB_DT_DEVICE_SIZE ? length : USB_DT_DEVICE_SIZE);
+      return false;
+    case USB_DT_DEVICE_QUALIFIER:
+      ep0Write(&qualifierDesc, length < (int)sizeof(qualifierDesc) ? length : (int)sizeof(qualifierDesc));
+      return false;
+    case USB_DT_CONFIG:
+      {
+        int total = configDescriptor(buf);
+        ep0Write(buf, length < total ? length : total);
+        return false;
+      }
+    }
+    stall();
+    return false;
+
+  case USB_REQ_SET_CONFIGURATION:
+    if (stage == stage_firmware && !enableEndpoints()) {
+      stall();
+      return false;
+    }
+    ioctl(fd, USB_RAW_IOCTL_VBUS_DRAW, 50);
+    ioctl(fd, USB_RAW_IOCTL_CONFIGURE, 0);
+    ep0Read(buf, 0);
+    if (stage == stage_firmware) mark(&tConfigured, "firmware configured by the host");
+    return false;
+
+  case USB_REQ_SET_INTERFACE:
+    ep0Read(buf, 0);
+    return false;
+
+  case USB_REQ_GET_STATUS:
+    memset(buf, 0, 2);
+    ep0Write(buf, length < 2 ? length : 2);
+    return false;
+  }
+
+  stall();
+  return false;
+}
+
+/* bind to the device controller */
+static bool
+connectGadget(
+) {
+  fd = open("/dev/raw-gadget", O_RDWR);
+  if (fd < 0) {
+    perror("/dev/raw-gadget");
+    return false;
+  }
+
+  struct usb_raw_init init;
+  memset(&init, 0, sizeof(init));
+  snprintf((char *)init.driver_name, sizeof(init.driver_name), "%s", driver);
+  snprintf((char *)init.device_name, sizeof(init.device_name), "%s", device);
+  init.speed = USB_SPEED_HIGH;
+  if (ioctl(fd, USB_RAW_IOCTL_INIT, &init) < 0 || ioctl(fd, USB_RAW_IOCTL_RUN, 0) < 0) {
+    perror("nvstusb-gadget: could not bind to the device controller");
+    close(fd);
+    return false;
+  }
+  return true;
+}
+
+/* serve endpoint 0 until the firmware started or we are stopped */
+static void
+serve(
+) {
+  struct {
+    struct usb_raw_event event;
+    uint8_t data[sizeof(struct usb_ctrlrequest)];
+  } ev;
+
+  while (!stopping) {
+    ev.event.type = 0;
+    ev.event.length = sizeof(ev.data);
+    if (ioctl(fd, USB_RAW_IOCTL_EVENT_FETCH, &ev) < 0) {
+      if (errno == EINTR) continue;
+      perror("nvstusb-gadget: event");
+      return;
+    }
+
+    switch (ev.event.type) {
+    case USB_RAW_EVENT_CONNECT:
+      if (stage == stage_boot) mark(&tConnect, "connected as boot loader");
+      else mark(&tFirmwareConnect, "connected as firmware");
+      break;
+
+    case USB_RAW_EVENT_CONTROL:
+      if (control((const struct usb_ctrlrequest *) ev.data)) return;
+      break;
+
+    case RAW_EVENT_RESET:
+      /* firmware without a CPUCS write starts on the reset after loading */
+      if (stage == stage_boot && 0 != loadRequests) {
+        pthread_mutex_lock(&lock);
+        uint8_t run = 0;
+        fx2emu_load_ram(&emu, 0xE600, &run, 1);
+        pthread_mutex_unlock(&lock);
+        return;
+      }
+      break;
+    }
+  }
+}
+
+static void
+report(
+) {
+  unsigned int i;
+  printf("startup, ms since nvstusb-gadget started:\n");
+  printf("  connected as boot loader   %10.3f\n", tConnect / 1e6);
+  printf("  first firmware write       %10.3f\n", tFirstLoad / 1e6);
+  printf("  firmware started           %10.3f  (%llu requests, %llu bytes)\n", tStarted / 1e6,
+    (unsigned long long)loadRequests, (unsigned long long)loadBytes);
+  printf("  connected as firmware      %10.3f\n", tFirmwareConnect / 1e6);
+  printf("  configured by the host     %10.3f\n", tConfigured / 1e6);
+  printf("  first eye packet           %10.3f\n", tFirstEye / 1e6);
+
+  printf("endpoint  packets      bytes  dropped\n");
+  for (i = 0; i < NUM_ENDPOINTS; i++) {
+    printf("  %02x  %11llu %10llu %8llu\n", endpoints[i].address,
+      (unsigned long long)endpoints[i].packets, (unsigned long long)endpoints[i].bytes,
+      (unsigned long long)endpoints[i].dropped);
+  }
+  if (emu.bad_opcodes) printf("undefined opcodes: %u\n", emu.bad_opcodes);
+}
+
+static void
+stop(
+  int sig
+) {
+  stopping = 1;
+}
+
+/* Main function */
+int main(int argc, char **argv)
+{
+  /* Getopt section */
+  struct option long_options[] =
+  {
+    {"driver",       required_argument, 0, 'd'},
+    {"device",       required_argument, 0, 'D'},
+    {"verbose",      no_argument,       0, 'v'},
+    {"help",         no_argument,       0, 'h'},
+    {NULL, 0, 0, 0}
+  };
+
+  while (1)
+  {
+    int c;
+    int option_index = 0;
+
+    c = getopt_long (argc, argv, "d:D:vh",
+        long_options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch (c)
+    {
+    case 'd':
+      driver = optarg;
+      break;
+
+    case 'D':
+      device = optarg;
+      break;
+
+    case 'v':
+      verbose = true;
+      break;
+
+    case 'h':
+    case '?':
+    default:
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  /* no SA_RESTART, the blocking event fetch returns */
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop;
+  sigaction(SIGINT, &sa, 0);
+  sigaction(SIGTERM, &sa, 0);
+
+  begin = nvstusb_usb_time_ns();
+  fx2emu_init(&emu);
+
+  if (!connectGadget()) exit(EXIT_FAILURE);
+  serve();
+
+  if (!stopping && stage == stage_boot) {
+    /* the firmware disconnects and comes back with its own endpoints */
+    mark(&tStarted, "firmware started, reconnecting");
+    close(fd);
+    stage = stage_firmware;
+    pthread_mutex_lock(&lock);
+    emuStart = nvstusb_usb_time_ns() - fx2emu_time_ns(&emu);
+    pthread_mutex_unlock(&lock);
+
+    if (!connectGadget()) exit(EXIT_FAILURE);
+    serve();
+  }
+
+  report();
+  return EXIT_SUCCESS;
+}
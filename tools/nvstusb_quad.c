@@ -23,14 +23,13 @@
 #include <GL/glext.h>
 
 #include<X11/Xlib.h>
-#include<X11/extensions/xf86vmode.h>
 
 struct nvstusb_context *ctx = 0;
 
 /* USAGE : sudo chrt -r -p 99 nvstusb */
 /* Usage */
 void usage(void) {
-  fprintf(stderr, "nvstusb-quad [firmware]\n");
+  fprintf(stderr, "nvstusb-quad [--output NAME] [firmware]\n");
 }
 /* Main function */
 int main(int argc, char **argv) 
@@ -40,11 +39,13 @@ int main(int argc, char **argv)
   Window win;
   uint i_swap_cnt = 0;
   char const * config_fw = NULL;
+  char const * config_output = NULL;
 
   /* Getopt section */
   struct option long_options[] =
   {
     /* These options set a flag. */
+    {"output",       required_argument, 0, 'o'},
     {NULL, 0, 0, 0}
   };
 
@@ -63,6 +64,10 @@ int main(int argc, char **argv)
 
     switch (c)
     {
+    case 'o':
+      config_output = optarg;
+      break;
+
     case '?':
     default:
       usage();
@@ -126,13 +131,22 @@ int main(int argc, char **argv)
     exit(EXIT_FAILURE);
   }
 
-  /* Get Vsync rate from X11 */
-  XF86VidModeModeLine modeline;
-  int pixelclock;
-  XF86VidModeGetModeLine( dpy, DefaultScreen(dpy), &pixelclock, &modeline );
-  double frameRate=(double) pixelclock*1000/modeline.htotal/modeline.vtotal;
-  printf("Vertical Refresh rate:%f Hz\n",frameRate);
-  nvstusb_set_rate(ctx, frameRate);
+  /* Sync to the stereo output, not whatever owns pixel 0,0 */
+  if (config_output) {
+    int x, y;
+    if (nvstusb_select_output(ctx, config_output) < 0) {
+      fprintf(stderr, "output %s not found, aborting\n", config_output);
+      exit(EXIT_FAILURE);
+    }
+    nvstusb_get_output_position(ctx, &x, &y);
+    XMoveWindow(dpy, win, x, y);
+  }
+
+  /* Detect Vsync rate and follow its drift */
+  if (nvstusb_set_rate_auto(ctx) < 0) {
+    fprintf(stderr, "could not detect refresh rate, aborting\n");
+    exit(EXIT_FAILURE);
+  }
 
   /* Loop until stop */
   while (1) {
@@ -143,7 +157,7 @@ int main(int argc, char **argv)
     /* Read status from usb controler */
     if(!(i_swap_cnt&0xF)) {
       struct nvstusb_keys k;
-      nvstusb_get_keys(ctx, &k);
+      nvstusb_get_keys_nowait(ctx, &k);
       if (k.toggled3D) {
         nvstusb_invert_eyes(ctx);
       }
@@ -0,0 +1,645 @@
+/* nvstusbd: holds the 3d stereo controller so applications need not
+ * claim it or load the firmware each time they start. The library talks
+ * to it when it runs (the "daemon" usb backend, see include/ipc.h).
+ *
+ * Every client gets a shared memory region with a command ring and a
+ * reply ring once it said hello; a connection that closes without one
+ * (nvstusb_usb_daemon_running) costs nothing. Writes are executed as
+ * usb transfers in the order they are posted; writes whose deadline
+ * passed while queued are dropped. Reads are never waited for here: the
+ * daemon keeps reads posted on endpoint 4, and each reply goes to the
+ * client whose read command it answers (matched by offset and size,
+ * oldest first), as the reply to its read or as a posted read
+ * completion if it asked for those.
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "usb_backend.h"
+#include "ipc.h"
+
+#define MAX_CLIENTS 16
+
+/* read commands go to endpoint 2, replies come from endpoint 4 */
+#define NVSTUSB_CMD_READ        (0x02)
+#define NVSTUSB_CMD_CLEAR       (0x40)
+#define COMMAND_ENDPOINT        2
+#define READ_ENDPOINT           4
+#define POSTED_READS            4
+
+/* read commands whose reply is awaited, reads waiting per client, and
+ * replies that came before the client's read */
+#define MAX_COMMANDS            64
+#define MAX_WAITS               8
+#define MAX_EARLY               4
+
+/* a command without a reply after this long gets none */
+#define COMMAND_TTL_NS          1000000000ULL
+
+/* longest usb event wait, and the pause after an error */
+#define EVENT_SLICE_US          10000
+#define EVENT_BACKOFF_US        100000
+
+/* a read of a client waiting for the reply to its command */
+struct wait {
+  uint32_t seq;
+  uint16_t length;
+  uint64_t deadline;      /* monotonic ns, 0 = none */
+};
+
+struct client {
+  int sock;
+  int cmdBell;
+  int replyBell;
+  struct nvstusb_ipc_shm *shm;    /* 0 until the client said hello */
+  bool posted;            /* wants posted read completions */
+
+  struct wait waits[MAX_WAITS];
+  int numWaits;
+  struct nvstusb_ipc_msg early[MAX_EARLY];
+  int numEarly;
+};
+
+/* a read command sent to the device for a client */
+struct command {
+  struct client *c;
+  uint8_t offset;
+  uint8_t size;
+  uint64_t sent;
+};
+
+static struct nvstusb_usb_device *dev = 0;
+
+/* the usb event thread posts to the clients too */
+static pthread_mutex_t clientLock = PTHREAD_MUTEX_INITIALIZER;
+static struct client *clients[MAX_CLIENTS];
+static int numClients = 0;
+
+/* read commands in the order they were sent, clientLock held */
+static struct command commands[MAX_COMMANDS];
+static int numCommands = 0;
+
+/* wakes the main loop when the event thread stops it */
+static int wakeBell = -1;
+
+static volatile sig_atomic_t running = 1;
+static int verbose = 0;
+
+/* Usage */
+void usage(void) {
+  fprintf(stderr, "nvstusbd [--firmware FILE] [--socket PATH] [--verbose]\n");
+}
+
+static void
+stop(
+  int sig
+) {
+  running = 0;
+}
+
+/* post a reply to a client, clientLock held */
+static void
+reply(
+  struct client *c,
+  const struct nvstusb_ipc_msg *msg
+) {
+  if (!nvstusb_ipc_push(&c->shm->reply, msg)) {
+    __atomic_add_fetch(&c->shm->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  nvstusb_ipc_ring_bell(c->replyBell);
+}
+
+/* the device is gone, tell everyone */
+static void
+lost(
+  int error
+) {
+  int i;
+  fprintf(stderr, "nvstusbd: controller lost\n");
+  pthread_mutex_lock(&clientLock);
+  for (i = 0; i < numClients; i++) {
+    if (0 == clients[i]->shm) continue;
+    __atomic_store_n(&clients[i]->shm->status, error, __ATOMIC_RELEASE);
+    nvstusb_ipc_ring_bell(clients[i]->replyBell);
+  }
+  pthread_mutex_unlock(&clientLock);
+  running = 0;
+  nvstusb_ipc_ring_bell(wakeBell);
+}
+
+/* forget command i, clientLock held */
+static void
+dropCommand(
+  int i
+) {
+  memmove(commands+i, commands+i+1, (numCommands-i-1)*sizeof(commands[0]));
+  numCommands--;
+}
+
+/* a read command is about to be sent for c, clientLock held */
+static void
+addCommand(
+  struct client *c,
+  uint8_t offset,
+  uint8_t size
+) {
+  if (numCommands == MAX_COMMANDS) dropCommand(0);
+  struct command *cmd = &commands[numCommands++];
+  cmd->c = c;
+  cmd->offset = offset;
+  cmd->size = size;
+  cmd->sent = nvstusb_usb_time_ns();
+}
+
+/* the newest read command of c with offset and size did not go out,
+ * clientLock held */
+static void
+forgetCommand(
+  struct client *c,
+  uint8_t offset,
+  uint8_t size
+) {
+  int i;
+  for (i = numCommands - 1; i >= 0; i--) {
+    if (commands[i].c == c && commands[i].offset == offset && commands[i].size == size) {
+      dropCommand(i);
+      return;
+    }
+  }
+}
+
+/* answer the oldest waiting read of c, clientLock held */
+static void
+answerWait(
+  struct client *c,
+  struct nvstusb_ipc_msg *msg
+) {
+  struct wait *w = &c->waits[0];
+  msg->type = nvstusb_ipc_read_done;
+  msg->seq = w->seq;
+  if (msg->result > w->length) msg->result = msg->length = w->length;
+  reply(c, msg);
+  memmove(c->waits, c->waits+1, (c->numWaits-1)*sizeof(c->waits[0]));
+  c->numWaits--;
+}
+
+/* hand a reply from the device to the client whose command it answers,
+ * with when its read was queued and completed, clientLock held */
+static void
+route(
+  const uint8_t *data,
+  int len,
+  uint64_t submit,
+  uint64_t complete
+) {
+  struct client *c = 0;
+  int i;
+  for (i = 0; i < numCommands && len >= 2; i++) {
+    if (commands[i].offset != data[0] || commands[i].size != data[1]) continue;
+    c = commands[i].c;
+    dropCommand(i);
+    break;
+  }
+  if (0 == c) {
+    if (verbose) fprintf(stderr, "nvstusbd: reply nobody asked for\n");
+    return;
+  }
+
+  struct nvstusb_ipc_msg msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.endpoint = READ_ENDPOINT;
+  msg.length = len;
+  msg.result = len;
+  msg.submit = submit;
+  msg.complete = complete;
+  memcpy(msg.data, data, len);
+
+  if (c->posted) {
+    msg.type = nvstusb_ipc_posted_done;
+    reply(c, &msg);
+  } else if (c->numWaits > 0) {
+    answerWait(c, &msg);
+  } else {
+    /* the read is still in the client's ring */
+    if (c->numEarly == MAX_EARLY) {
+      memmove(c->early, c->early+1, (MAX_EARLY-1)*sizeof(c->early[0]));
+      c->numEarly--;
+    }
+    c->early[c->numEarly++] = msg;
+  }
+}
+
+/* time out reads and commands that got no reply, clientLock held */
+static void
+expire(
+) {
+  uint64_t now = nvstusb_usb_time_ns();
+  int i;
+
+  while (numCommands > 0 && now - commands[0].sent > COMMAND_TTL_NS) dropCommand(0);
+
+  for (i = 0; i < numClients; i++) {
+    struct client *c = clients[i];
+    while (c->numWaits > 0 && c->waits[0].deadline && now > c->waits[0].deadline) {
+      struct nvstusb_ipc_msg msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.endpoint = READ_ENDPOINT;
+      msg.result = NVSTUSB_USB_ERROR_TIMEOUT;
+      answerWait(c, &msg);
+    }
+  }
+}
+
+/* run usb events and route the replies of the posted reads */
+static void *
+events(
+  void *arg
+) {
+  uint8_t buf[NVSTUSB_IPC_DATA];
+  uint64_t submit, complete;
+
+  while (running) {
+    int res = nvstusb_usb_handle_events(dev, EVENT_SLICE_US);
+    if (res == NVSTUSB_USB_ERROR_NO_DEVICE) {
+      lost(res);
+      break;
+    }
+    if (res < 0) {
+      usleep(EVENT_BACKOFF_US);
+      continue;
+    }
+
+    int len;
+    while ((len = nvstusb_usb_reap_bulk_times(dev, READ_ENDPOINT, buf, sizeof(buf), &submit, &complete)) > 0) {
+      pthread_mutex_lock(&clientLock);
+      route(buf, len, submit, complete);
+      pthread_mutex_unlock(&clientLock);
+    }
+    if (len == NVSTUSB_USB_ERROR_NO_DEVICE) {
+      lost(len);
+      break;
+    }
+
+    pthread_mutex_lock(&clientLock);
+    expire();
+    pthread_mutex_unlock(&clientLock);
+  }
+  return 0;
+}
+
+/* take a connection, nothing is set up before it says hello */
+static void
+acceptClient(
+  int listener
+) {
+  int sock = accept4(listener, 0, 0, SOCK_CLOEXEC);
+  if (sock < 0) return;
+
+  if (numClients == MAX_CLIENTS) {
+    fprintf(stderr, "nvstusbd: too many clients\n");
+    close(sock);
+    return;
+  }
+
+  struct client *c = (struct client *) calloc(1, sizeof(*c));
+  c->sock = sock;
+  c->cmdBell = -1;
+  c->replyBell = -1;
+
+  pthread_mutex_lock(&clientLock);
+  clients[numClients++] = c;
+  pthread_mutex_unlock(&clientLock);
+}
+
+/* set up shared memory and doorbells for a client that said hello,
+ * false if that failed */
+static bool
+setupClient(
+  struct client *c
+) {
+  struct nvstusb_ipc_shm *shm = 0;
+  int shmfd = memfd_create("nvstusbd", MFD_CLOEXEC);
+  if (shmfd < 0 || ftruncate(shmfd, sizeof(*shm)) < 0) {
+    perror("nvstusbd: memfd");
+    goto fail;
+  }
+  shm = mmap(0, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
+  if (MAP_FAILED == shm) {
+    perror("nvstusbd: mmap");
+    shm = 0;
+    goto fail;
+  }
+  shm->magic = NVSTUSB_IPC_MAGIC;
+  shm->version = NVSTUSB_IPC_VERSION;
+
+  c->cmdBell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  c->replyBell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (c->cmdBell < 0 || c->replyBell < 0) {
+    perror("nvstusbd: eventfd");
+    goto fail;
+  }
+
+  int fds[3] = { shmfd, c->cmdBell, c->replyBell };
+  if (!nvstusb_ipc_send_fds(c->sock, fds, 3)) goto fail;
+  close(shmfd);
+
+  pthread_mutex_lock(&clientLock);
+  c->shm = shm;
+  pthread_mutex_unlock(&clientLock);
+
+  if (verbose) fprintf(stderr, "nvstusbd: client %d connected\n", c->sock);
+  return true;
+
+fail:
+  if (shmfd >= 0) close(shmfd);
+  if (0 != shm) munmap(shm, sizeof(*shm));
+  return false;
+}
+
+static void
+removeClient(
+  int index
+) {
+  int i;
+  pthread_mutex_lock(&clientLock);
+  struct client *c = clients[index];
+  clients[index] = clients[--numClients];
+  for (i = numCommands - 1; i >= 0; i--) {
+    if (commands[i].c == c) dropCommand(i);
+  }
+  pthread_mutex_unlock(&clientLock);
+
+  if (0 != c->shm) {
+    if (verbose) fprintf(stderr, "nvstusbd: client %d gone\n", c->sock);
+    munmap(c->shm, sizeof(*c->shm));
+  }
+  if (c->cmdBell >= 0) close(c->cmdBell);
+  if (c->replyBell >= 0) close(c->replyBell);
+  close(c->sock);
+  free(c);
+}
+
+/* execute the commands a client posted */
+static void
+drain(
+  struct client *c
+) {
+  struct nvstusb_ipc_msg msg;
+  bool read;
+
+  while (running && nvstusb_ipc_pop(&c->shm->cmd, &msg)) {
+    if (msg.length > NVSTUSB_IPC_DATA && msg.type != nvstusb_ipc_post_reads) continue;
+
+    switch (msg.type) {
+    case nvstusb_ipc_write:
+      /* a stale eye command does more harm than a missing one */
+      read = false;
+      if (msg.deadline && nvstusb_usb_time_ns() > msg.deadline) {
+        if (verbose) fprintf(stderr, "nvstusbd: dropped late write to %d\n", msg.endpoint);
+        msg.result = NVSTUSB_USB_ERROR_TIMEOUT;
+      } else {
+        /* the reply of a read command may complete before the write
+         * returns, so it is known before */
+        read = msg.endpoint == COMMAND_ENDPOINT && msg.length >= 4 &&
+          (msg.data[0] & ~NVSTUSB_CMD_CLEAR) == NVSTUSB_CMD_READ;
+        if (read) {
+          pthread_mutex_lock(&clientLock);
+          addCommand(c, msg.data[1], msg.data[2]);
+          pthread_mutex_unlock(&clientLock);
+        }
+        msg.result = nvstusb_usb_write_bulk(dev, msg.endpoint, msg.data, msg.length, msg.timeout);
+      }
+      if (msg.result < 0) {
+        msg.type = nvstusb_ipc_write_failed;
+        pthread_mutex_lock(&clientLock);
+        if (read) forgetCommand(c, msg.data[1], msg.data[2]);
+        reply(c, &msg);
+        pthread_mutex_unlock(&clientLock);
+        if (msg.result == NVSTUSB_USB_ERROR_NO_DEVICE) lost(msg.result);
+      }
+      break;
+
+    case nvstusb_ipc_read:
+      /* answered by the event thread when the reply comes */
+      pthread_mutex_lock(&clientLock);
+      if (msg.endpoint != READ_ENDPOINT || c->numWaits == MAX_WAITS) {
+        msg.type = nvstusb_ipc_read_done;
+        msg.result = msg.endpoint != READ_ENDPOINT ? NVSTUSB_USB_ERROR_IO : NVSTUSB_USB_ERROR_BUSY;
+        reply(c, &msg);
+      } else {
+        struct wait *w = &c->waits[c->numWaits++];
+        w->seq = msg.seq;
+        w->length = msg.length;
+        w->deadline = msg.timeout ? nvstusb_usb_time_ns() + msg.timeout*1000000ULL : 0;
+        if (c->numEarly > 0) {
+          struct nvstusb_ipc_msg early = c->early[0];
+          memmove(c->early, c->early+1, (c->numEarly-1)*sizeof(c->early[0]));
+          c->numEarly--;
+          answerWait(c, &early);
+        }
+      }
+      pthread_mutex_unlock(&clientLock);
+      break;
+
+    case nvstusb_ipc_post_reads:
+      /* the daemon's own posted reads serve them */
+      pthread_mutex_lock(&clientLock);
+      c->posted = msg.endpoint == READ_ENDPOINT;
+      c->numEarly = 0;
+      msg.type = nvstusb_ipc_post_reads_done;
+      msg.result = c->posted ? 0 : NVSTUSB_USB_ERROR_IO;
+      reply(c, &msg);
+      pthread_mutex_unlock(&clientLock);
+      break;
+    }
+  }
+}
+
+/* Main function */
+int main(int argc, char **argv)
+{
+  const char *firmware = "nvstusb.fw";
+  const char *path = 0;
+
+  /* Getopt section */
+  struct option long_options[] =
+  {
+    {"firmware",     required_argument, 0, 'f'},
+    {"socket",       required_argument, 0, 's'},
+    {"verbose",      no_argument,       0, 'v'},
+    {"help",         no_argument,       0, 'h'},
+    {NULL, 0, 0, 0}
+  };
+
+  while (1)
+  {
+    int c;
+    int option_index = 0;
+
+    c = getopt_long (argc, argv, "f:s:vh",
+        long_options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch (c)
+    {
+    case 'f':
+      firmware = optarg;
+      break;
+
+    case 's':
+      path = optarg;
+      break;
+
+    case 'v':
+      verbose = 1;
+      break;
+
+    case 'h':
+    case '?':
+    default:
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  /* the library finds the socket the same way */
+  if (0 != path) setenv("NVSTUSB_DAEMON", path, 1);
+  path = nvstusb_ipc_socket_path();
+
+  if (nvstusb_usb_daemon_running()) {
+    fprintf(stderr, "nvstusbd: already running on %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "nvstusbd: socket path too long: %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  strcpy(addr.sun_path, path);
+
+  /* the daemon itself must own the device */
+  nvstusb_usb_select_backend("libusb");
+  if (!nvstusb_usb_init()) exit(EXIT_FAILURE);
+  dev = nvstusb_usb_open_device(firmware);
+  if (0 == dev) {
+    nvstusb_usb_deinit();
+    exit(EXIT_FAILURE);
+  }
+
+  /* every reply comes through these, the event thread routes them */
+  if (!nvstusb_usb_post_reads(dev, READ_ENDPOINT, POSTED_READS, NVSTUSB_IPC_DATA)) {
+    fprintf(stderr, "nvstusbd: could not post reads\n");
+    nvstusb_usb_close_device(dev);
+    nvstusb_usb_deinit();
+    exit(EXIT_FAILURE);
+  }
+  wakeBell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+  /* a socket left behind by a daemon that died */
+  unlink(path);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 8) < 0) {
+    perror(path);
+    nvstusb_usb_close_device(dev);
+    nvstusb_usb_deinit();
+    exit(EXIT_FAILURE);
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop;
+  sigaction(SIGINT, &sa, 0);
+  sigaction(SIGTERM, &sa, 0);
+
+  pthread_t thread;
+  pthread_create(&thread, 0, events, 0);
+
+  fprintf(stderr, "nvstusbd: listening on %s\n", path);
+
+  while (running) {
+    struct pollfd pfd[2 + 2*MAX_CLIENTS];
+    int i, n = 0;
+
+    /* only this thread adds and removes clients */
+    pfd[n].fd = listener;
+    pfd[n++].events = POLLIN;
+    pfd[n].fd = wakeBell;
+    pfd[n++].events = POLLIN;
+    for (i = 0; i < numClients; i++) {
+      pfd[n].fd = clients[i]->sock;
+      pfd[n++].events = POLLIN;
+      pfd[n].fd = clients[i]->cmdBell;    /* -1 before hello, ignored */
+      pfd[n++].events = POLLIN;
+    }
+
+    if (poll(pfd, n, -1) < 0) {
+      if (errno == EINTR) continue;
+      perror("nvstusbd: poll");
+      break;
+    }
+
+    /* backwards, removing swaps the last client in */
+    for (i = numClients - 1; i >= 0; i--) {
+      struct client *c = clients[i];
+      if (pfd[3+2*i].revents & POLLIN) {
+        uint64_t count;
+        if (read(c->cmdBell, &count, sizeof(count)) < 0) {
+          /* nothing new, drain anyway */
+        }
+        drain(c);
+      }
+      if (0 == (pfd[2+2*i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+      /* the hello, with the protocol version, or a probe closing */
+      uint8_t hello;
+      if (0 == c->shm && recv(c->sock, &hello, 1, 0) == 1 && setupClient(c)) continue;
+
+      /* clients only ever hang up */
+      removeClient(i);
+    }
+    if (pfd[0].revents & POLLIN) acceptClient(listener);
+  }
+
+  running = 0;
+  pthread_join(thread, 0);
+
+  while (numClients > 0) removeClient(numClients - 1);
+  close(listener);
+  if (wakeBell >= 0) close(wakeBell);
+  unlink(path);
+
+  nvstusb_usb_close_device(dev);
+  nvstusb_usb_deinit();
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,169 @@
+/* Finds the shutter timing for a display. Given its refresh rate, vertical
+ * blanking and response time, models what each eye sees through the
+ * shutter (see include/shutter.h), reports brightness and crosstalk of
+ * the built-in timing and searches for the brightest open window that
+ * keeps the crosstalk low. The result is written as a profile file, which
+ * nvstusb_load_profiles or NVSTUSB_PROFILE=FILE make nvstusb_set_rate use.
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+#include "nvstusb.h"
+#include "timing.h"
+#include "shutter.h"
+
+#define MAX_RATES     NVSTUSB_TIMING_MAX_PROFILES
+
+/* Usage */
+void usage(void) {
+  fprintf(stderr, "nvstusb-tune [--rate HZ]... [--vblank US] [--response US] [--crosstalk PERCENT]\n"
+                  "             [--step US] [--output FILE]\n");
+}
+
+/* the report goes to stderr while the profiles go to stdout */
+static FILE *log = 0;
+
+static void
+report(
+  const char *name,
+  const struct nvstusb_timing_profile *profile,
+  const struct nvstusb_shutter_result *result
+) {
+  fprintf(log, "%-9s x %8.1f us  active %7.1f us  open %7.1f-%7.1f us  brightness %5.1f%%  "
+    "crosstalk %5.1f%%, worst %5.1f%% at row %.2f\n", name, profile->x_us, profile->active_us,
+    result->open_us, result->close_us, result->brightness * 100, result->crosstalk * 100,
+    result->worst * 100, result->worst_row);
+}
+
+/* Main function */
+int main(int argc, char **argv)
+{
+  float rates[MAX_RATES];
+  int numRates = 0;
+  float vblank = 500.0;
+  float response = 3000.0;
+  float crosstalk = 5.0;
+  float step = 10.0;
+  const char *output = 0;
+
+  /* Getopt section */
+  struct option long_options[] =
+  {
+    {"rate",         required_argument, 0, 'r'},
+    {"vblank",       required_argument, 0, 'v'},
+    {"response",     required_argument, 0, 'p'},
+    {"crosstalk",    required_argument, 0, 'c'},
+    {"step",         required_argument, 0, 's'},
+    {"output",       required_argument, 0, 'o'},
+    {"help",         no_argument,       0, 'h'},
+    {NULL, 0, 0, 0}
+  };
+
+  while (1)
+  {
+    int c;
+    int option_index = 0;
+
+    c = getopt_long (argc, argv, "r:v:p:c:s:o:h",
+        long_options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch (c)
+    {
+    case 'r':
+      if (numRates == MAX_RATES) {
+        fprintf(stderr, "at most %d rates\n", MAX_RATES);
+        exit(EXIT_FAILURE);
+      }
+      rates[numRates++] = atof(optarg);
+      break;
+
+    case 'v':
+      vblank = atof(optarg);
+      break;
+
+    case 'p':
+      response = atof(optarg);
+      break;
+
+    case 'c':
+      crosstalk = atof(optarg);
+      break;
+
+    case 's':
+      step = atof(optarg);
+      break;
+
+    case 'o':
+      output = optarg;
+      break;
+
+    case 'h':
+    case '?':
+    default:
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc || vblank < 0 || response < 0 || step <= 0) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+  if (0 == numRates) rates[numRates++] = 120.0;
+
+  FILE *file = stdout;
+  log = stderr;
+  if (0 != output) {
+    log = stdout;
+    file = fopen(output, "w");
+    if (0 == file) { perror(output); exit(EXIT_FAILURE); }
+  }
+
+  fprintf(file, "# nvstusb-tune: vblank %.0f us, response %.0f us, crosstalk below %.1f%%\n",
+    vblank, response, crosstalk);
+  fprintf(file, "# rate       w_us       x_us  active_us  eye_delay_us\n");
+
+  int i;
+  for (i = 0; i < numRates; i++) {
+    struct nvstusb_panel panel = { rates[i], vblank, response };
+    if (!(rates[i] > NVSTUSB_RATE_MIN && rates[i] <= NVSTUSB_RATE_MAX) ||
+        vblank >= 1000000.0 / rates[i]) {
+      fprintf(stderr, "%.2f Hz: not a refresh rate the controller supports with %.0f us vblank\n",
+        rates[i], vblank);
+      continue;
+    }
+
+    /* what nvstusb_set_rate would use without a profile file */
+    struct nvstusb_timing_profile profile;
+    const struct nvstusb_timing_profile *known = nvstusb_timing_find_profile(rates[i]);
+    if (0 != known) profile = *known;
+    else nvstusb_timing_generate(rates[i], &profile);
+
+    struct nvstusb_shutter_result result;
+    fprintf(log, "%.2f Hz\n", rates[i]);
+    nvstusb_shutter_evaluate(&panel, &profile, &result);
+    report("built-in", &profile, &result);
+
+    nvstusb_shutter_optimize(&panel, crosstalk / 100, step, &profile, &result);
+    report("tuned", &profile, &result);
+    if (result.worst > crosstalk / 100) {
+      fprintf(log, "no timing keeps the crosstalk below %.1f%%, this is the least\n", crosstalk);
+    }
+
+    struct nvstusb_timing timing;
+    if (!nvstusb_timing_compute(&profile, rates[i], &timing)) continue;
+    nvstusb_timing_write_profile(file, &profile);
+  }
+
+  if (file != stdout) fclose(file);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,226 @@
+/* Measures the usb path to the controller: how long writing an eye
+ * packet takes and the round trip of a status read (command on endpoint
+ * 2, reply on endpoint 4), through the backend given with --backend.
+ * Run it once with libusb and once with usbfs to compare them. "eye" is
+ * until the packet completed, "eye submit" until the write returned,
+ * which is earlier for backends that do not wait for eye packets.
+ *
+ * This program comes with ABSOLUTELY NO WARRANTY.
+ * This is free software, and you are welcome to redistribute it
+ * under certain conditions. See the file COPYING for details
+ * */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "usb_backend.h"
+#include "timing.h"
+
+#define NVSTUSB_CMD_READ        (0x02)
+#define NVSTUSB_CMD_CLEAR       (0x40)
+#define NVSTUSB_CMD_SET_EYE     (0xAA)
+
+/* key status, the read the library repeats most */
+#define NVSTUSB_REG_STATUS      0x18
+
+#define TIMEOUT_MS  200
+
+/* Usage */
+void usage(void) {
+  fprintf(stderr, "nvstusb-usbbench [--backend NAME] [--count N] [--interval US] firmware\n");
+}
+
+static int
+compare(
+  const void *a,
+  const void *b
+) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* latency percentiles of n samples in ns */
+static void
+report(
+  const char *name,
+  uint64_t *samples,
+  int n,
+  int errors
+) {
+  if (0 == n) {
+    printf("%-10s no samples, %d errors\n", name, errors);
+    return;
+  }
+
+  qsort(samples, n, sizeof(samples[0]), compare);
+  double sum = 0;
+  int i;
+  for (i = 0; i < n; i++) sum += samples[i];
+
+  printf("%-10s %6d  %8.1f  %8.1f  %8.1f  %8.1f  %8.1f  %6d\n", name, n,
+    samples[0] / 1000.0, samples[n/2] / 1000.0, sum / n / 1000.0,
+    samples[(int)(n * 0.99)] / 1000.0, samples[n-1] / 1000.0, errors);
+}
+
+/* eye packets completed and failed so far */
+static void
+eyeDone(
+  struct nvstusb_usb_device *dev,
+  uint64_t *completed,
+  uint64_t *failed
+) {
+  struct nvstusb_endpoint_stats stats[NVSTUSB_USB_ENDPOINTS];
+  int n = nvstusb_usb_get_stats(dev, stats, NVSTUSB_USB_ENDPOINTS);
+  int i;
+  *completed = *failed = 0;
+  for (i = 0; i < n; i++) {
+    if (stats[i].endpoint == 1) {
+      *completed = stats[i].completed;
+      *failed = stats[i].failed;
+    }
+  }
+}
+
+static void
+pauseUs(
+  unsigned int interval
+) {
+  if (interval) usleep(interval);
+}
+
+/* Main function */
+int main(int argc, char **argv)
+{
+  const char *backend = 0;
+  int count = 1000;
+  unsigned int interval = 1000;
+
+  /* Getopt section */
+  struct option long_options[] =
+  {
+    {"backend",      required_argument, 0, 'b'},
+    {"count",        required_argument, 0, 'n'},
+    {"interval",     required_argument, 0, 'i'},
+    {"help",         no_argument,       0, 'h'},
+    {NULL, 0, 0, 0}
+  };
+
+  while (1)
+  {
+    int c;
+    int option_index = 0;
+
+    c = getopt_long (argc, argv, "b:n:i:h",
+        long_options, &option_index);
+
+    if (c == -1)
+      break;
+
+    switch (c)
+    {
+    case 'b':
+      backend = optarg;
+      break;
+
+    case 'n':
+      count = atoi(optarg);
+      break;
+
+    case 'i':
+      interval = atoi(optarg);
+      break;
+
+    case 'h':
+    case '?':
+    default:
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind + 1 != argc || count <= 0) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  if (0 != backend && !nvstusb_usb_select_backend(backend)) exit(EXIT_FAILURE);
+  if (!nvstusb_usb_init()) exit(EXIT_FAILURE);
+
+  struct nvstusb_usb_device *dev = nvstusb_usb_open_device(argv[optind]);
+  if (0 == dev) {
+    nvstusb_usb_deinit();
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t *eye = malloc(count * sizeof(uint64_t));
+  uint64_t *eyeSubmit = malloc(count * sizeof(uint64_t));
+  uint64_t *status = malloc(count * sizeof(uint64_t));
+  int eyes = 0, eyeErrors = 0;
+  int eyeSubmits = 0, eyeSubmitErrors = 0;
+  bool posted = dev->postedWrites & (1u << 1);
+  int reads = 0, readErrors = 0;
+  int i;
+
+  /* eye packets alternating left and right, r as sent at 120 Hz */
+  for (i = 0; i < count; i++) {
+    int32_t r = NVSTUSB_T2_COUNT(4629);
+    uint8_t buf[8] = {
+      NVSTUSB_CMD_SET_EYE, (i & 1) ? 0xFE : 0xFF, 0x00, 0x00,
+      r, r>>8, r>>16, r>>24
+    };
+    uint64_t completed, failed, c, f;
+    if (posted) eyeDone(dev, &completed, &failed);
+
+    uint64_t start = nvstusb_usb_time_ns();
+    int res = nvstusb_usb_write_bulk(dev, 1, buf, sizeof(buf), TIMEOUT_MS);
+    uint64_t end = nvstusb_usb_time_ns();
+    if (res == sizeof(buf)) eyeSubmit[eyeSubmits++] = end - start;
+    else eyeSubmitErrors++;
+
+    /* the backend returned at submit, wait until it reaped the packet */
+    if (posted && res == sizeof(buf)) {
+      uint64_t limit = start + TIMEOUT_MS * 1000000ULL;
+      for (;;) {
+        eyeDone(dev, &c, &f);
+        if (c != completed || f != failed || nvstusb_usb_time_ns() > limit) break;
+        if (nvstusb_usb_handle_events(dev, 1000) < 0) break;
+      }
+      end = nvstusb_usb_time_ns();
+      if (c == completed) res = NVSTUSB_USB_ERROR_TIMEOUT;
+    }
+    if (res == sizeof(buf)) eye[eyes++] = end - start;
+    else eyeErrors++;
+    pauseUs(interval);
+  }
+
+  /* status reads, command and reply */
+  for (i = 0; i < count; i++) {
+    uint8_t cmd[] = { NVSTUSB_CMD_READ | NVSTUSB_CMD_CLEAR, NVSTUSB_REG_STATUS, 3, 0 };
+    uint8_t reply[64];
+    uint64_t start = nvstusb_usb_time_ns();
+    int res = nvstusb_usb_write_bulk(dev, 2, cmd, sizeof(cmd), TIMEOUT_MS);
+    if (res == sizeof(cmd)) res = nvstusb_usb_read_bulk(dev, 4, reply, 4+3, TIMEOUT_MS);
+    uint64_t end = nvstusb_usb_time_ns();
+    if (res >= 4) status[reads++] = end - start;
+    else readErrors++;
+    pauseUs(interval);
+  }
+
+  printf("backend %s\n", dev->backend->name);
+  printf("               n    min us    med us    avg us    p99 us    max us  errors\n");
+  report("eye", eye, eyes, eyeErrors);
+  report("eye submit", eyeSubmit, eyeSubmits, eyeSubmitErrors);
+  report("status", status, reads, readErrors);
+
+  free(eye);
+  free(eyeSubmit);
+  free(status);
+  nvstusb_usb_close_device(dev);
+  nvstusb_usb_deinit();
+  return EXIT_SUCCESS;
+}